@@ -0,0 +1,676 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "accel_builder.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <nvh/fileoperations.hpp>  // For nvh::loadFile
+#include <nvh/nvprint.hpp>         // For nvprintf
+#include <nvvk/error_vk.hpp>       // For NVVK_CHECK
+#include <nvvk/structs_vk.hpp>     // For nvvk::make
+
+#include "deferred_operation.hpp"
+#include "file_utils.hpp"
+#include "gpu_profiler.hpp"
+#include "mesh_cache.hpp"  // For HashBytes
+
+namespace {
+// The header of a BLAS cache file, followed by `dataSize` bytes of data from
+// vkCmdCopyAccelerationStructureToMemoryKHR.
+struct AccelCacheHeader
+{
+    char     magic[4];  // "VMPA"
+    uint32_t version;   // ACCEL_CACHE_VERSION
+    uint64_t dataSize;  // Size in bytes of the serialized acceleration structure
+};
+
+const uint32_t ACCEL_CACHE_VERSION = 1;
+
+// Serialized acceleration structures start with a driver UUID and a
+// compatibility UUID (which vkGetDeviceAccelerationStructureCompatibilityKHR
+// reads), then the serialized size, the size of the acceleration structure
+// once deserialized, and the number of BLAS handles that follow.
+const size_t SERIALIZED_VERSION_SIZE = 2 * VK_UUID_SIZE;
+const size_t SERIALIZED_HEADER_SIZE = SERIALIZED_VERSION_SIZE + 3 * sizeof(uint64_t);
+}  // namespace
+
+void AccelBuilder::init(VkDevice device, nvvk::AllocatorDedicated* allocator, uint32_t queueFamilyIndex, VkQueue queue)
+{
+    m_device = device;
+    m_allocator = allocator;
+    m_queue = queue;
+
+    VkCommandPoolCreateInfo cmdPoolInfo = nvvk::make<VkCommandPoolCreateInfo>();
+    cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    cmdPoolInfo.queueFamilyIndex = queueFamilyIndex;
+    NVVK_CHECK(vkCreateCommandPool(device, &cmdPoolInfo, nullptr, &m_cmdPool));
+}
+
+void AccelBuilder::deinit()
+{
+    for (nvvk::AccelKHRDedicated& blas : m_blases)
+    {
+        m_allocator->destroy(blas);
+    }
+    m_blases.clear();
+    m_allocator->destroy(m_tlas);
+    if (m_cmdPool != VK_NULL_HANDLE)
+    {
+        vkDestroyCommandPool(m_device, m_cmdPool, nullptr);
+        m_cmdPool = VK_NULL_HANDLE;
+    }
+}
+
+VkCommandBuffer AccelBuilder::beginCommandBuffer()
+{
+    VkCommandBufferAllocateInfo cmdAllocInfo = nvvk::make<VkCommandBufferAllocateInfo>();
+    cmdAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmdAllocInfo.commandPool = m_cmdPool;
+    cmdAllocInfo.commandBufferCount = 1;
+    VkCommandBuffer cmdBuffer;
+    NVVK_CHECK(vkAllocateCommandBuffers(m_device, &cmdAllocInfo, &cmdBuffer));
+    VkCommandBufferBeginInfo beginInfo = nvvk::make<VkCommandBufferBeginInfo>();
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    NVVK_CHECK(vkBeginCommandBuffer(cmdBuffer, &beginInfo));
+    return cmdBuffer;
+}
+
+void AccelBuilder::submitAndWait(VkCommandBuffer cmdBuffer)
+{
+    NVVK_CHECK(vkEndCommandBuffer(cmdBuffer));
+    VkSubmitInfo submitInfo = nvvk::make<VkSubmitInfo>();
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &cmdBuffer;
+    NVVK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, VK_NULL_HANDLE));
+    NVVK_CHECK(vkQueueWaitIdle(m_queue));
+    vkFreeCommandBuffers(m_device, m_cmdPool, 1, &cmdBuffer);
+}
+
+void AccelBuilder::recordBuildBarrier(VkCommandBuffer cmdBuffer)
+{
+    // Builds, copies, and queries of acceleration structures all happen in
+    // the acceleration structure build stage. This makes the results of
+    // previous commands (and their scratch buffer use) visible to later ones:
+    VkMemoryBarrier barrier = nvvk::make<VkMemoryBarrier>();
+    barrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    barrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    vkCmdPipelineBarrier(cmdBuffer,                                            // The command buffer
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,  // From AS builds
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,  // To AS builds
+                         0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+nvvk::AccelKHRDedicated AccelBuilder::createAccel(VkAccelerationStructureTypeKHR type, VkDeviceSize size)
+{
+    VkAccelerationStructureCreateInfoKHR createInfo = nvvk::make<VkAccelerationStructureCreateInfoKHR>();
+    createInfo.type = type;
+    createInfo.size = size;
+    if (!usesHostBuilds())
+    {
+        return m_allocator->createAcceleration(createInfo);  // Also allocates the buffer that stores it
+    }
+
+    // The host reads and writes acceleration structures that it builds, so
+    // they must be in host-visible memory:
+    nvvk::AccelKHRDedicated accel;
+    accel.buffer = m_allocator->createBuffer(size,                                                                       //
+                                             VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,  //
+                                             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    createInfo.buffer = accel.buffer.buffer;
+    NVVK_CHECK(vkCreateAccelerationStructureKHR(m_device, &createInfo, nullptr, &accel.accel));
+    return accel;
+}
+
+VkDeviceAddress AccelBuilder::getBufferAddress(VkBuffer buffer) const
+{
+    VkBufferDeviceAddressInfo addressInfo = nvvk::make<VkBufferDeviceAddressInfo>();
+    addressInfo.buffer = buffer;
+    return vkGetBufferDeviceAddress(m_device, &addressInfo);
+}
+
+uint32_t AccelBuilder::beginSection(VkCommandBuffer cmdBuffer, const char* phase)
+{
+    return (m_profiler != nullptr) ? m_profiler->beginSection(cmdBuffer, phase) : UINT32_MAX;
+}
+
+void AccelBuilder::endSection(VkCommandBuffer cmdBuffer, uint32_t sectionId)
+{
+    if (m_profiler != nullptr)
+    {
+        m_profiler->endSection(cmdBuffer, sectionId);
+    }
+}
+
+void AccelBuilder::addHostSample(const char* phase, std::chrono::steady_clock::time_point startTime)
+{
+    if (m_profiler != nullptr)
+    {
+        m_profiler->addSample(phase, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count());
+    }
+}
+
+std::string AccelBuilder::getCacheFilename(const BlasInput& input, VkBuildAccelerationStructureFlagsKHR flags)
+{
+    // Hash everything that affects the BLAS except buffer addresses, which
+    // change from run to run:
+    uint64_t key = HashBytes(&input.contentHash, sizeof(input.contentHash));
+    key = HashBytes(&flags, sizeof(flags), key);
+    for (size_t geometryIdx = 0; geometryIdx < input.geometries.size(); geometryIdx++)
+    {
+        const VkAccelerationStructureGeometryKHR&             geometry = input.geometries[geometryIdx];
+        const VkAccelerationStructureGeometryTrianglesDataKHR& triangles = geometry.geometry.triangles;
+        const VkAccelerationStructureBuildRangeInfoKHR&       range = input.ranges[geometryIdx];
+        const uint64_t fields[] = { static_cast<uint64_t>(geometry.geometryType), geometry.flags,
+                                    static_cast<uint64_t>(triangles.vertexFormat), triangles.vertexStride,
+                                    triangles.maxVertex,                           static_cast<uint64_t>(triangles.indexType),
+                                    range.primitiveCount,                          range.primitiveOffset,
+                                    range.firstVertex };
+        key = HashBytes(fields, sizeof(fields), key);
+    }
+    char filename[64];
+    snprintf(filename, sizeof(filename), "blascache_%016llx.bin", static_cast<unsigned long long>(key));
+    return filename;
+}
+
+std::string AccelBuilder::loadCacheFile(const std::string& filename) const
+{
+    // nvh::loadFile returns an empty string if the file doesn't exist.
+    std::string fileData = nvh::loadFile(filename, true);
+    if (fileData.empty())
+    {
+        return std::string();
+    }
+
+    AccelCacheHeader header{};
+    if (fileData.size() >= sizeof(header))
+    {
+        memcpy(&header, fileData.data(), sizeof(header));
+    }
+    if (fileData.size() < sizeof(header) || memcmp(header.magic, "VMPA", 4) != 0 || header.version != ACCEL_CACHE_VERSION
+        || header.dataSize != fileData.size() - sizeof(header) || header.dataSize < SERIALIZED_HEADER_SIZE)
+    {
+        nvprintf("Ignoring %s: invalid file.\n", filename.c_str());
+        return std::string();
+    }
+    std::string blob = fileData.substr(sizeof(header));
+
+    // The driver decides whether it can use data serialized by another
+    // driver version or device:
+    VkAccelerationStructureVersionInfoKHR versionInfo = nvvk::make<VkAccelerationStructureVersionInfoKHR>();
+    versionInfo.pVersionData = reinterpret_cast<const uint8_t*>(blob.data());
+    VkAccelerationStructureCompatibilityKHR compatibility = VK_ACCELERATION_STRUCTURE_COMPATIBILITY_INCOMPATIBLE_KHR;
+    vkGetDeviceAccelerationStructureCompatibilityKHR(m_device, &versionInfo, &compatibility);
+    if (compatibility != VK_ACCELERATION_STRUCTURE_COMPATIBILITY_COMPATIBLE_KHR)
+    {
+        nvprintf("Ignoring %s: serialized by an incompatible device or driver.\n", filename.c_str());
+        return std::string();
+    }
+    return blob;
+}
+
+void AccelBuilder::buildBlases(const std::vector<BlasInput>& inputs, VkBuildAccelerationStructureFlagsKHR flags, bool useCache)
+{
+    const auto startTime = std::chrono::steady_clock::now();
+    m_blases.resize(inputs.size());
+
+    // Sort the BLASes into those we can load from the cache, and those we need to build:
+    std::vector<size_t>      loadIds, buildIds, saveIds;
+    std::vector<std::string> loadBlobs, saveFilenames;
+    for (size_t blasIdx = 0; blasIdx < inputs.size(); blasIdx++)
+    {
+        const bool cacheable = useCache && !usesHostBuilds() && (inputs[blasIdx].contentHash != 0);
+        if (cacheable)
+        {
+            const std::string filename = getCacheFilename(inputs[blasIdx], flags);
+            std::string       blob = loadCacheFile(filename);
+            if (!blob.empty())
+            {
+                loadIds.push_back(blasIdx);
+                loadBlobs.push_back(std::move(blob));
+                continue;
+            }
+            saveIds.push_back(blasIdx);
+            saveFilenames.push_back(filename);
+        }
+        buildIds.push_back(blasIdx);
+    }
+
+    if (!loadIds.empty())
+    {
+        deserializeBlases(loadIds, loadBlobs);
+    }
+    if (usesHostBuilds())
+    {
+        buildAndCompactBlasesOnHost(inputs, flags);
+    }
+    else if (!buildIds.empty())
+    {
+        buildAndCompactBlases(inputs, buildIds, flags);
+    }
+    if (!saveIds.empty())
+    {
+        serializeBlases(saveIds, saveFilenames);
+    }
+
+    const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    nvprintf("BLASes: %zu loaded from the cache, %zu built on the %s, in %.2f ms.\n", loadIds.size(), buildIds.size(),
+             usesHostBuilds() ? "host" : "device", milliseconds);
+}
+
+void AccelBuilder::deserializeBlases(const std::vector<size_t>& blasIds, const std::vector<std::string>& blobs)
+{
+    // Copy each serialized BLAS to a host-visible buffer that the device can
+    // read through its address, then deserialize it on the device:
+    std::vector<nvvk::BufferDedicated> blobBuffers(blasIds.size());
+    VkCommandBuffer                    cmdBuffer = beginCommandBuffer();
+    const uint32_t                     sectionId = beginSection(cmdBuffer, "BLAS deserialize");
+    for (size_t i = 0; i < blasIds.size(); i++)
+    {
+        const std::string& blob = blobs[i];
+        blobBuffers[i] = m_allocator->createBuffer(blob.size(),                                                            //
+                                                   VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,  //
+                                                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        void* mapped = m_allocator->map(blobBuffers[i]);
+        memcpy(mapped, blob.data(), blob.size());
+        m_allocator->unmap(blobBuffers[i]);
+
+        uint64_t deserializedSize;
+        memcpy(&deserializedSize, blob.data() + SERIALIZED_VERSION_SIZE + sizeof(uint64_t), sizeof(deserializedSize));
+        m_blases[blasIds[i]] = createAccel(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, deserializedSize);
+
+        VkCopyMemoryToAccelerationStructureInfoKHR copyInfo = nvvk::make<VkCopyMemoryToAccelerationStructureInfoKHR>();
+        copyInfo.src.deviceAddress = getBufferAddress(blobBuffers[i].buffer);
+        copyInfo.dst = m_blases[blasIds[i]].accel;
+        copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_DESERIALIZE_KHR;
+        vkCmdCopyMemoryToAccelerationStructureKHR(cmdBuffer, &copyInfo);
+    }
+    endSection(cmdBuffer, sectionId);
+    submitAndWait(cmdBuffer);
+    for (nvvk::BufferDedicated& blobBuffer : blobBuffers)
+    {
+        m_allocator->destroy(blobBuffer);
+    }
+}
+
+void AccelBuilder::buildAndCompactBlases(const std::vector<BlasInput>&       inputs,
+                                         const std::vector<size_t>&          blasIds,
+                                         VkBuildAccelerationStructureFlagsKHR flags)
+{
+    // Get the size of each BLAS, and the size of the largest scratch buffer
+    // needed. The BLASes are built one after another, so they can share one
+    // scratch buffer.
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos(blasIds.size());
+    std::vector<VkDeviceSize>                                accelSizes(blasIds.size());
+    VkDeviceSize                                             maxScratchSize = 0;
+    for (size_t i = 0; i < blasIds.size(); i++)
+    {
+        const BlasInput&                             input = inputs[blasIds[i]];
+        VkAccelerationStructureBuildGeometryInfoKHR& buildInfo = buildInfos[i];
+        buildInfo = nvvk::make<VkAccelerationStructureBuildGeometryInfoKHR>();
+        buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        buildInfo.flags = flags;
+        buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        buildInfo.geometryCount = static_cast<uint32_t>(input.geometries.size());
+        buildInfo.pGeometries = input.geometries.data();
+
+        std::vector<uint32_t> maxPrimitiveCounts;
+        for (const VkAccelerationStructureBuildRangeInfoKHR& range : input.ranges)
+        {
+            maxPrimitiveCounts.push_back(range.primitiveCount);
+        }
+        VkAccelerationStructureBuildSizesInfoKHR sizeInfo = nvvk::make<VkAccelerationStructureBuildSizesInfoKHR>();
+        vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo,
+                                                maxPrimitiveCounts.data(), &sizeInfo);
+        accelSizes[i] = sizeInfo.accelerationStructureSize;
+        maxScratchSize = std::max(maxScratchSize, sizeInfo.buildScratchSize);
+    }
+
+    nvvk::BufferDedicated scratchBuffer =
+        m_allocator->createBuffer(maxScratchSize, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    const VkDeviceAddress scratchAddress = getBufferAddress(scratchBuffer.buffer);
+
+    // If compaction is allowed, query the compacted size of each BLAS after building it:
+    const bool  compact = (flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR) != 0;
+    VkQueryPool queryPool = VK_NULL_HANDLE;
+    if (compact)
+    {
+        VkQueryPoolCreateInfo queryPoolInfo = nvvk::make<VkQueryPoolCreateInfo>();
+        queryPoolInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+        queryPoolInfo.queryCount = static_cast<uint32_t>(blasIds.size());
+        NVVK_CHECK(vkCreateQueryPool(m_device, &queryPoolInfo, nullptr, &queryPool));
+    }
+
+    VkCommandBuffer cmdBuffer = beginCommandBuffer();
+    if (compact)
+    {
+        vkCmdResetQueryPool(cmdBuffer, queryPool, 0, static_cast<uint32_t>(blasIds.size()));
+    }
+    uint32_t sectionId = beginSection(cmdBuffer, "BLAS build");
+    for (size_t i = 0; i < blasIds.size(); i++)
+    {
+        nvvk::AccelKHRDedicated& blas = m_blases[blasIds[i]];
+        blas = createAccel(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, accelSizes[i]);
+        buildInfos[i].dstAccelerationStructure = blas.accel;
+        buildInfos[i].scratchData.deviceAddress = scratchAddress;
+        const VkAccelerationStructureBuildRangeInfoKHR* pRanges = inputs[blasIds[i]].ranges.data();
+        vkCmdBuildAccelerationStructuresKHR(cmdBuffer, 1, &buildInfos[i], &pRanges);
+        // The next build reuses the scratch buffer, and the query reads the BLAS:
+        recordBuildBarrier(cmdBuffer);
+        if (compact)
+        {
+            vkCmdWriteAccelerationStructuresPropertiesKHR(cmdBuffer, 1, &blas.accel, VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+                                                          queryPool, static_cast<uint32_t>(i));
+        }
+    }
+    endSection(cmdBuffer, sectionId);
+    submitAndWait(cmdBuffer);
+    m_allocator->destroy(scratchBuffer);
+
+    if (!compact)
+    {
+        return;
+    }
+
+    // Copy each BLAS to a new one that's only as large as it needs to be:
+    std::vector<VkDeviceSize> compactSizes(blasIds.size());
+    NVVK_CHECK(vkGetQueryPoolResults(m_device, queryPool, 0, static_cast<uint32_t>(compactSizes.size()),
+                                     compactSizes.size() * sizeof(VkDeviceSize), compactSizes.data(), sizeof(VkDeviceSize),
+                                     VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+    vkDestroyQueryPool(m_device, queryPool, nullptr);
+
+    std::vector<nvvk::AccelKHRDedicated> uncompactedBlases(blasIds.size());
+    VkDeviceSize                         totalUncompactedSize = 0, totalCompactedSize = 0;
+    cmdBuffer = beginCommandBuffer();
+    sectionId = beginSection(cmdBuffer, "BLAS compaction");
+    for (size_t i = 0; i < blasIds.size(); i++)
+    {
+        nvvk::AccelKHRDedicated& blas = m_blases[blasIds[i]];
+        uncompactedBlases[i] = blas;
+        blas = createAccel(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, compactSizes[i]);
+
+        VkCopyAccelerationStructureInfoKHR copyInfo = nvvk::make<VkCopyAccelerationStructureInfoKHR>();
+        copyInfo.src = uncompactedBlases[i].accel;
+        copyInfo.dst = blas.accel;
+        copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+        vkCmdCopyAccelerationStructureKHR(cmdBuffer, &copyInfo);
+
+        totalUncompactedSize += accelSizes[i];
+        totalCompactedSize += compactSizes[i];
+    }
+    endSection(cmdBuffer, sectionId);
+    submitAndWait(cmdBuffer);
+    for (nvvk::AccelKHRDedicated& blas : uncompactedBlases)
+    {
+        m_allocator->destroy(blas);
+    }
+    nvprintf("Compacted BLASes from %llu to %llu bytes.\n", static_cast<unsigned long long>(totalUncompactedSize),
+             static_cast<unsigned long long>(totalCompactedSize));
+}
+
+void AccelBuilder::serializeBlases(const std::vector<size_t>& blasIds, const std::vector<std::string>& filenames)
+{
+    // Get the size of each serialized BLAS:
+    VkQueryPoolCreateInfo queryPoolInfo = nvvk::make<VkQueryPoolCreateInfo>();
+    queryPoolInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR;
+    queryPoolInfo.queryCount = static_cast<uint32_t>(blasIds.size());
+    VkQueryPool queryPool;
+    NVVK_CHECK(vkCreateQueryPool(m_device, &queryPoolInfo, nullptr, &queryPool));
+
+    std::vector<VkAccelerationStructureKHR> accels;
+    for (size_t blasId : blasIds)
+    {
+        accels.push_back(m_blases[blasId].accel);
+    }
+    VkCommandBuffer cmdBuffer = beginCommandBuffer();
+    vkCmdResetQueryPool(cmdBuffer, queryPool, 0, queryPoolInfo.queryCount);
+    vkCmdWriteAccelerationStructuresPropertiesKHR(cmdBuffer, queryPoolInfo.queryCount, accels.data(),
+                                                  VK_QUERY_TYPE_ACCELERATION_STRUCTURE_SERIALIZATION_SIZE_KHR, queryPool, 0);
+    submitAndWait(cmdBuffer);
+    std::vector<VkDeviceSize> serializedSizes(blasIds.size());
+    NVVK_CHECK(vkGetQueryPoolResults(m_device, queryPool, 0, queryPoolInfo.queryCount, serializedSizes.size() * sizeof(VkDeviceSize),
+                                     serializedSizes.data(), sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+    vkDestroyQueryPool(m_device, queryPool, nullptr);
+
+    // Serialize the BLASes into host-visible buffers:
+    std::vector<nvvk::BufferDedicated> blobBuffers(blasIds.size());
+    cmdBuffer = beginCommandBuffer();
+    const uint32_t sectionId = beginSection(cmdBuffer, "BLAS serialize");
+    for (size_t i = 0; i < blasIds.size(); i++)
+    {
+        blobBuffers[i] = m_allocator->createBuffer(serializedSizes[i],                                                     //
+                                                   VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,  //
+                                                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT
+                                                       | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+        VkCopyAccelerationStructureToMemoryInfoKHR copyInfo = nvvk::make<VkCopyAccelerationStructureToMemoryInfoKHR>();
+        copyInfo.src = accels[i];
+        copyInfo.dst.deviceAddress = getBufferAddress(blobBuffers[i].buffer);
+        copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_SERIALIZE_KHR;
+        vkCmdCopyAccelerationStructureToMemoryKHR(cmdBuffer, &copyInfo);
+    }
+    endSection(cmdBuffer, sectionId);
+    // Make the serialized data visible to the CPU:
+    VkMemoryBarrier hostBarrier = nvvk::make<VkMemoryBarrier>();
+    hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_HOST_BIT, 0, 1,
+                         &hostBarrier, 0, nullptr, 0, nullptr);
+    submitAndWait(cmdBuffer);
+
+    // Write each BLAS to its cache file, so that other processes never see a
+    // partial file:
+    for (size_t i = 0; i < blasIds.size(); i++)
+    {
+        AccelCacheHeader header{};
+        memcpy(header.magic, "VMPA", 4);
+        header.version = ACCEL_CACHE_VERSION;
+        header.dataSize = serializedSizes[i];
+
+        const void* mapped = m_allocator->map(blobBuffers[i]);
+        const bool  written = WriteFileAtomically(filenames[i], [&](std::ostream& file) {
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(reinterpret_cast<const char*>(mapped), static_cast<std::streamsize>(header.dataSize));
+            return static_cast<bool>(file);
+        });
+        m_allocator->unmap(blobBuffers[i]);
+        if (!written)
+        {
+            nvprintf("Could not write BLAS cache file %s.\n", filenames[i].c_str());
+        }
+        m_allocator->destroy(blobBuffers[i]);
+    }
+}
+
+void AccelBuilder::buildTlas(const std::vector<AccelInstance>& instances, VkBuildAccelerationStructureFlagsKHR flags)
+{
+    // Convert the instances to the format the device reads:
+    std::vector<VkAccelerationStructureInstanceKHR> vkInstances;
+    vkInstances.reserve(instances.size());
+    for (const AccelInstance& instance : instances)
+    {
+        VkAccelerationStructureDeviceAddressInfoKHR addressInfo = nvvk::make<VkAccelerationStructureDeviceAddressInfoKHR>();
+        addressInfo.accelerationStructure = m_blases[instance.blasId].accel;
+
+        VkAccelerationStructureInstanceKHR vkInstance{};
+        // VkTransformMatrixKHR is a row-major 3x4 matrix, while nvmath matrices are column-major:
+        const nvmath::mat4f transposed = nvmath::transpose(instance.transform);
+        memcpy(&vkInstance.transform, &transposed, sizeof(vkInstance.transform));
+        vkInstance.instanceCustomIndex = instance.instanceCustomId;
+        vkInstance.mask = instance.mask;
+        vkInstance.instanceShaderBindingTableRecordOffset = instance.hitGroupId;
+        vkInstance.flags = static_cast<VkGeometryInstanceFlagsKHR>(instance.flags);
+        // Host builds refer to BLASes by handle, and device builds by address:
+        vkInstance.accelerationStructureReference = usesHostBuilds() ?
+                                                        reinterpret_cast<uint64_t>(m_blases[instance.blasId].accel) :
+                                                        vkGetAccelerationStructureDeviceAddressKHR(m_device, &addressInfo);
+        vkInstances.push_back(vkInstance);
+    }
+    if (usesHostBuilds())
+    {
+        buildTlasOnHost(vkInstances, flags);
+        return;
+    }
+
+    VkCommandBuffer cmdBuffer = beginCommandBuffer();
+    const uint32_t  sectionId = beginSection(cmdBuffer, "TLAS build");
+    // Upload the instances, and make them visible to the build:
+    nvvk::BufferDedicated instanceBuffer = m_allocator->createBuffer(
+        cmdBuffer, vkInstances, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR);
+    VkMemoryBarrier uploadBarrier = nvvk::make<VkMemoryBarrier>();
+    uploadBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    uploadBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1,
+                         &uploadBarrier, 0, nullptr, 0, nullptr);
+
+    VkAccelerationStructureGeometryKHR geometry = nvvk::make<VkAccelerationStructureGeometryKHR>();
+    geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    geometry.geometry.instances = nvvk::make<VkAccelerationStructureGeometryInstancesDataKHR>();
+    geometry.geometry.instances.arrayOfPointers = VK_FALSE;
+    geometry.geometry.instances.data.deviceAddress = getBufferAddress(instanceBuffer.buffer);
+
+    VkAccelerationStructureBuildGeometryInfoKHR buildInfo = nvvk::make<VkAccelerationStructureBuildGeometryInfoKHR>();
+    buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    buildInfo.flags = flags;
+    buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    buildInfo.geometryCount = 1;
+    buildInfo.pGeometries = &geometry;
+
+    const uint32_t                           numInstances = static_cast<uint32_t>(instances.size());
+    VkAccelerationStructureBuildSizesInfoKHR sizeInfo = nvvk::make<VkAccelerationStructureBuildSizesInfoKHR>();
+    vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo, &numInstances, &sizeInfo);
+
+    m_tlas = createAccel(VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, sizeInfo.accelerationStructureSize);
+    nvvk::BufferDedicated scratchBuffer =
+        m_allocator->createBuffer(sizeInfo.buildScratchSize, VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    buildInfo.dstAccelerationStructure = m_tlas.accel;
+    buildInfo.scratchData.deviceAddress = getBufferAddress(scratchBuffer.buffer);
+
+    VkAccelerationStructureBuildRangeInfoKHR        range{};
+    const VkAccelerationStructureBuildRangeInfoKHR* pRange = &range;
+    range.primitiveCount = numInstances;
+    vkCmdBuildAccelerationStructuresKHR(cmdBuffer, 1, &buildInfo, &pRange);
+    endSection(cmdBuffer, sectionId);
+    submitAndWait(cmdBuffer);
+
+    m_allocator->finalizeAndReleaseStaging();
+    m_allocator->destroy(scratchBuffer);
+    m_allocator->destroy(instanceBuffer);
+}
+
+void AccelBuilder::buildAndCompactBlasesOnHost(const std::vector<BlasInput>& inputs, VkBuildAccelerationStructureFlagsKHR flags)
+{
+    // Unlike on the device, where builds run one after another, all BLASes
+    // are built by one deferred operation, so each needs its own scratch memory.
+    const size_t                                             numBlases = inputs.size();
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> buildInfos(numBlases);
+    std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> pRanges(numBlases);
+    std::vector<std::vector<uint8_t>>                        scratchMemory(numBlases);
+    for (size_t i = 0; i < numBlases; i++)
+    {
+        const BlasInput&                             input = inputs[i];
+        VkAccelerationStructureBuildGeometryInfoKHR& buildInfo = buildInfos[i];
+        buildInfo = nvvk::make<VkAccelerationStructureBuildGeometryInfoKHR>();
+        buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        buildInfo.flags = flags;
+        buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        buildInfo.geometryCount = static_cast<uint32_t>(input.geometries.size());
+        buildInfo.pGeometries = input.geometries.data();
+
+        std::vector<uint32_t> maxPrimitiveCounts;
+        for (const VkAccelerationStructureBuildRangeInfoKHR& range : input.ranges)
+        {
+            maxPrimitiveCounts.push_back(range.primitiveCount);
+        }
+        VkAccelerationStructureBuildSizesInfoKHR sizeInfo = nvvk::make<VkAccelerationStructureBuildSizesInfoKHR>();
+        vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR, &buildInfo,
+                                                maxPrimitiveCounts.data(), &sizeInfo);
+
+        m_blases[i] = createAccel(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, sizeInfo.accelerationStructureSize);
+        scratchMemory[i].resize(sizeInfo.buildScratchSize);
+        buildInfo.dstAccelerationStructure = m_blases[i].accel;
+        buildInfo.scratchData.hostAddress = scratchMemory[i].data();
+        pRanges[i] = input.ranges.data();
+    }
+
+    auto startTime = std::chrono::steady_clock::now();
+    NVVK_CHECK(RunDeferredOperation(m_device, *m_hostPool, [&](VkDeferredOperationKHR operation) {
+        return vkBuildAccelerationStructuresKHR(m_device, operation, static_cast<uint32_t>(numBlases), buildInfos.data(),
+                                                pRanges.data());
+    }));
+    addHostSample("BLAS build (host)", startTime);
+
+    if ((flags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR) == 0)
+    {
+        return;
+    }
+
+    // On the host, compacted sizes can be read directly, without a query pool:
+    std::vector<VkAccelerationStructureKHR> accels;
+    for (const nvvk::AccelKHRDedicated& blas : m_blases)
+    {
+        accels.push_back(blas.accel);
+    }
+    std::vector<VkDeviceSize> compactSizes(numBlases);
+    NVVK_CHECK(vkWriteAccelerationStructuresPropertiesKHR(m_device, static_cast<uint32_t>(numBlases), accels.data(),
+                                                          VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+                                                          compactSizes.size() * sizeof(VkDeviceSize), compactSizes.data(),
+                                                          sizeof(VkDeviceSize)));
+
+    // Compact the BLASes in parallel; each copy is its own deferred operation:
+    startTime = std::chrono::steady_clock::now();
+    std::vector<nvvk::AccelKHRDedicated> compactBlases(numBlases);
+    for (size_t i = 0; i < numBlases; i++)
+    {
+        compactBlases[i] = createAccel(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, compactSizes[i]);
+    }
+    m_hostPool->parallelFor(numBlases, [&](size_t i) {
+        VkCopyAccelerationStructureInfoKHR copyInfo = nvvk::make<VkCopyAccelerationStructureInfoKHR>();
+        copyInfo.src = m_blases[i].accel;
+        copyInfo.dst = compactBlases[i].accel;
+        copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+        NVVK_CHECK(RunDeferredOperation(m_device, *m_hostPool, [&](VkDeferredOperationKHR operation) {
+            return vkCopyAccelerationStructureKHR(m_device, operation, &copyInfo);
+        }));
+    });
+    addHostSample("BLAS compaction (host)", startTime);
+    for (size_t i = 0; i < numBlases; i++)
+    {
+        m_allocator->destroy(m_blases[i]);
+        m_blases[i] = compactBlases[i];
+    }
+}
+
+void AccelBuilder::buildTlasOnHost(const std::vector<VkAccelerationStructureInstanceKHR>& vkInstances, VkBuildAccelerationStructureFlagsKHR flags)
+{
+    VkAccelerationStructureGeometryKHR geometry = nvvk::make<VkAccelerationStructureGeometryKHR>();
+    geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+    geometry.geometry.instances = nvvk::make<VkAccelerationStructureGeometryInstancesDataKHR>();
+    geometry.geometry.instances.arrayOfPointers = VK_FALSE;
+    geometry.geometry.instances.data.hostAddress = vkInstances.data();
+
+    VkAccelerationStructureBuildGeometryInfoKHR buildInfo = nvvk::make<VkAccelerationStructureBuildGeometryInfoKHR>();
+    buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+    buildInfo.flags = flags;
+    buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+    buildInfo.geometryCount = 1;
+    buildInfo.pGeometries = &geometry;
+
+    const uint32_t                           numInstances = static_cast<uint32_t>(vkInstances.size());
+    VkAccelerationStructureBuildSizesInfoKHR sizeInfo = nvvk::make<VkAccelerationStructureBuildSizesInfoKHR>();
+    vkGetAccelerationStructureBuildSizesKHR(m_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR, &buildInfo, &numInstances, &sizeInfo);
+
+    m_tlas = createAccel(VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, sizeInfo.accelerationStructureSize);
+    std::vector<uint8_t> scratchMemory(sizeInfo.buildScratchSize);
+    buildInfo.dstAccelerationStructure = m_tlas.accel;
+    buildInfo.scratchData.hostAddress = scratchMemory.data();
+
+    VkAccelerationStructureBuildRangeInfoKHR        range{};
+    const VkAccelerationStructureBuildRangeInfoKHR* pRange = &range;
+    range.primitiveCount = numInstances;
+    const auto startTime = std::chrono::steady_clock::now();
+    NVVK_CHECK(RunDeferredOperation(m_device, *m_hostPool, [&](VkDeferredOperationKHR operation) {
+        return vkBuildAccelerationStructuresKHR(m_device, operation, 1, &buildInfo, &pRange);
+    }));
+    addHostSample("TLAS build (host)", startTime);
+}
@@ -0,0 +1,119 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_ACCEL_BUILDER_HPP
+#define VK_MINI_PATH_TRACER_ACCEL_BUILDER_HPP
+
+#include <nvmath/nvmath.h>
+#include <chrono>
+#include <nvvk/allocator_dedicated_vk.hpp>
+#include <string>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+class GpuProfiler;
+class ThreadPool;
+
+// The geometries of one bottom-level acceleration structure (BLAS).
+struct BlasInput
+{
+    // For host builds, these must use host addresses instead of device addresses.
+    std::vector<VkAccelerationStructureGeometryKHR>       geometries;
+    std::vector<VkAccelerationStructureBuildRangeInfoKHR> ranges;  // One per geometry
+    // Identifies the contents of the buffers the geometries read from, such
+    // as MeshFile::contentHash(). 0 means this BLAS is never cached.
+    uint64_t contentHash = 0;
+};
+
+// An instance of a BLAS in the top-level acceleration structure (TLAS). This
+// has the same fields as nvvk::RaytracingBuilderKHR::Instance.
+struct AccelInstance
+{
+    uint32_t                   blasId = 0;            // Index of the BLAS in the list passed to buildBlases()
+    uint32_t                   instanceCustomId = 0;  // 24 bits accessible to ray shaders via gl_InstanceCustomIndexEXT
+    uint32_t                   hitGroupId = 0;        // Offset added when looking up the instance's shader in the SBT
+    uint32_t                   mask = 0xFF;           // Visibility mask, ANDed with the ray mask
+    VkGeometryInstanceFlagsKHR flags = 0;             // How to trace this instance
+    nvmath::mat4f              transform{ 1 };        // Object-to-world transformation
+};
+
+// Builds the BLASes and the TLAS of the scene, like nvvk::RaytracingBuilderKHR,
+// and keeps a serialized copy of each compacted BLAS on disk.
+//
+// Building a BLAS for a large static mesh is often the largest GPU cost
+// before the first pixel, but its result only depends on the mesh, the build
+// flags, and the driver. So after compaction, buildBlases() serializes each
+// BLAS with vkCmdCopyAccelerationStructureToMemoryKHR to a file whose name
+// is a hash of the BLAS's content hash, geometry descriptions, and build
+// flags. Later runs deserialize the file with
+// vkCmdCopyMemoryToAccelerationStructureKHR instead of building, after
+// vkGetDeviceAccelerationStructureCompatibilityKHR confirms that this device
+// and driver can use it; otherwise the BLAS is rebuilt and the file replaced.
+//
+// With enableHostBuilds(), acceleration structures are instead built on the
+// CPU (this needs the accelerationStructureHostCommands feature), in
+// host-visible memory. Each host command runs as a deferred operation that
+// threads of a ThreadPool join, so builds scale across CPU cores. This is
+// useful on CPU implementations such as lavapipe, and keeps the GPU's queue
+// free. Host builds don't use the cache.
+class AccelBuilder
+{
+public:
+    void init(VkDevice device, nvvk::AllocatorDedicated* allocator, uint32_t queueFamilyIndex, VkQueue queue);
+    void deinit();
+    // Makes later builds run on the host, using threads from `pool`.
+    void enableHostBuilds(ThreadPool& pool) { m_hostPool = &pool; }
+    bool usesHostBuilds() const { return m_hostPool != nullptr; }
+    // Measures each build, compaction, and cache phase with `profiler`.
+    void setProfiler(GpuProfiler* profiler) { m_profiler = profiler; }
+
+    // Builds (or, if `useCache` is true, loads) one BLAS per input. If
+    // `flags` includes VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR,
+    // built BLASes are compacted.
+    void buildBlases(const std::vector<BlasInput>& inputs, VkBuildAccelerationStructureFlagsKHR flags, bool useCache);
+    // Builds the TLAS over instances of the BLASes from buildBlases().
+    void buildTlas(const std::vector<AccelInstance>& instances, VkBuildAccelerationStructureFlagsKHR flags);
+
+    VkAccelerationStructureKHR getTlas() const { return m_tlas.accel; }
+
+private:
+    VkCommandBuffer beginCommandBuffer();
+    void            submitAndWait(VkCommandBuffer cmdBuffer);
+    // Records a barrier between acceleration structure commands.
+    static void recordBuildBarrier(VkCommandBuffer cmdBuffer);
+    // Creates an acceleration structure of the given type and size, in
+    // host-visible memory for host builds.
+    nvvk::AccelKHRDedicated createAccel(VkAccelerationStructureTypeKHR type, VkDeviceSize size);
+    VkDeviceAddress         getBufferAddress(VkBuffer buffer) const;
+    // Profiling helpers that do nothing without a profiler:
+    uint32_t beginSection(VkCommandBuffer cmdBuffer, const char* phase);
+    void     endSection(VkCommandBuffer cmdBuffer, uint32_t sectionId);
+    void     addHostSample(const char* phase, std::chrono::steady_clock::time_point startTime);
+
+    // Returns the name of the cache file for a BLAS.
+    static std::string getCacheFilename(const BlasInput& input, VkBuildAccelerationStructureFlagsKHR flags);
+    // Reads a cache file and checks that this device can deserialize it.
+    // Returns the serialized BLAS, or an empty string if it can't be used.
+    std::string loadCacheFile(const std::string& filename) const;
+    // Deserializes BLASes from cache data. `blobs[i]` is the data for
+    // m_blases[blasIds[i]].
+    void deserializeBlases(const std::vector<size_t>& blasIds, const std::vector<std::string>& blobs);
+    // Builds (and compacts) the BLASes m_blases[blasIds[i]] on the device.
+    void buildAndCompactBlases(const std::vector<BlasInput>& inputs, const std::vector<size_t>& blasIds, VkBuildAccelerationStructureFlagsKHR flags);
+    // Builds (and compacts) all BLASes on the host.
+    void buildAndCompactBlasesOnHost(const std::vector<BlasInput>& inputs, VkBuildAccelerationStructureFlagsKHR flags);
+    // Builds the TLAS on the host.
+    void buildTlasOnHost(const std::vector<VkAccelerationStructureInstanceKHR>& vkInstances, VkBuildAccelerationStructureFlagsKHR flags);
+    // Serializes the BLASes m_blases[blasIds[i]] to the files `filenames[i]`.
+    void serializeBlases(const std::vector<size_t>& blasIds, const std::vector<std::string>& filenames);
+
+    VkDevice                             m_device = VK_NULL_HANDLE;
+    nvvk::AllocatorDedicated*            m_allocator = nullptr;
+    VkQueue                              m_queue = VK_NULL_HANDLE;
+    VkCommandPool                        m_cmdPool = VK_NULL_HANDLE;
+    std::vector<nvvk::AccelKHRDedicated> m_blases;
+    nvvk::AccelKHRDedicated              m_tlas;
+    ThreadPool*                          m_hostPool = nullptr;  // Not null if building on the host
+    GpuProfiler*                         m_profiler = nullptr;
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_ACCEL_BUILDER_HPP
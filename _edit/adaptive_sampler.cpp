@@ -0,0 +1,213 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "adaptive_sampler.hpp"
+
+#include <array>
+#include <cstddef>
+#include <nvvk/error_vk.hpp>    // For NVVK_CHECK
+#include <nvvk/structs_vk.hpp>  // For nvvk::make
+
+#include "common.h"
+#include "pipeline_variants.hpp"
+
+namespace {
+// Marks a readback slot that no batch has copied to since it was last read.
+const uint32_t NO_TILE_COUNT = ~0u;
+}  // namespace
+
+void AdaptiveSampler::init(VkDevice device, nvvk::AllocatorDedicated* allocator, PipelineVariantCache* pipelineVariants,
+    VkImageView colorImageView, uint32_t width, uint32_t height, uint32_t tileWidth, uint32_t tileHeight, uint32_t numSlots)
+{
+    m_device = device;
+    m_allocator = allocator;
+    m_tileWidth = tileWidth;
+    m_tileHeight = tileHeight;
+    m_numTilesX = (width + tileWidth - 1) / tileWidth;
+    m_numTilesY = (height + tileHeight - 1) / tileHeight;
+
+    // The variance image has one float per pixel:
+    VkImageCreateInfo imageCreateInfo = nvvk::make<VkImageCreateInfo>();
+    imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
+    imageCreateInfo.format = VK_FORMAT_R32_SFLOAT;
+    imageCreateInfo.extent = { width, height, 1 };
+    imageCreateInfo.mipLevels = 1;
+    imageCreateInfo.arrayLayers = 1;
+    imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    imageCreateInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    imageCreateInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    m_varianceImage = allocator->createImage(imageCreateInfo);
+    VkImageViewCreateInfo imageViewCreateInfo = nvvk::make<VkImageViewCreateInfo>();
+    imageViewCreateInfo.image = m_varianceImage.image;
+    imageViewCreateInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    imageViewCreateInfo.format = imageCreateInfo.format;
+    imageViewCreateInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    imageViewCreateInfo.subresourceRange.layerCount = 1;
+    imageViewCreateInfo.subresourceRange.levelCount = 1;
+    NVVK_CHECK(vkCreateImageView(device, &imageViewCreateInfo, nullptr, &m_varianceImageView));
+
+    // The tile list has room for every tile:
+    m_tileBuffer = allocator->createBuffer(sizeof(AdaptiveTileHeader) + getNumTiles() * sizeof(uint32_t),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT
+            | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    VkBufferDeviceAddressInfo addressInfo = nvvk::make<VkBufferDeviceAddressInfo>();
+    addressInfo.buffer = m_tileBuffer.buffer;
+    m_tileBufferAddress = vkGetBufferDeviceAddress(device, &addressInfo);
+
+    // The readback buffer stays mapped:
+    m_readbackBuffer = allocator->createBuffer(numSlots * sizeof(uint32_t), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+    m_readbackData = reinterpret_cast<uint32_t*>(allocator->map(m_readbackBuffer));
+    for (uint32_t slot = 0; slot < numSlots; slot++)
+    {
+        m_readbackData[slot] = NO_TILE_COUNT;
+    }
+
+    // The tile list shader's descriptor set:
+    m_descriptorSetContainer.init(device);
+    m_descriptorSetContainer.addBinding(BINDING_IMAGEDATA, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.addBinding(BINDING_ADAPTIVE_VARIANCE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.addBinding(BINDING_ADAPTIVE_TILES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.initLayout();
+    m_descriptorSetContainer.initPool(1);
+    VkPushConstantRange pushConstantRange;
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(AdaptivePushConstants);
+    m_descriptorSetContainer.initPipeLayout(1, &pushConstantRange);
+
+    VkDescriptorImageInfo colorImageInfo{};
+    colorImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    colorImageInfo.imageView = colorImageView;
+    VkDescriptorImageInfo varianceImageInfo = colorImageInfo;
+    varianceImageInfo.imageView = m_varianceImageView;
+    VkDescriptorBufferInfo tileBufferInfo{};
+    tileBufferInfo.buffer = m_tileBuffer.buffer;
+    tileBufferInfo.range = VK_WHOLE_SIZE;
+    const std::array<VkWriteDescriptorSet, 3> writeDescriptorSets = {
+        m_descriptorSetContainer.makeWrite(0, BINDING_IMAGEDATA, &colorImageInfo),
+        m_descriptorSetContainer.makeWrite(0, BINDING_ADAPTIVE_VARIANCE, &varianceImageInfo),
+        m_descriptorSetContainer.makeWrite(0, BINDING_ADAPTIVE_TILES, &tileBufferInfo) };
+    vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+
+    // One workgroup per tile:
+    SpecializationConstants constants;
+    constants.set(CONSTANT_ID_ADAPTIVE_TILE_WIDTH, tileWidth).set(CONSTANT_ID_ADAPTIVE_TILE_HEIGHT, tileHeight);
+    m_pipeline = pipelineVariants->getComputePipeline("shaders/adaptiveTiles.comp.glsl.spv",
+        m_descriptorSetContainer.getPipeLayout(), constants);
+}
+
+void AdaptiveSampler::deinit()
+{
+    m_pipeline = VK_NULL_HANDLE;
+    m_descriptorSetContainer.deinit();
+    if (m_readbackData != nullptr)
+    {
+        m_allocator->unmap(m_readbackBuffer);
+        m_readbackData = nullptr;
+    }
+    m_allocator->destroy(m_readbackBuffer);
+    m_allocator->destroy(m_tileBuffer);
+    vkDestroyImageView(m_device, m_varianceImageView, nullptr);
+    m_varianceImageView = VK_NULL_HANDLE;
+    m_allocator->destroy(m_varianceImage);
+}
+
+void AdaptiveSampler::setTarget(float targetRelativeError, uint32_t minBatches)
+{
+    m_targetRelativeError = targetRelativeError;
+    m_minBatches = minBatches;
+}
+
+void AdaptiveSampler::recordInitialize(VkCommandBuffer cmdBuffer) const
+{
+    VkImageMemoryBarrier imageBarrier = nvvk::make<VkImageMemoryBarrier>();
+    imageBarrier.srcAccessMask = 0;
+    imageBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    imageBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    imageBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+    imageBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    imageBarrier.image = m_varianceImage.image;
+    imageBarrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    imageBarrier.subresourceRange.levelCount = 1;
+    imageBarrier.subresourceRange.layerCount = 1;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+        nullptr, 1, &imageBarrier);
+
+    const VkClearColorValue clearColor{};
+    vkCmdClearColorImage(cmdBuffer, m_varianceImage.image, VK_IMAGE_LAYOUT_GENERAL, &clearColor, 1,
+        &imageBarrier.subresourceRange);
+
+    VkMemoryBarrier memoryBarrier = nvvk::make<VkMemoryBarrier>();
+    memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0,
+        nullptr, 0, nullptr);
+}
+
+void AdaptiveSampler::recordBuildTileList(VkCommandBuffer cmdBuffer) const
+{
+    // The previous batch may still be tracing the last tile list or copying
+    // its count, so wait for it before emptying the list:
+    vkCmdPipelineBarrier(cmdBuffer,
+        VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+    const AdaptiveTileHeader emptyHeader = { m_tileWidth * m_tileHeight, 0, 1 };
+    vkCmdUpdateBuffer(cmdBuffer, m_tileBuffer.buffer, 0, sizeof(emptyHeader), &emptyHeader);
+    // Make the empty list, and the previous batch's writes to the images,
+    // visible to the compute shader:
+    VkMemoryBarrier memoryBarrier = nvvk::make<VkMemoryBarrier>();
+    memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+
+    // Append each tile that hasn't converged:
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_pipeline);
+    VkDescriptorSet descriptorSet = m_descriptorSetContainer.getSet(0);
+    vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_descriptorSetContainer.getPipeLayout(), 0, 1,
+        &descriptorSet, 0, nullptr);
+    AdaptivePushConstants pushConstants;
+    pushConstants.targetRelativeError = m_targetRelativeError;
+    pushConstants.minBatches = m_minBatches;
+    vkCmdPushConstants(cmdBuffer, m_descriptorSetContainer.getPipeLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0,
+        sizeof(pushConstants), &pushConstants);
+    vkCmdDispatch(cmdBuffer, m_numTilesX, m_numTilesY, 1);
+
+    // Then make the list visible to the indirect trace, to the ray generation
+    // shader, and to the copy of its count:
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+        VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_TRANSFER_BIT,
+        0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+}
+
+void AdaptiveSampler::recordCopyTileCount(VkCommandBuffer cmdBuffer, uint32_t slotIndex) const
+{
+    // recordBuildTileList() already made the count visible to transfers:
+    VkBufferCopy region;
+    region.srcOffset = offsetof(AdaptiveTileHeader, launchHeight);
+    region.dstOffset = slotIndex * sizeof(uint32_t);
+    region.size = sizeof(uint32_t);
+    vkCmdCopyBuffer(cmdBuffer, m_tileBuffer.buffer, m_readbackBuffer.buffer, 1, &region);
+    VkMemoryBarrier memoryBarrier = nvvk::make<VkMemoryBarrier>();
+    memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memoryBarrier, 0,
+        nullptr, 0, nullptr);
+}
+
+void AdaptiveSampler::retireSlot(uint32_t slotIndex)
+{
+    uint32_t& tileCount = m_readbackData[slotIndex];
+    if (tileCount == NO_TILE_COUNT)
+    {
+        return;  // This batch didn't build a tile list (e.g. it only read back the image)
+    }
+    m_lastTileCount = tileCount;
+    tileCount = NO_TILE_COUNT;
+}
@@ -0,0 +1,88 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_ADAPTIVE_SAMPLER_HPP
+#define VK_MINI_PATH_TRACER_ADAPTIVE_SAMPLER_HPP
+
+#include <nvvk/allocator_dedicated_vk.hpp>
+#include <nvvk/descriptorsets_vk.hpp>  // For nvvk::DescriptorSetContainer
+#include <vulkan/vulkan_core.h>
+
+#include "common.h"
+
+class PipelineVariantCache;
+
+// AdaptiveSampler spends sample batches only on the parts of the image that
+// are still noisy.
+//
+// Besides the accumulated image, it keeps a second image with the mean
+// squared luminance of each pixel's sample batches, which the ray generation
+// shader updates. Before each batch, a compute shader (adaptiveTiles.comp.glsl)
+// estimates each pixel's relative error from these, and builds a list of the
+// tiles with pixels that haven't reached the target error yet; the batch then
+// traces only those tiles with vkCmdTraceRaysIndirectKHR. Flat sky and walls
+// converge after a few batches, so later batches trace far fewer rays.
+//
+// The tile list is built on the GPU, so the recorded commands are the same
+// for every batch. Each batch also copies the number of tiles to a per-slot
+// readback area (like RayStatistics), so that the CPU can stop submitting
+// batches once a batch finds that every tile has converged.
+class AdaptiveSampler
+{
+public:
+    // `colorImageView` is the accumulated image, in GENERAL layout, and tiles
+    // are tileWidth x tileHeight pixels; the ray generation shader must be
+    // specialized for the same tile size.
+    void init(VkDevice device, nvvk::AllocatorDedicated* allocator, PipelineVariantCache* pipelineVariants,
+        VkImageView colorImageView, uint32_t width, uint32_t height, uint32_t tileWidth, uint32_t tileHeight,
+        uint32_t numSlots);
+    void deinit();
+
+    // Sets the convergence criteria used by batches recorded after this call.
+    void setTarget(float targetRelativeError, uint32_t minBatches);
+
+    // Records the transition of the variance image to GENERAL layout, and
+    // clears it. Must run before the first batch.
+    void recordInitialize(VkCommandBuffer cmdBuffer) const;
+    // Records the commands that build the tile list for the next batch from
+    // the previous batches' images, and make it visible to
+    // vkCmdTraceRaysIndirectKHR and the ray generation shader.
+    void recordBuildTileList(VkCommandBuffer cmdBuffer) const;
+    // Records a copy of the number of tiles in the list to the readback area
+    // of slot `slotIndex`.
+    void recordCopyTileCount(VkCommandBuffer cmdBuffer, uint32_t slotIndex) const;
+    // Reads the number of tiles copied to slot `slotIndex`, if a batch copied
+    // one since the last call. Call this when the slot's batch retires.
+    void retireSlot(uint32_t slotIndex);
+
+    // Returns true once a retired batch found that every tile has converged.
+    bool isConverged() const { return m_lastTileCount == 0; }
+    // Returns the total number of tiles in the image.
+    uint32_t getNumTiles() const { return m_numTilesX * m_numTilesY; }
+
+    VkImageView     getVarianceImageView() const { return m_varianceImageView; }
+    VkBuffer        getTileBuffer() const { return m_tileBuffer.buffer; }
+    // Returns the device address of the VkTraceRaysIndirectCommandKHR for
+    // the ray tracing pipeline.
+    VkDeviceAddress getIndirectDeviceAddress() const { return m_tileBufferAddress; }
+
+private:
+    VkDevice                     m_device = VK_NULL_HANDLE;
+    nvvk::AllocatorDedicated*    m_allocator = nullptr;
+    nvvk::DescriptorSetContainer m_descriptorSetContainer;
+    VkPipeline                   m_pipeline = VK_NULL_HANDLE;  // Owned by the PipelineVariantCache
+    nvvk::ImageDedicated         m_varianceImage;
+    VkImageView                  m_varianceImageView = VK_NULL_HANDLE;
+    nvvk::BufferDedicated        m_tileBuffer;      // AdaptiveTileHeader, then one uint per tile
+    VkDeviceAddress              m_tileBufferAddress = 0;
+    nvvk::BufferDedicated        m_readbackBuffer;  // One tile count per slot, persistently mapped
+    uint32_t*                    m_readbackData = nullptr;
+    uint32_t                     m_tileWidth = DEFAULT_ADAPTIVE_TILE_WIDTH;
+    uint32_t                     m_tileHeight = DEFAULT_ADAPTIVE_TILE_HEIGHT;
+    uint32_t                     m_numTilesX = 0;
+    uint32_t                     m_numTilesY = 0;
+    float                        m_targetRelativeError = 0.01f;
+    uint32_t                     m_minBatches = 2;
+    uint32_t                     m_lastTileCount = ~0u;  // Tiles in the list of the last retired batch; ~0u if none
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_ADAPTIVE_SAMPLER_HPP
@@ -0,0 +1,245 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "batch_submitter.hpp"
+
+#include <cassert>
+#include <chrono>
+#include <nvh/nvprint.hpp>      // For nvprintf
+#include <nvvk/error_vk.hpp>    // For NVVK_CHECK
+#include <nvvk/structs_vk.hpp>  // For nvvk::make
+
+#include "gpu_profiler.hpp"
+
+void BatchSubmitter::init(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue queue, uint32_t queueFamilyIndex, uint32_t maxBatchesInFlight)
+{
+    assert(maxBatchesInFlight > 0);
+    m_device = device;
+    m_queue = queue;
+
+    // Timeline semaphores are core in Vulkan 1.2, but are still an optional feature:
+    VkPhysicalDeviceVulkan12Features features12 = nvvk::make<VkPhysicalDeviceVulkan12Features>();
+    VkPhysicalDeviceFeatures2        features2 = nvvk::make<VkPhysicalDeviceFeatures2>();
+    features2.pNext = &features12;
+    vkGetPhysicalDeviceFeatures2(physicalDevice, &features2);
+    assert(features12.timelineSemaphore == VK_TRUE);
+
+    // The command buffers in this pool are reset and re-recorded every time
+    // their slot comes around again:
+    VkCommandPoolCreateInfo cmdPoolInfo = nvvk::make<VkCommandPoolCreateInfo>();
+    cmdPoolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    cmdPoolInfo.queueFamilyIndex = queueFamilyIndex;
+    NVVK_CHECK(vkCreateCommandPool(device, &cmdPoolInfo, nullptr, &m_cmdPool));
+
+    m_slots.resize(maxBatchesInFlight);
+    std::vector<VkCommandBuffer>  cmdBuffers(maxBatchesInFlight);
+    VkCommandBufferAllocateInfo cmdAllocInfo = nvvk::make<VkCommandBufferAllocateInfo>();
+    cmdAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmdAllocInfo.commandPool = m_cmdPool;
+    cmdAllocInfo.commandBufferCount = maxBatchesInFlight;
+    NVVK_CHECK(vkAllocateCommandBuffers(device, &cmdAllocInfo, cmdBuffers.data()));
+    for (uint32_t slotIndex = 0; slotIndex < maxBatchesInFlight; slotIndex++)
+    {
+        m_slots[slotIndex].cmdBuffer = cmdBuffers[slotIndex];
+    }
+
+    // Create the timeline semaphore, starting at 0 (nothing has completed yet):
+    VkSemaphoreTypeCreateInfo semaphoreTypeInfo = nvvk::make<VkSemaphoreTypeCreateInfo>();
+    semaphoreTypeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    semaphoreTypeInfo.initialValue = 0;
+    VkSemaphoreCreateInfo semaphoreInfo = nvvk::make<VkSemaphoreCreateInfo>();
+    semaphoreInfo.pNext = &semaphoreTypeInfo;
+    NVVK_CHECK(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &m_timeline));
+
+    // Only measure idle time if this queue family supports timestamps:
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+    const uint32_t validBits = queueFamilies[queueFamilyIndex].timestampValidBits;
+    if (validBits != 0)
+    {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        m_timestampPeriod = properties.limits.timestampPeriod;
+        m_timestampMask = (validBits >= 64) ? ~uint64_t(0) : ((uint64_t(1) << validBits) - 1);
+
+        VkQueryPoolCreateInfo queryPoolInfo = nvvk::make<VkQueryPoolCreateInfo>();
+        queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        queryPoolInfo.queryCount = 2 * maxBatchesInFlight;
+        NVVK_CHECK(vkCreateQueryPool(device, &queryPoolInfo, nullptr, &m_queryPool));
+    }
+}
+
+void BatchSubmitter::deinit()
+{
+    waitIdle();
+    if (m_queryPool != VK_NULL_HANDLE)
+    {
+        vkDestroyQueryPool(m_device, m_queryPool, nullptr);
+        m_queryPool = VK_NULL_HANDLE;
+    }
+    vkDestroySemaphore(m_device, m_timeline, nullptr);
+    vkDestroyCommandPool(m_device, m_cmdPool, nullptr);  // Also frees the command buffers
+    m_slots.clear();
+}
+
+VkCommandBuffer BatchSubmitter::beginBatch(const char* profilerPhase)
+{
+    // Make sure the GPU is done with the last batch that used this slot:
+    retireSlot(m_currentSlot);
+    Slot& slot = m_slots[m_currentSlot];
+    slot.profilerPhase = profilerPhase;
+
+    // Re-recording a slot means the ring no longer holds replayable batches.
+    m_replayable = false;
+    NVVK_CHECK(vkResetCommandBuffer(slot.cmdBuffer, 0));
+    VkCommandBufferBeginInfo beginInfo = nvvk::make<VkCommandBufferBeginInfo>();
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    NVVK_CHECK(vkBeginCommandBuffer(slot.cmdBuffer, &beginInfo));
+    writeStartTimestamp(slot.cmdBuffer);
+    return slot.cmdBuffer;
+}
+
+uint64_t BatchSubmitter::submitBatch()
+{
+    Slot& slot = m_slots[m_currentSlot];
+    writeEndTimestamp(slot.cmdBuffer);
+    NVVK_CHECK(vkEndCommandBuffer(slot.cmdBuffer));
+    return submitCurrentSlot();
+}
+
+void BatchSubmitter::recordReplayableBatches(const std::function<void(VkCommandBuffer)>& recordCommands)
+{
+    waitIdle();  // None of the command buffers may be pending while we record them
+
+    // Record each slot in turn; since m_currentSlot cycles through every slot
+    // exactly once, this leaves m_currentSlot where it started.
+    for (size_t i = 0; i < m_slots.size(); i++)
+    {
+        Slot& slot = m_slots[m_currentSlot];
+        slot.profilerPhase = "sample batch";
+        NVVK_CHECK(vkResetCommandBuffer(slot.cmdBuffer, 0));
+        // No ONE_TIME_SUBMIT flag, since we'll submit these many times:
+        VkCommandBufferBeginInfo beginInfo = nvvk::make<VkCommandBufferBeginInfo>();
+        NVVK_CHECK(vkBeginCommandBuffer(slot.cmdBuffer, &beginInfo));
+        writeStartTimestamp(slot.cmdBuffer);
+        recordCommands(slot.cmdBuffer);
+        writeEndTimestamp(slot.cmdBuffer);
+        NVVK_CHECK(vkEndCommandBuffer(slot.cmdBuffer));
+        m_currentSlot = (m_currentSlot + 1) % static_cast<uint32_t>(m_slots.size());
+    }
+    m_replayable = true;
+}
+
+uint64_t BatchSubmitter::replayBatch()
+{
+    assert(m_replayable && "recordReplayableBatches() must be called before replayBatch()!");
+    retireSlot(m_currentSlot);
+    return submitCurrentSlot();
+}
+
+void BatchSubmitter::writeStartTimestamp(VkCommandBuffer cmdBuffer)
+{
+    if (m_queryPool != VK_NULL_HANDLE)
+    {
+        vkCmdResetQueryPool(cmdBuffer, m_queryPool, 2 * m_currentSlot, 2);
+        vkCmdWriteTimestamp(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_queryPool, 2 * m_currentSlot);
+    }
+}
+
+void BatchSubmitter::writeEndTimestamp(VkCommandBuffer cmdBuffer)
+{
+    if (m_queryPool != VK_NULL_HANDLE)
+    {
+        vkCmdWriteTimestamp(cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, 2 * m_currentSlot + 1);
+    }
+}
+
+uint64_t BatchSubmitter::submitCurrentSlot()
+{
+    Slot& slot = m_slots[m_currentSlot];
+    // Signal the next value of the timeline semaphore when this batch finishes:
+    slot.timelineValue = m_nextTimelineValue++;
+    VkTimelineSemaphoreSubmitInfo timelineInfo = nvvk::make<VkTimelineSemaphoreSubmitInfo>();
+    timelineInfo.signalSemaphoreValueCount = 1;
+    timelineInfo.pSignalSemaphoreValues = &slot.timelineValue;
+    VkSubmitInfo submitInfo = nvvk::make<VkSubmitInfo>();
+    submitInfo.pNext = &timelineInfo;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &slot.cmdBuffer;
+    submitInfo.signalSemaphoreCount = 1;
+    submitInfo.pSignalSemaphores = &m_timeline;
+    NVVK_CHECK(vkQueueSubmit(m_queue, 1, &submitInfo, VK_NULL_HANDLE));
+
+    m_currentSlot = (m_currentSlot + 1) % static_cast<uint32_t>(m_slots.size());
+    return slot.timelineValue;
+}
+
+void BatchSubmitter::waitIdle()
+{
+    // m_currentSlot is the oldest slot in the ring, so retiring from there
+    // keeps the statistics in submission order:
+    const uint32_t numSlots = static_cast<uint32_t>(m_slots.size());
+    for (uint32_t i = 0; i < numSlots; i++)
+    {
+        retireSlot((m_currentSlot + i) % numSlots);
+    }
+}
+
+void BatchSubmitter::retireSlot(uint32_t slotIndex)
+{
+    Slot& slot = m_slots[slotIndex];
+    if (slot.timelineValue == 0)
+    {
+        return;  // Nothing in flight
+    }
+
+    const auto          waitStart = std::chrono::steady_clock::now();
+    VkSemaphoreWaitInfo waitInfo = nvvk::make<VkSemaphoreWaitInfo>();
+    waitInfo.semaphoreCount = 1;
+    waitInfo.pSemaphores = &m_timeline;
+    waitInfo.pValues = &slot.timelineValue;
+    NVVK_CHECK(vkWaitSemaphores(m_device, &waitInfo, UINT64_MAX));
+    m_cpuBlockedMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - waitStart).count();
+
+    double batchMs = 0.0;
+    if (m_queryPool != VK_NULL_HANDLE)
+    {
+        uint64_t timestamps[2];
+        NVVK_CHECK(vkGetQueryPoolResults(m_device, m_queryPool, 2 * slotIndex, 2, sizeof(timestamps), timestamps,
+            sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+        const uint64_t start = timestamps[0] & m_timestampMask;
+        const uint64_t end = timestamps[1] & m_timestampMask;
+        batchMs = double(end - start) * m_timestampPeriod * 1e-6;
+        m_gpuBusyMs += batchMs;
+        if (m_profiler != nullptr)
+        {
+            m_profiler->addSample(slot.profilerPhase, batchMs);
+        }
+        // The queue was idle from the end of the previous batch to the start
+        // of this one, unless the two overlapped:
+        if (m_retiredBatches > 0 && start > m_lastEndTimestamp)
+        {
+            m_gpuIdleMs += double(start - m_lastEndTimestamp) * m_timestampPeriod * 1e-6;
+        }
+        m_lastEndTimestamp = end;
+    }
+
+    if (m_retireCallback)
+    {
+        m_retireCallback(slotIndex, batchMs);
+    }
+
+    m_retiredBatches++;
+    slot.timelineValue = 0;
+}
+
+void BatchSubmitter::printStatistics() const
+{
+    nvprintf("Batch submission: %u batches, up to %zu in flight.\n", m_retiredBatches, m_slots.size());
+    if (m_queryPool != VK_NULL_HANDLE)
+    {
+        nvprintf("  GPU busy: %.3f ms, queue idle between batches: %.3f ms\n", m_gpuBusyMs, m_gpuIdleMs);
+    }
+    nvprintf("  CPU blocked waiting for free slots: %.3f ms\n", m_cpuBlockedMs);
+}
@@ -0,0 +1,118 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_BATCH_SUBMITTER_HPP
+#define VK_MINI_PATH_TRACER_BATCH_SUBMITTER_HPP
+
+#include <functional>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+class GpuProfiler;
+
+// BatchSubmitter keeps up to N sample batches in flight on a queue.
+//
+// Instead of submitting a command buffer and then calling vkQueueWaitIdle
+// (which leaves the GPU with nothing to do while the CPU records the next
+// batch), each batch gets one slot in a ring of command buffers. Every
+// submission signals the next value of a single timeline semaphore; before a
+// slot is reused, we wait on the value its previous submission signaled.
+// This way, the CPU can record batch k+1 while the GPU runs batch k.
+//
+// When every batch records the same commands, the ring's command buffers can
+// instead be recorded once with recordReplayableBatches() and then resubmitted
+// with replayBatch(), so that each batch only costs a vkQueueSubmit call.
+//
+// Each batch is also bracketed by two timestamps, so that when a batch
+// retires we can measure how long the queue sat idle between the end of the
+// previous batch and the start of this one.
+class BatchSubmitter
+{
+public:
+    void init(VkDevice device, VkPhysicalDevice physicalDevice, VkQueue queue, uint32_t queueFamilyIndex, uint32_t maxBatchesInFlight);
+    void deinit();
+
+    // Waits until the next slot in the ring is free, retiring the batch that
+    // last used it, so that its results (and the retire callback's) can be
+    // checked before deciding whether to record another batch.
+    void waitForSlot() { retireSlot(m_currentSlot); }
+    // Waits until the next slot in the ring is free, then resets its command
+    // buffer and starts recording it. `profilerPhase` names the phase that
+    // this batch's GPU time is added to, if there's a profiler.
+    VkCommandBuffer beginBatch(const char* profilerPhase = "sample batch");
+    // Ends recording the command buffer returned by beginBatch() and submits
+    // it. Returns the timeline semaphore value this batch will signal.
+    uint64_t submitBatch();
+
+    // Records the command buffer of every slot once, using `recordCommands`
+    // for the contents. The recorded commands must not depend on which batch
+    // they are submitted for.
+    void recordReplayableBatches(const std::function<void(VkCommandBuffer)>& recordCommands);
+    // Waits until the next slot in the ring is free, then resubmits the
+    // command buffer recorded for it by recordReplayableBatches(). Returns the
+    // timeline semaphore value this batch will signal.
+    uint64_t replayBatch();
+
+    // Blocks until every submitted batch has finished on the GPU.
+    void waitIdle();
+
+    // Prints how long the GPU was busy and idle, and how long the CPU blocked
+    // waiting for free slots, over all retired batches.
+    void printStatistics() const;
+
+    VkSemaphore getTimelineSemaphore() const { return m_timeline; }
+    // Returns the index of the slot being recorded: the slot of the last
+    // beginBatch() call, or, inside recordReplayableBatches(), the slot that
+    // `recordCommands` is recording. Commands can use this to write results
+    // to per-slot locations that the retire callback then reads.
+    uint32_t getCurrentSlot() const { return m_currentSlot; }
+    // Calls `callback` with the slot index and the GPU time of every batch
+    // (0 if timestamps aren't supported) when the batch retires, in
+    // submission order.
+    void setRetireCallback(const std::function<void(uint32_t slotIndex, double gpuMs)>& callback) { m_retireCallback = callback; }
+    // Returns the callback that setRetireCallback() set, so that code that
+    // replaces it for a while can put it back.
+    const std::function<void(uint32_t slotIndex, double gpuMs)>& getRetireCallback() const { return m_retireCallback; }
+
+    // Adds the GPU time of every batch to `profiler` when the batch retires.
+    void setProfiler(GpuProfiler* profiler) { m_profiler = profiler; }
+
+private:
+    struct Slot
+    {
+        VkCommandBuffer cmdBuffer = VK_NULL_HANDLE;
+        uint64_t        timelineValue = 0;  // Value signaled by the last submission using this slot; 0 if none
+        const char*     profilerPhase = "sample batch";
+    };
+
+    // Waits for the slot's last submission, then reads its timestamps.
+    void retireSlot(uint32_t slotIndex);
+    // Writes the start timestamp for the current slot.
+    void writeStartTimestamp(VkCommandBuffer cmdBuffer);
+    // Writes the end timestamp for the current slot.
+    void writeEndTimestamp(VkCommandBuffer cmdBuffer);
+    // Submits the current slot's command buffer and advances to the next slot.
+    uint64_t submitCurrentSlot();
+
+    VkDevice          m_device = VK_NULL_HANDLE;
+    VkQueue           m_queue = VK_NULL_HANDLE;
+    VkCommandPool     m_cmdPool = VK_NULL_HANDLE;
+    VkSemaphore       m_timeline = VK_NULL_HANDLE;
+    VkQueryPool       m_queryPool = VK_NULL_HANDLE;  // Two timestamps per slot; VK_NULL_HANDLE if unsupported
+    std::vector<Slot> m_slots;
+    uint32_t          m_currentSlot = 0;
+    bool              m_replayable = false;  // True if every slot holds a replayable recording
+    uint64_t          m_nextTimelineValue = 1;
+    float             m_timestampPeriod = 1.0f;  // Nanoseconds per timestamp tick
+    uint64_t          m_timestampMask = ~uint64_t(0);
+    GpuProfiler*      m_profiler = nullptr;
+    std::function<void(uint32_t, double)> m_retireCallback;
+
+    // Statistics, accumulated when batches retire (always in submission order).
+    uint32_t m_retiredBatches = 0;
+    uint64_t m_lastEndTimestamp = 0;
+    double   m_gpuBusyMs = 0.0;
+    double   m_gpuIdleMs = 0.0;
+    double   m_cpuBlockedMs = 0.0;
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_BATCH_SUBMITTER_HPP
@@ -0,0 +1,861 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "benchmarks.hpp"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fileformats/stb_image_write.h>
+#include <fileformats/tiny_obj_loader.h>
+#include <fstream>
+#include <functional>
+#include <nvh/nvprint.hpp>      // For nvprintf
+#include <nvvk/error_vk.hpp>    // For NVVK_CHECK
+#include <nvvk/images_vk.hpp>   // For nvvk::makeImageMemoryBarrier
+#include <nvvk/structs_vk.hpp>  // For nvvk::make
+#include <random>
+#include <string>
+#include <vector>
+
+#include "batch_submitter.hpp"
+#include "common.h"
+#include "cpu_bvh.hpp"
+#include "cpu_tracer.hpp"
+#include "launch_tuning.hpp"
+#include "light_table.hpp"
+#include "obj_parser.hpp"
+#include "simd.hpp"
+#include "thread_pool.hpp"
+#include "triangle_packs.hpp"
+#include "wavefront_tracer.hpp"
+
+namespace {
+// Returns the median of several runs of `func`, in milliseconds.
+template <class Func>
+double MedianMilliseconds(int numRuns, Func&& func)
+{
+    std::vector<double> times;
+    for (int run = 0; run < numRuns; run++)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        func();
+        times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+// Writes a grid of quads, each split into two triangles, that is large
+// enough to have `numTriangles` triangles. Positions are jittered so that
+// they have realistic numbers of digits. Each row of quads is a group; even
+// rows are named `g` records and odd rows bare `g` records. If `shapes` isn't
+// null, sets it to the index range of each group.
+bool WriteSyntheticObj(const std::string& filename, uint64_t numTriangles, std::vector<ObjShape>* shapes = nullptr)
+{
+    const uint64_t numQuads = (numTriangles + 1) / 2;
+    const uint64_t quadsPerRow = std::max<uint64_t>(1, static_cast<uint64_t>(std::sqrt(static_cast<double>(numQuads))));
+    const uint64_t numRows = (numQuads + quadsPerRow - 1) / quadsPerRow;
+    const uint64_t verticesPerRow = quadsPerRow + 1;
+
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    file << "# Synthetic benchmark mesh with " << numTriangles << " triangles\no benchmark\n";
+    char     line[128];
+    uint32_t rngState = 1;
+    for (uint64_t row = 0; row <= numRows; row++)
+    {
+        for (uint64_t column = 0; column < verticesPerRow; column++)
+        {
+            rngState = rngState * 747796405u + 2891336453u;
+            const float jitter = static_cast<float>(rngState >> 8) / 16777216.0f - 0.5f;
+            const int   length = snprintf(line, sizeof(line), "v %.6f %.6f %.6f\n", static_cast<double>(column) * 0.01,
+                                        static_cast<double>(jitter) * 0.001, static_cast<double>(row) * -0.01);
+            file.write(line, length);
+        }
+    }
+    uint64_t trianglesWritten = 0;
+    if (shapes != nullptr)
+    {
+        shapes->clear();
+    }
+    for (uint64_t quad = 0; quad < numQuads; quad++)
+    {
+        if (quad % quadsPerRow == 0)
+        {
+            const uint64_t row = quad / quadsPerRow;
+            if (row % 2 == 0)
+            {
+                file << "g row" << row << "\n";
+            }
+            else
+            {
+                file << "g\n";
+            }
+            if (shapes != nullptr)
+            {
+                shapes->push_back({ static_cast<uint32_t>(3 * trianglesWritten), 0, {} });
+            }
+        }
+        if (shapes != nullptr)
+        {
+            shapes->back().numIndices += (trianglesWritten + 1 < numTriangles) ? 6 : 3;
+        }
+        // 1-based indices of the corners of this quad:
+        const uint64_t v00 = (quad / quadsPerRow) * verticesPerRow + (quad % quadsPerRow) + 1;
+        const uint64_t v01 = v00 + 1, v10 = v00 + verticesPerRow, v11 = v10 + 1;
+        int            length = snprintf(line, sizeof(line), "f %llu %llu %llu\n", static_cast<unsigned long long>(v00),
+                                         static_cast<unsigned long long>(v10), static_cast<unsigned long long>(v11));
+        file.write(line, length);
+        if (++trianglesWritten == numTriangles)
+        {
+            break;
+        }
+        length = snprintf(line, sizeof(line), "f %llu %llu %llu\n", static_cast<unsigned long long>(v00),
+                          static_cast<unsigned long long>(v11), static_cast<unsigned long long>(v01));
+        file.write(line, length);
+        trianglesWritten++;
+    }
+    return static_cast<bool>(file);
+}
+
+uint64_t GetFileSize(const std::string& filename)
+{
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    return file ? static_cast<uint64_t>(file.tellg()) : 0;
+}
+
+// Records a layout transition of `image`.
+void RecordImageTransition(VkCommandBuffer cmdBuffer, VkImage image, VkImageLayout oldLayout, VkImageLayout newLayout,
+    VkAccessFlags srcAccesses, VkAccessFlags dstAccesses)
+{
+    const VkImageMemoryBarrier barrier =
+        nvvk::makeImageMemoryBarrier(image, srcAccesses, dstAccesses, oldLayout, newLayout, VK_IMAGE_ASPECT_COLOR_BIT);
+    vkCmdPipelineBarrier(cmdBuffer, nvvk::makeAccessMaskPipelineStageFlags(srcAccesses),
+        nvvk::makeAccessMaskPipelineStageFlags(dstAccesses), 0, 0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+// Records commands that clear image.image, which must be in GENERAL layout,
+// so that the next batch starts a new image.
+void RecordClearImage(VkCommandBuffer cmdBuffer, const BenchmarkImage& image)
+{
+    const VkAccessFlags shaderAccesses = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    // Wait for earlier batches, clear, then make the clear visible to the kernels:
+    VkMemoryBarrier memoryBarrier = nvvk::make<VkMemoryBarrier>();
+    memoryBarrier.srcAccessMask = shaderAccesses;
+    memoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1,
+        &memoryBarrier, 0, nullptr, 0, nullptr);
+    const VkClearColorValue clearColor{};
+    VkImageSubresourceRange clearRange{};
+    clearRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    clearRange.levelCount = 1;
+    clearRange.layerCount = 1;
+    vkCmdClearColorImage(cmdBuffer, image.image, VK_IMAGE_LAYOUT_GENERAL, &clearColor, 1, &clearRange);
+    memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = shaderAccesses;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+        &memoryBarrier, 0, nullptr, 0, nullptr);
+}
+
+// Records commands that copy image.image, which must be in GENERAL layout,
+// to image.linearImage, and make the copy visible to the CPU.
+void RecordCopyToLinearImage(VkCommandBuffer cmdBuffer, const BenchmarkImage& image)
+{
+    const VkAccessFlags shaderAccesses = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    RecordImageTransition(cmdBuffer, image.image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        shaderAccesses, VK_ACCESS_TRANSFER_READ_BIT);
+    VkImageCopy region{};
+    region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.srcSubresource.layerCount = 1;
+    region.dstSubresource = region.srcSubresource;
+    region.extent = { image.width, image.height, 1 };
+    vkCmdCopyImage(cmdBuffer, image.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, image.linearImage,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+    RecordImageTransition(cmdBuffer, image.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL,
+        VK_ACCESS_TRANSFER_READ_BIT, shaderAccesses);
+    VkMemoryBarrier memoryBarrier = nvvk::make<VkMemoryBarrier>();
+    memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memoryBarrier, 0,
+        nullptr, 0, nullptr);
+}
+
+// Returns the RGB values of image.linearImage, row by row. The GPU must have
+// finished writing it.
+std::vector<float> ReadLinearImage(const BenchmarkImage& image)
+{
+    VkImageSubresource subresource{};
+    subresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    VkSubresourceLayout layout;
+    vkGetImageSubresourceLayout(image.device, image.linearImage, &subresource, &layout);
+
+    std::vector<float> rgb(size_t(image.width) * image.height * 3);
+    void*              data;
+    NVVK_CHECK(vkMapMemory(image.device, image.linearMemory, 0, VK_WHOLE_SIZE, 0, &data));
+    for (uint32_t y = 0; y < image.height; y++)
+    {
+        const float* row = reinterpret_cast<const float*>(static_cast<const uint8_t*>(data) + layout.offset + y * layout.rowPitch);
+        for (uint32_t x = 0; x < image.width; x++)
+        {
+            for (uint32_t channel = 0; channel < 3; channel++)
+            {
+                rgb[(size_t(y) * image.width + x) * 3 + channel] = row[4 * x + channel];
+            }
+        }
+    }
+    vkUnmapMemory(image.device, image.linearMemory);
+    return rgb;
+}
+
+double RootMeanSquaredError(const std::vector<float>& values, const std::vector<float>& reference)
+{
+    double sumSquaredErrors = 0.0;
+    for (size_t i = 0; i < values.size(); i++)
+    {
+        const double error = double(values[i]) - double(reference[i]);
+        sumSquaredErrors += error * error;
+    }
+    return std::sqrt(sumSquaredErrors / double(values.size()));
+}
+
+// A scene that the CPU benchmarks render: instances of the mesh, with the
+// same light buffer contents as the GPU tracers.
+struct CpuBenchmarkScene
+{
+    const char*                   name;
+    std::vector<AccelInstance>    instances;
+    std::vector<EmissiveTriangle> lights;
+    LightTableHeader              lightHeader;
+};
+
+// Returns the scenes the CPU benchmarks compare tracers on: one instance of
+// `mesh`, and `gridInstances` of it.
+std::vector<CpuBenchmarkScene> GetCpuBenchmarkScenes(const MeshFile& mesh, const std::vector<AccelInstance>& gridInstances)
+{
+    std::vector<CpuBenchmarkScene> scenes = { { "Cornell box", { AccelInstance() } }, { "Instance grid", gridInstances } };
+    LightTable                     lightTable;
+    lightTable.addMeshEmitters(0, mesh);
+    for (CpuBenchmarkScene& scene : scenes)
+    {
+        scene.lights = lightTable.buildTriangles(scene.instances, scene.lightHeader);
+    }
+    return scenes;
+}
+
+// Returns the number of pixels of `a` and `b`, with `channels` floats each,
+// that differ by more than rounding.
+size_t CountDifferentPixels(const std::vector<float>& a, const std::vector<float>& b, size_t channels)
+{
+    size_t differentPixels = 0;
+    for (size_t pixel = 0; pixel < a.size() / channels; pixel++)
+    {
+        for (size_t channel = 0; channel < channels; channel++)
+        {
+            const float valueA = a[channels * pixel + channel];
+            const float valueB = b[channels * pixel + channel];
+            if (std::abs(valueA - valueB) > 1e-4f * std::max(1.0f, std::abs(valueA)))
+            {
+                differentPixels++;
+                break;
+            }
+        }
+    }
+    return differentPixels;
+}
+
+// Renders into a BenchmarkImage with the wavefront tracer, and times the
+// batches that trace samples. For its lifetime, the image is in GENERAL
+// layout, and it owns the retire callback of the batch submitter.
+class ImageRenderer
+{
+public:
+    ImageRenderer(WavefrontTracer& tracer, BatchSubmitter& batchSubmitter, const BenchmarkImage& image, const char* name)
+        : m_tracer(tracer)
+        , m_batchSubmitter(batchSubmitter)
+        , m_image(image)
+        , m_name(name)
+    {
+        // Sum the GPU time of the batches that trace samples as they retire.
+        // Without timestamps, this stays 0, and we use the CPU time from
+        // submission to completion instead.
+        m_batchSubmitter.waitIdle();
+        m_previousRetireCallback = m_batchSubmitter.getRetireCallback();
+        m_batchSubmitter.setRetireCallback([this](uint32_t, double batchMs) {
+            if (m_timing)
+            {
+                m_gpuMs += batchMs;
+            }
+        });
+        // main() left the image in TRANSFER_SRC_OPTIMAL layout after reading it back:
+        RecordImageTransition(m_batchSubmitter.beginBatch(m_name), m_image.image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            VK_IMAGE_LAYOUT_GENERAL, VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+        m_batchSubmitter.submitBatch();
+    }
+    ~ImageRenderer()
+    {
+        RecordImageTransition(m_batchSubmitter.beginBatch(m_name), m_image.image, VK_IMAGE_LAYOUT_GENERAL,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+            VK_ACCESS_TRANSFER_READ_BIT);
+        m_batchSubmitter.submitBatch();
+        m_batchSubmitter.waitIdle();
+        m_batchSubmitter.setRetireCallback(m_previousRetireCallback);
+    }
+
+    // Traces `numBatches` batches into the image, and returns their time in milliseconds.
+    double traceBatches(uint32_t numBatches)
+    {
+        m_gpuMs = 0.0;
+        m_timing = true;
+        const auto start = std::chrono::steady_clock::now();
+        for (uint32_t batch = 0; batch < numBatches; batch++)
+        {
+            m_tracer.recordBatch(m_batchSubmitter.beginBatch(m_name));
+            m_batchSubmitter.submitBatch();
+        }
+        m_batchSubmitter.waitIdle();
+        m_timing = false;
+        const double cpuMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return m_gpuMs > 0.0 ? m_gpuMs : cpuMs;
+    }
+    // Traces one warm-up batch, and then `numRuns` batches one at a time, and
+    // returns the median time of one of these, in milliseconds.
+    double traceMedianBatch(uint32_t numRuns)
+    {
+        traceBatches(1);
+        std::vector<double> times;
+        for (uint32_t run = 0; run < numRuns; run++)
+        {
+            times.push_back(traceBatches(1));
+        }
+        std::sort(times.begin(), times.end());
+        return times[times.size() / 2];
+    }
+    // Clears the image, so that the next batch starts a new image.
+    void clearImage()
+    {
+        RecordClearImage(m_batchSubmitter.beginBatch(m_name), m_image);
+        m_batchSubmitter.submitBatch();
+    }
+    // Returns the RGB values of the image, row by row.
+    std::vector<float> readImage()
+    {
+        RecordCopyToLinearImage(m_batchSubmitter.beginBatch(m_name), m_image);
+        m_batchSubmitter.submitBatch();
+        m_batchSubmitter.waitIdle();
+        return ReadLinearImage(m_image);
+    }
+
+private:
+    WavefrontTracer&      m_tracer;
+    BatchSubmitter&       m_batchSubmitter;
+    const BenchmarkImage& m_image;
+    const char*           m_name;
+    double                m_gpuMs = 0.0;
+    bool                  m_timing = false;
+    // The callback main() set, which the destructor puts back:
+    std::function<void(uint32_t, double)> m_previousRetireCallback;
+};
+}  // namespace
+
+bool RunObjParserBenchmark(uint64_t numTriangles)
+{
+    const std::string     filename = "obj_benchmark_" + std::to_string(numTriangles) + ".obj";
+    std::vector<ObjShape> expectedShapes;
+    if (!WriteSyntheticObj(filename, numTriangles, &expectedShapes))
+    {
+        nvprintf("Could not write %s.\n", filename.c_str());
+        return false;
+    }
+    const double megabytes = static_cast<double>(GetFileSize(filename)) / (1024.0 * 1024.0);
+    ThreadPool&  pool = ThreadPool::getDefault();
+    nvprintf("OBJ parser benchmark: %llu triangles, %.1f MB, %u threads\n", static_cast<unsigned long long>(numTriangles),
+             megabytes, pool.getConcurrency());
+
+    const int numRuns = 3;
+    ObjMesh   tinyObjMesh;
+    bool      tinyObjValid = true;
+    // This does the same work the tracer used to do with tinyobj: parse, then
+    // extract the vertex indices.
+    const double tinyObjTime = MedianMilliseconds(numRuns, [&]() {
+        tinyobj::ObjReader reader;
+        reader.ParseFromFile(filename);
+        tinyObjValid = reader.Valid();
+        if (!tinyObjValid)
+        {
+            return;
+        }
+        tinyObjMesh.vertices = reader.GetAttrib().GetVertices();
+        tinyObjMesh.indices.clear();
+        for (const tinyobj::shape_t& objShape : reader.GetShapes())
+        {
+            for (const tinyobj::index_t& index : objShape.mesh.indices)
+            {
+                tinyObjMesh.indices.push_back(index.vertex_index);
+            }
+        }
+    });
+
+    ObjMesh      parallelMesh;
+    bool         parallelValid = true;
+    std::string  error;
+    const double parallelTime = MedianMilliseconds(numRuns, [&]() {
+        parallelValid = ParseObjFileParallel(filename, pool, parallelMesh, error);
+    });
+    std::remove(filename.c_str());
+
+    if (!tinyObjValid || !parallelValid)
+    {
+        nvprintf("Parsing failed (tinyobj: %s, parallel: %s).\n", tinyObjValid ? "ok" : "failed",
+                 parallelValid ? "ok" : error.c_str());
+        return false;
+    }
+
+    // Both parsers should give the same indices, and the same positions up to
+    // float rounding differences:
+    bool matches = (tinyObjMesh.indices == parallelMesh.indices) && (tinyObjMesh.vertices.size() == parallelMesh.vertices.size());
+    for (size_t i = 0; matches && i < tinyObjMesh.vertices.size(); i++)
+    {
+        const float expected = tinyObjMesh.vertices[i];
+        matches = std::abs(expected - parallelMesh.vertices[i]) <= 1e-6f * std::max(1.0f, std::abs(expected));
+    }
+    // tinyobj merges the rows of bare `g` records into the rows before them,
+    // so the parallel parser's shapes are checked against the groups that
+    // were written instead:
+    matches = matches && (parallelMesh.shapes.size() == expectedShapes.size());
+    for (size_t i = 0; matches && i < expectedShapes.size(); i++)
+    {
+        matches = (parallelMesh.shapes[i].firstIndex == expectedShapes[i].firstIndex)
+                  && (parallelMesh.shapes[i].numIndices == expectedShapes[i].numIndices);
+    }
+
+    nvprintf("  %-10s %10s %10s %9s\n", "Parser", "Time (ms)", "MB/s", "Speedup");
+    nvprintf("  %-10s %10.2f %10.1f %8.2fx\n", "tinyobj", tinyObjTime, megabytes / (tinyObjTime / 1000.0), 1.0);
+    nvprintf("  %-10s %10.2f %10.1f %8.2fx\n", "parallel", parallelTime, megabytes / (parallelTime / 1000.0),
+             tinyObjTime / parallelTime);
+    nvprintf("  Outputs %s.\n", matches ? "match" : "DIFFER");
+    return matches;
+}
+
+bool RunBvhBuildBenchmark(uint64_t numTriangles)
+{
+    const std::string filename = "bvh_benchmark_" + std::to_string(numTriangles) + ".obj";
+    ObjMesh           mesh;
+    std::string       error;
+    const bool        parsed = WriteSyntheticObj(filename, numTriangles) && ParseObjFileParallel(filename, ThreadPool::getDefault(), mesh, error);
+    std::remove(filename.c_str());
+    if (!parsed)
+    {
+        nvprintf("Could not create the benchmark mesh: %s\n", error.c_str());
+        return false;
+    }
+    const size_t numMeshTriangles = mesh.indices.size() / 3;
+    const double millionTriangles = static_cast<double>(numMeshTriangles) / 1e6;
+    nvprintf("BVH build benchmark: %llu triangles\n", static_cast<unsigned long long>(numMeshTriangles));
+
+    // Trees are equal if their nodes and primitive orders are equal byte for
+    // byte; BvhNode has no padding.
+    const auto equalTrees = [](const Bvh& a, const Bvh& b) {
+        return (a.nodes.size() == b.nodes.size()) && (a.primitives == b.primitives)
+               && (memcmp(a.nodes.data(), b.nodes.data(), a.nodes.size() * sizeof(BvhNode)) == 0);
+    };
+
+    const int numRuns = 3;
+    Bvh       serialBvh;
+    const double serialTime = MedianMilliseconds(numRuns, [&]() {
+        serialBvh = BuildBvh(GetTriangleBounds(mesh.vertices.data(), mesh.indices.data(), numMeshTriangles), TRIANGLE_PACK_SIZE);
+    });
+    nvprintf("  %-8s %10s %12s %9s\n", "Threads", "Time (ms)", "ms/Mtris", "Speedup");
+    nvprintf("  %-8u %10.2f %12.2f %8.2fx\n", 1u, serialTime, serialTime / millionTriangles, 1.0);
+
+    // 2, 4, 8, ... threads, and then all of them:
+    const unsigned        maxThreads = ThreadPool::getDefault().getConcurrency();
+    std::vector<unsigned> threadCounts;
+    for (unsigned numThreads = 2; numThreads < maxThreads; numThreads *= 2)
+    {
+        threadCounts.push_back(numThreads);
+    }
+    if (maxThreads > 1)
+    {
+        threadCounts.push_back(maxThreads);
+    }
+    bool matches = true;
+    for (const unsigned numThreads : threadCounts)
+    {
+        // The pool's concurrency includes the thread that waits:
+        ThreadPool   pool(numThreads - 1);
+        Bvh          parallelBvh;
+        const double parallelTime = MedianMilliseconds(numRuns, [&]() {
+            parallelBvh = BuildBvh(GetTriangleBounds(mesh.vertices.data(), mesh.indices.data(), numMeshTriangles, &pool),
+                                   TRIANGLE_PACK_SIZE, &pool);
+        });
+        matches = matches && equalTrees(serialBvh, parallelBvh);
+        nvprintf("  %-8u %10.2f %12.2f %8.2fx\n", numThreads, parallelTime, parallelTime / millionTriangles,
+                 serialTime / parallelTime);
+    }
+    nvprintf("  Parallel trees %s the serial tree (%zu nodes, %.1f MB).\n", matches ? "match" : "DIFFER",
+             serialBvh.nodes.size(), static_cast<double>(serialBvh.nodes.size() * sizeof(BvhNode)) / (1024.0 * 1024.0));
+
+    const std::string bvhFilename = "bvh_benchmark_" + std::to_string(numTriangles) + ".vmpbvh";
+    if (!SaveBvh(bvhFilename, serialBvh, 0))
+    {
+        return false;
+    }
+    MappedBvh    mappedBvh;
+    bool         loaded = false;
+    const double loadTime =
+        MedianMilliseconds(numRuns, [&]() { loaded = mappedBvh.open(bvhFilename, 0, numMeshTriangles); });
+    const bool   roundTrips = loaded && (mappedBvh.numNodes() == serialBvh.nodes.size())
+                            && (mappedBvh.numPrimitives() == serialBvh.primitives.size())
+                            && (memcmp(mappedBvh.nodes(), serialBvh.nodes.data(), serialBvh.nodes.size() * sizeof(BvhNode)) == 0)
+                            && (memcmp(mappedBvh.primitives(), serialBvh.primitives.data(), serialBvh.primitives.size() * sizeof(uint32_t)) == 0);
+    mappedBvh.close();
+    std::remove(bvhFilename.c_str());
+    nvprintf("  Loading the saved tree takes %.3f ms (%.0fx faster than building it); contents %s.\n", loadTime,
+             serialTime / loadTime, roundTrips ? "match" : "DIFFER");
+    return matches && roundTrips;
+}
+
+bool RunWideBvhBenchmark(const MeshFile& mesh, const std::vector<AccelInstance>& gridInstances, const CpuRenderSettings& settings)
+{
+    nvprintf("Wide BVH benchmark: %ux%u, %u samples per pixel, %s box tests\n", settings.width, settings.height,
+             settings.samplesPerPixel, CpuHasAvx2() ? "AVX2" : "scalar");
+    nvprintf("  %-14s %-7s %12s %9s %9s\n", "Scene", "BVH", "Nodes (KB)", "Mrays/s", "Speedup");
+    bool allMatch = true;
+    for (const CpuBenchmarkScene& scene : GetCpuBenchmarkScenes(mesh, gridInstances))
+    {
+        std::vector<float> images[2];
+        double             mraysPerSecond[2] = {};
+        for (int wide = 0; wide < 2; wide++)
+        {
+            CpuTracer tracer;
+            tracer.init(mesh, scene.instances, scene.lights, scene.lightHeader, ThreadPool::getDefault(), wide != 0);
+            const CpuRenderStats stats = tracer.render(settings, ThreadPool::getDefault(), images[wide]);
+            mraysPerSecond[wide] = double(stats.rays) / stats.seconds / 1.0e6;
+            nvprintf("  %-14s %-7s %12.1f %9.2f %8.2fx\n", scene.name, wide ? "8-wide" : "binary",
+                     double(tracer.getBvhBytes()) / 1024.0, mraysPerSecond[wide], mraysPerSecond[wide] / mraysPerSecond[0]);
+        }
+
+        // Both BVHs find the same closest hits, up to ties between triangles
+        // at the same distance, so almost every pixel should be the same:
+        const size_t differentPixels = CountDifferentPixels(images[0], images[1], 3);
+        const bool   matches = differentPixels * 1000 <= images[0].size() / 3;
+        allMatch = allMatch && matches;
+        nvprintf("  %-14s %zu pixels differ between the BVHs (%s).\n", scene.name, differentPixels, matches ? "match" : "DIFFER");
+    }
+    return allMatch;
+}
+
+bool RunCameraPacketBenchmark(const MeshFile& mesh, const std::vector<AccelInstance>& gridInstances, const CpuRenderSettings& settings)
+{
+    nvprintf("Camera packet benchmark: %ux%u, %u samples per pixel, %ux%u rays per packet, %s box tests\n", settings.width,
+             settings.height, settings.samplesPerPixel, RAY_PACKET_WIDTH, RAY_PACKET_WIDTH, CpuHasAvx2() ? "AVX2" : "scalar");
+    nvprintf("  %-14s %-7s %-8s %9s %9s\n", "Scene", "Rays", "Traced", "Mrays/s", "Speedup");
+    bool allMatch = true;
+    for (const CpuBenchmarkScene& scene : GetCpuBenchmarkScenes(mesh, gridInstances))
+    {
+        CpuTracer tracer;
+        tracer.init(mesh, scene.instances, scene.lights, scene.lightHeader, ThreadPool::getDefault());
+
+        CpuRenderSettings packetSettings[2] = { settings, settings };
+        packetSettings[0].cameraPackets = false;
+        packetSettings[1].cameraPackets = true;
+        std::vector<float> depths[2];
+        std::vector<float> images[2];
+        double             cameraMrays[2] = {};
+        double             pathMrays[2] = {};
+        for (int packets = 0; packets < 2; packets++)
+        {
+            const CpuRenderStats stats = tracer.traceCameraRays(packetSettings[packets], ThreadPool::getDefault(), depths[packets]);
+            cameraMrays[packets] = double(stats.rays) / stats.seconds / 1.0e6;
+            nvprintf("  %-14s %-7s %-8s %9.2f %8.2fx\n", scene.name, "camera", packets ? "packets" : "single",
+                     cameraMrays[packets], cameraMrays[packets] / cameraMrays[0]);
+        }
+        for (int packets = 0; packets < 2; packets++)
+        {
+            const CpuRenderStats stats = tracer.render(packetSettings[packets], ThreadPool::getDefault(), images[packets]);
+            pathMrays[packets] = double(stats.rays) / stats.seconds / 1.0e6;
+            nvprintf("  %-14s %-7s %-8s %9.2f %8.2fx\n", scene.name, "paths", packets ? "packets" : "single",
+                     pathMrays[packets], pathMrays[packets] / pathMrays[0]);
+        }
+
+        // Packets find the same closest hits as single rays, up to ties
+        // between triangles at the same distance:
+        const size_t differentDepths = CountDifferentPixels(depths[0], depths[1], 1);
+        const size_t differentPixels = CountDifferentPixels(images[0], images[1], 3);
+        const bool   matches = differentDepths * 1000 <= depths[0].size() && differentPixels * 1000 <= images[0].size() / 3;
+        allMatch = allMatch && matches;
+        nvprintf("  %-14s %zu depths and %zu pixels differ with packets (%s).\n", scene.name, differentDepths, differentPixels,
+                 matches ? "match" : "DIFFER");
+    }
+    return allMatch;
+}
+
+bool RunMaterialSortBenchmark(WavefrontTracer& tracer, BatchSubmitter& batchSubmitter, const BenchmarkImage& image)
+{
+    const uint32_t                  NUM_BATCHES = 4;
+    const std::array<uint32_t, 12> materialIdCounts = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 16, 32, MAX_MATERIAL_IDS };
+
+    const std::vector<uint32_t> originalMaterials = tracer.getInstanceMaterials();
+    const bool                  originalSortByMaterial = tracer.getSortByMaterial();
+    const uint32_t              numInstances = static_cast<uint32_t>(originalMaterials.size());
+    const uint32_t              samplesPerBatch = tracer.getSamplesPerBatch();
+    ImageRenderer               renderer(tracer, batchSubmitter, image, "material sort benchmark");
+
+    nvprintf("Material sort benchmark: %u instances, %u batches of %u samples per pixel per measurement\n", numInstances,
+        NUM_BATCHES, samplesPerBatch);
+    nvprintf("  %-12s %14s %14s %9s\n", "Material IDs", "Unsorted (ms)", "Sorted (ms)", "Speedup");
+    for (uint32_t numMaterialIds : materialIdCounts)
+    {
+        // Give each instance a random material ID, the same way every run:
+        std::default_random_engine              randomEngine(numMaterialIds);
+        std::uniform_int_distribution<uint32_t> materialDist(0, numMaterialIds - 1);
+        std::vector<uint32_t>                   instanceMaterials(numInstances);
+        for (uint32_t& material : instanceMaterials)
+        {
+            material = materialDist(randomEngine);
+        }
+        tracer.setInstanceMaterials(instanceMaterials);
+
+        tracer.setSortByMaterial(false);
+        const double unsortedMs = renderer.traceBatches(NUM_BATCHES) / NUM_BATCHES;
+        tracer.setSortByMaterial(true);
+        const double sortedMs = renderer.traceBatches(NUM_BATCHES) / NUM_BATCHES;
+        nvprintf("  %-12u %14.2f %14.2f %8.2fx\n", numMaterialIds, unsortedMs, sortedMs, unsortedMs / sortedMs);
+    }
+
+    // traceBatches() waited for every batch, so no batch is executing:
+    tracer.setInstanceMaterials(originalMaterials);
+    tracer.setSortByMaterial(originalSortByMaterial);
+    return true;
+}
+
+bool RunSamplerConvergenceBenchmark(WavefrontTracer& tracer, BatchSubmitter& batchSubmitter, const BenchmarkImage& image)
+{
+    // The reference's own error adds to every RMSE, so it gets many more
+    // samples than the measured images:
+    const uint32_t                   REFERENCE_BATCHES = 128;
+    const uint32_t                   MAX_BATCHES = 16;  // Measure after 1, 2, 4, ..., MAX_BATCHES batches
+    const std::array<uint32_t, 3>    samplers = { SAMPLER_RANDOM, SAMPLER_SOBOL, SAMPLER_BLUE_NOISE };
+    const std::array<const char*, 3> samplerNames = { "random", "sobol", "blue-noise" };
+
+    const uint32_t samplesPerBatch = tracer.getSamplesPerBatch();
+    ImageRenderer  renderer(tracer, batchSubmitter, image, "sampler benchmark");
+
+    nvprintf("Sampler convergence benchmark: %u samples per pixel per batch, reference with %u batches\n",
+        samplesPerBatch, REFERENCE_BATCHES);
+    tracer.setSampler(SAMPLER_SOBOL);
+    tracer.setSamplerSeed(1);
+    renderer.clearImage();
+    const double             referenceMs = renderer.traceBatches(REFERENCE_BATCHES);
+    const std::vector<float> reference = renderer.readImage();
+    nvprintf("  Rendered the reference in %.1f ms.\n", referenceMs);
+    tracer.setSamplerSeed(0);
+
+    // errors[s][i] is the RMSE of sampler s after 2^i batches.
+    std::vector<std::vector<double>> errors(samplers.size());
+    bool                             allFinite = true;
+    nvprintf("  %-11s %8s %12s %10s\n", "Sampler", "Samples", "GPU time (ms)", "RMSE");
+    for (size_t samplerIdx = 0; samplerIdx < samplers.size(); samplerIdx++)
+    {
+        tracer.setSampler(samplers[samplerIdx]);
+        renderer.clearImage();
+        uint32_t batchesTraced = 0;
+        double   totalMs = 0.0;
+        for (uint32_t numBatches = 1; numBatches <= MAX_BATCHES; numBatches *= 2)
+        {
+            totalMs += renderer.traceBatches(numBatches - batchesTraced);
+            batchesTraced = numBatches;
+            const double rmse = RootMeanSquaredError(renderer.readImage(), reference);
+            allFinite = allFinite && std::isfinite(rmse);
+            errors[samplerIdx].push_back(rmse);
+            nvprintf("  %-11s %8u %12.1f %10.6f\n", samplerNames[samplerIdx], numBatches * samplesPerBatch, totalMs, rmse);
+        }
+    }
+
+    // Compare the samples each sampler needs for the error of the most random samples:
+    const double   targetError = errors[0].back();
+    const uint32_t randomSamples = MAX_BATCHES * samplesPerBatch;
+    nvprintf("  Samples per pixel to reach the RMSE of %u random samples (%.6f):\n", randomSamples, targetError);
+    for (size_t samplerIdx = 0; samplerIdx < samplers.size(); samplerIdx++)
+    {
+        const std::vector<double>& samplerErrors = errors[samplerIdx];
+        const auto                 reached =
+            std::find_if(samplerErrors.begin(), samplerErrors.end(), [&](double rmse) { return rmse <= targetError; });
+        if (reached == samplerErrors.end())
+        {
+            nvprintf("    %-11s more than %u\n", samplerNames[samplerIdx], randomSamples);
+            continue;
+        }
+        const uint32_t samples = (1u << (reached - samplerErrors.begin())) * samplesPerBatch;
+        nvprintf("    %-11s %u (%.1fx fewer)\n", samplerNames[samplerIdx], samples, double(randomSamples) / double(samples));
+    }
+    return allFinite;
+}
+
+bool RunBsdfSamplingBenchmark(WavefrontTracer& tracer, BatchSubmitter& batchSubmitter, const BenchmarkImage& image)
+{
+    const uint32_t                   REFERENCE_BATCHES = 128;
+    const uint32_t                   BUDGET_BATCHES = 8;  // The time budget is what this many cosine-weighted batches take
+    const std::array<uint32_t, 2>    strategies = { DIFFUSE_SAMPLING_COSINE, DIFFUSE_SAMPLING_UNIFORM };
+    const std::array<const char*, 2> strategyNames = { "cosine", "uniform" };
+
+    const uint32_t samplesPerBatch = tracer.getSamplesPerBatch();
+    ImageRenderer  renderer(tracer, batchSubmitter, image, "BSDF sampling benchmark");
+
+    nvprintf("BSDF sampling benchmark: %u samples per pixel per batch, reference with %u batches\n", samplesPerBatch,
+        REFERENCE_BATCHES);
+    tracer.setDiffuseSampling(DIFFUSE_SAMPLING_COSINE);
+    tracer.setSamplerSeed(1);
+    renderer.clearImage();
+    const double             referenceMs = renderer.traceBatches(REFERENCE_BATCHES);
+    const std::vector<float> reference = renderer.readImage();
+    nvprintf("  Rendered the reference in %.1f ms.\n", referenceMs);
+    tracer.setSamplerSeed(0);
+
+    // Give every strategy the time the first one took, one batch at a time:
+    double budgetMs = 0.0;
+    double cosineRmse = 0.0;
+    bool   allFinite = true;
+    nvprintf("  %-8s %8s %12s %10s\n", "Sampling", "Samples", "GPU time (ms)", "RMSE");
+    for (size_t strategyIdx = 0; strategyIdx < strategies.size(); strategyIdx++)
+    {
+        tracer.setDiffuseSampling(strategies[strategyIdx]);
+        renderer.clearImage();
+        uint32_t numBatches = 0;
+        double   totalMs = 0.0;
+        while ((strategyIdx == 0) ? (numBatches < BUDGET_BATCHES) : (totalMs < budgetMs))
+        {
+            totalMs += renderer.traceBatches(1);
+            numBatches++;
+        }
+        if (strategyIdx == 0)
+        {
+            budgetMs = totalMs;
+        }
+        const std::vector<float> rgb = renderer.readImage();
+        const double             rmse = RootMeanSquaredError(rgb, reference);
+        allFinite = allFinite && std::isfinite(rmse);
+        nvprintf("  %-8s %8u %12.1f %10.6f\n", strategyNames[strategyIdx], numBatches * samplesPerBatch, totalMs, rmse);
+        if (strategyIdx == 0)
+        {
+            cosineRmse = rmse;
+        }
+        else
+        {
+            // Variance falls with 1 / time, so the ratio of squared errors at
+            // equal time is how many times longer this strategy would need:
+            nvprintf("  %s sampling needs %.2fx the time of cosine sampling for the same RMSE.\n",
+                strategyNames[strategyIdx], (rmse * rmse) / (cosineRmse * cosineRmse));
+        }
+        const std::string filename = std::string("bsdf_") + strategyNames[strategyIdx] + ".hdr";
+        stbi_write_hdr(filename.c_str(), int(image.width), int(image.height), 3, rgb.data());
+    }
+
+    tracer.setDiffuseSampling(DIFFUSE_SAMPLING_COSINE);
+    return allFinite;
+}
+
+bool RunLaunchTuningBenchmark(WavefrontTracer& tracer, BatchSubmitter& batchSubmitter, const BenchmarkImage& image,
+    uint32_t maxWorkgroupSize, LaunchTuning& best)
+{
+    const uint32_t                NUM_RUNS = 7;  // Batches timed per combination
+    const std::array<uint32_t, 6> workgroupSizes = { 32, 64, 128, 256, 512, 1024 };
+    const std::array<uint32_t, 5> samplesPerBatchCounts = { 4, 8, 16, 32, 64 };
+
+    ImageRenderer         renderer(tracer, batchSubmitter, image, "launch tuning benchmark");
+    WavefrontKernelConfig config = tracer.getKernelConfig();
+
+    nvprintf("Launch tuning benchmark: median of %u batches per combination\n", NUM_RUNS);
+    nvprintf("  %-10s %8s %14s %16s\n", "Workgroup", "Samples", "Batch (ms)", "Per sample (ms)");
+    double bestMsPerSample = 0.0;
+    for (uint32_t workgroupSize : workgroupSizes)
+    {
+        if (workgroupSize > maxWorkgroupSize)
+        {
+            continue;
+        }
+        for (uint32_t samplesPerBatch : samplesPerBatchCounts)
+        {
+            config.workgroupSize = workgroupSize;
+            config.samplesPerBatch = samplesPerBatch;
+            tracer.setKernelConfig(config);
+            renderer.clearImage();
+            const double batchMs = renderer.traceMedianBatch(NUM_RUNS);
+            const double msPerSample = batchMs / samplesPerBatch;
+            nvprintf("  %-10u %8u %14.3f %16.4f\n", workgroupSize, samplesPerBatch, batchMs, msPerSample);
+            if (batchMs > 0.0 && (bestMsPerSample == 0.0 || msPerSample < bestMsPerSample))
+            {
+                bestMsPerSample = msPerSample;
+                best.workgroupSize = workgroupSize;
+                best.samplesPerBatch = samplesPerBatch;
+            }
+        }
+    }
+    if (bestMsPerSample == 0.0)
+    {
+        return false;
+    }
+
+    nvprintf("  Fastest: %u threads per workgroup, %u samples per batch (%.4f ms per sample per pixel).\n",
+        best.workgroupSize, best.samplesPerBatch, bestMsPerSample);
+    config.workgroupSize = best.workgroupSize;
+    config.samplesPerBatch = best.samplesPerBatch;
+    tracer.setKernelConfig(config);
+    return true;
+}
+
+bool RunPixelOrderBenchmark(WavefrontTracer& tracer, BatchSubmitter& batchSubmitter, const BenchmarkImage& image)
+{
+    const uint32_t                   NUM_BATCHES = 4;  // Batches per image, for comparing the images
+    const uint32_t                   NUM_RUNS = 7;     // Batches timed per combination
+    const std::array<uint32_t, 3>    pixelOrders = { PIXEL_ORDER_LINEAR, PIXEL_ORDER_TILED, PIXEL_ORDER_MORTON };
+    const std::array<const char*, 3> pixelOrderNames = { "linear", "tiled", "morton" };
+
+    ImageRenderer               renderer(tracer, batchSubmitter, image, "pixel order benchmark");
+    const WavefrontKernelConfig originalConfig = tracer.getKernelConfig();
+    WavefrontKernelConfig       config = originalConfig;
+
+    nvprintf("Pixel order benchmark: median of %u batches of %u samples per pixel\n", NUM_RUNS, tracer.getSamplesPerBatch());
+    nvprintf("  %-7s %-10s %12s %9s %10s\n", "Order", "Threads", "Batch (ms)", "Speedup", "RMSE");
+    // Every combination traces the same samples of each pixel, so the images
+    // they render after the same number of batches must match:
+    std::vector<float> reference;
+    double             linearMs = 0.0;
+    bool               imagesMatch = true;
+    for (size_t orderIdx = 0; orderIdx < pixelOrders.size(); orderIdx++)
+    {
+        for (bool persistentThreads : { false, true })
+        {
+            config.pixelOrder = pixelOrders[orderIdx];
+            config.persistentThreads = persistentThreads;
+            tracer.setKernelConfig(config);
+            tracer.setSamplerSeed(0);
+            renderer.clearImage();
+            renderer.traceBatches(NUM_BATCHES);
+            const std::vector<float> rgb = renderer.readImage();
+            if (reference.empty())
+            {
+                reference = rgb;
+            }
+            const double rmse = RootMeanSquaredError(rgb, reference);
+            imagesMatch = imagesMatch && rmse <= 1e-4;
+
+            const double batchMs = renderer.traceMedianBatch(NUM_RUNS);
+            if (linearMs == 0.0)
+            {
+                linearMs = batchMs;
+            }
+            nvprintf("  %-7s %-10s %12.3f %8.2fx %10.6f\n", pixelOrderNames[orderIdx],
+                persistentThreads ? "persistent" : "dispatch", batchMs, linearMs / batchMs, rmse);
+        }
+    }
+    if (!imagesMatch)
+    {
+        nvprintf("  Error: the images of the pixel orders don't match!\n");
+    }
+
+    tracer.setKernelConfig(originalConfig);
+    return imagesMatch;
+}
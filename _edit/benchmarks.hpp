@@ -0,0 +1,104 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_BENCHMARKS_HPP
+#define VK_MINI_PATH_TRACER_BENCHMARKS_HPP
+
+#include <cstdint>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+class BatchSubmitter;
+class MeshFile;
+class WavefrontTracer;
+struct AccelInstance;
+struct CpuRenderSettings;
+struct LaunchTuning;
+
+// Standalone benchmarks, run from the command line instead of rendering.
+// Each one prints its results and returns false if a correctness check failed.
+
+// Writes a synthetic OBJ file with `numTriangles` triangles, parses it with
+// tinyobj and with ParseObjParallel, checks that both produce the same mesh,
+// and prints parse times and throughput.
+bool RunObjParserBenchmark(uint64_t numTriangles);
+
+// Builds CPU BVHs over the triangles of a synthetic OBJ file with
+// `numTriangles` triangles, serially and with 2, 4, ... threads up to the
+// default thread pool's concurrency, and prints the build time per million
+// triangles of each. Checks that every parallel build gives the same tree
+// as the serial one, and that the tree survives a SaveBvh() and MappedBvh
+// round trip, whose load time it also prints.
+bool RunBvhBuildBenchmark(uint64_t numTriangles);
+
+// Renders `mesh` with the CPU tracer, as a single instance and as
+// `gridInstances`, once with the mesh's binary BVH and once with it
+// collapsed into 8-wide nodes, and prints the size of the BVH nodes and the
+// Mrays/s of each. Checks that both BVHs render the same image.
+bool RunWideBvhBenchmark(const MeshFile& mesh, const std::vector<AccelInstance>& gridInstances, const CpuRenderSettings& settings);
+
+// Traces the camera rays of `mesh` with the CPU tracer, as a single instance
+// and as `gridInstances`, one ray at a time and in 8x8 ray packets, and
+// prints the primary Mrays/s of each. Then renders each scene both ways and
+// prints the Mrays/s of the whole paths. Checks that packets find the same
+// hits, and render the same image.
+bool RunCameraPacketBenchmark(const MeshFile& mesh, const std::vector<AccelInstance>& gridInstances, const CpuRenderSettings& settings);
+
+// The accumulation image, and the host-visible copy that main() reads it
+// back to, for benchmarks that measure the rendered image.
+struct BenchmarkImage
+{
+    VkDevice       device = VK_NULL_HANDLE;
+    VkImage        image = VK_NULL_HANDLE;         // The accumulation image, in TRANSFER_SRC_OPTIMAL layout
+    VkImage        linearImage = VK_NULL_HANDLE;   // RGBA32F with linear tiling, in TRANSFER_DST_OPTIMAL layout
+    VkDeviceMemory linearMemory = VK_NULL_HANDLE;  // The memory of linearImage, host-visible and coherent
+    uint32_t       width = 0;
+    uint32_t       height = 0;
+};
+
+// Traces sample batches with the wavefront tracer into `image` while giving
+// the instances 1 to 9 and then up to MAX_MATERIAL_IDS random material IDs,
+// with and without sorting hits by material before shading, and prints the
+// GPU time per batch. Leaves `image` with unspecified contents, and restores
+// the tracer's material IDs and sorting.
+bool RunMaterialSortBenchmark(WavefrontTracer& tracer, BatchSubmitter& batchSubmitter, const BenchmarkImage& image);
+
+// Renders a reference image with many sample batches, then renders the
+// image from scratch with each sampler (SAMPLER_RANDOM, SAMPLER_SOBOL, and
+// SAMPLER_BLUE_NOISE), and prints the RMSE against the reference and the
+// GPU time after 1, 2, 4, ... batches. Then prints how many samples per
+// pixel each sampler needed to reach the error that random sampling reached
+// with the most batches. The reference uses a different seed, so its samples
+// don't correlate with the measured images. Returns false if an RMSE isn't
+// finite. Leaves `image` with unspecified contents, and the tracer's sampler
+// at SAMPLER_BLUE_NOISE with seed 0.
+bool RunSamplerConvergenceBenchmark(WavefrontTracer& tracer, BatchSubmitter& batchSubmitter, const BenchmarkImage& image);
+
+// Compares the noise of cosine-weighted and uniform sampling of the diffuse
+// lobe at equal time: renders a reference with many cosine-weighted batches,
+// then renders with cosine-weighted sampling for a few batches, and with
+// uniform sampling until it has used the same GPU time. Prints the RMSE of
+// each against the reference, and writes both images to bsdf_cosine.hdr and
+// bsdf_uniform.hdr. Returns false if an RMSE isn't finite. Leaves `image`
+// with unspecified contents, and the tracer with cosine-weighted sampling
+// and seed 0.
+bool RunBsdfSamplingBenchmark(WavefrontTracer& tracer, BatchSubmitter& batchSubmitter, const BenchmarkImage& image);
+
+// Traces sample batches with the wavefront tracer for every workgroup size
+// from 32 to `maxWorkgroupSize` threads and several sample counts per
+// batch, and prints the median GPU time per batch and per sample per pixel
+// of each. Writes the fastest combination per sample to `best`. Returns
+// false if no batch could be timed. Leaves `image` with unspecified
+// contents, and the tracer with the kernels of `best`.
+bool RunLaunchTuningBenchmark(WavefrontTracer& tracer, BatchSubmitter& batchSubmitter, const BenchmarkImage& image,
+    uint32_t maxWorkgroupSize, LaunchTuning& best);
+
+// Traces sample batches with the wavefront tracer for each pixel order
+// (PIXEL_ORDER_LINEAR, PIXEL_ORDER_TILED, and PIXEL_ORDER_MORTON), with and
+// without persistent threads, and prints the median GPU time per batch of
+// each. Since every combination traces the same samples, also checks that
+// they render the same image. Returns false if they don't. Leaves `image`
+// with unspecified contents, and the tracer with its original kernels and
+// seed 0.
+bool RunPixelOrderBenchmark(WavefrontTracer& tracer, BatchSubmitter& batchSubmitter, const BenchmarkImage& image);
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_BENCHMARKS_HPP
@@ -4,20 +4,266 @@
 
 #ifdef __cplusplus
 #include <cstdint>
+#include <nvmath/nvmath.h>
 using uint = uint32_t;
+using vec3 = nvmath::vec3f;
 #endif  // #ifdef __cplusplus
 
-struct PushConstants
-{
-	uint sample_batch;
-};
-
-#define WORKGROUP_WIDTH 16
-#define WORKGROUP_HEIGHT 8
-
 #define BINDING_IMAGEDATA 0
 #define BINDING_TLAS 1
 #define BINDING_VERTICES 2
 #define BINDING_INDICES 3
+#define BINDING_GEOMETRIES 4
+#define BINDING_STATS 5
+// Bindings used only by the wavefront tracer:
+#define BINDING_WAVEFRONT_PATHS 6
+#define BINDING_WAVEFRONT_QUEUES 7
+#define BINDING_WAVEFRONT_COUNTERS 8
+#define BINDING_WAVEFRONT_MATERIALS 9
+// Bindings used by adaptive sampling:
+#define BINDING_ADAPTIVE_VARIANCE 10
+#define BINDING_ADAPTIVE_TILES 11
+// The emissive triangles that next-event estimation samples:
+#define BINDING_LIGHTS 12
+
+// The default number of samples each pixel gets per sample batch (see
+// CONSTANT_ID_SAMPLES_PER_BATCH).
+#define DEFAULT_SAMPLES_PER_BATCH 64
+// The number of closest-hit shaders (materials).
+#define NUM_MATERIALS 9
+// The number of material IDs the wavefront tracer can sort hits by. Material
+// ID m shades exactly like material (m % NUM_MATERIALS); IDs past
+// NUM_MATERIALS only add sort bins, and don't change the image.
+#define MAX_MATERIAL_IDS 64
+
+// The largest maximum number of segments in each path (see PathTermination).
+#define MAX_PATH_SEGMENTS 32
+
+// How paths end, passed to both tracers in push constants. The ray tracing
+// pipeline is specialized for maxSegments instead (see
+// CONSTANT_ID_MAX_SEGMENTS), so that the compiler knows its loop bound.
+struct PathTermination
+{
+	uint maxSegments;          // Paths end after this many segments; at most MAX_PATH_SEGMENTS
+	uint rouletteMinSegments;  // Russian roulette starts once a path has this many segments
+};
+
+// Specialization constant IDs of the ray generation shader:
+#define CONSTANT_ID_ENABLE_RAY_STATS 0
+#define CONSTANT_ID_ADAPTIVE_SAMPLING 1
+// Specialization constant ID of the sample sequence, used by every shader
+// that includes shaderCommon.h:
+#define CONSTANT_ID_SAMPLER 2
+
+// The sample sequences paths can draw their random numbers from (see Sampler
+// in shaderCommon.h):
+#define SAMPLER_RANDOM 0      // Independent random numbers
+#define SAMPLER_SOBOL 1       // An Owen-scrambled Sobol sequence, scrambled differently in every pixel
+#define SAMPLER_BLUE_NOISE 2  // One Owen-scrambled Sobol sequence, rotated per pixel and dimension by a blue noise mask
+
+// Specialization constant ID of how the Lambertian lobe samples directions
+// (see shaders/bsdf.h):
+#define CONSTANT_ID_DIFFUSE_SAMPLING 3
+#define DIFFUSE_SAMPLING_UNIFORM 0  // Uniformly over the hemisphere
+#define DIFFUSE_SAMPLING_COSINE 1   // In proportion to the cosine to the normal
+
+// Specialization constant IDs of the numbers the kernels used to have
+// compiled in, so that changing them only needs a new pipeline variant (see
+// PipelineVariantCache):
+#define CONSTANT_ID_SAMPLES_PER_BATCH 4         // Samples per pixel per batch, in every tracer
+#define CONSTANT_ID_MAX_SEGMENTS 5              // The loop bound of the ray generation shader
+#define CONSTANT_ID_ADAPTIVE_TILE_WIDTH 6       // The size of adaptive sampling's tiles
+#define CONSTANT_ID_ADAPTIVE_TILE_HEIGHT 7
+#define CONSTANT_ID_WAVEFRONT_WORKGROUP_SIZE 8  // The workgroup size of the wavefront kernels
+
+// Specialization constant ID of the order in which invocations visit pixels
+// (see pixelFromIndex in shaderCommon.h). Neighboring invocations trace
+// neighboring pixels in every order, but the orders other than
+// PIXEL_ORDER_LINEAR keep the pixels of a subgroup in a compact 2D region
+// instead of a row, so that their rays stay coherent for longer.
+#define CONSTANT_ID_PIXEL_ORDER 9
+#define PIXEL_ORDER_LINEAR 0  // Row by row
+#define PIXEL_ORDER_TILED 1   // Row by row within PIXEL_TILE_WIDTH x PIXEL_TILE_HEIGHT tiles
+#define PIXEL_ORDER_MORTON 2  // In Z-order within PIXEL_MORTON_BLOCK_SIZE x PIXEL_MORTON_BLOCK_SIZE blocks
+#define PIXEL_TILE_WIDTH 8
+#define PIXEL_TILE_HEIGHT 4
+#define PIXEL_MORTON_BLOCK_SIZE 32  // A power of two
+// Specialization constant ID of whether the wavefront tracer's extend kernel
+// runs persistent threads (see WAVEFRONT_PERSISTENT_INVOCATIONS).
+#define CONSTANT_ID_PERSISTENT_THREADS 10
+
+// Per-geometry data, indexed by gl_GeometryIndexEXT. Each shape of the OBJ
+// file is a separate geometry in the BLAS.
+struct GeometryInfo
+{
+	// Index of the geometry's first triangle in the index buffer. gl_PrimitiveID
+	// counts from the start of the geometry, so add this to get the triangle.
+	uint primitiveOffset;
+	// Radiance that the geometry's triangles emit from both sides (the MTL
+	// Ke of the shape's material); 0 if they don't emit light.
+	vec3 emission;
+};
+
+// The light buffer starts with this header, followed by numTriangles
+// EmissiveTriangles: the emissive triangles of every instance, in world
+// space. Next-event estimation picks a triangle in proportion to its power
+// (area times the luminance of its emission) with the alias table in the
+// triangles, then a uniformly distributed point on it. The probability
+// density per unit area of a point is then luminance(emission) / totalPower,
+// which doesn't depend on which instance or triangle was hit.
+struct LightTableHeader
+{
+	uint  numTriangles;
+	float totalPower;  // Sum of area * luminance(emission) over all triangles
+};
+
+struct EmissiveTriangle
+{
+	vec3  v0;        // The vertices are v0, v0 + edge1, and v0 + edge2
+	vec3  edge1;
+	vec3  edge2;
+	vec3  emission;  // Emitted radiance, from both sides
+	// Alias table entry: when slot i of the table is picked uniformly, use
+	// triangle i with probability keepProbability, and triangle alias otherwise.
+	float keepProbability;
+	uint  alias;
+};
+
+// A 64-bit counter made of two 32-bit halves, so that the shaders can add to
+// it without 64-bit atomics: they add to `low`, and add 1 to `high` when that
+// carries (see rayStatsAdd in shaders/rayStats.h).
+struct RayCount
+{
+	uint low;
+	uint high;
+};
+
+// Counters that the ray generation shader adds to when ray statistics are
+// enabled. These are reset at the start of each sample batch. A large batch
+// traces more than 2^32 rays, so each counter has 64 bits.
+struct RayStats
+{
+	RayCount primaryRays;             // Rays traced from the camera
+	RayCount secondaryRays;           // Rays traced from a previous hit
+	RayCount skyHits;                 // Paths that ended by hitting the sky
+	RayCount segmentCapTerminations;  // Paths that ended at PathTermination::maxSegments segments without hitting the sky
+	RayCount rouletteTerminations;    // Paths that Russian roulette ended
+	RayCount shadowRays;              // Rays traced from a hit towards a point on a light
+	// segmentHistogram[i] counts the paths that had i+1 segments.
+	RayCount segmentHistogram[MAX_PATH_SEGMENTS];
+};
+
+// The wavefront tracer runs one invocation per path or queue entry, in 1D
+// workgroups of this size by default (see CONSTANT_ID_WAVEFRONT_WORKGROUP_SIZE),
+// and of at most the maximum size.
+#define DEFAULT_WAVEFRONT_WORKGROUP_SIZE 128
+#define MAX_WAVEFRONT_WORKGROUP_SIZE 1024
+// The wavefront tracer traces this many samples of every pixel at once, so it
+// has (width * height * WAVEFRONT_SAMPLES_PER_PASS) paths in flight. The
+// number of samples per batch must be a multiple of this.
+#define WAVEFRONT_SAMPLES_PER_PASS 2
+// With persistent threads, the extend kernel launches at most this many
+// invocations, which is about enough to fill a large GPU. Each subgroup then
+// keeps taking the next entries of the active queue from an atomic counter
+// until the queue is empty, instead of tracing one entry per invocation.
+#define WAVEFRONT_PERSISTENT_INVOCATIONS (128 * 1024)
+
+// The state of one path in the wavefront tracer. Path i traces the pixel
+// that pixelFromIndex() returns for (i % (width * height)).
+struct WavefrontPath
+{
+	vec3 origin;       // Origin of the next segment
+	uint sampleIndex;  // Index of the path's sample in its pixel's sample sequence (see Sampler)
+	vec3 direction;    // Direction of the next segment
+	uint segments;     // Number of segments shaded so far
+	vec3 throughput;   // Product of the colors of the surfaces hit so far
+	int  hitPrimitiveID;
+	// Where the last segment hit a surface, written by the extend kernel for
+	// the shade kernel (see HitInfo):
+	vec3 hitObjectPosition;
+	vec3 hitWorldPosition;
+	vec3 hitWorldNormal;
+	// Sum of the colors of the samples this path traced in this batch
+	vec3 radianceSum;
+	// Material ID of the instance the last segment hit
+	uint hitMaterial;
+	// Solid angle probability density with which the shade kernel sampled
+	// `direction`, for weighting the emission it hits against light sampling;
+	// 0 for camera rays and mirror or pass-through directions.
+	float scatterPdf;
+};
+
+// The header of a queue of path indices. The first three members are a
+// VkDispatchIndirectCommand that runs one invocation per entry: whenever
+// an entry starts a new workgroup, groupCountX is incremented.
+struct WavefrontQueueHeader
+{
+	uint groupCountX;
+	uint groupCountY;  // Always 1
+	uint groupCountZ;  // Always 1
+	uint count;        // Number of entries
+};
+
+// Queues 0 and 1 hold the paths to extend, alternating between segments.
+// The hit queue holds the paths that hit a surface in this segment, in the
+// order the extend kernel found them, and the sorted queue holds the same
+// paths grouped by material ID. Only the first three queues have headers.
+#define WAVEFRONT_QUEUE_HIT 2
+#define WAVEFRONT_QUEUE_SORTED 3
+
+struct WavefrontCounters
+{
+	// Headers of the active queues and the hit queue
+	WavefrontQueueHeader queues[3];
+	// Indirect dispatch arguments for the shade kernel over the sorted
+	// queue, with one workgroup for each workgroup of every material bin
+	WavefrontQueueHeader shadeDispatch;
+	// The next entry of the active queue for a persistent extend kernel to trace
+	uint extendCursor;
+	// Index of the group of WAVEFRONT_SAMPLES_PER_PASS samples being traced.
+	// The CPU writes it before each pass, so that every pass runs the same
+	// commands.
+	uint pass;
+	// The counting sort of the hit queue by material ID. Bin m of the sorted
+	// queue starts at entry (materialFirstGroups[m] * workgroup size),
+	// so that no workgroup of the shade kernel spans two materials.
+	uint materialCounts[MAX_MATERIAL_IDS];       // Number of hits with each material ID
+	uint materialFirstGroups[MAX_MATERIAL_IDS];  // Exclusive prefix sum of the workgroups of each bin
+	uint materialCursors[MAX_MATERIAL_IDS];      // Number of entries scattered into each bin so far
+};
+
+struct WavefrontPushConstants
+{
+	uint numPaths;        // Number of paths in flight, and the capacity of every queue
+	uint segment;         // Index of the segment being traced
+	uint sortByMaterial;  // If nonzero, shade the sorted queue instead of the hit queue
+	uint samplerSeed;     // Seed of the sample sequences (see Sampler)
+	PathTermination termination;
+};
+
+// Adaptive sampling divides the image into tiles of this size by default
+// (see CONSTANT_ID_ADAPTIVE_TILE_WIDTH), and only traces the tiles that
+// haven't converged yet.
+#define DEFAULT_ADAPTIVE_TILE_WIDTH 16
+#define DEFAULT_ADAPTIVE_TILE_HEIGHT 8
+
+// The header of the list of tiles to trace, which the tile indices follow.
+// The members are a VkTraceRaysIndirectCommandKHR with one invocation per
+// pixel of each tile in x, and one row per tile in y.
+struct AdaptiveTileHeader
+{
+	uint launchWidth;   // Always the number of pixels in a tile
+	uint launchHeight;  // Number of tiles in the list
+	uint launchDepth;   // Always 1
+};
+
+struct AdaptivePushConstants
+{
+	// A pixel has converged once the standard error of its mean luminance,
+	// divided by its mean luminance, is at most this.
+	float targetRelativeError;
+	// Pixels with fewer sample batches than this haven't converged yet.
+	uint minBatches;
+};
 
 #endif // #ifndef VK_MINI_PATH_TRACER_COMMON_H
\ No newline at end of file
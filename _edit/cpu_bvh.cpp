@@ -0,0 +1,588 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "cpu_bvh.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <nvh/nvprint.hpp>  // For nvprintf
+
+#include "file_utils.hpp"
+#include "thread_pool.hpp"
+
+void BvhBounds::grow(const float point[3])
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        min[axis] = std::min(min[axis], point[axis]);
+        max[axis] = std::max(max[axis], point[axis]);
+    }
+}
+
+void BvhBounds::grow(const BvhBounds& other)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        min[axis] = std::min(min[axis], other.min[axis]);
+        max[axis] = std::max(max[axis], other.max[axis]);
+    }
+}
+
+float BvhBounds::halfArea() const
+{
+    const float dx = max[0] - min[0];
+    const float dy = max[1] - min[1];
+    const float dz = max[2] - min[2];
+    if (dx < 0.0f || dy < 0.0f || dz < 0.0f)
+    {
+        return 0.0f;
+    }
+    return dx * dy + dy * dz + dz * dx;
+}
+
+namespace {
+const int NUM_BINS = 16;
+// The cost of visiting an inner node, relative to intersecting a primitive:
+const float TRAVERSAL_COST = 1.0f;
+// Nodes with at least this many primitives build their subtrees in
+// parallel, and subtrees with at least this many nodes flatten in parallel:
+const uint32_t PARALLEL_SUBTREE_SIZE = 4096;
+// Nodes with at least twice this many primitives bin them in parallel
+// chunks of this many primitives:
+const uint32_t PARALLEL_CHUNK_SIZE = 16384;
+// Nodes at least this deep split at the median instead of by the SAH.
+// Halving fewer than 2^32 primitives takes at most 32 more levels, so no leaf
+// ends up deeper than BVH_MAX_DEPTH, however unbalanced the SAH splits above
+// it were.
+const uint32_t MEDIAN_SPLIT_DEPTH = BVH_MAX_DEPTH - 32;
+
+struct Bin
+{
+    BvhBounds bounds;
+    BvhBounds centroidBounds;
+    uint32_t  count = 0;
+
+    void add(const Bin& other)
+    {
+        bounds.grow(other.bounds);
+        centroidBounds.grow(other.centroidBounds);
+        count += other.count;
+    }
+};
+using AxisBins = std::array<std::array<Bin, NUM_BINS>, 3>;
+
+// A node of the tree while it's being built. The builder allocates the
+// children of a node as a pair, in whatever order the tasks get to them,
+// and flattens the tree into depth-first order once every subtree size is
+// known.
+struct BuildNode
+{
+    BvhBounds bounds;
+    uint32_t  firstChild = 0;   // Index of the first child; the second child follows it
+    uint32_t  begin = 0;        // Leaf: index of the first primitive in Bvh::primitives
+    uint32_t  count = 0;        // Leaf: number of primitives; 0 for inner nodes
+    uint32_t  subtreeSize = 1;  // Number of nodes in the subtree, including this one
+};
+
+class BvhBuilder
+{
+public:
+    BvhBuilder(const std::vector<BvhBounds>& bounds, uint32_t maxLeafSize, ThreadPool* threadPool, Bvh& bvh)
+        : m_bounds(bounds)
+        , m_maxLeafSize(std::max(maxLeafSize, 1u))
+        , m_threadPool(threadPool)
+        , m_bvh(bvh)
+    {
+    }
+
+    void build()
+    {
+        const uint32_t numPrimitives = static_cast<uint32_t>(m_bounds.size());
+        m_bvh.primitives.resize(numPrimitives);
+        for (uint32_t i = 0; i < numPrimitives; i++)
+        {
+            m_bvh.primitives[i] = i;
+        }
+        // A binary tree with n leaves has 2n - 1 nodes:
+        m_buildNodes.resize(2 * size_t(numPrimitives) - 1);
+        m_numBuildNodes = 1;
+
+        // The root's bounds are the union of every bin's:
+        AxisBins        bins;
+        const BvhBounds everything;
+        binPrimitives(0, numPrimitives, everything, bins);
+        Bin root;
+        for (const Bin& bin : bins[0])
+        {
+            root.add(bin);
+        }
+        m_buildNodes[0].bounds = root.bounds;
+        buildNode(0, 0, numPrimitives, root.centroidBounds, 0);
+
+        m_bvh.nodes.resize(m_buildNodes[0].subtreeSize);
+        flattenNode(0, 0);
+        m_buildNodes = std::vector<BuildNode>();
+    }
+
+private:
+    // Builds the subtree of build node `nodeIndex`, whose bounds are set,
+    // over primitives [begin, end) of m_bvh.primitives, whose centroids are
+    // within `centroidBounds`. The node is `depth` levels below the root.
+    void buildNode(uint32_t nodeIndex, uint32_t begin, uint32_t end, const BvhBounds& centroidBounds, uint32_t depth)
+    {
+        BuildNode&     node = m_buildNodes[nodeIndex];
+        const uint32_t count = end - begin;
+
+        uint32_t  mid = begin;
+        BvhBounds childBounds[2], childCentroidBounds[2];
+        if (depth >= MEDIAN_SPLIT_DEPTH)
+        {
+            if (count > m_maxLeafSize)
+            {
+                mid = splitAtMedian(begin, end, longestAxis(centroidBounds), childBounds, childCentroidBounds);
+            }
+        }
+        else if (count > 1)
+        {
+            mid = split(begin, end, node.bounds, centroidBounds, childBounds, childCentroidBounds);
+        }
+        if (mid == begin)
+        {
+            node.begin = begin;
+            node.count = count;
+            return;
+        }
+
+        node.firstChild = m_numBuildNodes.fetch_add(2);
+        const uint32_t firstChild = node.firstChild;
+        m_buildNodes[firstChild].bounds = childBounds[0];
+        m_buildNodes[firstChild + 1].bounds = childBounds[1];
+        if (m_threadPool != nullptr && count >= PARALLEL_SUBTREE_SIZE)
+        {
+            TaskGroup group;
+            m_threadPool->run(group, [&]() { buildNode(firstChild, begin, mid, childCentroidBounds[0], depth + 1); });
+            buildNode(firstChild + 1, mid, end, childCentroidBounds[1], depth + 1);
+            m_threadPool->wait(group);
+        }
+        else
+        {
+            buildNode(firstChild, begin, mid, childCentroidBounds[0], depth + 1);
+            buildNode(firstChild + 1, mid, end, childCentroidBounds[1], depth + 1);
+        }
+        node.subtreeSize = 1 + m_buildNodes[firstChild].subtreeSize + m_buildNodes[firstChild + 1].subtreeSize;
+    }
+
+    // Partitions primitives [begin, end) at the best split, sets the bounds
+    // and centroid bounds of the two sides, and returns the index of the
+    // first primitive of the second side, or `begin` if the node should be
+    // a leaf.
+    uint32_t split(uint32_t begin, uint32_t end, const BvhBounds& nodeBounds, const BvhBounds& centroidBounds,
+        BvhBounds childBounds[2], BvhBounds childCentroidBounds[2])
+    {
+        const uint32_t count = end - begin;
+        AxisBins       bins;
+        binPrimitives(begin, end, centroidBounds, bins);
+
+        float bestCost = 1e30f;
+        int   bestAxis = -1;
+        int   bestBin = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (centroidBounds.max[axis] <= centroidBounds.min[axis])
+            {
+                continue;  // Every primitive is in bin 0
+            }
+            // Sweep from the right to get the cost of everything right of
+            // each boundary, then from the left to evaluate each split:
+            std::array<float, NUM_BINS> rightCosts;
+            Bin                         right;
+            for (int bin = NUM_BINS - 1; bin > 0; bin--)
+            {
+                right.add(bins[axis][bin]);
+                rightCosts[bin] = right.bounds.halfArea() * float(right.count);
+            }
+            Bin left;
+            for (int bin = 0; bin < NUM_BINS - 1; bin++)
+            {
+                left.add(bins[axis][bin]);
+                const float cost = left.bounds.halfArea() * float(left.count) + rightCosts[bin + 1];
+                if (left.count != 0 && left.count != count && cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestBin = bin;
+                }
+            }
+        }
+
+        const float nodeArea = nodeBounds.halfArea();
+        const float splitCost = TRAVERSAL_COST + ((nodeArea > 0.0f) ? bestCost / nodeArea : 0.0f);
+        if (count <= m_maxLeafSize && (bestAxis < 0 || float(count) <= splitCost))
+        {
+            return begin;
+        }
+
+        uint32_t* first = m_bvh.primitives.data() + begin;
+        uint32_t* last = m_bvh.primitives.data() + end;
+        if (bestAxis < 0)
+        {
+            // Every centroid is in the same place, so binning can't separate
+            // them; split the node in half to keep leaves small:
+            return splitAtMedian(begin, end, -1, childBounds, childCentroidBounds);
+        }
+
+        Bin sides[2];
+        for (int bin = 0; bin < NUM_BINS; bin++)
+        {
+            sides[(bin <= bestBin) ? 0 : 1].add(bins[bestAxis][bin]);
+        }
+        for (int side = 0; side < 2; side++)
+        {
+            childBounds[side] = sides[side].bounds;
+            childCentroidBounds[side] = sides[side].centroidBounds;
+        }
+        const float scale = binScale(centroidBounds, bestAxis);
+        const auto  isLeft = [&](uint32_t primitive) {
+            return binIndex(m_bounds[primitive].centroid(bestAxis), centroidBounds.min[bestAxis], scale) <= bestBin;
+        };
+        if (count < 2 * PARALLEL_CHUNK_SIZE)
+        {
+            std::partition(first, last, isLeft);
+        }
+        else
+        {
+            partitionChunks(begin, end, sides[0].count, isLeft);
+        }
+        return begin + sides[0].count;
+    }
+
+    // Splits primitives [begin, end) in half, at the median of their
+    // centroids along `axis`, or as they are if `axis` is negative. Sets the
+    // bounds and centroid bounds of the two halves, and returns the index of
+    // the first primitive of the second half.
+    uint32_t splitAtMedian(uint32_t begin, uint32_t end, int axis, BvhBounds childBounds[2], BvhBounds childCentroidBounds[2])
+    {
+        uint32_t* const primitives = m_bvh.primitives.data();
+        const uint32_t  mid = begin + (end - begin) / 2;
+        if (axis >= 0)
+        {
+            std::nth_element(primitives + begin, primitives + mid, primitives + end, [&](uint32_t a, uint32_t b) {
+                return m_bounds[a].centroid(axis) < m_bounds[b].centroid(axis);
+            });
+        }
+        for (int side = 0; side < 2; side++)
+        {
+            childBounds[side] = BvhBounds();
+            childCentroidBounds[side] = BvhBounds();
+            for (uint32_t i = (side == 0) ? begin : mid; i < ((side == 0) ? mid : end); i++)
+            {
+                const BvhBounds& primitive = m_bounds[primitives[i]];
+                const float      centroid[3] = { primitive.centroid(0), primitive.centroid(1), primitive.centroid(2) };
+                childBounds[side].grow(primitive);
+                childCentroidBounds[side].grow(centroid);
+            }
+        }
+        return mid;
+    }
+
+    // Stably partitions primitives [begin, end), of which `numLeft` are on
+    // the left, in chunks of PARALLEL_CHUNK_SIZE primitives: each chunk
+    // counts its left primitives, and then copies its primitives to where
+    // the counts of the chunks before it say they go. The chunks run in
+    // parallel if there's a thread pool, and give the same order if not.
+    template <class IsLeft>
+    void partitionChunks(uint32_t begin, uint32_t end, uint32_t numLeft, const IsLeft& isLeft)
+    {
+        const uint32_t        count = end - begin;
+        const uint32_t        numChunks = (count + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+        uint32_t* const       primitives = m_bvh.primitives.data();
+        std::vector<uint32_t> chunkLeft(numChunks + 1, 0);
+        const auto            forEachChunk = [&](const std::function<void(uint32_t, uint32_t, uint32_t)>& func) {
+            const auto chunkFunc = [&](size_t chunk) {
+                const uint32_t chunkBegin = begin + static_cast<uint32_t>(chunk) * PARALLEL_CHUNK_SIZE;
+                func(static_cast<uint32_t>(chunk), chunkBegin, std::min(chunkBegin + PARALLEL_CHUNK_SIZE, end));
+            };
+            if (m_threadPool != nullptr)
+            {
+                m_threadPool->parallelFor(numChunks, chunkFunc);
+            }
+            else
+            {
+                for (size_t chunk = 0; chunk < numChunks; chunk++)
+                {
+                    chunkFunc(chunk);
+                }
+            }
+        };
+
+        forEachChunk([&](uint32_t chunk, uint32_t chunkBegin, uint32_t chunkEnd) {
+            chunkLeft[chunk + 1] = static_cast<uint32_t>(std::count_if(primitives + chunkBegin, primitives + chunkEnd, isLeft));
+        });
+        for (uint32_t chunk = 0; chunk < numChunks; chunk++)
+        {
+            chunkLeft[chunk + 1] += chunkLeft[chunk];
+        }
+        std::vector<uint32_t> partitioned(count);
+        forEachChunk([&](uint32_t chunk, uint32_t chunkBegin, uint32_t chunkEnd) {
+            uint32_t left = chunkLeft[chunk];
+            uint32_t right = numLeft + (chunkBegin - begin) - chunkLeft[chunk];
+            for (uint32_t i = chunkBegin; i < chunkEnd; i++)
+            {
+                partitioned[isLeft(primitives[i]) ? left++ : right++] = primitives[i];
+            }
+        });
+        forEachChunk([&](uint32_t, uint32_t chunkBegin, uint32_t chunkEnd) {
+            std::copy(partitioned.begin() + (chunkBegin - begin), partitioned.begin() + (chunkEnd - begin), primitives + chunkBegin);
+        });
+    }
+
+    // Sorts primitives [begin, end) into NUM_BINS bins along each axis by
+    // where their centroids are in `centroidBounds`. With an empty
+    // `centroidBounds`, puts every primitive into bin 0.
+    void binPrimitives(uint32_t begin, uint32_t end, const BvhBounds& centroidBounds, AxisBins& bins) const
+    {
+        const uint32_t count = end - begin;
+        if (m_threadPool == nullptr || count < 2 * PARALLEL_CHUNK_SIZE)
+        {
+            binChunk(begin, end, centroidBounds, bins);
+            return;
+        }
+        const uint32_t        numChunks = (count + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+        std::vector<AxisBins> chunkBins(numChunks);
+        m_threadPool->parallelFor(numChunks, [&](size_t chunk) {
+            const uint32_t chunkBegin = begin + static_cast<uint32_t>(chunk) * PARALLEL_CHUNK_SIZE;
+            binChunk(chunkBegin, std::min(chunkBegin + PARALLEL_CHUNK_SIZE, end), centroidBounds, chunkBins[chunk]);
+        });
+        bins = AxisBins();
+        for (const AxisBins& chunk : chunkBins)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                for (int bin = 0; bin < NUM_BINS; bin++)
+                {
+                    bins[axis][bin].add(chunk[axis][bin]);
+                }
+            }
+        }
+    }
+
+    void binChunk(uint32_t begin, uint32_t end, const BvhBounds& centroidBounds, AxisBins& bins) const
+    {
+        bins = AxisBins();
+        const float scales[3] = { binScale(centroidBounds, 0), binScale(centroidBounds, 1), binScale(centroidBounds, 2) };
+        for (uint32_t i = begin; i < end; i++)
+        {
+            const BvhBounds& primitive = m_bounds[m_bvh.primitives[i]];
+            const float      centroid[3] = { primitive.centroid(0), primitive.centroid(1), primitive.centroid(2) };
+            for (int axis = 0; axis < 3; axis++)
+            {
+                Bin& bin = bins[axis][binIndex(centroid[axis], centroidBounds.min[axis], scales[axis])];
+                bin.bounds.grow(primitive);
+                bin.centroidBounds.grow(centroid);
+                bin.count++;
+            }
+        }
+    }
+
+    // Writes the subtree of build node `nodeIndex` to m_bvh.nodes, starting at `flatIndex`.
+    void flattenNode(uint32_t nodeIndex, uint32_t flatIndex)
+    {
+        const BuildNode& node = m_buildNodes[nodeIndex];
+        BvhNode&         flatNode = m_bvh.nodes[flatIndex];
+        std::copy(node.bounds.min, node.bounds.min + 3, flatNode.boundsMin);
+        std::copy(node.bounds.max, node.bounds.max + 3, flatNode.boundsMax);
+        if (node.count != 0)
+        {
+            flatNode.offset = node.begin;
+            flatNode.count = node.count;
+            return;
+        }
+        const uint32_t firstChild = node.firstChild;
+        const uint32_t secondFlatIndex = flatIndex + 1 + m_buildNodes[firstChild].subtreeSize;
+        flatNode.offset = secondFlatIndex;
+        flatNode.count = 0;
+        if (m_threadPool != nullptr && node.subtreeSize >= PARALLEL_SUBTREE_SIZE)
+        {
+            TaskGroup group;
+            m_threadPool->run(group, [&]() { flattenNode(firstChild, flatIndex + 1); });
+            flattenNode(firstChild + 1, secondFlatIndex);
+            m_threadPool->wait(group);
+        }
+        else
+        {
+            flattenNode(firstChild, flatIndex + 1);
+            flattenNode(firstChild + 1, secondFlatIndex);
+        }
+    }
+
+    static int longestAxis(const BvhBounds& centroidBounds)
+    {
+        int longest = 0;
+        for (int axis = 1; axis < 3; axis++)
+        {
+            if (centroidBounds.max[axis] - centroidBounds.min[axis] > centroidBounds.max[longest] - centroidBounds.min[longest])
+            {
+                longest = axis;
+            }
+        }
+        return longest;
+    }
+
+    static float binScale(const BvhBounds& centroidBounds, int axis)
+    {
+        const float extent = centroidBounds.max[axis] - centroidBounds.min[axis];
+        return (extent > 0.0f) ? float(NUM_BINS) / extent : 0.0f;
+    }
+
+    static int binIndex(float centroid, float minCentroid, float scale)
+    {
+        return std::max(0, std::min(NUM_BINS - 1, static_cast<int>((centroid - minCentroid) * scale)));
+    }
+
+    const std::vector<BvhBounds>& m_bounds;
+    const uint32_t                m_maxLeafSize;
+    ThreadPool*                   m_threadPool;
+    Bvh&                          m_bvh;
+    std::vector<BuildNode>        m_buildNodes;
+    std::atomic<uint32_t>         m_numBuildNodes{ 0 };
+};
+}  // namespace
+
+Bvh BuildBvh(const std::vector<BvhBounds>& bounds, uint32_t maxLeafSize, ThreadPool* threadPool)
+{
+    Bvh bvh;
+    if (!bounds.empty())
+    {
+        BvhBuilder(bounds, maxLeafSize, threadPool, bvh).build();
+    }
+    return bvh;
+}
+
+std::vector<BvhBounds> GetTriangleBounds(const float* positions, const uint32_t* indices, size_t numTriangles, ThreadPool* threadPool)
+{
+    std::vector<BvhBounds> bounds(numTriangles);
+    const auto             boundTriangles = [&](size_t first, size_t last) {
+        for (size_t triangle = first; triangle < last; triangle++)
+        {
+            for (size_t corner = 0; corner < 3; corner++)
+            {
+                bounds[triangle].grow(positions + 3 * size_t(indices[3 * triangle + corner]));
+            }
+        }
+    };
+    if (threadPool == nullptr)
+    {
+        boundTriangles(0, numTriangles);
+    }
+    else
+    {
+        const size_t numChunks = (numTriangles + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+        threadPool->parallelFor(numChunks, [&](size_t chunk) {
+            boundTriangles(chunk * PARALLEL_CHUNK_SIZE, std::min(numTriangles, (chunk + 1) * PARALLEL_CHUNK_SIZE));
+        });
+    }
+    return bounds;
+}
+
+bool SaveBvh(const std::string& filename, const Bvh& bvh, uint64_t sourceHash)
+{
+    BvhFileHeader header{};
+    memcpy(header.magic, "VMPB", 4);
+    header.version = BVH_FILE_VERSION;
+    header.sourceHash = sourceHash;
+    header.numNodes = bvh.nodes.size();
+    header.numPrimitives = bvh.primitives.size();
+    const uint64_t nodeBytes = header.numNodes * sizeof(BvhNode);
+    header.nodeOffset = 64;  // The header fits in one cache line
+    header.primitiveOffset = header.nodeOffset + nodeBytes;
+    static_assert(sizeof(BvhFileHeader) <= 64, "The BVH file header must fit in front of the nodes!");
+
+    // As with the mesh cache, other processes must never map a partial file:
+    const bool written = WriteFileAtomically(filename, [&](std::ostream& file) {
+        const char padding[64] = {};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(padding, static_cast<std::streamsize>(header.nodeOffset - sizeof(header)));
+        file.write(reinterpret_cast<const char*>(bvh.nodes.data()), static_cast<std::streamsize>(nodeBytes));
+        file.write(reinterpret_cast<const char*>(bvh.primitives.data()),
+                   static_cast<std::streamsize>(header.numPrimitives * sizeof(uint32_t)));
+        return static_cast<bool>(file);
+    });
+    if (!written)
+    {
+        nvprintf("Could not write %s.\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool MappedBvh::open(const std::string& filename, uint64_t sourceHash, uint64_t numSourcePrimitives)
+{
+    close();
+    if (!m_mapping.open(filename))
+    {
+        return false;
+    }
+    BvhFileHeader header;
+    if (m_mapping.size() < sizeof(header))
+    {
+        m_mapping.close();
+        return false;
+    }
+    memcpy(&header, m_mapping.data(), sizeof(header));
+    bool valid = (memcmp(header.magic, "VMPB", 4) == 0) && (header.version == BVH_FILE_VERSION)
+        && (header.sourceHash == sourceHash) && (header.nodeOffset >= sizeof(header)) && (header.nodeOffset % 64 == 0)
+        && (header.primitiveOffset % alignof(uint32_t) == 0) && (header.nodeOffset <= m_mapping.size())
+        && (header.primitiveOffset <= m_mapping.size())
+        && (header.numNodes <= (m_mapping.size() - header.nodeOffset) / sizeof(BvhNode))
+        && (header.numPrimitives <= (m_mapping.size() - header.primitiveOffset) / sizeof(uint32_t))
+        && ((header.numNodes == 0) == (header.numPrimitives == 0));
+    const BvhNode*  nodes = reinterpret_cast<const BvhNode*>(m_mapping.data() + header.nodeOffset);
+    const uint32_t* primitives = reinterpret_cast<const uint32_t*>(m_mapping.data() + header.primitiveOffset);
+
+    // The traversals trust the tree, so check it too: every child comes after
+    // its parent (so there are no cycles), no leaf is deeper than the
+    // traversal stacks allow, and leaves only use primitive indices that
+    // exist, which only point to source primitives that exist.
+    if (valid)
+    {
+        std::vector<uint32_t> depths(header.numNodes, 0);
+        for (uint64_t i = 0; valid && i < header.numNodes; i++)
+        {
+            const BvhNode& node = nodes[i];
+            if (node.isLeaf())
+            {
+                valid = uint64_t(node.offset) + node.count <= header.numPrimitives;
+                continue;
+            }
+            valid = (node.offset > i + 1) && (node.offset < header.numNodes) && (depths[i] < BVH_MAX_DEPTH);
+            if (valid)
+            {
+                depths[i + 1] = std::max(depths[i + 1], depths[i] + 1);
+                depths[node.offset] = std::max(depths[node.offset], depths[i] + 1);
+            }
+        }
+        for (uint64_t i = 0; valid && i < header.numPrimitives; i++)
+        {
+            valid = primitives[i] < numSourcePrimitives;
+        }
+    }
+    if (!valid)
+    {
+        m_mapping.close();
+        return false;
+    }
+    m_header = header;
+    m_nodes = nodes;
+    m_primitives = primitives;
+    return true;
+}
+
+void MappedBvh::close()
+{
+    m_mapping.close();
+    m_header = BvhFileHeader{};
+    m_nodes = nullptr;
+    m_primitives = nullptr;
+}
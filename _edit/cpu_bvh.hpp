@@ -0,0 +1,161 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_CPU_BVH_HPP
+#define VK_MINI_PATH_TRACER_CPU_BVH_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mesh_cache.hpp"  // For MappedFile
+
+class ThreadPool;
+
+// An axis-aligned bounding box. The default box is empty.
+struct BvhBounds
+{
+    float min[3] = { 1e30f, 1e30f, 1e30f };
+    float max[3] = { -1e30f, -1e30f, -1e30f };
+
+    void grow(const float point[3]);
+    void grow(const BvhBounds& other);
+    // Returns half the surface area of the box, or 0 if it's empty.
+    float halfArea() const;
+    float centroid(int axis) const { return 0.5f * (min[axis] + max[axis]); }
+};
+
+// A node of a Bvh. Nodes are in depth-first order, so the first child of an
+// inner node is the node right after it, and a whole node fits in half a
+// cache line; arrays of nodes are 32-byte aligned, so no node straddles two
+// cache lines.
+struct alignas(32) BvhNode
+{
+    float    boundsMin[3];
+    uint32_t offset;  // Inner node: index of the second child. Leaf: index of the first primitive in Bvh::primitives.
+    float    boundsMax[3];
+    uint32_t count;   // Number of primitives of a leaf; 0 for inner nodes
+
+    bool isLeaf() const { return count != 0; }
+};
+static_assert(sizeof(BvhNode) == 32, "BvhNode must be half a cache line!");
+
+// A bounding volume hierarchy over primitives that are only known by their
+// bounds, such as triangles or instances, for the CPU tracer.
+struct Bvh
+{
+    std::vector<BvhNode>  nodes;       // nodes[0] is the root; empty if there are no primitives
+    std::vector<uint32_t> primitives;  // The indices of the primitives of each leaf, leaf by leaf
+};
+
+// A ray prepared for slab tests against the bounds of BvhNodes.
+struct BvhRay
+{
+    float origin[3];
+    float inverseDirection[3];
+
+    BvhRay(const float rayOrigin[3], const float rayDirection[3])
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            origin[axis] = rayOrigin[axis];
+            // Keep the slabs of axis-parallel rays finite, so that no 0 * inf NaNs come up:
+            const float direction = (rayDirection[axis] != 0.0f) ? rayDirection[axis] : 1e-30f;
+            inverseDirection[axis] = 1.0f / direction;
+        }
+    }
+};
+
+// Returns true if `ray` overlaps the bounds of `node` for some t in [tMin,
+// tMax], and sets `tEntry` to the first such t.
+inline bool IntersectBvhNode(const BvhNode& node, const BvhRay& ray, float tMin, float tMax, float& tEntry)
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float t0 = (node.boundsMin[axis] - ray.origin[axis]) * ray.inverseDirection[axis];
+        const float t1 = (node.boundsMax[axis] - ray.origin[axis]) * ray.inverseDirection[axis];
+        tMin = std::max(tMin, std::min(t0, t1));
+        tMax = std::min(tMax, std::max(t0, t1));
+    }
+    tEntry = tMin;
+    return tMin <= tMax;
+}
+
+// The CPU tracer's traversal stacks hold up to this many nodes. A traversal
+// that pushes both children of each node it visits holds at most
+// BVH_MAX_DEPTH + 1 of them, so BuildBvh() puts no leaf more than
+// BVH_MAX_DEPTH levels below the root.
+const int BVH_STACK_SIZE = 128;
+const int BVH_MAX_DEPTH = BVH_STACK_SIZE - 2;
+
+// Builds a BVH over primitives with the bounds `bounds`, with at most
+// `maxLeafSize` primitives per leaf. Each node is split where the surface
+// area heuristic (SAH), evaluated at the boundaries of 16 bins along each
+// axis, predicts the cheapest traversal; a node with at most `maxLeafSize`
+// primitives becomes a leaf if that's cheaper than any split. Nodes deep
+// enough that more SAH splits could exceed BVH_MAX_DEPTH split at the median
+// instead.
+//
+// With a `threadPool`, large nodes bin and partition their primitives in
+// parallel chunks, and build their two subtrees as separate tasks, which
+// then flatten the tree in parallel too. The result is the same BVH as
+// without a pool.
+Bvh BuildBvh(const std::vector<BvhBounds>& bounds, uint32_t maxLeafSize, ThreadPool* threadPool = nullptr);
+
+// Returns the bounds of `numTriangles` triangles with the vertex positions
+// `positions` (3 floats per vertex) and 3 indices per triangle, like the
+// vertex and index arrays of MeshFile.
+std::vector<BvhBounds> GetTriangleBounds(const float* positions, const uint32_t* indices, size_t numTriangles,
+    ThreadPool* threadPool = nullptr);
+
+// The BVH file format. A .vmpbvh file contains this header, followed by
+// `numNodes` BvhNodes starting at `nodeOffset`, which is a multiple of 64
+// (a cache line), and `numPrimitives` uint32 primitive indices starting at
+// `primitiveOffset`. MappedBvh uses both arrays directly from a mapping of
+// the file.
+struct BvhFileHeader
+{
+    char     magic[4];         // "VMPB"
+    uint32_t version;          // BVH_FILE_VERSION
+    uint64_t sourceHash;       // What the BVH was built over, such as MeshFile::contentHash()
+    uint64_t numNodes;
+    uint64_t numPrimitives;
+    uint64_t nodeOffset;       // Byte offset of the nodes from the start of the file
+    uint64_t primitiveOffset;  // Byte offset of the primitive indices from the start of the file
+};
+
+const uint32_t BVH_FILE_VERSION = 1;
+
+// Writes `bvh` to `filename`, tagged with `sourceHash`. Returns false if the
+// file couldn't be written.
+bool SaveBvh(const std::string& filename, const Bvh& bvh, uint64_t sourceHash);
+
+// A BVH that SaveBvh() wrote, loaded with a single memory mapping of the
+// file. Nothing is copied; the nodes are read from the page cache as the
+// BVH is traversed.
+class MappedBvh
+{
+public:
+    // Maps `filename`. Returns false if it's missing, was written by a
+    // different version, or wasn't built over the source `sourceHash`. Also
+    // returns false if the tree is invalid: a child that doesn't follow its
+    // parent, a leaf deeper than BVH_MAX_DEPTH, or a leaf past the primitive
+    // indices or with an index of `numSourcePrimitives` or more. This reads
+    // every node and primitive index once.
+    bool open(const std::string& filename, uint64_t sourceHash, uint64_t numSourcePrimitives);
+    void close();
+
+    const BvhNode*  nodes() const { return m_nodes; }
+    const uint32_t* primitives() const { return m_primitives; }
+    uint64_t        numNodes() const { return m_header.numNodes; }
+    uint64_t        numPrimitives() const { return m_header.numPrimitives; }
+    uint64_t        sourceHash() const { return m_header.sourceHash; }
+
+private:
+    BvhFileHeader   m_header{};
+    MappedFile      m_mapping;
+    const BvhNode*  m_nodes = nullptr;
+    const uint32_t* m_primitives = nullptr;
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_CPU_BVH_HPP
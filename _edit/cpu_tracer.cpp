@@ -0,0 +1,810 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "cpu_tracer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "mesh_cache.hpp"
+#include "thread_pool.hpp"
+
+struct CpuHitInfo
+{
+    vec3 objectPosition;
+    vec3 worldPosition;
+    vec3 worldNormal;
+    vec3 worldRayDirection;  // Direction of the ray that hit the surface
+    int  primitiveID;        // Index of the triangle in its shape, like gl_PrimitiveID
+    vec3 emission;           // Radiance the triangle emits
+};
+
+// The functions in this namespace are ports of the GLSL functions with the
+// same names in the shaders (starting with a capital letter); see there for
+// how they work. They must stay in sync with the shaders, so that the CPU
+// tracer renders the same image.
+namespace {
+// The image is split into square tiles of this size, which threads take one at a time.
+const uint32_t TILE_SIZE = 16;
+static_assert(TILE_SIZE % RAY_PACKET_WIDTH == 0, "Tiles must be made of whole ray packets!");
+// Rays look for hits up to this distance, like tMax in raytrace.rgen.glsl.
+const float RAY_T_MAX = 10000.0f;
+
+const float k_pi = 3.14159265f;
+
+// GLSL built-in functions:
+vec3 Reflect(const vec3& incident, const vec3& normal)
+{
+    return incident - 2.0f * nvmath::dot(normal, incident) * normal;
+}
+
+vec3 FaceForward(const vec3& normal, const vec3& incident, const vec3& normalReference)
+{
+    return (nvmath::dot(normalReference, incident) < 0.0f) ? normal : -normal;
+}
+
+float Mod(float x, float y)
+{
+    return x - y * std::floor(x / y);
+}
+
+int FloatBitsToInt(float value)
+{
+    int result;
+    memcpy(&result, &value, sizeof(result));
+    return result;
+}
+
+float IntBitsToFloat(int value)
+{
+    float result;
+    memcpy(&result, &value, sizeof(result));
+    return result;
+}
+
+vec3 TransformPoint(const nvmath::mat4f& transform, const vec3& point)
+{
+    const nvmath::vec4f result = transform * nvmath::vec4f(point.x, point.y, point.z, 1.0f);
+    return vec3(result.x, result.y, result.z);
+}
+
+// Transforms a normal with the transpose of `worldToObject`, like
+// (objectNormal * gl_WorldToObjectEXT) in GLSL.
+vec3 TransformNormal(const nvmath::mat4f& worldToObject, const vec3& normal)
+{
+    const nvmath::vec4f result = nvmath::transpose(worldToObject) * nvmath::vec4f(normal.x, normal.y, normal.z, 0.0f);
+    return vec3(result.x, result.y, result.z);
+}
+
+//-----------------------------------------------------------------------------
+// shaderCommon.h
+
+#define SAMPLE_CAMERA 0
+#define SAMPLE_FIRST_BOUNCE 4
+#define SAMPLE_DIMENSIONS_PER_BOUNCE 8
+#define SAMPLE_LOBE 0
+#define SAMPLE_DIRECTION 1
+#define SAMPLE_ROULETTE 3
+#define SAMPLE_LIGHT_PICK 4
+#define SAMPLE_LIGHT_POINT 6
+
+struct PathSampler
+{
+    uint32_t pixel;
+    uint32_t sampleIndex;
+    uint32_t bounce;
+    uint32_t seed;
+};
+
+PathSampler CreateSampler(uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t seed)
+{
+    return PathSampler{ x | (y << 16), sampleIndex, 0, seed };
+}
+
+uint32_t HashUint(uint32_t value)
+{
+    const uint32_t state = value * 747796405u + 2891336453u;
+    const uint32_t word = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+    return (word >> 22) ^ word;
+}
+
+uint32_t HashCombine(uint32_t seed, uint32_t value)
+{
+    return seed ^ (HashUint(value) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+float UintToUnitFloat(uint32_t value)
+{
+    return float(value >> 8) * (1.0f / 16777216.0f);
+}
+
+// SAMPLER_RANDOM's sampleDimension().
+float SampleDimension(const PathSampler& pathSampler, uint32_t dimension)
+{
+    return UintToUnitFloat(HashUint(HashCombine(HashCombine(HashCombine(pathSampler.seed, pathSampler.pixel), pathSampler.sampleIndex), dimension)));
+}
+
+float Sample1D(const PathSampler& pathSampler, uint32_t offset)
+{
+    return SampleDimension(pathSampler, SAMPLE_FIRST_BOUNCE + pathSampler.bounce * SAMPLE_DIMENSIONS_PER_BOUNCE + offset);
+}
+
+nvmath::vec2f Sample2D(const PathSampler& pathSampler, uint32_t offset)
+{
+    return nvmath::vec2f(Sample1D(pathSampler, offset), Sample1D(pathSampler, offset + 1));
+}
+
+nvmath::vec2f RandomGaussian(const nvmath::vec2f& u)
+{
+    const float u1 = 1.0f - u.x;
+    const float u2 = u.y;
+    const float r = std::sqrt(-2.0f * std::log(u1));
+    const float theta = 2.0f * k_pi * u2;
+    return nvmath::vec2f(r * std::cos(theta), r * std::sin(theta));
+}
+
+CpuRay GenerateCameraRay(uint32_t x, uint32_t y, uint32_t width, uint32_t height, const PathSampler& pathSampler)
+{
+    const vec3  cameraOrigin(-0.001f, 0.0f, 53.0f);
+    const float fovVerticalSlope = 1.0f / 5.0f;
+
+    const nvmath::vec2f gaussian = RandomGaussian(
+        nvmath::vec2f(SampleDimension(pathSampler, SAMPLE_CAMERA), SampleDimension(pathSampler, SAMPLE_CAMERA + 1)));
+    const float randomPixelCenterX = float(x) + 0.5f + 0.375f * gaussian.x;
+    const float randomPixelCenterY = float(y) + 0.5f + 0.375f * gaussian.y;
+    const float screenU = (2.0f * randomPixelCenterX - float(width)) / float(height);
+    const float screenV = -(2.0f * randomPixelCenterY - float(height)) / float(height);
+
+    CpuRay ray;
+    ray.origin = cameraOrigin;
+    ray.direction = nvmath::normalize(vec3(fovVerticalSlope * screenU, fovVerticalSlope * screenV, -1.0f));
+    return ray;
+}
+
+vec3 SkyColor(const vec3& direction)
+{
+    if (direction.y > 0.0f)
+    {
+        return vec3(1.0f) + (vec3(0.25f, 0.5f, 1.0f) - vec3(1.0f)) * direction.y;
+    }
+    else
+    {
+        return vec3(0.03f);
+    }
+}
+
+float Luminance(const vec3& color)
+{
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+bool RussianRouletteSurvives(uint32_t segments, uint32_t minSegments, vec3& throughput, const PathSampler& pathSampler)
+{
+    if (segments < minSegments)
+    {
+        return true;
+    }
+    const float survivalProbability = std::min(std::max(throughput.x, std::max(throughput.y, throughput.z)), 1.0f);
+    if (survivalProbability <= 0.0f || Sample1D(pathSampler, SAMPLE_ROULETTE) >= survivalProbability)
+    {
+        return false;
+    }
+    throughput /= survivalProbability;
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+// bsdf.h, with DIFFUSE_SAMPLING_COSINE
+
+struct BsdfSample
+{
+    vec3  direction;
+    vec3  weight;
+    float pdf;
+};
+
+void OrthonormalBasis(const vec3& normal, vec3& tangent, vec3& bitangent)
+{
+    const float s = (normal.z >= 0.0f) ? 1.0f : -1.0f;
+    const float a = -1.0f / (s + normal.z);
+    const float b = normal.x * normal.y * a;
+    tangent = vec3(1.0f + s * normal.x * normal.x * a, s * b, -s * normal.x);
+    bitangent = vec3(b, s + normal.y * normal.y * a, -normal.y);
+}
+
+nvmath::vec2f ConcentricDisk(const nvmath::vec2f& u)
+{
+    const float offsetX = 2.0f * u.x - 1.0f;
+    const float offsetY = 2.0f * u.y - 1.0f;
+    if (offsetX == 0.0f && offsetY == 0.0f)
+    {
+        return nvmath::vec2f(0.0f, 0.0f);
+    }
+    float radius, theta;
+    if (std::abs(offsetX) > std::abs(offsetY))
+    {
+        radius = offsetX;
+        theta = 0.25f * k_pi * (offsetY / offsetX);
+    }
+    else
+    {
+        radius = offsetY;
+        theta = 0.5f * k_pi - 0.25f * k_pi * (offsetX / offsetY);
+    }
+    return nvmath::vec2f(radius * std::cos(theta), radius * std::sin(theta));
+}
+
+float LambertianPdf(const vec3& normal, const vec3& direction)
+{
+    const float cosTheta = nvmath::dot(normal, direction);
+    return (cosTheta <= 0.0f) ? 0.0f : cosTheta / k_pi;
+}
+
+vec3 EvaluateLambertian(const vec3& albedo, const vec3& normal, const vec3& direction)
+{
+    return albedo * (std::max(nvmath::dot(normal, direction), 0.0f) / k_pi);
+}
+
+BsdfSample SampleLambertian(const vec3& albedo, const vec3& normal, const nvmath::vec2f& u)
+{
+    vec3 tangent, bitangent;
+    OrthonormalBasis(normal, tangent, bitangent);
+
+    BsdfSample          result;
+    const nvmath::vec2f disk = ConcentricDisk(u);
+    const float         cosTheta = std::sqrt(std::max(0.0f, 1.0f - disk.x * disk.x - disk.y * disk.y));
+    result.direction = nvmath::normalize(disk.x * tangent + disk.y * bitangent + cosTheta * normal);
+    result.pdf = LambertianPdf(normal, result.direction);
+    result.weight = (result.pdf > 0.0f) ? EvaluateLambertian(albedo, normal, result.direction) / result.pdf : vec3(0.0f);
+    return result;
+}
+
+BsdfSample SampleDelta(const vec3& color, const vec3& direction)
+{
+    return BsdfSample{ direction, color, 0.0f };
+}
+
+//-----------------------------------------------------------------------------
+// materials.h
+
+struct ReturnedInfo
+{
+    vec3       rayOrigin;
+    BsdfSample bsdf;
+    vec3       diffuseAlbedo;
+    vec3       diffuseNormal;
+};
+
+vec3 OffsetPositionAlongNormal(const vec3& worldPosition, const vec3& normal)
+{
+    const float intScale = 256.0f;
+    const float origin = 1.0f / 32.0f;
+    const float floatScale = 1.0f / 65536.0f;
+    vec3        result;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const int offset = static_cast<int>(intScale * normal[axis]);
+        if (std::abs(worldPosition[axis]) < origin)
+        {
+            result[axis] = worldPosition[axis] + floatScale * normal[axis];
+        }
+        else
+        {
+            result[axis] = IntBitsToFloat(FloatBitsToInt(worldPosition[axis]) + ((worldPosition[axis] < 0.0f) ? -offset : offset));
+        }
+    }
+    return result;
+}
+
+void ScatterLambertian(ReturnedInfo& result, const vec3& albedo, const vec3& normal, const PathSampler& pathSampler)
+{
+    result.bsdf = SampleLambertian(albedo, normal, Sample2D(pathSampler, SAMPLE_DIRECTION));
+    result.diffuseAlbedo = albedo;
+    result.diffuseNormal = normal;
+}
+
+void ScatterDelta(ReturnedInfo& result, const vec3& color, const vec3& direction)
+{
+    result.bsdf = SampleDelta(color, direction);
+    result.diffuseAlbedo = vec3(0.0f);
+    result.diffuseNormal = vec3(0.0f);
+}
+
+// material0() to material8(), picked like shadeMaterial() does.
+ReturnedInfo ShadeMaterial(uint32_t material, const CpuHitInfo& hitInfo, const PathSampler& pathSampler)
+{
+    ReturnedInfo result;
+    const vec3   frontOrigin = OffsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
+    const vec3   backOrigin = OffsetPositionAlongNormal(hitInfo.worldPosition, -hitInfo.worldNormal);
+    const vec3   mirrorDirection = Reflect(hitInfo.worldRayDirection, hitInfo.worldNormal);
+    switch (material)
+    {
+        case 0:
+            result.rayOrigin = frontOrigin;
+            ScatterLambertian(result, vec3(0.7f), hitInfo.worldNormal, pathSampler);
+            break;
+        case 1:
+            result.rayOrigin = frontOrigin;
+            ScatterDelta(result, vec3(0.7f), mirrorDirection);
+            break;
+        case 2:
+            result.rayOrigin = frontOrigin;
+            ScatterLambertian(result, vec3(0.5f) + 0.5f * hitInfo.worldNormal, hitInfo.worldNormal, pathSampler);
+            break;
+        case 3:
+            result.rayOrigin = frontOrigin;
+            if (Sample1D(pathSampler, SAMPLE_LOBE) < 0.2f)
+            {
+                ScatterDelta(result, vec3(0.7f), mirrorDirection);
+            }
+            else
+            {
+                ScatterLambertian(result, vec3(0.7f), hitInfo.worldNormal, pathSampler);
+            }
+            break;
+        case 4:
+            if (Sample1D(pathSampler, SAMPLE_LOBE) < 0.5f)
+            {
+                result.rayOrigin = frontOrigin;
+                ScatterLambertian(result, vec3(0.7f), hitInfo.worldNormal, pathSampler);
+            }
+            else
+            {
+                result.rayOrigin = backOrigin;
+                ScatterDelta(result, vec3(0.7f), hitInfo.worldRayDirection);
+            }
+            break;
+        case 5:
+            if (Mod(nvmath::dot(hitInfo.objectPosition, vec3(1.0f)), 0.5f) >= 0.25f)
+            {
+                result.rayOrigin = frontOrigin;
+                ScatterLambertian(result, vec3(0.7f), hitInfo.worldNormal, pathSampler);
+            }
+            else
+            {
+                result.rayOrigin = backOrigin;
+                ScatterDelta(result, vec3(1.0f), hitInfo.worldRayDirection);
+            }
+            break;
+        case 6:
+        {
+            result.rayOrigin = frontOrigin;
+            const float scaleFactor = 80.0f;
+            const vec3  perturbationAmount = 0.03f
+                                            * vec3(std::sin(scaleFactor * hitInfo.worldPosition.x),  //
+                                                   std::sin(scaleFactor * hitInfo.worldPosition.y),  //
+                                                   std::sin(scaleFactor * hitInfo.worldPosition.z));
+            const vec3  shadingNormal = nvmath::normalize(hitInfo.worldNormal + perturbationAmount);
+            BsdfSample  lobeSample;
+            if (Sample1D(pathSampler, SAMPLE_LOBE) < 0.4f)
+            {
+                lobeSample = SampleDelta(vec3(0.7f), Reflect(hitInfo.worldRayDirection, shadingNormal));
+            }
+            else
+            {
+                lobeSample = SampleLambertian(vec3(0.7f), shadingNormal, Sample2D(pathSampler, SAMPLE_DIRECTION));
+            }
+            vec3 direction = lobeSample.direction;
+            if (nvmath::dot(direction, hitInfo.worldNormal) <= 0.0f)
+            {
+                direction = Reflect(direction, hitInfo.worldNormal);
+            }
+            ScatterDelta(result, lobeSample.weight, direction);
+            break;
+        }
+        case 7:
+        {
+            const float primitiveID = float(hitInfo.primitiveID);
+            const vec3  albedo(std::min(primitiveID / 36.0f, 1.0f), std::min(primitiveID / 9.0f, 1.0f), std::min(primitiveID / 18.0f, 1.0f));
+            result.rayOrigin = frontOrigin;
+            ScatterLambertian(result, albedo, hitInfo.worldNormal, pathSampler);
+            break;
+        }
+        default:
+            if (Mod(nvmath::length(hitInfo.objectPosition), 0.2f) >= 0.05f)
+            {
+                result.rayOrigin = frontOrigin;
+                ScatterLambertian(result, vec3(0.7f), hitInfo.worldNormal, pathSampler);
+            }
+            else
+            {
+                result.rayOrigin = backOrigin;
+                ScatterDelta(result, vec3(1.0f), hitInfo.worldRayDirection);
+            }
+            break;
+    }
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+// lights.h
+
+struct LightSample
+{
+    vec3  direction;
+    float distance;
+    vec3  radiance;
+    float pdf;
+};
+
+float LightPdf(const LightTableHeader& lightHeader, const vec3& emission, float distance, float cosLight)
+{
+    if (lightHeader.numTriangles == 0 || cosLight <= 0.0f)
+    {
+        return 0.0f;
+    }
+    const float areaPdf = Luminance(emission) / lightHeader.totalPower;
+    return areaPdf * distance * distance / cosLight;
+}
+
+bool SampleLight(const std::vector<EmissiveTriangle>& lightTriangles, const LightTableHeader& lightHeader, const vec3& position,
+    const PathSampler& pathSampler, LightSample& lightSample)
+{
+    const uint32_t numTriangles = lightHeader.numTriangles;
+    if (numTriangles == 0)
+    {
+        return false;
+    }
+
+    const nvmath::vec2f pick = Sample2D(pathSampler, SAMPLE_LIGHT_PICK);
+    uint32_t            triangle = std::min(static_cast<uint32_t>(pick.x * float(numTriangles)), numTriangles - 1);
+    if (pick.y >= lightTriangles[triangle].keepProbability)
+    {
+        triangle = lightTriangles[triangle].alias;
+    }
+    const EmissiveTriangle& light = lightTriangles[triangle];
+
+    const nvmath::vec2f point = Sample2D(pathSampler, SAMPLE_LIGHT_POINT);
+    const float         sqrtU = std::sqrt(point.x);
+    const float         v = point.y;
+    const vec3          lightPosition = light.v0 + sqrtU * (1.0f - v) * light.edge1 + sqrtU * v * light.edge2;
+
+    const vec3 toLight = lightPosition - position;
+    lightSample.distance = nvmath::length(toLight);
+    if (lightSample.distance <= 0.0f)
+    {
+        return false;
+    }
+    lightSample.direction = toLight / lightSample.distance;
+    const vec3  lightNormal = nvmath::normalize(nvmath::cross(light.edge1, light.edge2));
+    const float cosLight = std::abs(nvmath::dot(lightNormal, lightSample.direction));
+    lightSample.radiance = light.emission;
+    lightSample.pdf = LightPdf(lightHeader, light.emission, lightSample.distance, cosLight);
+    return lightSample.pdf > 0.0f;
+}
+
+float PowerHeuristic(float pdf, float otherPdf)
+{
+    const float pdf2 = pdf * pdf;
+    return pdf2 / (pdf2 + otherPdf * otherPdf);
+}
+
+vec3 LightSampleRadiance(const LightSample& lightSample, const vec3& bsdfCos, float scatterPdf)
+{
+    return bsdfCos * lightSample.radiance * (PowerHeuristic(lightSample.pdf, scatterPdf) / lightSample.pdf);
+}
+
+float EmissionMisWeight(float scatterPdf, float emissionLightPdf)
+{
+    if (scatterPdf <= 0.0f)
+    {
+        return 1.0f;
+    }
+    return PowerHeuristic(scatterPdf, emissionLightPdf);
+}
+}  // namespace
+
+void CpuTracer::init(const MeshFile& mesh, const std::vector<AccelInstance>& instances, const std::vector<EmissiveTriangle>& lights,
+    const LightTableHeader& lightHeader, ThreadPool& threadPool, bool wideBvh, const std::string& meshBvhFilename)
+{
+    // Copy the mesh's triangles with the data of their shapes, since the
+    // mesh may be unmapped after this:
+    m_meshTriangles.clear();
+    const float*    vertices = mesh.vertices();
+    const uint32_t* indices = mesh.indices();
+    for (const ObjShape& shape : mesh.shapes())
+    {
+        for (uint32_t index = shape.firstIndex; index < shape.firstIndex + shape.numIndices; index += 3)
+        {
+            MeshTriangle triangle;
+            for (uint32_t corner = 0; corner < 3; corner++)
+            {
+                const float* vertex = vertices + 3 * size_t(indices[index + corner]);
+                triangle.vertices[corner] = vec3(vertex[0], vertex[1], vertex[2]);
+            }
+            triangle.emission = vec3(shape.emission[0], shape.emission[1], shape.emission[2]);
+            triangle.primitiveID = static_cast<int>((index - shape.firstIndex) / 3);
+            m_meshTriangles.push_back(triangle);
+        }
+    }
+
+    // Build one BVH over the mesh in object space, and a top-level BVH over
+    // its instances, like the BLAS and the TLAS:
+    std::vector<float> meshPositions;
+    meshPositions.reserve(m_meshTriangles.size() * 9);
+    for (const MeshTriangle& triangle : m_meshTriangles)
+    {
+        for (const vec3& vertex : triangle.vertices)
+        {
+            meshPositions.insert(meshPositions.end(), { vertex.x, vertex.y, vertex.z });
+        }
+    }
+    std::vector<uint32_t> meshIndices(3 * m_meshTriangles.size());
+    for (size_t i = 0; i < meshIndices.size(); i++)
+    {
+        meshIndices[i] = static_cast<uint32_t>(i);
+    }
+    if (meshBvhFilename.empty())
+    {
+        m_meshBvh.build(meshPositions.data(), meshIndices.data(), m_meshTriangles.size(), 0, &threadPool);
+    }
+    else
+    {
+        // m_meshTriangles only depends on the mesh's contents, so its hash identifies them:
+        m_meshBvh.buildCached(meshBvhFilename, mesh.contentHash(), meshPositions.data(), meshIndices.data(),
+                              m_meshTriangles.size(), 0, &threadPool);
+    }
+    if (wideBvh)
+    {
+        m_meshBvh.makeWide();
+    }
+    m_sceneBvh.build({ &m_meshBvh }, instances, &threadPool);
+
+    m_instances.clear();
+    m_instances.reserve(instances.size());
+    for (const AccelInstance& accelInstance : instances)
+    {
+        Instance instance;
+        instance.objectToWorld = accelInstance.transform;
+        instance.worldToObject = nvmath::invert(accelInstance.transform);
+        instance.material = accelInstance.hitGroupId;
+        m_instances.push_back(instance);
+    }
+
+    m_lights = lights;
+    m_lightHeader = lightHeader;
+}
+
+CpuHitInfo CpuTracer::computeHitInfo(const TriangleHit& hit, const vec3& rayDirection, uint32_t& material) const
+{
+    const Instance&     instance = m_instances[hit.instance];
+    const MeshTriangle& triangle = m_meshTriangles[hit.id];
+    material = instance.material;
+
+    CpuHitInfo result;
+    result.worldRayDirection = rayDirection;
+    result.primitiveID = triangle.primitiveID;
+    result.emission = triangle.emission;
+
+    const vec3& v0 = triangle.vertices[0];
+    const vec3& v1 = triangle.vertices[1];
+    const vec3& v2 = triangle.vertices[2];
+    result.objectPosition = v0 * (1.0f - hit.u - hit.v) + v1 * hit.u + v2 * hit.v;
+    result.worldPosition = TransformPoint(instance.objectToWorld, result.objectPosition);
+
+    const vec3 objectNormal = nvmath::cross(v1 - v0, v2 - v0);
+    result.worldNormal = nvmath::normalize(TransformNormal(instance.worldToObject, objectNormal));
+    result.worldNormal = FaceForward(result.worldNormal, rayDirection, result.worldNormal);
+    return result;
+}
+
+vec3 CpuTracer::tracePath(const CpuRenderSettings& settings, uint32_t x, uint32_t y, uint32_t sampleIndex, uint64_t& rays,
+    const TriangleHit* cameraHit) const
+{
+    PathSampler pathSampler = CreateSampler(x, y, sampleIndex, settings.seed);
+    CpuRay      ray = GenerateCameraRay(x, y, settings.width, settings.height, pathSampler);
+
+    vec3     radiance(0.0f);
+    vec3     throughput(1.0f);
+    float    scatterPdf = 0.0f;
+    uint32_t pathSegments = 0;
+    const uint32_t maxSegments = std::min(settings.termination.maxSegments, uint32_t(MAX_PATH_SEGMENTS));
+    for (uint32_t tracedSegments = 0; tracedSegments < maxSegments; tracedSegments++)
+    {
+        pathSampler.bounce = tracedSegments;
+
+        TriangleHit hit;
+        bool        hitSurface;
+        if (tracedSegments == 0 && cameraHit != nullptr)
+        {
+            hit = *cameraHit;
+            hitSurface = (hit.id != ~0u);
+        }
+        else
+        {
+            hit.t = RAY_T_MAX;
+            hitSurface = m_sceneBvh.intersect(ray, 0.0f, hit);
+        }
+        rays++;
+        pathSegments++;
+        if (!hitSurface)
+        {
+            radiance += throughput * SkyColor(ray.direction);
+            break;
+        }
+
+        uint32_t           material;
+        const CpuHitInfo   hitInfo = computeHitInfo(hit, ray.direction, material);
+        const ReturnedInfo returned = ShadeMaterial(material, hitInfo, pathSampler);
+
+        // Add the light the surface emits, weighted against having sampled it
+        // with a light sample at the previous hit:
+        const float emissionLightPdf =
+            LightPdf(m_lightHeader, hitInfo.emission, hit.t, std::abs(nvmath::dot(hitInfo.worldNormal, ray.direction)));
+        radiance += throughput * hitInfo.emission * EmissionMisWeight(scatterPdf, emissionLightPdf);
+        // At diffuse surfaces, also sample a point on a light:
+        LightSample lightSample;
+        if (returned.bsdf.pdf > 0.0f && SampleLight(m_lights, m_lightHeader, returned.rayOrigin, pathSampler, lightSample))
+        {
+            const vec3 lightRadiance = LightSampleRadiance(lightSample,
+                EvaluateLambertian(returned.diffuseAlbedo, returned.diffuseNormal, lightSample.direction),
+                LambertianPdf(returned.diffuseNormal, lightSample.direction));
+            if (lightRadiance.x > 0.0f || lightRadiance.y > 0.0f || lightRadiance.z > 0.0f)
+            {
+                rays++;
+                const CpuRay shadowRay{ returned.rayOrigin, lightSample.direction };
+                if (!m_sceneBvh.occluded(shadowRay, 0.0f, lightSample.distance * 0.999f))
+                {
+                    radiance += throughput * lightRadiance;
+                }
+            }
+        }
+        scatterPdf = returned.bsdf.pdf;
+
+        throughput *= returned.bsdf.weight;
+        if (!RussianRouletteSurvives(pathSegments, settings.termination.rouletteMinSegments, throughput, pathSampler))
+        {
+            break;
+        }
+        ray.origin = returned.rayOrigin;
+        ray.direction = returned.bsdf.direction;
+    }
+    return radiance;
+}
+
+uint32_t CpuTracer::traceCameraPacket(const CpuRenderSettings& settings, uint32_t blockX, uint32_t blockY, uint32_t sampleIndex,
+    TriangleHit hits[RAY_PACKET_SIZE]) const
+{
+    const uint32_t blockWidth = std::min(RAY_PACKET_WIDTH, settings.width - blockX);
+    const uint32_t blockHeight = std::min(RAY_PACKET_WIDTH, settings.height - blockY);
+    RayPacket      packet;
+    packet.numRays = blockWidth * blockHeight;
+    for (uint32_t ray = 0; ray < packet.numRays; ray++)
+    {
+        const uint32_t x = blockX + ray % blockWidth;
+        const uint32_t y = blockY + ray / blockWidth;
+        packet.rays[ray] = GenerateCameraRay(x, y, settings.width, settings.height, CreateSampler(x, y, sampleIndex, settings.seed));
+        hits[ray] = TriangleHit();
+        hits[ray].t = RAY_T_MAX;
+    }
+    packet.prepare();
+    m_sceneBvh.intersectPacket(packet, 0.0f, hits);
+    return packet.numRays;
+}
+
+CpuRenderStats CpuTracer::render(const CpuRenderSettings& settings, ThreadPool& threadPool, std::vector<float>& rgb) const
+{
+    rgb.assign(size_t(settings.width) * settings.height * 3, 0.0f);
+    const uint32_t tilesWide = (settings.width + TILE_SIZE - 1) / TILE_SIZE;
+    const uint32_t tilesHigh = (settings.height + TILE_SIZE - 1) / TILE_SIZE;
+
+    std::atomic<uint64_t> rays{ 0 };
+    const auto            startTime = std::chrono::steady_clock::now();
+    threadPool.parallelFor(size_t(tilesWide) * tilesHigh, [&](size_t tile) {
+        const uint32_t tileX = static_cast<uint32_t>(tile % tilesWide) * TILE_SIZE;
+        const uint32_t tileY = static_cast<uint32_t>(tile / tilesWide) * TILE_SIZE;
+        uint64_t       tileRays = 0;
+        const auto     writePixel = [&](uint32_t x, uint32_t y, const vec3& summedPixelColor) {
+            const vec3 pixelColor = summedPixelColor / float(std::max(settings.samplesPerPixel, 1u));
+            float*     output = rgb.data() + 3 * (size_t(y) * settings.width + x);
+            output[0] = pixelColor.x;
+            output[1] = pixelColor.y;
+            output[2] = pixelColor.z;
+        };
+        if (settings.cameraPackets)
+        {
+            // Trace the camera rays of each block of the tile together, and
+            // the rest of each path on its own:
+            for (uint32_t blockY = tileY; blockY < std::min(tileY + TILE_SIZE, settings.height); blockY += RAY_PACKET_WIDTH)
+            {
+                for (uint32_t blockX = tileX; blockX < std::min(tileX + TILE_SIZE, settings.width); blockX += RAY_PACKET_WIDTH)
+                {
+                    const uint32_t blockWidth = std::min(RAY_PACKET_WIDTH, settings.width - blockX);
+                    vec3           summedPixelColors[RAY_PACKET_SIZE];
+                    std::fill(summedPixelColors, summedPixelColors + RAY_PACKET_SIZE, vec3(0.0f));
+                    uint32_t numPixels = 0;
+                    for (uint32_t sampleIndex = 0; sampleIndex < settings.samplesPerPixel; sampleIndex++)
+                    {
+                        TriangleHit hits[RAY_PACKET_SIZE];
+                        numPixels = traceCameraPacket(settings, blockX, blockY, sampleIndex, hits);
+                        for (uint32_t pixel = 0; pixel < numPixels; pixel++)
+                        {
+                            const uint32_t x = blockX + pixel % blockWidth;
+                            const uint32_t y = blockY + pixel / blockWidth;
+                            summedPixelColors[pixel] += tracePath(settings, x, y, sampleIndex, tileRays, &hits[pixel]);
+                        }
+                    }
+                    for (uint32_t pixel = 0; pixel < numPixels; pixel++)
+                    {
+                        writePixel(blockX + pixel % blockWidth, blockY + pixel / blockWidth, summedPixelColors[pixel]);
+                    }
+                }
+            }
+        }
+        else
+        {
+            for (uint32_t y = tileY; y < std::min(tileY + TILE_SIZE, settings.height); y++)
+            {
+                for (uint32_t x = tileX; x < std::min(tileX + TILE_SIZE, settings.width); x++)
+                {
+                    vec3 summedPixelColor(0.0f);
+                    for (uint32_t sampleIndex = 0; sampleIndex < settings.samplesPerPixel; sampleIndex++)
+                    {
+                        summedPixelColor += tracePath(settings, x, y, sampleIndex, tileRays);
+                    }
+                    writePixel(x, y, summedPixelColor);
+                }
+            }
+        }
+        rays += tileRays;
+    });
+
+    CpuRenderStats stats;
+    stats.rays = rays;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    stats.threads = threadPool.getConcurrency();
+    return stats;
+}
+
+CpuRenderStats CpuTracer::traceCameraRays(const CpuRenderSettings& settings, ThreadPool& threadPool, std::vector<float>& depth) const
+{
+    depth.assign(size_t(settings.width) * settings.height, 0.0f);
+    const uint32_t blocksWide = (settings.width + RAY_PACKET_WIDTH - 1) / RAY_PACKET_WIDTH;
+    const uint32_t blocksHigh = (settings.height + RAY_PACKET_WIDTH - 1) / RAY_PACKET_WIDTH;
+
+    const auto startTime = std::chrono::steady_clock::now();
+    threadPool.parallelFor(size_t(blocksWide) * blocksHigh, [&](size_t block) {
+        const uint32_t blockX = static_cast<uint32_t>(block % blocksWide) * RAY_PACKET_WIDTH;
+        const uint32_t blockY = static_cast<uint32_t>(block / blocksWide) * RAY_PACKET_WIDTH;
+        const uint32_t blockWidth = std::min(RAY_PACKET_WIDTH, settings.width - blockX);
+        const uint32_t numPixels = blockWidth * std::min(RAY_PACKET_WIDTH, settings.height - blockY);
+        float          summedDepths[RAY_PACKET_SIZE] = {};
+        for (uint32_t sampleIndex = 0; sampleIndex < settings.samplesPerPixel; sampleIndex++)
+        {
+            TriangleHit hits[RAY_PACKET_SIZE];
+            if (settings.cameraPackets)
+            {
+                traceCameraPacket(settings, blockX, blockY, sampleIndex, hits);
+            }
+            else
+            {
+                for (uint32_t pixel = 0; pixel < numPixels; pixel++)
+                {
+                    const uint32_t x = blockX + pixel % blockWidth;
+                    const uint32_t y = blockY + pixel / blockWidth;
+                    const PathSampler pathSampler = CreateSampler(x, y, sampleIndex, settings.seed);
+                    hits[pixel].t = RAY_T_MAX;
+                    m_sceneBvh.intersect(GenerateCameraRay(x, y, settings.width, settings.height, pathSampler), 0.0f, hits[pixel]);
+                }
+            }
+            for (uint32_t pixel = 0; pixel < numPixels; pixel++)
+            {
+                summedDepths[pixel] += (hits[pixel].id != ~0u) ? hits[pixel].t : 0.0f;
+            }
+        }
+        for (uint32_t pixel = 0; pixel < numPixels; pixel++)
+        {
+            const uint32_t x = blockX + pixel % blockWidth;
+            const uint32_t y = blockY + pixel / blockWidth;
+            depth[size_t(y) * settings.width + x] = summedDepths[pixel] / float(std::max(settings.samplesPerPixel, 1u));
+        }
+    });
+
+    CpuRenderStats stats;
+    stats.rays = uint64_t(settings.width) * settings.height * settings.samplesPerPixel;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    stats.threads = threadPool.getConcurrency();
+    return stats;
+}
@@ -0,0 +1,121 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_CPU_TRACER_HPP
+#define VK_MINI_PATH_TRACER_CPU_TRACER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "accel_builder.hpp"  // For AccelInstance
+#include "common.h"
+#include "instance_bvh.hpp"
+#include "ray_packets.hpp"
+#include "triangle_packs.hpp"
+
+class MeshFile;
+class ThreadPool;
+struct CpuHitInfo;  // The C++ equivalent of HitInfo in materials.h
+
+// What the CPU tracer renders.
+struct CpuRenderSettings
+{
+    uint32_t        width = 800;
+    uint32_t        height = 600;
+    uint32_t        samplesPerPixel = 64;
+    PathTermination termination{ MAX_PATH_SEGMENTS, 3 };
+    uint32_t        seed = 0;  // Seed of the sample sequences (see Sampler in shaders/shaderCommon.h)
+    bool            cameraPackets = false;  // Trace the camera rays of each 8x8 pixel block as a RayPacket
+};
+
+// How long a CPU render took.
+struct CpuRenderStats
+{
+    uint64_t rays = 0;  // Camera rays, rays from previous hits, and shadow rays
+    double   seconds = 0.0;
+    unsigned threads = 0;  // Number of threads that traced rays
+};
+
+// CpuTracer renders the same image as the GPU tracers without a GPU, for
+// machines without ray tracing hardware, and as a reference to compare the
+// GPU tracers against.
+//
+// It's a C++ port of raytrace.rgen.glsl and the shaders it includes: the same
+// camera, materials (see materials.h), next-event estimation with MIS (see
+// lights.h), and Russian roulette, with the random sampler (SAMPLER_RANDOM).
+// Its images match the GPU tracers' up to noise, and with the same seed and
+// sampler, the same sample of a pixel traces the same path up to floating-
+// point differences. Rays are traced through a two-level InstanceBvh, with
+// one binned-SAH BVH over the mesh (optionally collapsed to 8-wide nodes)
+// whose leaves are packs of 8 triangles intersected with AVX2, and tiles of
+// the image are spread across a thread pool. With cameraPackets, the camera
+// rays of each 8x8 pixel block are traced together as a RayPacket, and each
+// path continues from its camera ray's hit one ray at a time.
+class CpuTracer
+{
+public:
+    // Sets up the scene: `instances` of `mesh` (the BLAS with ID 0), lit by
+    // the sky and by the emissive triangles `lights`, which are the contents
+    // of the light buffer for the same instances (see LightTable::buildTriangles()).
+    // Builds the BVHs with `threadPool`, and collapses the mesh's BVH into
+    // 8-wide nodes (see TriangleBvh::makeWide()) if `wideBvh` is true. If
+    // `meshBvhFilename` isn't empty, loads the mesh's BVH from that file
+    // instead if it was saved for the same mesh, or else saves it there (see
+    // TriangleBvh::buildCached()).
+    void init(const MeshFile& mesh, const std::vector<AccelInstance>& instances, const std::vector<EmissiveTriangle>& lights,
+        const LightTableHeader& lightHeader, ThreadPool& threadPool, bool wideBvh = false,
+        const std::string& meshBvhFilename = std::string());
+
+    // The size of the nodes of the mesh's BVH and the top-level BVH.
+    size_t getBvhBytes() const { return m_meshBvh.getNodeBytes() + m_sceneBvh.getNodeBytes(); }
+
+    // Renders an image into `rgb`, with 3 floats per pixel, row by row from
+    // the top, like out.hdr.
+    CpuRenderStats render(const CpuRenderSettings& settings, ThreadPool& threadPool, std::vector<float>& rgb) const;
+    // Traces only the camera rays of every sample, in packets if
+    // settings.cameraPackets is true, and writes the mean distance to their
+    // closest hits (0 for misses) of each pixel into `depth`, row by row from
+    // the top. This measures how fast the tracer traces primary rays.
+    CpuRenderStats traceCameraRays(const CpuRenderSettings& settings, ThreadPool& threadPool, std::vector<float>& depth) const;
+
+private:
+    // A triangle of the mesh in object space.
+    struct MeshTriangle
+    {
+        vec3 vertices[3];
+        vec3 emission;    // From its shape (see GeometryInfo)
+        int  primitiveID;  // Index of the triangle in its shape, like gl_PrimitiveID
+    };
+    struct Instance
+    {
+        nvmath::mat4f objectToWorld;
+        nvmath::mat4f worldToObject;
+        uint32_t      material;  // The hit group index, which picks the material
+    };
+
+    // Traces sample `sampleIndex` of pixel (x, y), and returns its radiance.
+    // Adds the number of rays it traced to `rays`. If `cameraHit` isn't
+    // null, it's the closest hit of the camera ray, which was traced in a packet.
+    vec3 tracePath(const CpuRenderSettings& settings, uint32_t x, uint32_t y, uint32_t sampleIndex, uint64_t& rays,
+        const TriangleHit* cameraHit = nullptr) const;
+    // Traces the camera rays of sample `sampleIndex` of the up to 8x8
+    // pixels from (blockX, blockY) as a packet, and writes their closest
+    // hits into `hits`, row by row. Returns the number of rays.
+    uint32_t traceCameraPacket(const CpuRenderSettings& settings, uint32_t blockX, uint32_t blockY, uint32_t sampleIndex,
+        TriangleHit hits[RAY_PACKET_SIZE]) const;
+    // Gets hit info about the intersection `hit` of a ray with direction
+    // `rayDirection`, like computeHitInfo() in materials.h, and the material
+    // of the instance that was hit.
+    CpuHitInfo computeHitInfo(const TriangleHit& hit, const vec3& rayDirection, uint32_t& material) const;
+
+    std::vector<MeshTriangle>     m_meshTriangles;
+    std::vector<Instance>         m_instances;
+    // The mesh's triangles in object space; triangle i is m_meshTriangles[i].
+    TriangleBvh                   m_meshBvh;
+    // The instances of m_meshBvh, in the same order as m_instances.
+    InstanceBvh                   m_sceneBvh;
+    std::vector<EmissiveTriangle> m_lights;
+    LightTableHeader              m_lightHeader{};
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_CPU_TRACER_HPP
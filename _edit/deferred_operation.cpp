@@ -0,0 +1,59 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "deferred_operation.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <nvvk/error_vk.hpp>  // For NVVK_CHECK
+#include <thread>
+
+#include "thread_pool.hpp"
+
+VkResult RunDeferredOperation(VkDevice device, ThreadPool& pool, const std::function<VkResult(VkDeferredOperationKHR)>& command)
+{
+    VkDeferredOperationKHR operation;
+    NVVK_CHECK(vkCreateDeferredOperationKHR(device, nullptr, &operation));
+
+    VkResult result = command(operation);
+    if (result == VK_OPERATION_DEFERRED_KHR)
+    {
+        // Each thread joins until the driver says there's no more work for
+        // it. VK_THREAD_IDLE_KHR means there's no work right now, but there
+        // may be more later, usually once other threads finish their parts.
+        // Rather than spin on a core those threads could use, sleep for
+        // exponentially longer between tries, and stop once the operation
+        // is complete.
+        const auto join = [device, operation]() {
+            const std::chrono::microseconds MAX_BACKOFF(1000);
+            std::chrono::microseconds       backoff(20);
+            for (;;)
+            {
+                const VkResult joinResult = vkDeferredOperationJoinKHR(device, operation);
+                if (joinResult != VK_THREAD_IDLE_KHR || vkGetDeferredOperationResultKHR(device, operation) != VK_NOT_READY)
+                {
+                    return;
+                }
+                std::this_thread::sleep_for(backoff);
+                backoff = std::min(backoff * 2, MAX_BACKOFF);
+            }
+        };
+        // The maximum concurrency can be UINT32_MAX (meaning "any number"):
+        const uint32_t maxConcurrency = vkGetDeferredOperationMaxConcurrencyKHR(device, operation);
+        const uint32_t numThreads = std::max(1u, std::min(maxConcurrency, pool.getConcurrency()));
+        TaskGroup      group;
+        for (uint32_t threadIdx = 1; threadIdx < numThreads; threadIdx++)
+        {
+            pool.run(group, join);
+        }
+        join();
+        pool.wait(group);
+        result = vkGetDeferredOperationResultKHR(device, operation);
+    }
+    else if (result == VK_OPERATION_NOT_DEFERRED_KHR)
+    {
+        result = VK_SUCCESS;  // The command finished before returning
+    }
+
+    vkDestroyDeferredOperationKHR(device, operation, nullptr);
+    return result;
+}
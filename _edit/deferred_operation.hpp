@@ -0,0 +1,22 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_DEFERRED_OPERATION_HPP
+#define VK_MINI_PATH_TRACER_DEFERRED_OPERATION_HPP
+
+#include <functional>
+#include <vulkan/vulkan_core.h>
+
+class ThreadPool;
+
+// Runs a deferrable Vulkan command (such as a host acceleration structure
+// build, or vkCreateRayTracingPipelinesKHR) through a
+// VK_KHR_deferred_host_operations operation, and returns its result.
+//
+// `command` is called with a new VkDeferredOperationKHR, and should pass it
+// to the deferrable command and return that command's result. If the driver
+// defers the work, the calling thread and threads from `pool` join the
+// operation with vkDeferredOperationJoinKHR until it completes; the number
+// of threads is limited by vkGetDeferredOperationMaxConcurrencyKHR.
+VkResult RunDeferredOperation(VkDevice device, ThreadPool& pool, const std::function<VkResult(VkDeferredOperationKHR)>& command);
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_DEFERRED_OPERATION_HPP
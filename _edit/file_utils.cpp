@@ -0,0 +1,82 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "file_utils.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <nvvk/structs_vk.hpp>  // For nvvk::make
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <process.h>  // For _getpid
+#include <windows.h>
+#else
+#include <unistd.h>  // For getpid
+#endif
+
+namespace {
+// Returns a temporary file name next to `filename` that no other process,
+// and no other call in this process, uses at the same time.
+std::string GetTempFilename(const std::string& filename)
+{
+    static std::atomic<uint32_t> counter{ 0 };
+#ifdef _WIN32
+    const unsigned long processId = static_cast<unsigned long>(_getpid());
+#else
+    const unsigned long processId = static_cast<unsigned long>(getpid());
+#endif
+    return filename + "." + std::to_string(processId) + "." + std::to_string(counter++) + ".tmp";
+}
+
+// Replaces `to` with `from`. On POSIX, rename() does this atomically; on
+// Windows, it fails if `to` exists, so use MoveFileEx instead.
+bool ReplaceFile(const std::string& from, const std::string& to)
+{
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    return std::rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+}  // namespace
+
+bool WriteFileAtomically(const std::string& filename, const std::function<bool(std::ostream&)>& write)
+{
+    const std::string tempFilename = GetTempFilename(filename);
+    bool              written = false;
+    {
+        std::ofstream file(tempFilename, std::ios::binary | std::ios::trunc);
+        written = file && write(file) && file.flush();
+    }
+    if (!written || !ReplaceFile(tempFilename, filename))
+    {
+        std::remove(tempFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::string GetDeviceFileTag(VkPhysicalDevice physicalDevice, bool withDriverVersion)
+{
+    VkPhysicalDeviceIDProperties idProperties = nvvk::make<VkPhysicalDeviceIDProperties>();
+    VkPhysicalDeviceProperties2  properties2 = nvvk::make<VkPhysicalDeviceProperties2>();
+    properties2.pNext = &idProperties;
+    vkGetPhysicalDeviceProperties2(physicalDevice, &properties2);
+
+    char uuidHex[2 * VK_UUID_SIZE + 1];
+    for (uint32_t i = 0; i < VK_UUID_SIZE; i++)
+    {
+        snprintf(&uuidHex[2 * i], 3, "%02x", idProperties.deviceUUID[i]);
+    }
+    std::string tag = uuidHex;
+    if (withDriverVersion)
+    {
+        char driverVersionHex[9];
+        snprintf(driverVersionHex, sizeof(driverVersionHex), "%08x", properties2.properties.driverVersion);
+        tag = tag + "_" + driverVersionHex;
+    }
+    return tag;
+}
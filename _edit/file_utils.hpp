@@ -0,0 +1,25 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_FILE_UTILS_HPP
+#define VK_MINI_PATH_TRACER_FILE_UTILS_HPP
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vulkan/vulkan_core.h>
+
+// Writes `filename` so that other processes only ever see the old file or
+// the complete new one: `write` writes the contents to a temporary file
+// whose name is unique to this process and call, which then replaces
+// `filename` in one rename. Several processes can save the same cache file
+// at once; the last rename wins. `write` returns false (or leaves the
+// stream failed) to abandon the write, which leaves `filename` untouched.
+// Returns false if the file couldn't be written.
+bool WriteFileAtomically(const std::string& filename, const std::function<bool(std::ostream&)>& write);
+
+// Returns a tag for the names of files that hold data specific to
+// `physicalDevice`: the hex digits of its device UUID, followed by "_" and
+// its driver version in hex if `withDriverVersion` is true.
+std::string GetDeviceFileTag(VkPhysicalDevice physicalDevice, bool withDriverVersion);
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_FILE_UTILS_HPP
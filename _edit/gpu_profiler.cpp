@@ -0,0 +1,179 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "gpu_profiler.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <nvh/nvprint.hpp>      // For nvprintf
+#include <nvvk/error_vk.hpp>    // For NVVK_CHECK
+#include <nvvk/structs_vk.hpp>  // For nvvk::make
+
+void GpuProfiler::init(VkDevice device, VkPhysicalDevice physicalDevice, uint32_t queueFamilyIndex, uint32_t maxSections)
+{
+    m_device = device;
+    m_maxSections = maxSections;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+    m_deviceName = properties.deviceName;
+
+    // Only create the query pool if this queue family supports timestamps:
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+    const uint32_t validBits = queueFamilies[queueFamilyIndex].timestampValidBits;
+    if (validBits == 0)
+    {
+        nvprintf("This queue doesn't support timestamps; GPU phases won't be profiled.\n");
+        return;
+    }
+    m_timestampPeriod = properties.limits.timestampPeriod;
+    m_timestampMask = (validBits >= 64) ? ~uint64_t(0) : ((uint64_t(1) << validBits) - 1);
+
+    VkQueryPoolCreateInfo queryPoolInfo = nvvk::make<VkQueryPoolCreateInfo>();
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = 2 * maxSections;
+    NVVK_CHECK(vkCreateQueryPool(device, &queryPoolInfo, nullptr, &m_queryPool));
+}
+
+void GpuProfiler::deinit()
+{
+    if (m_queryPool != VK_NULL_HANDLE)
+    {
+        vkDestroyQueryPool(m_device, m_queryPool, nullptr);
+        m_queryPool = VK_NULL_HANDLE;
+    }
+}
+
+size_t GpuProfiler::findPhase(const char* name)
+{
+    for (size_t phaseIdx = 0; phaseIdx < m_phases.size(); phaseIdx++)
+    {
+        if (m_phases[phaseIdx].name == name)
+        {
+            return phaseIdx;
+        }
+    }
+    m_phases.push_back({ name, {} });
+    return m_phases.size() - 1;
+}
+
+uint32_t GpuProfiler::beginSection(VkCommandBuffer cmdBuffer, const char* phase)
+{
+    const uint32_t sectionId = static_cast<uint32_t>(m_sections.size());
+    if (m_queryPool == VK_NULL_HANDLE || sectionId >= m_maxSections)
+    {
+        if (m_queryPool != VK_NULL_HANDLE && sectionId == m_maxSections)
+        {
+            nvprintf("GpuProfiler: out of queries; later sections won't be measured.\n");
+            m_sections.push_back({ 0, false });  // So that this message only appears once
+        }
+        return UINT32_MAX;
+    }
+    m_sections.push_back({ findPhase(phase), false });
+    vkCmdResetQueryPool(cmdBuffer, m_queryPool, 2 * sectionId, 2);
+    vkCmdWriteTimestamp(cmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_queryPool, 2 * sectionId);
+    return sectionId;
+}
+
+void GpuProfiler::endSection(VkCommandBuffer cmdBuffer, uint32_t sectionId)
+{
+    if (sectionId == UINT32_MAX)
+    {
+        return;
+    }
+    vkCmdWriteTimestamp(cmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_queryPool, 2 * sectionId + 1);
+    m_sections[sectionId].ended = true;
+}
+
+void GpuProfiler::addSample(const char* phase, double milliseconds)
+{
+    m_phases[findPhase(phase)].samplesMs.push_back(milliseconds);
+}
+
+void GpuProfiler::resolve()
+{
+    const size_t numSections = std::min<size_t>(m_sections.size(), m_maxSections);
+    for (; m_resolvedSections < numSections; m_resolvedSections++)
+    {
+        const Section& section = m_sections[m_resolvedSections];
+        if (!section.ended)
+        {
+            continue;
+        }
+        uint64_t timestamps[2];
+        NVVK_CHECK(vkGetQueryPoolResults(m_device, m_queryPool, static_cast<uint32_t>(2 * m_resolvedSections), 2,
+            sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+        const uint64_t ticks = ((timestamps[1] & m_timestampMask) - (timestamps[0] & m_timestampMask)) & m_timestampMask;
+        m_phases[section.phaseIndex].samplesMs.push_back(double(ticks) * m_timestampPeriod * 1e-6);
+    }
+}
+
+void GpuProfiler::printTable() const
+{
+    nvprintf("%-24s %8s %12s %12s %12s %12s\n", "Phase", "Samples", "Total (ms)", "Mean (ms)", "Min (ms)", "Max (ms)");
+    for (const Phase& phase : m_phases)
+    {
+        if (phase.samplesMs.empty())
+        {
+            continue;
+        }
+        double total = 0.0;
+        for (double sample : phase.samplesMs)
+        {
+            total += sample;
+        }
+        nvprintf("%-24s %8zu %12.3f %12.3f %12.3f %12.3f\n", phase.name.c_str(), phase.samplesMs.size(), total,
+            total / double(phase.samplesMs.size()), *std::min_element(phase.samplesMs.begin(), phase.samplesMs.end()),
+            *std::max_element(phase.samplesMs.begin(), phase.samplesMs.end()));
+    }
+}
+
+bool GpuProfiler::writeJson(const std::string& filename) const
+{
+    std::ofstream file(filename, std::ios::trunc);
+    // Phase names are string literals in this program, but device names
+    // could contain quotes or backslashes, which need escaping in JSON:
+    std::string deviceName;
+    for (char c : m_deviceName)
+    {
+        if (c == '"' || c == '\\')
+        {
+            deviceName += '\\';
+        }
+        deviceName += c;
+    }
+    file << "{\n  \"device\": \"" << deviceName << "\",\n  \"timestampPeriodNs\": " << m_timestampPeriod
+         << ",\n  \"phases\": [";
+    bool firstPhase = true;
+    for (const Phase& phase : m_phases)
+    {
+        if (phase.samplesMs.empty())
+        {
+            continue;
+        }
+        double total = 0.0;
+        for (double sample : phase.samplesMs)
+        {
+            total += sample;
+        }
+        file << (firstPhase ? "\n" : ",\n") << "    {\"name\": \"" << phase.name << "\", \"samples\": " << phase.samplesMs.size()
+             << ", \"totalMs\": " << total << ", \"meanMs\": " << total / double(phase.samplesMs.size())
+             << ", \"minMs\": " << *std::min_element(phase.samplesMs.begin(), phase.samplesMs.end())
+             << ", \"maxMs\": " << *std::max_element(phase.samplesMs.begin(), phase.samplesMs.end()) << ", \"samplesMs\": [";
+        for (size_t sampleIdx = 0; sampleIdx < phase.samplesMs.size(); sampleIdx++)
+        {
+            file << (sampleIdx == 0 ? "" : ", ") << phase.samplesMs[sampleIdx];
+        }
+        file << "]}";
+        firstPhase = false;
+    }
+    file << "\n  ]\n}\n";
+    if (!file)
+    {
+        nvprintf("Could not write %s.\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,73 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_GPU_PROFILER_HPP
+#define VK_MINI_PATH_TRACER_GPU_PROFILER_HPP
+
+#include <string>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+// GpuProfiler measures how long each phase of a render takes on the GPU.
+//
+// Code that records commands brackets each phase with beginSection() and
+// endSection(), which write timestamps to a query pool. Durations that are
+// measured elsewhere (such as the per-batch timestamps of BatchSubmitter, or
+// CPU time for host acceleration structure builds) can be added with
+// addSample(). Once all sections have finished executing, resolve() reads the
+// timestamps; then printTable() and writeJson() summarize every phase, in the
+// order in which each phase first appeared.
+//
+// If the queue family doesn't support timestamps, sections record nothing.
+class GpuProfiler
+{
+public:
+    // `maxSections` is the number of beginSection() calls the profiler can measure.
+    void init(VkDevice device, VkPhysicalDevice physicalDevice, uint32_t queueFamilyIndex, uint32_t maxSections = 256);
+    void deinit();
+
+    // Writes a timestamp when the GPU starts executing the following commands
+    // in `cmdBuffer`. Returns an ID to pass to endSection().
+    uint32_t beginSection(VkCommandBuffer cmdBuffer, const char* phase);
+    // Writes a timestamp when all previous commands in `cmdBuffer` have finished.
+    void endSection(VkCommandBuffer cmdBuffer, uint32_t sectionId);
+
+    // Adds a duration for `phase` that was measured some other way.
+    void addSample(const char* phase, double milliseconds);
+
+    // Reads the timestamps of all sections that haven't been read yet. All
+    // command buffers containing them must have finished executing.
+    void resolve();
+
+    // Prints the number of samples, total, mean, minimum, and maximum time of each phase.
+    void printTable() const;
+    // Writes the same statistics and every sample as JSON. Returns false if
+    // the file couldn't be written.
+    bool writeJson(const std::string& filename) const;
+
+private:
+    struct Phase
+    {
+        std::string         name;
+        std::vector<double> samplesMs;
+    };
+    struct Section
+    {
+        size_t phaseIndex;
+        bool   ended;
+    };
+
+    // Returns the index of the phase called `name`, adding it if needed.
+    size_t findPhase(const char* name);
+
+    VkDevice             m_device = VK_NULL_HANDLE;
+    VkQueryPool          m_queryPool = VK_NULL_HANDLE;  // Two timestamps per section; VK_NULL_HANDLE if unsupported
+    uint32_t             m_maxSections = 0;
+    float                m_timestampPeriod = 1.0f;  // Nanoseconds per timestamp tick
+    uint64_t             m_timestampMask = ~uint64_t(0);
+    std::string          m_deviceName;
+    std::vector<Section> m_sections;
+    size_t               m_resolvedSections = 0;
+    std::vector<Phase>   m_phases;
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_GPU_PROFILER_HPP
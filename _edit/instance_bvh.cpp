@@ -0,0 +1,226 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "instance_bvh.hpp"
+
+#include <cassert>
+
+#include "thread_pool.hpp"
+
+namespace {
+// Instances per leaf of the top-level BVH. Each one costs a ray transform
+// and a traversal of its BLAS, so leaves are small:
+const uint32_t MAX_INSTANCES_PER_LEAF = 2;
+
+vec3 TransformPoint(const nvmath::mat4f& transform, const vec3& point)
+{
+    const nvmath::vec4f result = transform * nvmath::vec4f(point.x, point.y, point.z, 1.0f);
+    return vec3(result.x, result.y, result.z);
+}
+
+vec3 TransformVector(const nvmath::mat4f& transform, const vec3& vector)
+{
+    const nvmath::vec4f result = transform * nvmath::vec4f(vector.x, vector.y, vector.z, 0.0f);
+    return vec3(result.x, result.y, result.z);
+}
+}  // namespace
+
+void InstanceBvh::build(const std::vector<const TriangleBvh*>& blases, const std::vector<AccelInstance>& instances,
+    ThreadPool* threadPool)
+{
+    m_instances.resize(instances.size());
+    std::vector<BvhBounds> bounds(instances.size());
+    const auto             placeInstance = [&](size_t i) {
+        const AccelInstance& accelInstance = instances[i];
+        assert(accelInstance.blasId < blases.size());
+        Instance& instance = m_instances[i];
+        instance.worldToObject = nvmath::invert(accelInstance.transform);
+        instance.blas = blases[accelInstance.blasId];
+
+        // The world-space bounds of the instance are the bounds of the
+        // corners of its BLAS's bounds:
+        const BvhBounds blasBounds = instance.blas->getBounds();
+        if (blasBounds.min[0] > blasBounds.max[0])
+        {
+            return;  // An empty BLAS; leave the bounds empty
+        }
+        for (int corner = 0; corner < 8; corner++)
+        {
+            const vec3 objectCorner((corner & 1) ? blasBounds.max[0] : blasBounds.min[0],
+                                    (corner & 2) ? blasBounds.max[1] : blasBounds.min[1],
+                                    (corner & 4) ? blasBounds.max[2] : blasBounds.min[2]);
+            const vec3  worldCorner = TransformPoint(accelInstance.transform, objectCorner);
+            const float point[3] = { worldCorner.x, worldCorner.y, worldCorner.z };
+            bounds[i].grow(point);
+        }
+    };
+    if (threadPool != nullptr)
+    {
+        threadPool->parallelFor(instances.size(), placeInstance);
+    }
+    else
+    {
+        for (size_t i = 0; i < instances.size(); i++)
+        {
+            placeInstance(i);
+        }
+    }
+
+    Bvh bvh = BuildBvh(bounds, MAX_INSTANCES_PER_LEAF, threadPool);
+    m_nodes = std::move(bvh.nodes);
+    m_leafInstances = std::move(bvh.primitives);
+}
+
+CpuRay InstanceBvh::toObjectSpace(const Instance& instance, const CpuRay& ray)
+{
+    return CpuRay{ TransformPoint(instance.worldToObject, ray.origin), TransformVector(instance.worldToObject, ray.direction) };
+}
+
+bool InstanceBvh::intersect(const CpuRay& ray, float tMin, TriangleHit& hit) const
+{
+    if (m_nodes.empty())
+    {
+        return false;
+    }
+    const float  origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+    const float  direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+    const BvhRay bvhRay(origin, direction);
+
+    // The same front-to-back traversal as TriangleBvh::intersect(), with
+    // instances in the leaves:
+    struct StackEntry
+    {
+        uint32_t node;
+        float    tEntry;
+    };
+    StackEntry stack[BVH_STACK_SIZE];
+    int        stackSize = 0;
+    float      rootEntry;
+    if (IntersectBvhNode(m_nodes[0], bvhRay, tMin, hit.t, rootEntry))
+    {
+        stack[stackSize++] = { 0, rootEntry };
+    }
+    bool found = false;
+    while (stackSize > 0)
+    {
+        const StackEntry entry = stack[--stackSize];
+        if (entry.tEntry > hit.t)
+        {
+            continue;
+        }
+        uint32_t nodeIndex = entry.node;
+        while (true)
+        {
+            const BvhNode& node = m_nodes[nodeIndex];
+            if (node.isLeaf())
+            {
+                for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+                {
+                    const uint32_t  instanceIndex = m_leafInstances[i];
+                    const Instance& instance = m_instances[instanceIndex];
+                    if (instance.blas->intersect(toObjectSpace(instance, ray), tMin, hit))
+                    {
+                        hit.instance = instanceIndex;
+                        found = true;
+                    }
+                }
+                break;
+            }
+            uint32_t   nearChild = nodeIndex + 1;
+            uint32_t   farChild = node.offset;
+            float      nearEntry, farEntry;
+            const bool hitNear = IntersectBvhNode(m_nodes[nearChild], bvhRay, tMin, hit.t, nearEntry);
+            const bool hitFar = IntersectBvhNode(m_nodes[farChild], bvhRay, tMin, hit.t, farEntry);
+            if (hitNear && hitFar)
+            {
+                if (farEntry < nearEntry)
+                {
+                    std::swap(nearChild, farChild);
+                    std::swap(nearEntry, farEntry);
+                }
+                assert(stackSize < BVH_STACK_SIZE);
+                stack[stackSize++] = { farChild, farEntry };
+                nodeIndex = nearChild;
+            }
+            else if (hitNear || hitFar)
+            {
+                nodeIndex = hitNear ? nearChild : farChild;
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+void InstanceBvh::intersectPacket(const RayPacket& packet, float tMin, TriangleHit* hits) const
+{
+    TraversePacket(m_nodes, packet, 0, tMin, hits, [&](const BvhNode& leaf, uint32_t firstActive) {
+        uint64_t updated = 0;
+        for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; i++)
+        {
+            const uint32_t  instanceIndex = m_leafInstances[i];
+            const Instance& instance = m_instances[instanceIndex];
+            // Rays from one origin still share one in object space. Rays
+            // before firstActive missed this leaf, so they're left out:
+            RayPacket objectPacket;
+            objectPacket.numRays = packet.numRays;
+            for (uint32_t ray = firstActive; ray < packet.numRays; ray++)
+            {
+                objectPacket.rays[ray] = toObjectSpace(instance, packet.rays[ray]);
+            }
+            objectPacket.prepare(firstActive);
+            const uint64_t instanceHits = instance.blas->intersectPacket(objectPacket, firstActive, tMin, hits);
+            updated |= instanceHits;
+            for (uint32_t ray = firstActive; ray < packet.numRays; ray++)
+            {
+                if ((instanceHits & (uint64_t(1) << ray)) != 0)
+                {
+                    hits[ray].instance = instanceIndex;
+                }
+            }
+        }
+        return updated;
+    });
+}
+
+bool InstanceBvh::occluded(const CpuRay& ray, float tMin, float tMax) const
+{
+    if (m_nodes.empty())
+    {
+        return false;
+    }
+    const float  origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+    const float  direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+    const BvhRay bvhRay(origin, direction);
+
+    uint32_t stack[BVH_STACK_SIZE];
+    int      stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        const BvhNode& node = m_nodes[stack[--stackSize]];
+        float          tEntry;
+        if (!IntersectBvhNode(node, bvhRay, tMin, tMax, tEntry))
+        {
+            continue;
+        }
+        if (node.isLeaf())
+        {
+            for (uint32_t i = node.offset; i < node.offset + node.count; i++)
+            {
+                const Instance& instance = m_instances[m_leafInstances[i]];
+                if (instance.blas->occluded(toObjectSpace(instance, ray), tMin, tMax))
+                {
+                    return true;
+                }
+            }
+            continue;
+        }
+        assert(stackSize + 2 <= BVH_STACK_SIZE);
+        stack[stackSize++] = node.offset;
+        stack[stackSize++] = static_cast<uint32_t>(&node - m_nodes.data()) + 1;
+    }
+    return false;
+}
@@ -0,0 +1,69 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_INSTANCE_BVH_HPP
+#define VK_MINI_PATH_TRACER_INSTANCE_BVH_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "accel_builder.hpp"  // For AccelInstance
+#include "cpu_bvh.hpp"
+#include "ray_packets.hpp"
+#include "triangle_packs.hpp"
+
+class ThreadPool;
+
+// A two-level acceleration structure for the CPU tracer, with the same
+// instance model as the GPU's TLAS and BLASes: each unique mesh has one
+// TriangleBvh in object space (the "BLAS"), and a top-level BVH over the
+// world-space bounds of the instances points to them. Rays that reach an
+// instance are transformed into its object space and traced through its
+// mesh's BVH, so an instance costs a transform and a top-level leaf instead
+// of a copy of its mesh's triangles.
+class InstanceBvh
+{
+public:
+    // Builds the top-level BVH over `instances`, which are the same list
+    // AccelBuilder::buildTlas() takes; the instance with blasId i is an
+    // instance of `blases[i]`, which must outlive this InstanceBvh. Builds
+    // in parallel on `threadPool`, if it isn't null.
+    void build(const std::vector<const TriangleBvh*>& blases, const std::vector<AccelInstance>& instances,
+        ThreadPool* threadPool = nullptr);
+
+    // Finds the closest intersection with tMin < t < hit.t, as
+    // TriangleBvh::intersect() does, and also sets hit.instance. `hit.id`
+    // is the ID of the triangle in its BLAS, and `hit.t` is a distance
+    // along `ray` in world space.
+    bool intersect(const CpuRay& ray, float tMin, TriangleHit& hit) const;
+    // Returns true if any instance intersects the ray with tMin < t < tMax.
+    bool occluded(const CpuRay& ray, float tMin, float tMax) const;
+    // Finds the closest intersection of every ray of `packet`, like
+    // intersect() does into hits[ray]. The top-level BVH is traversed with
+    // TraversePacket(), and the rays that reach an instance are transformed
+    // into its object space as a packet, with a frustum of their own.
+    void intersectPacket(const RayPacket& packet, float tMin, TriangleHit* hits) const;
+
+    // The size of the top-level nodes and instances, without the BLASes.
+    size_t getNodeBytes() const
+    {
+        return m_nodes.size() * sizeof(BvhNode) + m_leafInstances.size() * sizeof(uint32_t) + m_instances.size() * sizeof(Instance);
+    }
+
+private:
+    struct Instance
+    {
+        nvmath::mat4f      worldToObject;
+        const TriangleBvh* blas;
+    };
+
+    // Returns `ray` in the object space of `instance`. The direction isn't
+    // renormalized, so distances along the ray stay the same.
+    static CpuRay toObjectSpace(const Instance& instance, const CpuRay& ray);
+
+    std::vector<BvhNode>  m_nodes;
+    // Leaves point to the indices of their instances here, like Bvh::primitives:
+    std::vector<uint32_t> m_leafInstances;
+    std::vector<Instance> m_instances;
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_INSTANCE_BVH_HPP
@@ -0,0 +1,63 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "launch_tuning.hpp"
+
+#include <fstream>
+#include <nvh/nvprint.hpp>  // For nvprintf
+
+#include "file_utils.hpp"
+
+std::string GetLaunchTuningFilename(VkPhysicalDevice physicalDevice)
+{
+    return "launchtuning_" + GetDeviceFileTag(physicalDevice, false) + ".txt";
+}
+
+bool LoadLaunchTuning(VkPhysicalDevice physicalDevice, LaunchTuning& tuning)
+{
+    const std::string filename = GetLaunchTuningFilename(physicalDevice);
+    std::ifstream     file(filename);
+    if (!file)
+    {
+        return false;
+    }
+
+    // The file has one "<name> <value>" line per parameter:
+    LaunchTuning loaded;
+    std::string  name;
+    uint32_t     value;
+    while (file >> name >> value)
+    {
+        if (name == "workgroupSize")
+        {
+            loaded.workgroupSize = value;
+        }
+        else if (name == "samplesPerBatch")
+        {
+            loaded.samplesPerBatch = value;
+        }
+    }
+    if (loaded.workgroupSize == 0 || loaded.workgroupSize > MAX_WAVEFRONT_WORKGROUP_SIZE  //
+        || loaded.samplesPerBatch == 0 || loaded.samplesPerBatch % WAVEFRONT_SAMPLES_PER_PASS != 0)
+    {
+        nvprintf("Ignoring launch tuning file %s: invalid parameters.\n", filename.c_str());
+        return false;
+    }
+    tuning = loaded;
+    return true;
+}
+
+bool SaveLaunchTuning(VkPhysicalDevice physicalDevice, const LaunchTuning& tuning)
+{
+    const std::string filename = GetLaunchTuningFilename(physicalDevice);
+    const bool        written = WriteFileAtomically(filename, [&](std::ostream& file) {
+        file << "workgroupSize " << tuning.workgroupSize << "\n";
+        file << "samplesPerBatch " << tuning.samplesPerBatch << "\n";
+        return static_cast<bool>(file);
+    });
+    if (!written)
+    {
+        nvprintf("Could not write launch tuning file %s.\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,33 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_LAUNCH_TUNING_HPP
+#define VK_MINI_PATH_TRACER_LAUNCH_TUNING_HPP
+
+#include <cstdint>
+#include <string>
+#include <vulkan/vulkan_core.h>
+
+#include "common.h"
+
+// The launch parameters of the wavefront tracer that are fastest on a
+// device: its workgroup size, and how many samples per pixel each batch
+// traces. Which ones win depends on the GPU (its subgroup size, how many
+// registers the kernels need, and how well it hides the latency of ray
+// queries) as well as on the scene, so --autotune measures them (see
+// RunLaunchTuningBenchmark), and saves the winner to a file named after the
+// device UUID. Later runs on the same device load it at startup.
+struct LaunchTuning
+{
+    uint32_t workgroupSize = DEFAULT_WAVEFRONT_WORKGROUP_SIZE;
+    uint32_t samplesPerBatch = DEFAULT_SAMPLES_PER_BATCH;
+};
+
+// Returns the name of the tuning file of `physicalDevice`.
+std::string GetLaunchTuningFilename(VkPhysicalDevice physicalDevice);
+// Reads the tuning saved for `physicalDevice` into `tuning`. Returns false
+// and leaves `tuning` unchanged if there is none, or it's invalid.
+bool LoadLaunchTuning(VkPhysicalDevice physicalDevice, LaunchTuning& tuning);
+// Saves `tuning` for `physicalDevice`. Returns false if the file couldn't be written.
+bool SaveLaunchTuning(VkPhysicalDevice physicalDevice, const LaunchTuning& tuning);
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_LAUNCH_TUNING_HPP
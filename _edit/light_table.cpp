@@ -0,0 +1,153 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "light_table.hpp"
+
+#include <cstring>
+
+#include "mesh_cache.hpp"
+
+static_assert(sizeof(EmissiveTriangle) == 14 * 4, "EmissiveTriangle must match its scalar layout in GLSL!");
+
+namespace {
+// Returns the luminance of a linear sRGB color, like luminance() in shaderCommon.h.
+float Luminance(const vec3& color)
+{
+    return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+nvmath::vec3f TransformPoint(const nvmath::mat4f& transform, const vec3& point)
+{
+    const nvmath::vec4f result = transform * nvmath::vec4f(point.x, point.y, point.z, 1.0f);
+    return nvmath::vec3f(result.x, result.y, result.z);
+}
+
+// Fills in the alias table of `triangles` with Vose's method, so that
+// picking a slot uniformly and then the slot's triangle or its alias picks
+// triangle i with probability weights[i] / (sum of weights).
+void BuildAliasTable(const std::vector<double>& weights, double totalWeight, std::vector<EmissiveTriangle>& triangles)
+{
+    const size_t        numTriangles = triangles.size();
+    std::vector<double> scaledWeights(numTriangles);  // The average is 1
+    std::vector<size_t> small, large;  // Slots with scaled weights below and at least 1
+    for (size_t i = 0; i < numTriangles; i++)
+    {
+        scaledWeights[i] = weights[i] * double(numTriangles) / totalWeight;
+        (scaledWeights[i] < 1.0 ? small : large).push_back(i);
+    }
+    // Fill each small slot up to 1 with part of a large slot:
+    while (!small.empty() && !large.empty())
+    {
+        const size_t smallSlot = small.back();
+        small.pop_back();
+        const size_t largeSlot = large.back();
+        triangles[smallSlot].keepProbability = static_cast<float>(scaledWeights[smallSlot]);
+        triangles[smallSlot].alias = static_cast<uint32_t>(largeSlot);
+        scaledWeights[largeSlot] -= 1.0 - scaledWeights[smallSlot];
+        if (scaledWeights[largeSlot] < 1.0)
+        {
+            large.pop_back();
+            small.push_back(largeSlot);
+        }
+    }
+    // The remaining slots are full, up to rounding errors:
+    for (const std::vector<size_t>* slots : { &small, &large })
+    {
+        for (size_t slot : *slots)
+        {
+            triangles[slot].keepProbability = 1.0f;
+            triangles[slot].alias = static_cast<uint32_t>(slot);
+        }
+    }
+}
+}  // namespace
+
+void LightTable::deinit()
+{
+    m_allocator->destroy(m_buffer);
+    m_blasEmitters.clear();
+    m_header = LightTableHeader{};
+}
+
+void LightTable::addMeshEmitters(uint32_t blasId, const MeshFile& mesh)
+{
+    if (m_blasEmitters.size() <= blasId)
+    {
+        m_blasEmitters.resize(blasId + 1);
+    }
+    std::vector<ObjectTriangle>& emitters = m_blasEmitters[blasId];
+    const float*                 vertices = mesh.vertices();
+    const uint32_t*              indices = mesh.indices();
+    for (const ObjShape& shape : mesh.shapes())
+    {
+        const vec3 emission(shape.emission[0], shape.emission[1], shape.emission[2]);
+        if (Luminance(emission) <= 0.0f)
+        {
+            continue;
+        }
+        for (uint32_t index = shape.firstIndex; index < shape.firstIndex + shape.numIndices; index += 3)
+        {
+            ObjectTriangle triangle;
+            for (uint32_t corner = 0; corner < 3; corner++)
+            {
+                const float* vertex = vertices + 3 * size_t(indices[index + corner]);
+                triangle.vertices[corner] = vec3(vertex[0], vertex[1], vertex[2]);
+            }
+            triangle.emission = emission;
+            emitters.push_back(triangle);
+        }
+    }
+}
+
+std::vector<EmissiveTriangle> LightTable::buildTriangles(const std::vector<AccelInstance>& instances, LightTableHeader& header) const
+{
+    // Place every instance's emitters in world space, and weight each
+    // triangle by its power:
+    std::vector<EmissiveTriangle> triangles;
+    std::vector<double>           weights;
+    double                        totalWeight = 0.0;
+    for (const AccelInstance& instance : instances)
+    {
+        if (instance.blasId >= m_blasEmitters.size())
+        {
+            continue;
+        }
+        for (const ObjectTriangle& objectTriangle : m_blasEmitters[instance.blasId])
+        {
+            EmissiveTriangle triangle{};
+            triangle.v0 = TransformPoint(instance.transform, objectTriangle.vertices[0]);
+            triangle.edge1 = TransformPoint(instance.transform, objectTriangle.vertices[1]) - triangle.v0;
+            triangle.edge2 = TransformPoint(instance.transform, objectTriangle.vertices[2]) - triangle.v0;
+            triangle.emission = objectTriangle.emission;
+            const double area = 0.5 * double(nvmath::length(nvmath::cross(triangle.edge1, triangle.edge2)));
+            const double weight = area * double(Luminance(triangle.emission));
+            if (weight > 0.0)  // Skip degenerate triangles
+            {
+                triangles.push_back(triangle);
+                weights.push_back(weight);
+                totalWeight += weight;
+            }
+        }
+    }
+    if (!triangles.empty())
+    {
+        BuildAliasTable(weights, totalWeight, triangles);
+    }
+    header.numTriangles = static_cast<uint32_t>(triangles.size());
+    header.totalPower = static_cast<float>(totalWeight);
+    return triangles;
+}
+
+void LightTable::build(VkCommandBuffer cmdBuffer, const std::vector<AccelInstance>& instances)
+{
+    const std::vector<EmissiveTriangle> triangles = buildTriangles(instances, m_header);
+
+    // The buffer is the header followed by the triangles, in scalar layout:
+    std::vector<uint8_t> contents(sizeof(LightTableHeader) + triangles.size() * sizeof(EmissiveTriangle));
+    memcpy(contents.data(), &m_header, sizeof(LightTableHeader));
+    if (!triangles.empty())
+    {
+        memcpy(contents.data() + sizeof(LightTableHeader), triangles.data(), triangles.size() * sizeof(EmissiveTriangle));
+    }
+    m_allocator->destroy(m_buffer);
+    m_buffer = m_allocator->createBuffer(cmdBuffer, contents.size(), contents.data(), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+}
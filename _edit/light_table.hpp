@@ -0,0 +1,62 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_LIGHT_TABLE_HPP
+#define VK_MINI_PATH_TRACER_LIGHT_TABLE_HPP
+
+#include <nvvk/allocator_dedicated_vk.hpp>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+#include "accel_builder.hpp"  // For AccelInstance
+#include "common.h"
+
+class MeshFile;
+
+// LightTable owns the light buffer (see LightTableHeader) that next-event
+// estimation samples: every emissive triangle of every instance, in world
+// space, with an alias table for picking triangles in proportion to their
+// power in constant time.
+//
+// Emissive triangles are the triangles of shapes whose material has a
+// nonzero Ke. Since the mesh is usually unmapped once it's in the BLAS,
+// addMeshEmitters() copies the emissive triangles in object space first, and
+// build() places a copy of them for each instance once the instances are
+// known. Scenes without emissive triangles get a buffer with just the header,
+// and are only lit by the sky.
+class LightTable
+{
+public:
+    void init(nvvk::AllocatorDedicated* allocator) { m_allocator = allocator; }
+    void deinit();
+
+    // Adds the emissive triangles of `mesh` as the emitters of BLAS `blasId`.
+    // Call this before mesh.close().
+    void addMeshEmitters(uint32_t blasId, const MeshFile& mesh);
+    // Builds the light buffer for `instances`, and records its upload to
+    // `cmdBuffer`. Call allocator->finalizeAndReleaseStaging() once the
+    // command buffer has finished.
+    void build(VkCommandBuffer cmdBuffer, const std::vector<AccelInstance>& instances);
+    // Returns the contents of the light buffer for `instances` without
+    // creating it: the triangles with their alias table, and the header in
+    // `header`. This only needs addMeshEmitters(), not init().
+    std::vector<EmissiveTriangle> buildTriangles(const std::vector<AccelInstance>& instances, LightTableHeader& header) const;
+
+    // The buffer to bind at BINDING_LIGHTS.
+    VkBuffer getBuffer() const { return m_buffer.buffer; }
+    uint32_t getNumTriangles() const { return m_header.numTriangles; }
+
+private:
+    // An emissive triangle in object space.
+    struct ObjectTriangle
+    {
+        vec3 vertices[3];
+        vec3 emission;
+    };
+
+    nvvk::AllocatorDedicated*                m_allocator = nullptr;
+    nvvk::BufferDedicated                    m_buffer;
+    LightTableHeader                         m_header{};
+    std::vector<std::vector<ObjectTriangle>> m_blasEmitters;  // Indexed by BLAS ID
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_LIGHT_TABLE_HPP
@@ -1,25 +1,394 @@
 // Copyright 2020 NVIDIA Corporation
 // SPDX-License-Identifier: Apache-2.0
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <random>
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include <fileformats/stb_image_write.h>
-#define TINYOBJLOADER_IMPLEMENTATION
-#include <fileformats/tiny_obj_loader.h>
 #include <nvh/fileoperations.hpp>  // For nvh::loadFile
 #define NVVK_ALLOC_DEDICATED
 #include <nvvk/allocator_vk.hpp>  // For NVVK memory allocators
 #include <nvvk/context_vk.hpp>
 #include <nvvk/descriptorsets_vk.hpp>  // For nvvk::DescriptorSetContainer
-#include <nvvk/raytraceKHR_vk.hpp>     // For nvvk::RaytracingBuilderKHR
 #include <nvvk/shaders_vk.hpp>         // For nvvk::createShaderModule
 #include <nvvk/structs_vk.hpp>         // For nvvk::make
 
+#include "accel_builder.hpp"
+#include "adaptive_sampler.hpp"
+#include "batch_submitter.hpp"
+#include "benchmarks.hpp"
 #include "common.h"
+#include "cpu_tracer.hpp"
+#include "deferred_operation.hpp"
+#include "gpu_profiler.hpp"
+#include "launch_tuning.hpp"
+#include "light_table.hpp"
+#include "mesh_cache.hpp"
+#include "pipeline_cache.hpp"
+#include "pipeline_variants.hpp"
+#include "ray_stats.hpp"
+#include "simd.hpp"
+#include "thread_pool.hpp"
+#include "wavefront_tracer.hpp"
 
-PushConstants  pushConstants;
-const uint32_t render_width = 800;
-const uint32_t render_height = 600;
+// The render traces this many samples per pixel, in as many batches of
+// Options::samplesPerBatch as that takes, so that tuning the batch size only
+// changes the speed and not the image.
+const uint32_t TOTAL_SAMPLES_PER_PIXEL = 32 * DEFAULT_SAMPLES_PER_BATCH;
+
+// Options that can be set from the command line.
+struct Options
+{
+    // Size of the rendered image.
+    uint32_t width = 800;
+    uint32_t height = 600;
+    // Samples per pixel in each batch (a multiple of WAVEFRONT_SAMPLES_PER_PASS).
+    // 0 uses the launch tuning of the device (see launch_tuning.hpp).
+    uint32_t samplesPerBatch = 0;
+    // Size of the tiles that adaptive sampling decides to trace or skip.
+    uint32_t tileWidth = DEFAULT_ADAPTIVE_TILE_WIDTH;
+    uint32_t tileHeight = DEFAULT_ADAPTIVE_TILE_HEIGHT;
+    // Workgroup size of the wavefront tracer's kernels. 0 uses the launch
+    // tuning of the device.
+    uint32_t workgroupSize = 0;
+    // If true, record the sample batch command buffers once and resubmit them
+    // for every batch, instead of recording a new command buffer per batch.
+    bool replayCommandBuffers = false;
+    // If false, create pipelines without a VkPipelineCache (for timing comparisons).
+    bool usePipelineCache = true;
+    // If false, always build BLASes instead of loading serialized ones from disk.
+    bool useAccelCache = true;
+    // If true, build acceleration structures on the CPU with deferred host operations.
+    bool hostAccelBuilds = false;
+    // If true, count rays in the ray generation shader and report Mrays/s for each batch.
+    bool rayStats = false;
+    // If true, trace with the wavefront compute kernels instead of the ray tracing pipeline.
+    bool wavefront = false;
+    // Paths end after this many segments (at most MAX_PATH_SEGMENTS).
+    uint32_t maxDepth = MAX_PATH_SEGMENTS;
+    // Russian roulette starts once a path has this many segments; maxDepth or more turns it off.
+    uint32_t rouletteDepth = 3;
+    // If nonzero, stop tracing each tile once its pixels reach this relative error.
+    float adaptiveError = 0.0f;
+    // If false, the wavefront tracer shades hits without sorting them by material first.
+    bool materialSort = true;
+    // If true, run the material sort benchmark after rendering (implies wavefront).
+    bool benchmarkMaterials = false;
+    // The sample sequence paths draw random numbers from (SAMPLER_RANDOM, SAMPLER_SOBOL, or SAMPLER_BLUE_NOISE).
+    uint32_t sampler = SAMPLER_SOBOL;
+    // If true, run the sampler convergence benchmark after rendering (implies wavefront).
+    bool benchmarkSamplers = false;
+    // If true, run the BSDF sampling benchmark after rendering (implies wavefront).
+    bool benchmarkBsdf = false;
+    // If true, measure the fastest launch parameters after rendering and save them (implies wavefront).
+    bool autotune = false;
+    // The order in which invocations visit pixels (PIXEL_ORDER_LINEAR, PIXEL_ORDER_TILED, or PIXEL_ORDER_MORTON).
+    uint32_t pixelOrder = PIXEL_ORDER_LINEAR;
+    // If true, the wavefront tracer's extend kernel runs persistent threads.
+    bool persistentThreads = false;
+    // If true, run the pixel order benchmark after rendering (implies wavefront).
+    bool benchmarkPixelOrder = false;
+    // How to load the scene's OBJ file.
+    MeshLoadOptions meshLoad;
+    // Where to write the GPU profile of this run.
+    std::string profileFilename = "profile.json";
+    // If nonzero, run the OBJ parser benchmark with this many triangles and exit.
+    uint64_t benchmarkObjTriangles = 0;
+    // If nonzero, run the CPU BVH build benchmark with this many triangles and exit.
+    uint64_t benchmarkBvhTriangles = 0;
+    // If true, render with the CPU tracer instead of Vulkan, and exit.
+    bool cpu = false;
+    // Samples per pixel of a CPU render.
+    uint32_t cpuSamples = 64;
+    // If true, the CPU tracer collapses the mesh's BVH into 8-wide nodes.
+    bool cpuWideBvh = false;
+    // If true, compare the CPU tracer's binary and 8-wide BVHs, and exit.
+    bool benchmarkWideBvh = false;
+    // If true, the CPU tracer traces camera rays in 8x8 packets.
+    bool cpuPackets = false;
+    // If true, compare the CPU tracer's camera rays with and without packets, and exit.
+    bool benchmarkPackets = false;
+};
+
+void PrintUsage()
+{
+    nvprintf("Supported arguments:\n");
+    nvprintf("  --size <w>x<h>       Render a w by h image (default: 800x600)\n");
+    nvprintf("  --samples <n>        Trace n samples per pixel in each batch, a multiple of %d (default: tuned, or %d);\n"
+             "                       the number of batches keeps the total at about %d\n",
+             WAVEFRONT_SAMPLES_PER_PASS, DEFAULT_SAMPLES_PER_BATCH, TOTAL_SAMPLES_PER_PIXEL);
+    nvprintf("  --tile <w>x<h>       Make adaptive sampling's tiles w by h pixels (default: %dx%d)\n",
+             DEFAULT_ADAPTIVE_TILE_WIDTH, DEFAULT_ADAPTIVE_TILE_HEIGHT);
+    nvprintf("  --workgroup-size <n> Run the wavefront kernels with n threads per workgroup, up to %d (default: tuned, or %d)\n",
+             MAX_WAVEFRONT_WORKGROUP_SIZE, DEFAULT_WAVEFRONT_WORKGROUP_SIZE);
+    nvprintf("  --replay             Record sample batch command buffers once and resubmit them\n");
+    nvprintf("  --no-pipeline-cache  Don't load or save the on-disk pipeline cache\n");
+    nvprintf("  --no-as-cache        Build BLASes every run instead of loading them from blascache_*.bin files\n");
+    nvprintf("  --host-as-build      Build acceleration structures on the CPU, using all cores\n");
+    nvprintf("  --ray-stats          Count rays and path lengths on the GPU, and report Mrays/s for each batch\n");
+    nvprintf("  --wavefront          Trace with wavefront compute kernels and ray queries instead of the RT pipeline\n");
+    nvprintf("  --max-depth <n>      End paths after n segments, from 1 to %d (default: %d)\n", MAX_PATH_SEGMENTS, MAX_PATH_SEGMENTS);
+    nvprintf("  --roulette-depth <n> Start Russian roulette after n segments; n >= max depth turns it off (default: 3)\n");
+    nvprintf("  --adaptive <e>       Only trace tiles with a relative error above e (e.g. 0.02), and stop once none are left\n");
+    nvprintf("  --no-material-sort   Don't sort hits by material before shading in the wavefront tracer\n");
+    nvprintf("  --sampler <s>        Draw samples from s: random, sobol (Owen-scrambled Sobol), or blue-noise (default: sobol)\n");
+    nvprintf("  --pixel-order <o>    Visit pixels in order o: linear, tiled (%dx%d tiles), or morton (default: linear)\n",
+             PIXEL_TILE_WIDTH, PIXEL_TILE_HEIGHT);
+    nvprintf("  --persistent-threads Extend wavefront paths with persistent threads that take rays from an atomic counter\n");
+    nvprintf("  --no-mesh-cache      Parse the OBJ file every run instead of using a .vmpmesh file, and build the CPU\n"
+             "                       tracer's BVH instead of loading a .vmpbvh file\n");
+    nvprintf("  --tinyobj            Parse OBJ files with tinyobj instead of the multithreaded parser\n");
+    nvprintf("  --profile-json <f>   Write per-phase GPU times to the JSON file f (default: profile.json)\n");
+    nvprintf("  --benchmark-obj <n>  Compare OBJ parsers on a synthetic mesh with n triangles, then exit\n");
+    nvprintf("  --benchmark-bvh <n>  Time CPU BVH builds over a synthetic mesh with n triangles, then exit\n");
+    nvprintf("  --cpu                Render on the CPU without Vulkan, report Mrays/s per thread, then exit\n");
+    nvprintf("  --cpu-samples <n>    Trace n samples per pixel in a CPU render (default: 64)\n");
+    nvprintf("  --cpu-wide-bvh       Trace CPU renders through 8-wide BVH nodes with quantized child bounds\n");
+    nvprintf("  --benchmark-wide-bvh Compare CPU renders with binary and 8-wide BVHs on the Cornell box and the grid, then exit\n");
+    nvprintf("  --cpu-packets        Trace the camera rays of CPU renders in 8x8 packets with frustum culling\n");
+    nvprintf("  --benchmark-packets  Compare CPU camera rays traced singly and in packets on the Cornell box and the grid, then exit\n");
+    nvprintf("  --benchmark-materials  After rendering, time wavefront shading with and without sorting for 1-64 materials\n");
+    nvprintf("  --benchmark-samplers   After rendering, compare how fast each sampler's error falls against a reference\n");
+    nvprintf("  --benchmark-bsdf       After rendering, compare cosine-weighted and uniform diffuse sampling at equal time\n");
+    nvprintf("  --benchmark-pixel-order After rendering, time the wavefront tracer with each pixel order, with and without\n"
+             "                         persistent threads\n");
+    nvprintf("  --autotune             After rendering, time wavefront workgroup sizes and samples per batch, and save the\n"
+             "                         fastest as the default for this device\n");
+}
+
+Options ParseOptions(int argc, const char** argv)
+{
+    Options options;
+    for (int argIdx = 1; argIdx < argc; argIdx++)
+    {
+        if (strcmp(argv[argIdx], "--size") == 0 && argIdx + 1 < argc)
+        {
+            if (sscanf(argv[++argIdx], "%ux%u", &options.width, &options.height) != 2  //
+                || options.width == 0 || options.height == 0 || options.width > 65535 || options.height > 65535)
+            {
+                nvprintf("--size must be <width>x<height>, from 1x1 to 65535x65535.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[argIdx], "--samples") == 0 && argIdx + 1 < argc)
+        {
+            options.samplesPerBatch = static_cast<uint32_t>(strtoul(argv[++argIdx], nullptr, 10));
+            if (options.samplesPerBatch == 0 || options.samplesPerBatch % WAVEFRONT_SAMPLES_PER_PASS != 0)
+            {
+                nvprintf("--samples must be a positive multiple of %d.\n", WAVEFRONT_SAMPLES_PER_PASS);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[argIdx], "--tile") == 0 && argIdx + 1 < argc)
+        {
+            if (sscanf(argv[++argIdx], "%ux%u", &options.tileWidth, &options.tileHeight) != 2  //
+                || options.tileWidth == 0 || options.tileHeight == 0)
+            {
+                nvprintf("--tile must be <width>x<height>.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[argIdx], "--workgroup-size") == 0 && argIdx + 1 < argc)
+        {
+            options.workgroupSize = static_cast<uint32_t>(strtoul(argv[++argIdx], nullptr, 10));
+            if (options.workgroupSize == 0 || options.workgroupSize > MAX_WAVEFRONT_WORKGROUP_SIZE)
+            {
+                nvprintf("--workgroup-size must be between 1 and %d.\n", MAX_WAVEFRONT_WORKGROUP_SIZE);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[argIdx], "--replay") == 0)
+        {
+            options.replayCommandBuffers = true;
+        }
+        else if (strcmp(argv[argIdx], "--no-pipeline-cache") == 0)
+        {
+            options.usePipelineCache = false;
+        }
+        else if (strcmp(argv[argIdx], "--no-as-cache") == 0)
+        {
+            options.useAccelCache = false;
+        }
+        else if (strcmp(argv[argIdx], "--host-as-build") == 0)
+        {
+            options.hostAccelBuilds = true;
+        }
+        else if (strcmp(argv[argIdx], "--ray-stats") == 0)
+        {
+            options.rayStats = true;
+        }
+        else if (strcmp(argv[argIdx], "--wavefront") == 0)
+        {
+            options.wavefront = true;
+        }
+        else if (strcmp(argv[argIdx], "--max-depth") == 0 && argIdx + 1 < argc)
+        {
+            options.maxDepth = static_cast<uint32_t>(strtoul(argv[++argIdx], nullptr, 10));
+            if (options.maxDepth == 0 || options.maxDepth > MAX_PATH_SEGMENTS)
+            {
+                nvprintf("--max-depth must be between 1 and %d.\n", MAX_PATH_SEGMENTS);
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[argIdx], "--roulette-depth") == 0 && argIdx + 1 < argc)
+        {
+            options.rouletteDepth = static_cast<uint32_t>(strtoul(argv[++argIdx], nullptr, 10));
+        }
+        else if (strcmp(argv[argIdx], "--adaptive") == 0 && argIdx + 1 < argc)
+        {
+            options.adaptiveError = strtof(argv[++argIdx], nullptr);
+            if (!(options.adaptiveError > 0.0f))
+            {
+                nvprintf("--adaptive needs a positive relative error.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[argIdx], "--no-material-sort") == 0)
+        {
+            options.materialSort = false;
+        }
+        else if (strcmp(argv[argIdx], "--sampler") == 0 && argIdx + 1 < argc)
+        {
+            const char* samplerName = argv[++argIdx];
+            if (strcmp(samplerName, "random") == 0)
+            {
+                options.sampler = SAMPLER_RANDOM;
+            }
+            else if (strcmp(samplerName, "sobol") == 0)
+            {
+                options.sampler = SAMPLER_SOBOL;
+            }
+            else if (strcmp(samplerName, "blue-noise") == 0)
+            {
+                options.sampler = SAMPLER_BLUE_NOISE;
+            }
+            else
+            {
+                nvprintf("--sampler must be random, sobol, or blue-noise.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[argIdx], "--benchmark-materials") == 0)
+        {
+            options.benchmarkMaterials = true;
+            options.wavefront = true;
+        }
+        else if (strcmp(argv[argIdx], "--benchmark-samplers") == 0)
+        {
+            options.benchmarkSamplers = true;
+            options.wavefront = true;
+        }
+        else if (strcmp(argv[argIdx], "--benchmark-bsdf") == 0)
+        {
+            options.benchmarkBsdf = true;
+            options.wavefront = true;
+        }
+        else if (strcmp(argv[argIdx], "--pixel-order") == 0 && argIdx + 1 < argc)
+        {
+            const char* orderName = argv[++argIdx];
+            if (strcmp(orderName, "linear") == 0)
+            {
+                options.pixelOrder = PIXEL_ORDER_LINEAR;
+            }
+            else if (strcmp(orderName, "tiled") == 0)
+            {
+                options.pixelOrder = PIXEL_ORDER_TILED;
+            }
+            else if (strcmp(orderName, "morton") == 0)
+            {
+                options.pixelOrder = PIXEL_ORDER_MORTON;
+            }
+            else
+            {
+                nvprintf("--pixel-order must be linear, tiled, or morton.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[argIdx], "--persistent-threads") == 0)
+        {
+            options.persistentThreads = true;
+        }
+        else if (strcmp(argv[argIdx], "--benchmark-pixel-order") == 0)
+        {
+            options.benchmarkPixelOrder = true;
+            options.wavefront = true;
+        }
+        else if (strcmp(argv[argIdx], "--autotune") == 0)
+        {
+            options.autotune = true;
+            options.wavefront = true;
+        }
+        else if (strcmp(argv[argIdx], "--no-mesh-cache") == 0)
+        {
+            options.meshLoad.useCache = false;
+        }
+        else if (strcmp(argv[argIdx], "--tinyobj") == 0)
+        {
+            options.meshLoad.useTinyObj = true;
+        }
+        else if (strcmp(argv[argIdx], "--profile-json") == 0 && argIdx + 1 < argc)
+        {
+            options.profileFilename = argv[++argIdx];
+        }
+        else if (strcmp(argv[argIdx], "--benchmark-obj") == 0 && argIdx + 1 < argc)
+        {
+            options.benchmarkObjTriangles = strtoull(argv[++argIdx], nullptr, 10);
+            if (options.benchmarkObjTriangles == 0)
+            {
+                nvprintf("--benchmark-obj needs a positive number of triangles.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[argIdx], "--benchmark-bvh") == 0 && argIdx + 1 < argc)
+        {
+            options.benchmarkBvhTriangles = strtoull(argv[++argIdx], nullptr, 10);
+            if (options.benchmarkBvhTriangles == 0)
+            {
+                nvprintf("--benchmark-bvh needs a positive number of triangles.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[argIdx], "--cpu") == 0)
+        {
+            options.cpu = true;
+        }
+        else if (strcmp(argv[argIdx], "--cpu-samples") == 0 && argIdx + 1 < argc)
+        {
+            options.cpuSamples = static_cast<uint32_t>(strtoul(argv[++argIdx], nullptr, 10));
+            if (options.cpuSamples == 0)
+            {
+                nvprintf("--cpu-samples needs a positive number of samples.\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (strcmp(argv[argIdx], "--cpu-wide-bvh") == 0)
+        {
+            options.cpuWideBvh = true;
+        }
+        else if (strcmp(argv[argIdx], "--benchmark-wide-bvh") == 0)
+        {
+            options.benchmarkWideBvh = true;
+        }
+        else if (strcmp(argv[argIdx], "--cpu-packets") == 0)
+        {
+            options.cpuPackets = true;
+        }
+        else if (strcmp(argv[argIdx], "--benchmark-packets") == 0)
+        {
+            options.benchmarkPackets = true;
+        }
+        else
+        {
+            nvprintf("Unknown argument %s.\n", argv[argIdx]);
+            PrintUsage();
+            exit(EXIT_FAILURE);
+        }
+    }
+    return options;
+}
 
 VkCommandBuffer AllocateAndBeginOneTimeCommandBuffer(VkDevice device, VkCommandPool cmdPool)
 {
@@ -53,8 +422,114 @@ VkDeviceAddress GetBufferDeviceAddress(VkDevice device, VkBuffer buffer)
     return vkGetBufferDeviceAddress(device, &addressInfo);
 }
 
+// Returns the directories to look for scenes and shaders in, relative to
+// the executable `argv0`.
+std::vector<std::string> GetSearchPaths(const char* argv0)
+{
+    const std::string exePath(argv0, std::string(argv0).find_last_of("/\\") + 1);
+    return { exePath + PROJECT_RELDIRECTORY, exePath + PROJECT_RELDIRECTORY "..", exePath + PROJECT_RELDIRECTORY "../..",
+             exePath + PROJECT_NAME };
+}
+
+// Creates 441 instances with random rotations pointing to BLAS 0.
+std::vector<AccelInstance> CreateInstances()
+{
+    std::vector<AccelInstance>            instances;
+    std::default_random_engine            randomEngine;  // The random number generator
+    std::uniform_real_distribution<float> uniformDist(-0.5f, 0.5f);
+    std::uniform_int_distribution<int>    uniformIntDist(0, 8);
+    for (int x = -10; x <= 10; x++)
+    {
+        for (int y = -10; y <= 10; y++)
+        {
+            AccelInstance instance;
+            instance.transform.translate(nvmath::vec3f(float(x), float(y), 0.0f));
+            instance.transform.scale(1.0f / 2.7f);
+            instance.transform.rotate(uniformDist(randomEngine), nvmath::vec3f(0.0f, 1.0f, 0.0f));
+            instance.transform.rotate(uniformDist(randomEngine), nvmath::vec3f(1.0f, 0.0f, 0.0f));
+            instance.transform.translate(nvmath::vec3f(0.0f, -1.0f, 0.0f));
+
+            instance.instanceCustomId = uniformIntDist(randomEngine);;  // 24 bits accessible to ray shaders via gl_InstanceCustomIndex
+            instance.blasId = 0;  // The index of the BLAS in `blases` that this instance points to
+            instance.hitGroupId = instance.instanceCustomId;  // An offset that will be added when looking up the instance's shader in the SBT.
+            instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;  // How to trace this instance
+            instances.push_back(instance);
+        }
+    }
+    return instances;
+}
+
+// Renders the scene with the CPU tracer instead of Vulkan, writes it to
+// out.hdr, and reports how fast the CPU traced rays; or runs the wide BVH
+// or camera packet benchmark on the scene instead. Returns false if the
+// scene couldn't be loaded or the benchmark failed.
+bool RenderOnCpu(const Options& options, const std::vector<std::string>& searchPaths)
+{
+    const std::string objFilename = nvh::findFile("scenes/CornellBox-Original-Merged.obj", searchPaths);
+    MeshFile          mesh;
+    if (!mesh.load(objFilename, options.meshLoad))
+    {
+        return false;
+    }
+    const std::vector<AccelInstance> instances = CreateInstances();
+    CpuRenderSettings                settings;
+    settings.width = options.width;
+    settings.height = options.height;
+    settings.samplesPerPixel = options.cpuSamples;
+    settings.termination.maxSegments = options.maxDepth;
+    settings.termination.rouletteMinSegments = options.rouletteDepth;
+    settings.cameraPackets = options.cpuPackets;
+    if (options.benchmarkWideBvh)
+    {
+        return RunWideBvhBenchmark(mesh, instances, settings);
+    }
+    if (options.benchmarkPackets)
+    {
+        return RunCameraPacketBenchmark(mesh, instances, settings);
+    }
+    // The same light buffer contents as the GPU tracers, without the buffer:
+    LightTable lightTable;
+    lightTable.addMeshEmitters(0, mesh);
+    LightTableHeader                    lightHeader;
+    const std::vector<EmissiveTriangle> lights = lightTable.buildTriangles(instances, lightHeader);
+
+    CpuTracer  tracer;
+    const auto buildStart = std::chrono::steady_clock::now();
+    // Like the mesh, the mesh's BVH is cached in a file next to the OBJ file:
+    const std::string meshBvhFilename = options.meshLoad.useCache ? objFilename + ".vmpbvh" : std::string();
+    tracer.init(mesh, instances, lights, lightHeader, ThreadPool::getDefault(), options.cpuWideBvh, meshBvhFilename);
+    nvprintf("CPU: built the scene's BVH in %.1f ms.\n",
+             std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - buildStart).count());
+    mesh.close();
+
+    std::vector<float>   rgb;
+    const CpuRenderStats stats = tracer.render(settings, ThreadPool::getDefault(), rgb);
+    const double         mraysPerSecond = double(stats.rays) / stats.seconds / 1.0e6;
+    nvprintf("CPU: traced %u samples per pixel in %.2f s on %u threads (%s triangle tests): %.2f Mrays/s, %.2f Mrays/s per thread.\n",
+             settings.samplesPerPixel, stats.seconds, stats.threads, CpuHasAvx2() ? "AVX2" : "scalar", mraysPerSecond,
+             mraysPerSecond / double(stats.threads));
+
+    stbi_write_hdr("out.hdr", static_cast<int>(settings.width), static_cast<int>(settings.height), 3, rgb.data());
+    return true;
+}
+
 int main(int argc, const char** argv)
 {
+    const Options options = ParseOptions(argc, argv);
+    if (options.benchmarkObjTriangles != 0)
+    {
+        return RunObjParserBenchmark(options.benchmarkObjTriangles) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (options.benchmarkBvhTriangles != 0)
+    {
+        return RunBvhBuildBenchmark(options.benchmarkBvhTriangles) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    std::vector<std::string> searchPaths = GetSearchPaths(argv[0]);
+    if (options.cpu || options.benchmarkWideBvh || options.benchmarkPackets)
+    {
+        return RenderOnCpu(options, searchPaths) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
     // Create the Vulkan context, consisting of an instance, device, physical device, and queues.
     nvvk::ContextCreateInfo deviceInfo;  // One can modify this to load different extensions or pick the Vulkan core version
     deviceInfo.apiMajor = 1;             // Specify the version of Vulkan we'll use
@@ -65,11 +540,26 @@ int main(int argc, const char** argv)
     deviceInfo.addDeviceExtension(VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME, false, &asFeatures);
     VkPhysicalDeviceRayTracingPipelineFeaturesKHR rtPipelineFeatures = nvvk::make<VkPhysicalDeviceRayTracingPipelineFeaturesKHR>();
     deviceInfo.addDeviceExtension(VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME, false, &rtPipelineFeatures);
+    // Ray queries are optional; the wavefront tracer needs them.
+    VkPhysicalDeviceRayQueryFeaturesKHR rayQueryFeatures = nvvk::make<VkPhysicalDeviceRayQueryFeaturesKHR>();
+    deviceInfo.addDeviceExtension(VK_KHR_RAY_QUERY_EXTENSION_NAME, true, &rayQueryFeatures);
 
     nvvk::Context context;     // Encapsulates device state in a single object
     context.init(deviceInfo);  // Initialize the context
     // Device must support acceleration structures and ray tracing pipelines:
     assert(asFeatures.accelerationStructure == VK_TRUE && rtPipelineFeatures.rayTracingPipeline == VK_TRUE);
+    const bool useWavefront = options.wavefront && rayQueryFeatures.rayQuery == VK_TRUE;
+    if (options.wavefront && !useWavefront)
+    {
+        nvprintf("This device doesn't support ray queries; using the ray tracing pipeline instead of the wavefront tracer.\n");
+    }
+    // Adaptive sampling traces its tile list with vkCmdTraceRaysIndirectKHR:
+    const bool adaptiveEnabled = options.adaptiveError > 0.0f && !useWavefront
+        && rtPipelineFeatures.rayTracingPipelineTraceRaysIndirect == VK_TRUE;
+    if (options.adaptiveError > 0.0f && !adaptiveEnabled)
+    {
+        nvprintf("Adaptive sampling needs the ray tracing pipeline with indirect trace rays; it is disabled.\n");
+    }
 
     // Get the properties of ray tracing pipelines on this device. We do this by
     // using vkGetPhysicalDeviceProperties2, and extending this by chaining on a
@@ -78,9 +568,79 @@ int main(int argc, const char** argv)
     // This gives us information about shader binding tables.
     VkPhysicalDeviceRayTracingPipelinePropertiesKHR rtPipelineProperties =
         nvvk::make<VkPhysicalDeviceRayTracingPipelinePropertiesKHR>();
+    // We also get the subgroup properties, to see if ray statistics can use subgroup operations.
+    VkPhysicalDeviceSubgroupProperties subgroupProperties = nvvk::make<VkPhysicalDeviceSubgroupProperties>();
+    rtPipelineProperties.pNext = &subgroupProperties;
     VkPhysicalDeviceProperties2 physicalDeviceProperties = nvvk::make<VkPhysicalDeviceProperties2>();
     physicalDeviceProperties.pNext = &rtPipelineProperties;
     vkGetPhysicalDeviceProperties2(context.m_physicalDevice, &physicalDeviceProperties);
+    const uint32_t render_width = options.width;
+    const uint32_t render_height = options.height;
+
+    // The tile size and the wavefront workgroup size are workgroup sizes of
+    // compute shaders, so they must fit the device's limits:
+    const VkPhysicalDeviceLimits& limits = physicalDeviceProperties.properties.limits;
+    const auto fitsWorkgroup = [&](uint32_t x, uint32_t y) {
+        return x <= limits.maxComputeWorkGroupSize[0] && y <= limits.maxComputeWorkGroupSize[1]
+               && uint64_t(x) * y <= limits.maxComputeWorkGroupInvocations;
+    };
+
+    // Launch the wavefront tracer with the parameters from the command line,
+    // or else the ones --autotune measured on this device, or else the defaults:
+    LaunchTuning launchTuning;
+    if (useWavefront && (options.samplesPerBatch == 0 || options.workgroupSize == 0)
+        && LoadLaunchTuning(context.m_physicalDevice, launchTuning))
+    {
+        const std::string tuningFilename = GetLaunchTuningFilename(context.m_physicalDevice);
+        // The file may come from an older driver or have been edited, so
+        // fall back to the defaults (which every device supports) if its
+        // workgroup size doesn't fit:
+        if (!fitsWorkgroup(launchTuning.workgroupSize, 1))
+        {
+            nvprintf("Ignoring launch tuning from %s: its workgroup size of %u doesn't fit this device.\n",
+                     tuningFilename.c_str(), launchTuning.workgroupSize);
+            launchTuning = LaunchTuning();
+        }
+        else
+        {
+            nvprintf("Loaded launch tuning from %s.\n", tuningFilename.c_str());
+        }
+    }
+    const uint32_t samplesPerBatch = (options.samplesPerBatch != 0) ? options.samplesPerBatch : launchTuning.samplesPerBatch;
+    const uint32_t workgroupSize = (options.workgroupSize != 0) ? options.workgroupSize : launchTuning.workgroupSize;
+
+    // Now only the command line can have sizes that don't fit:
+    if (!fitsWorkgroup(options.tileWidth, options.tileHeight))
+    {
+        nvprintf("--tile must fit in a workgroup of at most %ux%u and %u threads on this device.\n",
+                 limits.maxComputeWorkGroupSize[0], limits.maxComputeWorkGroupSize[1], limits.maxComputeWorkGroupInvocations);
+        exit(EXIT_FAILURE);
+    }
+    if (!fitsWorkgroup(workgroupSize, 1))
+    {
+        nvprintf("--workgroup-size must be at most %u on this device.\n",
+                 std::min(limits.maxComputeWorkGroupSize[0], limits.maxComputeWorkGroupInvocations));
+        exit(EXIT_FAILURE);
+    }
+    // --size only checks that the size fits in 16 bits; the image and the
+    // tracer's launches must also fit the device:
+    if (render_width > limits.maxImageDimension2D || render_height > limits.maxImageDimension2D)
+    {
+        nvprintf("--size must be at most %ux%u on this device.\n", limits.maxImageDimension2D, limits.maxImageDimension2D);
+        exit(EXIT_FAILURE);
+    }
+    if (useWavefront && WavefrontTracer::computeNumPaths(render_width, render_height, limits) == 0)
+    {
+        nvprintf("A %ux%u image needs more paths in flight than the wavefront tracer can hold on this device; "
+                 "use a smaller --size.\n", render_width, render_height);
+        exit(EXIT_FAILURE);
+    }
+    if (!useWavefront && uint64_t(render_width) * render_height > rtPipelineProperties.maxRayDispatchInvocationCount)
+    {
+        nvprintf("A %ux%u image needs more than the %u ray generation invocations this device can launch at once; "
+                 "use a smaller --size.\n", render_width, render_height, rtPipelineProperties.maxRayDispatchInvocationCount);
+        exit(EXIT_FAILURE);
+    }
     const VkDeviceSize sbtHeaderSize = rtPipelineProperties.shaderGroupHandleSize;
     const VkDeviceSize sbtBaseAlignment = rtPipelineProperties.shaderGroupBaseAlignment;
     const VkDeviceSize sbtHandleAlignment = rtPipelineProperties.shaderGroupHandleAlignment;
@@ -102,6 +662,20 @@ int main(int argc, const char** argv)
         ((sbtHeaderSize + sbtBaseAlignment - 1) / sbtBaseAlignment);
     assert(sbtStride <= rtPipelineProperties.maxShaderGroupStride);
 
+    // Ray statistics aggregate their counts with subgroup operations in the
+    // ray generation shader, or in the compute shaders of the wavefront tracer:
+    const VkSubgroupFeatureFlags statsSubgroupOps =
+        VK_SUBGROUP_FEATURE_BASIC_BIT | VK_SUBGROUP_FEATURE_ARITHMETIC_BIT | VK_SUBGROUP_FEATURE_BALLOT_BIT;
+    const VkShaderStageFlags statsStage = useWavefront ? VK_SHADER_STAGE_COMPUTE_BIT : VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+    const bool               rayStatsEnabled = options.rayStats
+        && (subgroupProperties.supportedStages & statsStage) != 0
+        && (subgroupProperties.supportedOperations & statsSubgroupOps) == statsSubgroupOps;
+    if (options.rayStats && !rayStatsEnabled)
+    {
+        nvprintf("This device doesn't support subgroup arithmetic and ballots in the tracer's shaders; "
+                 "ray statistics are disabled.\n");
+    }
+
     // Initialize the debug utilities:
     nvvk::DebugUtil debugUtil(context);
 
@@ -109,6 +683,14 @@ int main(int argc, const char** argv)
     nvvk::AllocatorDedicated allocator;
     allocator.init(context, context.m_physicalDevice);
 
+    // Load the pipeline cache from the last run, if there is one
+    PipelineCache pipelineCache;
+    pipelineCache.init(context, context.m_physicalDevice, options.usePipelineCache);
+
+    // Measures the GPU time of each phase of the render, from uploads to readback
+    GpuProfiler profiler;
+    profiler.init(context, context.m_physicalDevice, context.m_queueGCT);
+
     // Create an image. Images are more complex than buffers - they can have
     // multiple dimensions, different color+depth formats, be arrays of mips,
     // have multisampling, be tiled in memory in e.g. row-linear order or in an
@@ -129,9 +711,9 @@ int main(int argc, const char** argv)
     imageCreateInfo.samples = VK_SAMPLE_COUNT_1_BIT;
     // The driver controls the tiling of the image for performance:
     imageCreateInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-    // This image is read and written on the GPU, and data can be transferred
-    // from it:
-    imageCreateInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    // This image is read and written on the GPU, cleared using a transfer,
+    // and data can be transferred from it:
+    imageCreateInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
     // Image is only used by one queue:
     imageCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
     // The image must be in either VK_IMAGE_LAYOUT_UNDEFINED or VK_IMAGE_LAYOUT_PREINITIALIZED
@@ -180,23 +762,17 @@ int main(int argc, const char** argv)
         | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
     debugUtil.setObjectName(imageLinear.image, "imageLinear");
 
-    // Load the mesh of the first shape from an OBJ file
-    const std::string        exePath(argv[0], std::string(argv[0]).find_last_of("/\\") + 1);
-    std::vector<std::string> searchPaths = { exePath + PROJECT_RELDIRECTORY, exePath + PROJECT_RELDIRECTORY "..",
-                                            exePath + PROJECT_RELDIRECTORY "../..", exePath + PROJECT_NAME };
-    tinyobj::ObjReader       reader;  // Used to read an OBJ file
-    reader.ParseFromFile(nvh::findFile("scenes/CornellBox-Original-Merged.obj", searchPaths));
-    assert(reader.Valid());  // Make sure tinyobj was able to parse this file
-    const std::vector<tinyobj::real_t>   objVertices = reader.GetAttrib().GetVertices();
-    const std::vector<tinyobj::shape_t>& objShapes = reader.GetShapes();  // All shapes in the file
-    assert(objShapes.size() == 1);                                          // Check that this file has only one shape
-    const tinyobj::shape_t& objShape = objShapes[0];                        // Get the first shape
-    // Get the indices of the vertices of the first mesh of `objShape` in `attrib.vertices`:
-    std::vector<uint32_t> objIndices;
-    objIndices.reserve(objShape.mesh.indices.size());
-    for (const tinyobj::index_t& index : objShape.mesh.indices)
-    {
-        objIndices.push_back(index.vertex_index);
+    // Load the mesh from an OBJ file. The first run converts it to a binary
+    // mesh cache file; later runs memory-map that file instead of parsing text.
+    MeshFile mesh;
+    if (!mesh.load(nvh::findFile("scenes/CornellBox-Original-Merged.obj", searchPaths), options.meshLoad))
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (mesh.shapes().empty())
+    {
+        nvprintf("The scene doesn't contain any triangles.\n");
+        exit(EXIT_FAILURE);
     }
 
     // Create the command pool
@@ -206,16 +782,37 @@ int main(int argc, const char** argv)
     NVVK_CHECK(vkCreateCommandPool(context, &cmdPoolInfo, nullptr, &cmdPool));
     debugUtil.setObjectName(cmdPool, "cmdPool");
 
-    // Upload the vertex and index buffers to the GPU.
-    nvvk::BufferDedicated vertexBuffer, indexBuffer;
+    // Each shape of the mesh is a separate geometry in the BLAS. The closest
+    // hit shaders find a geometry's triangles in the shared index buffer and
+    // its emission using its GeometryInfo.
+    std::vector<GeometryInfo> geometryInfos;
+    for (const ObjShape& shape : mesh.shapes())
+    {
+        GeometryInfo geometryInfo;
+        geometryInfo.primitiveOffset = shape.firstIndex / 3;
+        geometryInfo.emission = vec3(shape.emission[0], shape.emission[1], shape.emission[2]);
+        geometryInfos.push_back(geometryInfo);
+    }
+    // Keep a copy of the emissive triangles for next-event estimation:
+    LightTable lightTable;
+    lightTable.init(&allocator);
+    lightTable.addMeshEmitters(0, mesh);
+    nvprintf("Loaded %zu shapes with %llu triangles.\n", geometryInfos.size(),
+             static_cast<unsigned long long>(mesh.numIndices() / 3));
+
+    // Upload the vertex, index, and geometry info buffers to the GPU.
+    nvvk::BufferDedicated vertexBuffer, indexBuffer, geometryInfoBuffer;
     {
         // Start a command buffer for uploading the buffers
         VkCommandBuffer uploadCmdBuffer = AllocateAndBeginOneTimeCommandBuffer(context, cmdPool);
+        const uint32_t  uploadSection = profiler.beginSection(uploadCmdBuffer, "upload");
         // We get these buffers' device addresses, and use them as storage buffers and build inputs.
         const VkBufferUsageFlags usage = VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
             | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR;
-        vertexBuffer = allocator.createBuffer(uploadCmdBuffer, objVertices, usage);
-        indexBuffer = allocator.createBuffer(uploadCmdBuffer, objIndices, usage);
+        // These copy straight from the mesh (which is usually memory-mapped) to staging buffers:
+        vertexBuffer = allocator.createBuffer(uploadCmdBuffer, mesh.numVertices() * 3 * sizeof(float), mesh.vertices(), usage);
+        indexBuffer = allocator.createBuffer(uploadCmdBuffer, mesh.numIndices() * sizeof(uint32_t), mesh.indices(), usage);
+        geometryInfoBuffer = allocator.createBuffer(uploadCmdBuffer, geometryInfos, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
 
         // Also, let's transition the layout of `image` to `VK_IMAGE_LAYOUT_GENERAL`,
         // and the layout of `imageLinear` to `VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL`.
@@ -229,7 +826,7 @@ int main(int argc, const char** argv)
         // This pipeline barrier will say "Make it so that all writes to memory by
         const VkAccessFlags srcAccesses = 0;  // Since image and imageLinear aren't initially accessible
         // finish and can be read correctly by
-        const VkAccessFlags dstImageAccesses = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;  // for image
+        const VkAccessFlags dstImageAccesses = VK_ACCESS_TRANSFER_WRITE_BIT;  // for image (we'll clear it next)
         const VkAccessFlags dstImageLinearAccesses = VK_ACCESS_TRANSFER_WRITE_BIT;  // for imageLinear
         // "
 
@@ -255,98 +852,210 @@ int main(int argc, const char** argv)
             0, nullptr,            // Buffer memory barrier objects
             2, imageBarriers);     // Image barrier objects
 
+        // Clear `image` to 0. The ray generation shader counts the number of
+        // accumulated sample batches in the alpha channel, so this starts
+        // every pixel at 0 batches:
+        const VkClearColorValue clearColor{};
+        VkImageSubresourceRange clearRange{};
+        clearRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        clearRange.levelCount = 1;
+        clearRange.layerCount = 1;
+        vkCmdClearColorImage(uploadCmdBuffer, image.image, VK_IMAGE_LAYOUT_GENERAL, &clearColor, 1, &clearRange);
+        // Then make the clear visible to the ray tracing and compute shaders:
+        VkMemoryBarrier clearBarrier = nvvk::make<VkMemoryBarrier>();
+        clearBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        clearBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(uploadCmdBuffer,                                  // The command buffer
+            VK_PIPELINE_STAGE_TRANSFER_BIT,  // From transfers
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,  // To shaders
+            0,                                             // No special flags
+            1, &clearBarrier,                              // An array of memory barriers
+            0, nullptr, 0, nullptr);                       // No other barriers
+
+        profiler.endSection(uploadCmdBuffer, uploadSection);
         EndSubmitWaitAndFreeCommandBuffer(context, context.m_queueGCT, cmdPool, uploadCmdBuffer);
         allocator.finalizeAndReleaseStaging();
     }
 
-    // Describe the bottom-level acceleration structure (BLAS)
-    std::vector<nvvk::RaytracingBuilderKHR::BlasInput> blases;
+    // Host builds need the accelerationStructureHostCommands feature, which
+    // nvvk::Context enabled if the device supports it.
+    const bool hostAccelBuilds = options.hostAccelBuilds && asFeatures.accelerationStructureHostCommands;
+    if (options.hostAccelBuilds && !hostAccelBuilds)
+    {
+        nvprintf("This device doesn't support host acceleration structure builds; building on the device.\n");
+    }
+
+    // Describe the bottom-level acceleration structure (BLAS), with one geometry per shape
+    std::vector<BlasInput> blases;
     {
-        nvvk::RaytracingBuilderKHR::BlasInput blas;
+        BlasInput blas;
+        // Used to find this BLAS in the acceleration structure cache:
+        blas.contentHash = mesh.contentHash();
         // Get the device addresses of the vertex and index buffers
         VkDeviceAddress vertexBufferAddress = GetBufferDeviceAddress(context, vertexBuffer.buffer);
         VkDeviceAddress indexBufferAddress = GetBufferDeviceAddress(context, indexBuffer.buffer);
+
         // Specify where the builder can find the vertices and indices for triangles, and their formats:
         VkAccelerationStructureGeometryTrianglesDataKHR triangles = nvvk::make<VkAccelerationStructureGeometryTrianglesDataKHR>();
         triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-        triangles.vertexData.deviceAddress = vertexBufferAddress;
+        // Host builds read the mesh data from CPU memory instead of the GPU buffers:
+        if (hostAccelBuilds)
+        {
+            triangles.vertexData.hostAddress = mesh.vertices();
+        }
+        else
+        {
+            triangles.vertexData.deviceAddress = vertexBufferAddress;
+        }
         triangles.vertexStride = 3 * sizeof(float);
-        triangles.maxVertex = static_cast<uint32_t>(objVertices.size() - 1);
+        triangles.maxVertex = static_cast<uint32_t>(mesh.numVertices() - 1);
         triangles.indexType = VK_INDEX_TYPE_UINT32;
-        triangles.indexData.deviceAddress = indexBufferAddress;
+        if (hostAccelBuilds)
+        {
+            triangles.indexData.hostAddress = mesh.indices();
+        }
+        else
+        {
+            triangles.indexData.deviceAddress = indexBufferAddress;
+        }
         triangles.transformData.deviceAddress = 0;  // No transform
-        // Create a VkAccelerationStructureGeometryKHR object that says it handles opaque triangles and points to the above:
-        VkAccelerationStructureGeometryKHR geometry = nvvk::make<VkAccelerationStructureGeometryKHR>();
-        geometry.geometry.triangles = triangles;
-        geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
-        geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
-        blas.asGeometry.push_back(geometry);
-        // Create offset info that allows us to say how many triangles and vertices to read
-        VkAccelerationStructureBuildRangeInfoKHR offsetInfo;
-        offsetInfo.firstVertex = 0;
-        offsetInfo.primitiveCount = static_cast<uint32_t>(objIndices.size() / 3);  // Number of triangles
-        offsetInfo.primitiveOffset = 0;
-        offsetInfo.transformOffset = 0;
-        blas.asBuildOffsetInfo.push_back(offsetInfo);
+        for (const ObjShape& shape : mesh.shapes())
+        {
+            // Create a VkAccelerationStructureGeometryKHR object that says it handles opaque triangles and points to the above.
+            // All shapes share the same vertex and index buffers:
+            VkAccelerationStructureGeometryKHR geometry = nvvk::make<VkAccelerationStructureGeometryKHR>();
+            geometry.geometry.triangles = triangles;
+            geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+            geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+            blas.geometries.push_back(geometry);
+            // Create offset info that says which triangles of the index buffer belong to this shape.
+            // Indices are global, so firstVertex is 0:
+            VkAccelerationStructureBuildRangeInfoKHR offsetInfo;
+            offsetInfo.firstVertex = 0;
+            offsetInfo.primitiveCount = shape.numIndices / 3;                  // Number of triangles
+            offsetInfo.primitiveOffset = shape.firstIndex * sizeof(uint32_t);  // Byte offset in the index buffer
+            offsetInfo.transformOffset = 0;
+            blas.ranges.push_back(offsetInfo);
+        }
         blases.push_back(blas);
     }
-    // Create the BLAS
-    nvvk::RaytracingBuilderKHR raytracingBuilder;
-    raytracingBuilder.setup(context, &allocator, context.m_queueGCT);
-    raytracingBuilder.buildBlas(blases, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR
-        | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR);
+    // Create the BLAS, or load it from the acceleration structure cache
+    AccelBuilder accelBuilder;
+    accelBuilder.init(context, &allocator, context.m_queueGCT, context.m_queueGCT);
+    accelBuilder.setProfiler(&profiler);
+    if (hostAccelBuilds)
+    {
+        accelBuilder.enableHostBuilds(ThreadPool::getDefault());
+    }
+    accelBuilder.buildBlases(blases,
+        VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR,
+        options.useAccelCache);
+    // The mesh data is on the GPU and in the BLAS now, so we can unmap it. (Counts stay valid.)
+    mesh.close();
 
     // Create 441 instances with random rotations pointing to BLAS 0, and build these instances into a TLAS:
-    std::vector<nvvk::RaytracingBuilderKHR::Instance> instances;
-    std::default_random_engine                        randomEngine;  // The random number generator
-    std::uniform_real_distribution<float>             uniformDist(-0.5f, 0.5f);
-    std::uniform_int_distribution<int>                uniformIntDist(0, 8);
-    for (int x = -10; x <= 10; x++)
+    const std::vector<AccelInstance> instances = CreateInstances();
+    accelBuilder.buildTlas(instances, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+
+    // Place the emissive triangles of every instance in the light buffer:
     {
-        for (int y = -10; y <= 10; y++)
-        {
-            nvvk::RaytracingBuilderKHR::Instance instance;
-            instance.transform.translate(nvmath::vec3f(float(x), float(y), 0.0f));
-            instance.transform.scale(1.0f / 2.7f);
-            instance.transform.rotate(uniformDist(randomEngine), nvmath::vec3f(0.0f, 1.0f, 0.0f));
-            instance.transform.rotate(uniformDist(randomEngine), nvmath::vec3f(1.0f, 0.0f, 0.0f));
-            instance.transform.translate(nvmath::vec3f(0.0f, -1.0f, 0.0f));
+        VkCommandBuffer cmdBuffer = AllocateAndBeginOneTimeCommandBuffer(context, cmdPool);
+        lightTable.build(cmdBuffer, instances);
+        EndSubmitWaitAndFreeCommandBuffer(context, context.m_queueGCT, cmdPool, cmdBuffer);
+        allocator.finalizeAndReleaseStaging();
+    }
+    if (lightTable.getNumTriangles() != 0)
+    {
+        nvprintf("Sampling %u emissive triangles for next-event estimation.\n", lightTable.getNumTriangles());
+    }
+    else
+    {
+        nvprintf("The scene has no emissive (MTL Ke) triangles, so it's only lit by the sky.\n");
+    }
 
-            instance.instanceCustomId = uniformIntDist(randomEngine);;  // 24 bits accessible to ray shaders via gl_InstanceCustomIndex
-            instance.blasId = 0;  // The index of the BLAS in `blases` that this instance points to
-            instance.hitGroupId = instance.instanceCustomId;  // An offset that will be added when looking up the instance's shader in the SBT.
-            instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;  // How to trace this instance
-            instances.push_back(instance);
-        }
+    // Keep several sample batches in flight at once, so that the CPU can
+    // record the next batch while the GPU is still tracing the current one:
+    const uint32_t NUM_BATCHES_IN_FLIGHT = 3;
+    BatchSubmitter batchSubmitter;
+    batchSubmitter.init(context, context.m_physicalDevice, context.m_queueGCT, context.m_queueGCT, NUM_BATCHES_IN_FLIGHT);
+    batchSubmitter.setProfiler(&profiler);
+
+    // The ray statistics buffer is always bound, but only used with --ray-stats.
+    // Each batch in flight gets its own readback area:
+    RayStatistics rayStats;
+    rayStats.init(&allocator, NUM_BATCHES_IN_FLIGHT);
+
+    // The compute pipelines of adaptive sampling and the wavefront tracer,
+    // one for each set of specialization constants they're used with:
+    PipelineVariantCache pipelineVariants;
+    pipelineVariants.init(context, pipelineCache.get(), searchPaths);
+
+    // Adaptive sampling's variance image and tile list are also always bound,
+    // but only used with --adaptive:
+    const uint32_t  ADAPTIVE_MIN_BATCHES = 4;
+    AdaptiveSampler adaptiveSampler;
+    adaptiveSampler.init(context, &allocator, &pipelineVariants, imageView, render_width, render_height,
+        options.tileWidth, options.tileHeight, NUM_BATCHES_IN_FLIGHT);
+    adaptiveSampler.setTarget(options.adaptiveError, ADAPTIVE_MIN_BATCHES);
+    {
+        VkCommandBuffer cmdBuffer = AllocateAndBeginOneTimeCommandBuffer(context, cmdPool);
+        adaptiveSampler.recordInitialize(cmdBuffer);
+        EndSubmitWaitAndFreeCommandBuffer(context, context.m_queueGCT, cmdPool, cmdBuffer);
+    }
+    if (adaptiveEnabled)
+    {
+        nvprintf("Adaptive sampling: %u tiles, target relative error %g.\n", adaptiveSampler.getNumTiles(),
+            static_cast<double>(options.adaptiveError));
     }
-    raytracingBuilder.buildTlas(instances, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+
+    batchSubmitter.setRetireCallback([&](uint32_t slotIndex, double gpuMs) {
+        if (rayStatsEnabled)
+        {
+            rayStats.retireSlot(slotIndex, gpuMs);
+        }
+        if (adaptiveEnabled)
+        {
+            adaptiveSampler.retireSlot(slotIndex);
+        }
+    });
 
     // Here's the list of bindings for the descriptor set layout, from raytrace.comp.glsl:
     // 0 - a storage image (the image `image`)
     // 1 - an acceleration structure (the TLAS)
     // 2 - a storage buffer (the vertex buffer)
     // 3 - a storage buffer (the index buffer)
+    // 4 - a storage buffer (the geometry info buffer)
+    // 5 - a storage buffer (the ray statistics)
+    // 10 - a storage image (the adaptive sampling variance image)
+    // 11 - a storage buffer (the adaptive sampling tile list)
+    // 12 - a storage buffer (the light buffer)
     nvvk::DescriptorSetContainer descriptorSetContainer(context);
     descriptorSetContainer.addBinding(BINDING_IMAGEDATA, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR);
     descriptorSetContainer.addBinding(BINDING_TLAS, VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR);
     descriptorSetContainer.addBinding(BINDING_VERTICES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
     descriptorSetContainer.addBinding(BINDING_INDICES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
+    descriptorSetContainer.addBinding(BINDING_GEOMETRIES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
+    descriptorSetContainer.addBinding(BINDING_STATS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR);
+    descriptorSetContainer.addBinding(BINDING_ADAPTIVE_VARIANCE, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR);
+    descriptorSetContainer.addBinding(BINDING_ADAPTIVE_TILES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_RAYGEN_BIT_KHR);
+    descriptorSetContainer.addBinding(BINDING_LIGHTS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+        VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR);
     // Create a layout from the list of bindings
     descriptorSetContainer.initLayout();
     // Create a descriptor pool from the list of bindings with space for 1 set, and allocate that set
     descriptorSetContainer.initPool(1);
-    // Create a push constant range describing the amount of data for the push constants.
-    static_assert(sizeof(PushConstants) % 4 == 0, "Push constant size must be a multiple of 4 per the Vulkan spec!");
+    // Create a pipeline layout from the descriptor set layout. The only push
+    // constants are the path termination settings, which are the same for
+    // every batch: the ray generation shader reads the sample batch index
+    // from the image, so that recorded command buffers can be reused.
     VkPushConstantRange pushConstantRange;
     pushConstantRange.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
     pushConstantRange.offset = 0;
-    pushConstantRange.size = sizeof(PushConstants);
-    // Create a pipeline layout from the descriptor set layout and push constant range:
-    descriptorSetContainer.initPipeLayout(1,                    // Number of push constant ranges
-        &pushConstantRange);  // Pointer to push constant ranges
+    pushConstantRange.size = sizeof(PathTermination);
+    descriptorSetContainer.initPipeLayout(1, &pushConstantRange);
 
 // Write values into the descriptor set.
-    std::array<VkWriteDescriptorSet, 4> writeDescriptorSets;
+    std::array<VkWriteDescriptorSet, 9> writeDescriptorSets;
     // Color image
     VkDescriptorImageInfo descriptorImageInfo{};
     descriptorImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;  // The image's layout
@@ -354,7 +1063,7 @@ int main(int argc, const char** argv)
     writeDescriptorSets[0] = descriptorSetContainer.makeWrite(0 /*set index*/, BINDING_IMAGEDATA /*binding*/, &descriptorImageInfo);
     // Top-level acceleration structure (TLAS)
     VkWriteDescriptorSetAccelerationStructureKHR descriptorAS = nvvk::make<VkWriteDescriptorSetAccelerationStructureKHR>();
-    VkAccelerationStructureKHR tlasCopy = raytracingBuilder.getAccelerationStructure();  // So that we can take its address
+    VkAccelerationStructureKHR tlasCopy = accelBuilder.getTlas();  // So that we can take its address
     descriptorAS.accelerationStructureCount = 1;
     descriptorAS.pAccelerationStructures = &tlasCopy;
     writeDescriptorSets[1] = descriptorSetContainer.makeWrite(0, BINDING_TLAS, &descriptorAS);
@@ -368,21 +1077,51 @@ int main(int argc, const char** argv)
     indexDescriptorBufferInfo.buffer = indexBuffer.buffer;
     indexDescriptorBufferInfo.range = VK_WHOLE_SIZE;
     writeDescriptorSets[3] = descriptorSetContainer.makeWrite(0, BINDING_INDICES, &indexDescriptorBufferInfo);
+    // Geometry info buffer
+    VkDescriptorBufferInfo geometryInfoDescriptorBufferInfo{};
+    geometryInfoDescriptorBufferInfo.buffer = geometryInfoBuffer.buffer;
+    geometryInfoDescriptorBufferInfo.range = VK_WHOLE_SIZE;
+    writeDescriptorSets[4] = descriptorSetContainer.makeWrite(0, BINDING_GEOMETRIES, &geometryInfoDescriptorBufferInfo);
+    // Ray statistics buffer
+    VkDescriptorBufferInfo statsDescriptorBufferInfo{};
+    statsDescriptorBufferInfo.buffer = rayStats.getBuffer();
+    statsDescriptorBufferInfo.range = VK_WHOLE_SIZE;
+    writeDescriptorSets[5] = descriptorSetContainer.makeWrite(0, BINDING_STATS, &statsDescriptorBufferInfo);
+    // Adaptive sampling variance image
+    VkDescriptorImageInfo varianceDescriptorImageInfo{};
+    varianceDescriptorImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    varianceDescriptorImageInfo.imageView = adaptiveSampler.getVarianceImageView();
+    writeDescriptorSets[6] = descriptorSetContainer.makeWrite(0, BINDING_ADAPTIVE_VARIANCE, &varianceDescriptorImageInfo);
+    // Adaptive sampling tile list
+    VkDescriptorBufferInfo tilesDescriptorBufferInfo{};
+    tilesDescriptorBufferInfo.buffer = adaptiveSampler.getTileBuffer();
+    tilesDescriptorBufferInfo.range = VK_WHOLE_SIZE;
+    writeDescriptorSets[7] = descriptorSetContainer.makeWrite(0, BINDING_ADAPTIVE_TILES, &tilesDescriptorBufferInfo);
+    // Light buffer
+    VkDescriptorBufferInfo lightsDescriptorBufferInfo{};
+    lightsDescriptorBufferInfo.buffer = lightTable.getBuffer();
+    lightsDescriptorBufferInfo.range = VK_WHOLE_SIZE;
+    writeDescriptorSets[8] = descriptorSetContainer.makeWrite(0, BINDING_LIGHTS, &lightsDescriptorBufferInfo);
     vkUpdateDescriptorSets(context,                                            // The context
         static_cast<uint32_t>(writeDescriptorSets.size()),  // Number of VkWriteDescriptorSet objects
         writeDescriptorSets.data(),                         // Pointer to VkWriteDescriptorSet objects
         0, nullptr);  // An array of VkCopyDescriptorSet objects (unused)
 
 // Shader loading and pipeline creation
+    // Module 0 is the ray generation shader, modules 1 and 2 are the miss shaders
+    // of path segments and of shadow rays, and the rest are closest-hit shaders:
     const size_t                                      NUM_C_HIT_SHADERS = 9;
-    std::array<VkShaderModule, 2 + NUM_C_HIT_SHADERS> modules;
+    const int                                         FIRST_C_HIT_MODULE = 3;
+    std::array<VkShaderModule, FIRST_C_HIT_MODULE + NUM_C_HIT_SHADERS> modules;
     modules[0] = nvvk::createShaderModule(context, nvh::loadFile("shaders/raytrace.rgen.glsl.spv", true, searchPaths));
     debugUtil.setObjectName(modules[0], "Ray generation module (raytrace.rgen.glsl.spv)");
     modules[1] = nvvk::createShaderModule(context, nvh::loadFile("shaders/raytrace.rmiss.glsl.spv", true, searchPaths));
     debugUtil.setObjectName(modules[1], "Miss module (raytrace.rmiss.glsl.spv)");
+    modules[2] = nvvk::createShaderModule(context, nvh::loadFile("shaders/shadow.rmiss.glsl.spv", true, searchPaths));
+    debugUtil.setObjectName(modules[2], "Shadow miss module (shadow.rmiss.glsl.spv)");
     for (int closestHitShaderIdx = 0; closestHitShaderIdx < NUM_C_HIT_SHADERS; closestHitShaderIdx++)
     {
-        const int         moduleIdx = 2 + closestHitShaderIdx;
+        const int         moduleIdx = FIRST_C_HIT_MODULE + closestHitShaderIdx;
         const std::string filename = "shaders/material" + std::to_string(closestHitShaderIdx) + ".rchit.glsl.spv";
         modules[moduleIdx] = nvvk::createShaderModule(context, nvh::loadFile(filename, true, searchPaths));
 
@@ -401,21 +1140,40 @@ int main(int argc, const char** argv)
         // These are called "shader stages" in this context.
         // These are shader module + entry point + stage combinations, because each
         // shader module can contain multiple entry points (e.g. main1, main2...)
-        std::array<VkPipelineShaderStageCreateInfo, 2 + NUM_C_HIT_SHADERS> stages;  // Pointers to shaders
+        std::array<VkPipelineShaderStageCreateInfo, FIRST_C_HIT_MODULE + NUM_C_HIT_SHADERS> stages;  // Pointers to shaders
 
         // Stage 0 will be the raygen shader.
         stages[0] = nvvk::make<VkPipelineShaderStageCreateInfo>();
         stages[0].stage = VK_SHADER_STAGE_RAYGEN_BIT_KHR;  // Kind of shader
         stages[0].module = modules[0];                      // Contains the shader
         stages[0].pName = "main";                          // Name of the entry point
+        // Turn ray statistics and adaptive sampling on or off with
+        // specialization constants, so that they cost nothing when they're off,
+        // and pick the sample sequence and pixel order the same way. The sample count, the
+        // maximum path length, and the tile size are specialization constants
+        // too, so the driver can unroll and fold the loops over them. Every
+        // stage gets the same constants, and ignores the ones it doesn't declare:
+        SpecializationConstants specialization;
+        specialization.set(CONSTANT_ID_ENABLE_RAY_STATS, rayStatsEnabled ? VK_TRUE : VK_FALSE)
+            .set(CONSTANT_ID_ADAPTIVE_SAMPLING, adaptiveEnabled ? VK_TRUE : VK_FALSE)
+            .set(CONSTANT_ID_SAMPLER, options.sampler)
+            .set(CONSTANT_ID_PIXEL_ORDER, options.pixelOrder)
+            .set(CONSTANT_ID_SAMPLES_PER_BATCH, samplesPerBatch)
+            .set(CONSTANT_ID_MAX_SEGMENTS, options.maxDepth)
+            .set(CONSTANT_ID_ADAPTIVE_TILE_WIDTH, options.tileWidth)
+            .set(CONSTANT_ID_ADAPTIVE_TILE_HEIGHT, options.tileHeight);
+        stages[0].pSpecializationInfo = specialization.getInfo();
         // Stage 1 will be the miss shader.
         stages[1] = stages[0];
         stages[1].stage = VK_SHADER_STAGE_MISS_BIT_KHR;  // Kind of shader
         stages[1].module = modules[1];                    // Contains the shader
-        // Stages 2 through the end will be closest-hit shaders.
+        // Stage 2 will be the shadow ray miss shader.
+        stages[2] = stages[1];
+        stages[2].module = modules[2];
+        // Stages 3 through the end will be closest-hit shaders.
         for (int closestHitShaderIdx = 0; closestHitShaderIdx < NUM_C_HIT_SHADERS; closestHitShaderIdx++)
         {
-            const int moduleIdx = 2 + closestHitShaderIdx;
+            const int moduleIdx = FIRST_C_HIT_MODULE + closestHitShaderIdx;
             stages[moduleIdx] = stages[0];
             stages[moduleIdx].stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR;
             stages[moduleIdx].module = modules[moduleIdx];
@@ -426,7 +1184,7 @@ int main(int argc, const char** argv)
         // stages array. These groups of handles then become the most important
         // part of the entries in the shader binding table.
         // Stores the indices of stages in each group:
-        std::array<VkRayTracingShaderGroupCreateInfoKHR, 2 + NUM_C_HIT_SHADERS> groups;
+        std::array<VkRayTracingShaderGroupCreateInfoKHR, FIRST_C_HIT_MODULE + NUM_C_HIT_SHADERS> groups;
 
         // The vkCmdTraceRays call will eventually refer to ray gen, miss, hit, and
         // callable shader binding tables and ranges.
@@ -451,11 +1209,14 @@ int main(int argc, const char** argv)
         groups[1] = nvvk::make<VkRayTracingShaderGroupCreateInfoKHR>();
         groups[1].type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
         groups[1].generalShader = 1;  // Index of ray gen, miss, or callable in `stages`
+        // Group 2 - points to Stage 2 (miss index 1, used by shadow rays)
+        groups[2] = groups[1];
+        groups[2].generalShader = 2;
         // CLOSEST-HIT REGION
         // Group N - uses Stage N as its closest-hit shader
         for (int closestHitShaderIdx = 0; closestHitShaderIdx < NUM_C_HIT_SHADERS; closestHitShaderIdx++)
         {
-            const int moduleIdx = 2 + closestHitShaderIdx;
+            const int moduleIdx = FIRST_C_HIT_MODULE + closestHitShaderIdx;
             groups[moduleIdx] = nvvk::make<VkRayTracingShaderGroupCreateInfoKHR>();
             groups[moduleIdx].type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
             groups[moduleIdx].closestHitShader = moduleIdx;  // Index of closest-hit in `stages`
@@ -470,12 +1231,20 @@ int main(int argc, const char** argv)
         pipelineCreateInfo.pGroups = groups.data();
         pipelineCreateInfo.maxPipelineRayRecursionDepth = 1;  // Depth of call tree
         pipelineCreateInfo.layout = descriptorSetContainer.getPipeLayout();
-        NVVK_CHECK(vkCreateRayTracingPipelinesKHR(context,                 // Device
-            VK_NULL_HANDLE,          // Deferred operation or VK_NULL_HANDLE
-            VK_NULL_HANDLE,          // Pipeline cache or VK_NULL_HANDLE
-            1, &pipelineCreateInfo,  // Array of create infos
-            nullptr,                 // Allocator
-            &rtPipeline));
+        const auto pipelineStart = std::chrono::steady_clock::now();
+        // Compile the pipeline through a deferred operation, so that drivers
+        // that support it can spread the work across the thread pool:
+        NVVK_CHECK(RunDeferredOperation(context, ThreadPool::getDefault(), [&](VkDeferredOperationKHR deferredOperation) {
+            return vkCreateRayTracingPipelinesKHR(context,                 // Device
+                deferredOperation,       // Deferred operation or VK_NULL_HANDLE
+                pipelineCache.get(),     // Pipeline cache or VK_NULL_HANDLE
+                1, &pipelineCreateInfo,  // Array of create infos
+                nullptr,                 // Allocator
+                &rtPipeline);
+        }));
+        const double pipelineMs =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - pipelineStart).count();
+        nvprintf("Created ray tracing pipeline in %.3f ms (pipeline cache: %s).\n", pipelineMs, pipelineCache.getStateName());
         debugUtil.setObjectName(rtPipeline, "rtPipeline");
 
         // Now create and write the shader binding table, by getting the shader
@@ -523,21 +1292,85 @@ int main(int argc, const char** argv)
 
         sbtMissRegion = sbtRayGenRegion;              // The miss shader region:
         sbtMissRegion.deviceAddress = sbtStartAddress + sbtStride;  // Starts sbtStride bytes (1 group) in
-        sbtMissRegion.size = sbtStride;                    // Is this number of bytes long (1 group)
+        sbtMissRegion.size = 2 * sbtStride;                // Is this number of bytes long (2 groups)
 
         sbtHitRegion = sbtRayGenRegion;                  // The hit group region:
-        sbtHitRegion.deviceAddress = sbtStartAddress + 2 * sbtStride;  // Starts 2 * sbtStride bytes (2 groups) in
+        sbtHitRegion.deviceAddress = sbtStartAddress + 3 * sbtStride;  // Starts 3 * sbtStride bytes (3 groups) in
         sbtHitRegion.size = sbtStride * NUM_C_HIT_SHADERS;    // Is this number of bytes long
 
         sbtCallableRegion = sbtRayGenRegion;  // The callable shader region:
         sbtCallableRegion.size = 0;                // Is empty
     }
 
-    const uint32_t NUM_SAMPLE_BATCHES = 32;
-    for (uint32_t sampleBatch = 0; sampleBatch < NUM_SAMPLE_BATCHES; sampleBatch++)
+    // Both tracers end paths the same way:
+    PathTermination pathTermination;
+    pathTermination.maxSegments = options.maxDepth;
+    pathTermination.rouletteMinSegments = options.rouletteDepth;
+    if (options.rouletteDepth < options.maxDepth)
     {
-        // Create and start recording a command buffer
-        VkCommandBuffer cmdBuffer = AllocateAndBeginOneTimeCommandBuffer(context, cmdPool);
+        nvprintf("Paths end after %u segments, with Russian roulette from %u segments.\n", options.maxDepth, options.rouletteDepth);
+    }
+    else
+    {
+        nvprintf("Paths end after %u segments, without Russian roulette.\n", options.maxDepth);
+    }
+
+    // The wavefront tracer shares the scene's resources, but has its own
+    // descriptor set and pipelines:
+    WavefrontTracer wavefrontTracer;
+    if (useWavefront)
+    {
+        WavefrontSceneBindings sceneBindings;
+        sceneBindings.imageView = imageView;
+        sceneBindings.tlas = accelBuilder.getTlas();
+        sceneBindings.vertexBuffer = vertexBuffer.buffer;
+        sceneBindings.indexBuffer = indexBuffer.buffer;
+        sceneBindings.geometryInfoBuffer = geometryInfoBuffer.buffer;
+        sceneBindings.statsBuffer = rayStats.getBuffer();
+        sceneBindings.lightBuffer = lightTable.getBuffer();
+        // Use the same materials as the ray tracing pipeline:
+        std::vector<uint32_t> instanceMaterials;
+        for (const AccelInstance& instance : instances)
+        {
+            instanceMaterials.push_back(instance.hitGroupId);
+        }
+        WavefrontKernelConfig kernelConfig;
+        kernelConfig.enableRayStats = rayStatsEnabled;
+        kernelConfig.sampler = options.sampler;
+        kernelConfig.samplesPerBatch = samplesPerBatch;
+        kernelConfig.workgroupSize = workgroupSize;
+        kernelConfig.pixelOrder = options.pixelOrder;
+        kernelConfig.persistentThreads = options.persistentThreads;
+        wavefrontTracer.init(context, &allocator, &pipelineVariants, context.m_queueGCT, sceneBindings, render_width,
+            render_height, instanceMaterials, kernelConfig);
+        wavefrontTracer.setSortByMaterial(options.materialSort);
+        wavefrontTracer.setPathTermination(pathTermination);
+        nvprintf("Tracing with the wavefront tracer (%u paths in flight).\n", wavefrontTracer.getNumPaths());
+    }
+    else
+    {
+        nvprintf("Tracing with the ray tracing pipeline.\n");
+    }
+
+    // Records the ray tracing pipeline's commands for one sample batch.
+    const auto recordRayTracingPipelineCommands = [&](VkCommandBuffer cmdBuffer) {
+        if (adaptiveEnabled)
+        {
+            // Find the tiles that still need samples:
+            adaptiveSampler.recordBuildTileList(cmdBuffer);
+        }
+
+        // Since batches are no longer separated by vkQueueWaitIdle, make the
+        // previous batch's writes to `image` visible to this batch's shaders:
+        VkMemoryBarrier memoryBarrier = nvvk::make<VkMemoryBarrier>();
+        memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(cmdBuffer,                                     // The command buffer
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,  // From ray tracing shaders
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,  // To ray tracing shaders
+            0,                                             // No special flags
+            1, &memoryBarrier,                             // An array of memory barriers
+            0, nullptr, 0, nullptr);                       // No other barriers
 
         // Bind the ray tracing pipeline:
         vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, rtPipeline);
@@ -545,17 +1378,21 @@ int main(int argc, const char** argv)
         VkDescriptorSet descriptorSet = descriptorSetContainer.getSet(0);
         vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, descriptorSetContainer.getPipeLayout(),
             0, 1, &descriptorSet, 0, nullptr);
+        vkCmdPushConstants(cmdBuffer, descriptorSetContainer.getPipeLayout(), VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0,
+            sizeof(pathTermination), &pathTermination);
 
-        // Push push constants:
-        pushConstants.sample_batch = sampleBatch;
-        vkCmdPushConstants(cmdBuffer,                               // Command buffer
-            descriptorSetContainer.getPipeLayout(),  // Pipeline layout
-            VK_SHADER_STAGE_RAYGEN_BIT_KHR,          // Stage flags
-            0,                                       // Offset
-            sizeof(PushConstants),                   // Size in bytes
-            &pushConstants);                         // Data
+        if (adaptiveEnabled)
+        {
+            // Trace one row of the launch per tile in the list. The launch
+            // size comes from the tile list's header:
+            vkCmdTraceRaysIndirectKHR(cmdBuffer, &sbtRayGenRegion, &sbtMissRegion, &sbtHitRegion, &sbtCallableRegion,
+                adaptiveSampler.getIndirectDeviceAddress());
+            // And tell the CPU how many tiles were left:
+            adaptiveSampler.recordCopyTileCount(cmdBuffer, batchSubmitter.getCurrentSlot());
+            return;
+        }
 
-// Run the ray tracing pipeline and trace rays
+        // Run the ray tracing pipeline and trace rays
         vkCmdTraceRaysKHR(cmdBuffer,           // Command buffer
             &sbtRayGenRegion,    // Region of memory with ray generation groups
             &sbtMissRegion,      // Region of memory with miss groups
@@ -564,70 +1401,153 @@ int main(int argc, const char** argv)
             render_width,        // Width of dispatch
             render_height,       // Height of dispatch
             1);                  // Depth of dispatch
+    };
+
+    // Records the commands for one sample batch. These are the same for every
+    // batch, since both tracers read the batch index from the image.
+    const auto recordTraceCommands = [&](VkCommandBuffer cmdBuffer) {
+        if (rayStatsEnabled)
+        {
+            rayStats.recordReset(cmdBuffer);
+        }
+
+        if (useWavefront)
+        {
+            wavefrontTracer.recordBatch(cmdBuffer);
+        }
+        else
+        {
+            recordRayTracingPipelineCommands(cmdBuffer);
+        }
 
-// On the last sample batch:
-        if (sampleBatch == NUM_SAMPLE_BATCHES - 1)
-        {
-            // Transition `image` from GENERAL to TRANSFER_SRC_OPTIMAL layout. See the
-            // code for uploadCmdBuffer above to see a description of what this does:
-            const VkAccessFlags        srcAccesses = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
-            const VkAccessFlags        dstAccesses = VK_ACCESS_TRANSFER_READ_BIT;
-            const VkPipelineStageFlags srcStages = nvvk::makeAccessMaskPipelineStageFlags(srcAccesses);
-            const VkPipelineStageFlags dstStages = nvvk::makeAccessMaskPipelineStageFlags(dstAccesses);
-            const VkImageMemoryBarrier barrier =
-                nvvk::makeImageMemoryBarrier(image.image,               // The VkImage
-                    srcAccesses, dstAccesses,  // Src and dst access masks
-                    VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,  // Src and dst layouts
-                    VK_IMAGE_ASPECT_COLOR_BIT);
-            vkCmdPipelineBarrier(cmdBuffer,             // Command buffer
-                srcStages, dstStages,  // Src and dst pipeline stages
-                0,                     // Dependency flags
-                0, nullptr,            // Global memory barriers
-                0, nullptr,            // Buffer memory barriers
-                1, &barrier);          // Image memory barriers
+        if (rayStatsEnabled)
+        {
+            // Copy this batch's counts to the readback area of the slot being recorded:
+            rayStats.recordCopy(cmdBuffer, batchSubmitter.getCurrentSlot());
+        }
+    };
+
+    // Records the commands that copy `image` to `imageLinear` after the last batch.
+    const auto recordReadbackCommands = [&](VkCommandBuffer cmdBuffer) {
+        const uint32_t readbackSection = profiler.beginSection(cmdBuffer, "readback");
+        // Transition `image` from GENERAL to TRANSFER_SRC_OPTIMAL layout. See the
+        // code for uploadCmdBuffer above to see a description of what this does:
+        const VkAccessFlags        srcAccesses = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+        const VkAccessFlags        dstAccesses = VK_ACCESS_TRANSFER_READ_BIT;
+        const VkPipelineStageFlags srcStages = nvvk::makeAccessMaskPipelineStageFlags(srcAccesses);
+        const VkPipelineStageFlags dstStages = nvvk::makeAccessMaskPipelineStageFlags(dstAccesses);
+        const VkImageMemoryBarrier barrier =
+            nvvk::makeImageMemoryBarrier(image.image,               // The VkImage
+                srcAccesses, dstAccesses,  // Src and dst access masks
+                VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,  // Src and dst layouts
+                VK_IMAGE_ASPECT_COLOR_BIT);
+        vkCmdPipelineBarrier(cmdBuffer,             // Command buffer
+            srcStages, dstStages,  // Src and dst pipeline stages
+            0,                     // Dependency flags
+            0, nullptr,            // Global memory barriers
+            0, nullptr,            // Buffer memory barriers
+            1, &barrier);          // Image memory barriers
 
 // Now, copy the image (which has layout TRANSFER_SRC_OPTIMAL) to imageLinear
 // (which has layout TRANSFER_DST_OPTIMAL).
+        {
+            VkImageCopy region;
+            // We copy the image aspect, layer 0, mip 0:
+            region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            region.srcSubresource.baseArrayLayer = 0;
+            region.srcSubresource.layerCount = 1;
+            region.srcSubresource.mipLevel = 0;
+            // (0, 0, 0) in the first image corresponds to (0, 0, 0) in the second image:
+            region.srcOffset = { 0, 0, 0 };
+            region.dstSubresource = region.srcSubresource;
+            region.dstOffset = { 0, 0, 0 };
+            // Copy the entire image:
+            region.extent = { render_width, render_height, 1 };
+            vkCmdCopyImage(cmdBuffer,                             // Command buffer
+                image.image,                           // Source image
+                VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,  // Source image layout
+                imageLinear.image,                     // Destination image
+                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,  // Destination image layout
+                1, &region);                           // Regions
+        }
+
+        // Add a command that says "Make it so that memory writes by transfers
+        // are available to read from the CPU." (In other words, "Flush the GPU caches
+        // so the CPU can read the data.") To do this, we use a memory barrier.
+        VkMemoryBarrier memoryBarrier = nvvk::make<VkMemoryBarrier>();
+        memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;  // Make transfer writes
+        memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;       // Readable by the CPU
+        vkCmdPipelineBarrier(cmdBuffer,                                // The command buffer
+            VK_PIPELINE_STAGE_TRANSFER_BIT,           // From transfers
+            VK_PIPELINE_STAGE_HOST_BIT,               // To the CPU
+            0,                                        // No special flags
+            1, &memoryBarrier,                        // An array of memory barriers
+            0, nullptr, 0, nullptr);                  // No other barriers
+        profiler.endSection(cmdBuffer, readbackSection);
+    };
+
+    const uint32_t NUM_SAMPLE_BATCHES = (TOTAL_SAMPLES_PER_PIXEL + samplesPerBatch - 1) / samplesPerBatch;
+    nvprintf("Rendering %u samples per pixel in %u batches of %u.\n", NUM_SAMPLE_BATCHES * samplesPerBatch,
+             NUM_SAMPLE_BATCHES, samplesPerBatch);
+    if (options.replayCommandBuffers)
+    {
+        // Record the batches once; after this, each batch is a single vkQueueSubmit:
+        batchSubmitter.recordReplayableBatches(recordTraceCommands);
+        uint32_t sampleBatch = 0;
+        for (; sampleBatch < NUM_SAMPLE_BATCHES; sampleBatch++)
+        {
+            // With adaptive sampling, stop once a retired batch had nothing
+            // left to trace. Retire the slot's last batch first, as below, so
+            // that its tile count is read before deciding to submit another.
+            batchSubmitter.waitForSlot();
+            if (adaptiveEnabled && adaptiveSampler.isConverged())
             {
-                VkImageCopy region;
-                // We copy the image aspect, layer 0, mip 0:
-                region.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-                region.srcSubresource.baseArrayLayer = 0;
-                region.srcSubresource.layerCount = 1;
-                region.srcSubresource.mipLevel = 0;
-                // (0, 0, 0) in the first image corresponds to (0, 0, 0) in the second image:
-                region.srcOffset = { 0, 0, 0 };
-                region.dstSubresource = region.srcSubresource;
-                region.dstOffset = { 0, 0, 0 };
-                // Copy the entire image:
-                region.extent = { render_width, render_height, 1 };
-                vkCmdCopyImage(cmdBuffer,                             // Command buffer
-                    image.image,                           // Source image
-                    VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,  // Source image layout
-                    imageLinear.image,                     // Destination image
-                    VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,  // Destination image layout
-                    1, &region);                           // Regions
+                nvprintf("Every tile converged after %u sample batches.\n", sampleBatch);
+                break;
             }
+            batchSubmitter.replayBatch();
+        }
+        nvprintf("Submitted %u pre-recorded sample batches.\n", sampleBatch);
+    }
+    else
+    {
+        for (uint32_t sampleBatch = 0; sampleBatch < NUM_SAMPLE_BATCHES; sampleBatch++)
+        {
+            // With adaptive sampling, stop once a retired batch had nothing
+            // left to trace. (waitForSlot() retires the slot's last batch.)
+            batchSubmitter.waitForSlot();
+            if (adaptiveEnabled && adaptiveSampler.isConverged())
+            {
+                nvprintf("Every tile converged after %u sample batches.\n", sampleBatch);
+                break;
+            }
+            // Start recording a free command buffer:
+            VkCommandBuffer cmdBuffer = batchSubmitter.beginBatch();
+            recordTraceCommands(cmdBuffer);
+            // End and submit the command buffer, without waiting for it to finish:
+            batchSubmitter.submitBatch();
 
-            // Add a command that says "Make it so that memory writes by transfers
-            // are available to read from the CPU." (In other words, "Flush the GPU caches
-            // so the CPU can read the data.") To do this, we use a memory barrier.
-            VkMemoryBarrier memoryBarrier = nvvk::make<VkMemoryBarrier>();
-            memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;  // Make transfer writes
-            memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;       // Readable by the CPU
-            vkCmdPipelineBarrier(cmdBuffer,                                // The command buffer
-                VK_PIPELINE_STAGE_TRANSFER_BIT,           // From transfers
-                VK_PIPELINE_STAGE_HOST_BIT,               // To the CPU
-                0,                                        // No special flags
-                1, &memoryBarrier,                        // An array of memory barriers
-                0, nullptr, 0, nullptr);                  // No other barriers
-        }
-
-        // End and submit the command buffer, then wait for it to finish:
-        EndSubmitWaitAndFreeCommandBuffer(context, context.m_queueGCT, cmdPool, cmdBuffer);
+            nvprintf("Submitted sample batch index %d.\n", sampleBatch);
+        }
+    }
+    // Copy the image back in a batch of its own, so that its time only counts
+    // as "readback" and not as part of the last sample batch:
+    {
+        VkCommandBuffer cmdBuffer = batchSubmitter.beginBatch("readback batch");
+        recordReadbackCommands(cmdBuffer);
+        batchSubmitter.submitBatch();
+    }
 
-        nvprintf("Rendered sample batch index %d.\n", sampleBatch);
+    // Wait for the last batches to finish before reading the image:
+    batchSubmitter.waitIdle();
+    batchSubmitter.printStatistics();
+    if (rayStatsEnabled)
+    {
+        rayStats.printSummary();
     }
+    // All work has finished, so we can read every timestamp:
+    profiler.resolve();
+    profiler.printTable();
 
     // Get the image data back from the GPU
     void* data;
@@ -635,6 +1555,57 @@ int main(int argc, const char** argv)
     stbi_write_hdr("out.hdr", render_width, render_height, 4, reinterpret_cast<float*>(data));
     vkUnmapMemory(context, imageLinear.allocation);
 
+    BenchmarkImage benchmarkImage;
+    benchmarkImage.device = context;
+    benchmarkImage.image = image.image;
+    benchmarkImage.linearImage = imageLinear.image;
+    benchmarkImage.linearMemory = imageLinear.allocation;
+    benchmarkImage.width = render_width;
+    benchmarkImage.height = render_height;
+    if (options.benchmarkSamplers && useWavefront)
+    {
+        RunSamplerConvergenceBenchmark(wavefrontTracer, batchSubmitter, benchmarkImage);
+    }
+    if (options.benchmarkBsdf && useWavefront)
+    {
+        RunBsdfSamplingBenchmark(wavefrontTracer, batchSubmitter, benchmarkImage);
+    }
+    if (options.benchmarkPixelOrder && useWavefront)
+    {
+        RunPixelOrderBenchmark(wavefrontTracer, batchSubmitter, benchmarkImage);
+    }
+    if (options.autotune && useWavefront)
+    {
+        const uint32_t maxWorkgroupSize = std::min<uint32_t>(MAX_WAVEFRONT_WORKGROUP_SIZE,
+            std::min(limits.maxComputeWorkGroupSize[0], limits.maxComputeWorkGroupInvocations));
+        LaunchTuning bestTuning;
+        if (RunLaunchTuningBenchmark(wavefrontTracer, batchSubmitter, benchmarkImage, maxWorkgroupSize, bestTuning)
+            && SaveLaunchTuning(context.m_physicalDevice, bestTuning))
+        {
+            nvprintf("Saved launch tuning to %s.\n", GetLaunchTuningFilename(context.m_physicalDevice).c_str());
+        }
+    }
+    if (options.benchmarkMaterials && useWavefront)
+    {
+        RunMaterialSortBenchmark(wavefrontTracer, batchSubmitter, benchmarkImage);
+    }
+    // The benchmarks add batches of their own, so write the profile once
+    // every batch has retired and added its time:
+    batchSubmitter.waitIdle();
+    profiler.resolve();
+    profiler.writeJson(options.profileFilename);
+
+    batchSubmitter.deinit();
+    if (useWavefront)
+    {
+        wavefrontTracer.deinit();
+    }
+    rayStats.deinit();
+    adaptiveSampler.deinit();
+    pipelineVariants.deinit();
+    // Save the pipeline cache so that the next run doesn't need to compile shaders again:
+    pipelineCache.save();
+    pipelineCache.deinit();
     allocator.destroy(rtSBTBuffer);
     vkDestroyPipeline(context, rtPipeline, nullptr);
     for (VkShaderModule& shaderModule : modules)
@@ -642,9 +1613,12 @@ int main(int argc, const char** argv)
         vkDestroyShaderModule(context, shaderModule, nullptr);
     }
     descriptorSetContainer.deinit();
-    raytracingBuilder.destroy();
+    accelBuilder.deinit();
+    profiler.deinit();
     allocator.destroy(vertexBuffer);
     allocator.destroy(indexBuffer);
+    allocator.destroy(geometryInfoBuffer);
+    lightTable.deinit();
     vkDestroyCommandPool(context, cmdPool, nullptr);
     allocator.destroy(imageLinear);
     vkDestroyImageView(context, imageView, nullptr);
@@ -0,0 +1,379 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "mesh_cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#define TINYOBJLOADER_IMPLEMENTATION
+#include <fileformats/tiny_obj_loader.h>
+#include <nvh/nvprint.hpp>  // For nvprintf
+#include <sys/stat.h>
+
+#include "file_utils.hpp"
+#include "obj_parser.hpp"
+#include "thread_pool.hpp"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::open(const std::string& filename)
+{
+    close();
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr)
+    {
+        CloseHandle(file);
+        return false;
+    }
+    m_data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (m_data == nullptr)
+    {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    m_file = file;
+    m_mapping = mapping;
+    m_size = static_cast<size_t>(fileSize.QuadPart);
+#else
+    const int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size == 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    void* mapped = mmap(nullptr, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);  // The mapping keeps the file alive
+    if (mapped == MAP_FAILED)
+    {
+        return false;
+    }
+    // We read the file once from start to end while uploading it:
+    madvise(mapped, static_cast<size_t>(fileStat.st_size), MADV_SEQUENTIAL);
+    m_data = static_cast<const uint8_t*>(mapped);
+    m_size = static_cast<size_t>(fileStat.st_size);
+#endif
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (m_data == nullptr)
+    {
+        return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(m_data);
+    CloseHandle(static_cast<HANDLE>(m_mapping));
+    CloseHandle(static_cast<HANDLE>(m_file));
+    m_file = nullptr;
+    m_mapping = nullptr;
+#else
+    munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+    m_data = nullptr;
+    m_size = 0;
+}
+
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash)
+{
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Gets the size and modification time of a file. Returns false if it doesn't exist.
+static bool GetFileInfo(const std::string& filename, uint64_t& size, int64_t& modifiedTime)
+{
+#ifdef _WIN32
+    struct _stat64 fileStat;
+    if (_stat64(filename.c_str(), &fileStat) != 0)
+    {
+        return false;
+    }
+#else
+    struct stat fileStat;
+    if (stat(filename.c_str(), &fileStat) != 0)
+    {
+        return false;
+    }
+#endif
+    size = static_cast<uint64_t>(fileStat.st_size);
+    modifiedTime = static_cast<int64_t>(fileStat.st_mtime);
+    return true;
+}
+
+namespace {
+// Returns MeshCacheHeader::contentHash for the given arrays.
+uint64_t HashMeshContent(const float* vertices, uint64_t numVertices, const uint32_t* indices, uint64_t numIndices,
+    const ObjShape* shapes, uint64_t numShapes)
+{
+    uint64_t hash = HashBytes(vertices, numVertices * 3 * sizeof(float));
+    hash = HashBytes(indices, numIndices * sizeof(uint32_t), hash);
+    return HashBytes(shapes, numShapes * sizeof(ObjShape), hash);
+}
+
+// Sets the emission of `shape` to the Ke of `material`.
+void SetEmission(ObjShape& shape, const tinyobj::material_t& material)
+{
+    for (int c = 0; c < 3; c++)
+    {
+        shape.emission[c] = material.emission[c];
+    }
+}
+
+// Sets the emission of each shape of `objMesh` from the materials named by
+// its `usemtl` records, using tinyobj to read the material libraries next to
+// `objFilename`. Materials that can't be found don't emit light.
+void LoadShapeEmission(const std::string& objFilename, ObjMesh& objMesh)
+{
+    const std::string                directory = objFilename.substr(0, objFilename.find_last_of("/\\") + 1);
+    std::map<std::string, int>       materialMap;
+    std::vector<tinyobj::material_t> materials;
+    for (const std::string& library : objMesh.materialLibraries)
+    {
+        std::ifstream stream(directory + library);
+        if (!stream)
+        {
+            nvprintf("Could not open the material library %s; its materials won't emit light.\n", library.c_str());
+            continue;
+        }
+        std::string warning, error;
+        tinyobj::LoadMtl(&materialMap, &materials, &stream, &warning, &error);
+    }
+    for (size_t shapeIdx = 0; shapeIdx < objMesh.shapes.size(); shapeIdx++)
+    {
+        const auto material = materialMap.find(objMesh.shapeMaterials[shapeIdx]);
+        if (material != materialMap.end())
+        {
+            SetEmission(objMesh.shapes[shapeIdx], materials[material->second]);
+        }
+    }
+}
+}  // namespace
+
+bool MeshFile::load(const std::string& objFilename, const MeshLoadOptions& options)
+{
+    close();
+    m_shapes.clear();
+    uint64_t sourceSize = 0;
+    int64_t  sourceModifiedTime = 0;
+    if (!GetFileInfo(objFilename, sourceSize, sourceModifiedTime))
+    {
+        nvprintf("Could not find %s.\n", objFilename.c_str());
+        return false;
+    }
+
+    const std::string cacheFilename = objFilename + ".vmpmesh";
+    if (options.useCache && openCache(cacheFilename, sourceSize, sourceModifiedTime))
+    {
+        return true;
+    }
+    if (!parse(objFilename, options.useTinyObj))
+    {
+        return false;
+    }
+
+    MeshCacheHeader& header = m_header;
+    header = MeshCacheHeader{};
+    memcpy(header.magic, "VMPM", 4);
+    header.version = MESH_CACHE_VERSION;
+    header.sourceSize = sourceSize;
+    header.sourceModifiedTime = sourceModifiedTime;
+    header.numVertices = m_ownedVertices.size() / 3;
+    header.numIndices = m_ownedIndices.size();
+    header.numShapes = m_shapes.size();
+    const size_t vertexBytes = m_ownedVertices.size() * sizeof(float);
+    const size_t indexBytes = m_ownedIndices.size() * sizeof(uint32_t);
+    header.contentHash = HashMeshContent(m_ownedVertices.data(), header.numVertices, m_ownedIndices.data(), header.numIndices,
+                                         m_shapes.data(), header.numShapes);
+    // Align each array to 16 bytes from the start of the file:
+    header.vertexOffset = (sizeof(MeshCacheHeader) + 15) & ~uint64_t(15);
+    header.indexOffset = (header.vertexOffset + vertexBytes + 15) & ~uint64_t(15);
+    header.shapeOffset = (header.indexOffset + indexBytes + 15) & ~uint64_t(15);
+    m_vertices = m_ownedVertices.data();
+    m_indices = m_ownedIndices.data();
+
+    if (options.useCache)
+    {
+        nvprintf("Converting %s to %s.\n", objFilename.c_str(), cacheFilename.c_str());
+        writeCache(cacheFilename);
+    }
+    return true;
+}
+
+void MeshFile::close()
+{
+    m_mapping.close();
+    m_ownedVertices = std::vector<float>();
+    m_ownedIndices = std::vector<uint32_t>();
+    m_vertices = nullptr;
+    m_indices = nullptr;
+}
+
+bool MeshFile::openCache(const std::string& cacheFilename, uint64_t sourceSize, int64_t sourceModifiedTime)
+{
+    if (!m_mapping.open(cacheFilename))
+    {
+        return false;
+    }
+
+    MeshCacheHeader header;
+    if (m_mapping.size() < sizeof(header))
+    {
+        m_mapping.close();
+        return false;
+    }
+    memcpy(&header, m_mapping.data(), sizeof(header));
+    bool valid = (memcmp(header.magic, "VMPM", 4) == 0) && (header.version == MESH_CACHE_VERSION)
+        && (header.sourceSize == sourceSize) && (header.sourceModifiedTime == sourceModifiedTime)
+        && (header.vertexOffset % alignof(float) == 0) && (header.indexOffset % alignof(uint32_t) == 0)
+        && (header.shapeOffset % alignof(ObjShape) == 0) && (header.vertexOffset <= m_mapping.size())
+        && (header.indexOffset <= m_mapping.size()) && (header.shapeOffset <= m_mapping.size())
+        && (header.numVertices <= (m_mapping.size() - header.vertexOffset) / (3 * sizeof(float)))
+        && (header.numIndices <= (m_mapping.size() - header.indexOffset) / sizeof(uint32_t))
+        && (header.numShapes <= (m_mapping.size() - header.shapeOffset) / sizeof(ObjShape));
+    if (valid)
+    {
+        const ObjShape* shapes = reinterpret_cast<const ObjShape*>(m_mapping.data() + header.shapeOffset);
+        m_shapes.assign(shapes, shapes + header.numShapes);
+    }
+    for (const ObjShape& shape : m_shapes)
+    {
+        valid = valid && (uint64_t(shape.firstIndex) + shape.numIndices <= header.numIndices);
+    }
+    const float*    vertices = reinterpret_cast<const float*>(m_mapping.data() + header.vertexOffset);
+    const uint32_t* indices = reinterpret_cast<const uint32_t*>(m_mapping.data() + header.indexOffset);
+    // The GPU reads vertices through these indices, so a corrupt or
+    // overwritten file must never get past here:
+    for (uint64_t i = 0; valid && i < header.numIndices; i++)
+    {
+        valid = indices[i] < header.numVertices;
+    }
+    valid = valid
+        && (HashMeshContent(vertices, header.numVertices, indices, header.numIndices, m_shapes.data(), header.numShapes)
+            == header.contentHash);
+    if (!valid)
+    {
+        nvprintf("%s is out of date or invalid.\n", cacheFilename.c_str());
+        m_mapping.close();
+        m_shapes.clear();
+        return false;
+    }
+
+    m_header = header;
+    m_vertices = vertices;
+    m_indices = indices;
+    return true;
+}
+
+bool MeshFile::parse(const std::string& objFilename, bool useTinyObj)
+{
+    if (!useTinyObj)
+    {
+        ObjMesh     objMesh;
+        std::string error;
+        if (!ParseObjFileParallel(objFilename, ThreadPool::getDefault(), objMesh, error))
+        {
+            nvprintf("Could not parse %s: %s\n", objFilename.c_str(), error.c_str());
+            return false;
+        }
+        LoadShapeEmission(objFilename, objMesh);
+        m_ownedVertices = std::move(objMesh.vertices);
+        m_ownedIndices = std::move(objMesh.indices);
+        m_shapes = std::move(objMesh.shapes);
+        return true;
+    }
+
+    tinyobj::ObjReader reader;  // Used to read an OBJ file
+    reader.ParseFromFile(objFilename);
+    if (!reader.Valid())  // Make sure tinyobj was able to parse this file
+    {
+        nvprintf("Could not parse %s: %s\n", objFilename.c_str(), reader.Error().c_str());
+        return false;
+    }
+    // Pack the vertex indices of all shapes into one index array. tinyobj's
+    // vertex indices already refer to the shared `attrib.vertices` array.
+    // Like the multithreaded parser, start a new shape wherever the material
+    // changes, so that each shape has one material.
+    m_ownedVertices = reader.GetAttrib().GetVertices();
+    const std::vector<tinyobj::material_t>& materials = reader.GetMaterials();
+    for (const tinyobj::shape_t& objShape : reader.GetShapes())
+    {
+        const std::vector<int>& materialIds = objShape.mesh.material_ids;  // One per triangle
+        for (size_t triangle = 0; triangle < materialIds.size(); triangle++)
+        {
+            if (triangle == 0 || materialIds[triangle] != materialIds[triangle - 1])
+            {
+                m_shapes.push_back({ static_cast<uint32_t>(m_ownedIndices.size()), 0, {} });
+                if (materialIds[triangle] >= 0 && static_cast<size_t>(materialIds[triangle]) < materials.size())
+                {
+                    SetEmission(m_shapes.back(), materials[materialIds[triangle]]);
+                }
+            }
+            for (size_t corner = 0; corner < 3; corner++)
+            {
+                m_ownedIndices.push_back(objShape.mesh.indices[3 * triangle + corner].vertex_index);
+            }
+            m_shapes.back().numIndices += 3;
+        }
+    }
+    return true;
+}
+
+void MeshFile::writeCache(const std::string& cacheFilename) const
+{
+    const MeshCacheHeader& header = m_header;
+    const size_t           vertexBytes = header.numVertices * 3 * sizeof(float);
+    const size_t           indexBytes = header.numIndices * sizeof(uint32_t);
+    const size_t           shapeBytes = header.numShapes * sizeof(ObjShape);
+
+    // Other processes may load the same OBJ file, so they must never map a
+    // partially written cache file:
+    const bool written = WriteFileAtomically(cacheFilename, [&](std::ostream& file) {
+        const char padding[16] = {};
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(padding, static_cast<std::streamsize>(header.vertexOffset - sizeof(header)));
+        file.write(reinterpret_cast<const char*>(m_vertices), static_cast<std::streamsize>(vertexBytes));
+        file.write(padding, static_cast<std::streamsize>(header.indexOffset - header.vertexOffset - vertexBytes));
+        file.write(reinterpret_cast<const char*>(m_indices), static_cast<std::streamsize>(indexBytes));
+        file.write(padding, static_cast<std::streamsize>(header.shapeOffset - header.indexOffset - indexBytes));
+        file.write(reinterpret_cast<const char*>(m_shapes.data()), static_cast<std::streamsize>(shapeBytes));
+        return static_cast<bool>(file);
+    });
+    if (!written)
+    {
+        nvprintf("Could not write %s; using the parsed mesh from memory.\n", cacheFilename.c_str());
+    }
+}
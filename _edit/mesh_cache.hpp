@@ -0,0 +1,120 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_MESH_CACHE_HPP
+#define VK_MINI_PATH_TRACER_MESH_CACHE_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "obj_parser.hpp"
+
+// A read-only memory mapping of a whole file.
+class MappedFile
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() { close(); }
+
+    // Maps `filename` into memory. Returns false if the file couldn't be opened.
+    bool open(const std::string& filename);
+    void close();
+
+    const uint8_t* data() const { return m_data; }
+    size_t         size() const { return m_size; }
+
+private:
+    const uint8_t* m_data = nullptr;
+    size_t         m_size = 0;
+#ifdef _WIN32
+    void* m_file = nullptr;     // HANDLE
+    void* m_mapping = nullptr;  // HANDLE
+#endif
+};
+
+// The binary mesh cache format. A .vmpmesh file contains this header,
+// followed by `numVertices` tightly packed float3 positions starting at
+// `vertexOffset`, `numIndices` uint32 indices starting at `indexOffset`, and
+// `numShapes` ObjShape ranges starting at `shapeOffset`. The vertex and index
+// arrays have the same layout as the GPU vertex and index buffers, so they
+// can be uploaded directly from the memory-mapped file.
+struct MeshCacheHeader
+{
+    char     magic[4];             // "VMPM"
+    uint32_t version;              // MESH_CACHE_VERSION
+    uint64_t sourceSize;           // Size in bytes of the OBJ file this was converted from
+    int64_t  sourceModifiedTime;   // Modification time of the OBJ file this was converted from
+    uint64_t contentHash;          // 64-bit FNV-1a hash of the vertex, index, and shape arrays
+    uint64_t numVertices;          // Number of float3 positions
+    uint64_t numIndices;           // Number of uint32 indices (3 per triangle)
+    uint64_t vertexOffset;         // Byte offset of the positions from the start of the file
+    uint64_t indexOffset;          // Byte offset of the indices from the start of the file
+    uint64_t numShapes;            // Number of ObjShape ranges
+    uint64_t shapeOffset;          // Byte offset of the shapes from the start of the file
+};
+
+const uint32_t MESH_CACHE_VERSION = 3;
+
+// Returns the 64-bit FNV-1a hash of `size` bytes at `data`, continuing from `hash`.
+uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 0xcbf29ce484222325ull);
+
+// How MeshFile loads OBJ files.
+struct MeshLoadOptions
+{
+    // If false, always parse the OBJ file, and don't read or write .vmpmesh files.
+    bool useCache = true;
+    // If true, parse OBJ files with tinyobj instead of the multithreaded parser.
+    bool useTinyObj = false;
+};
+
+// A triangle mesh loaded from an OBJ file through the binary mesh cache.
+//
+// The first time an OBJ file is loaded, it's parsed and converted to a
+// .vmpmesh file next to it. Later runs memory-map the .vmpmesh file instead,
+// so no text parsing happens and the vertex and index data never pass through
+// intermediate vectors. If the OBJ file changes size or modification time, the
+// cache is rebuilt, and so is a cache whose arrays don't match its content
+// hash or whose indices point past its vertices. The cache also stores each
+// shape's emission from the OBJ's material libraries, but doesn't check
+// them; after editing only an MTL file, load with useCache = false.
+class MeshFile
+{
+public:
+    // Loads the mesh for `objFilename`, converting it if needed.
+    // Returns false if neither the cache nor the OBJ file could be loaded.
+    bool load(const std::string& objFilename, const MeshLoadOptions& options = MeshLoadOptions());
+    // Releases the mesh data. Counts, shapes, and the hash remain valid.
+    void close();
+
+    const float*    vertices() const { return m_vertices; }  // 3 floats per vertex
+    const uint32_t* indices() const { return m_indices; }
+    uint64_t        numVertices() const { return m_header.numVertices; }
+    uint64_t        numIndices() const { return m_header.numIndices; }
+    uint64_t        contentHash() const { return m_header.contentHash; }
+    // The shapes of the mesh; one BLAS geometry each. These stay valid after close().
+    const std::vector<ObjShape>& shapes() const { return m_shapes; }
+
+private:
+    // Tries to use an existing cache file. Returns false if it's missing,
+    // invalid, or out of date. This reads the whole file once, to check its
+    // content hash and its indices.
+    bool openCache(const std::string& cacheFilename, uint64_t sourceSize, int64_t sourceModifiedTime);
+    // Parses the OBJ file into m_ownedVertices and m_ownedIndices.
+    bool parse(const std::string& objFilename, bool useTinyObj);
+    // Writes the parsed data to a cache file. If this fails, the parsed data
+    // is still used from memory.
+    void writeCache(const std::string& cacheFilename) const;
+
+    MeshCacheHeader m_header{};
+    MappedFile      m_mapping;
+    const float*    m_vertices = nullptr;
+    const uint32_t* m_indices = nullptr;
+    std::vector<ObjShape> m_shapes;
+    // Holds the mesh when it was parsed in this run instead of mapped from the cache:
+    std::vector<float>    m_ownedVertices;
+    std::vector<uint32_t> m_ownedIndices;
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_MESH_CACHE_HPP
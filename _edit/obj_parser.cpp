@@ -0,0 +1,486 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "obj_parser.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "mesh_cache.hpp"  // For MappedFile
+#include "thread_pool.hpp"
+
+namespace {
+
+// Chunks smaller than this aren't worth a task of their own.
+const size_t MIN_CHUNK_BYTES = 256 * 1024;
+
+// The results of parsing one line-aligned piece of the file.
+struct Chunk
+{
+    const char*           begin = nullptr;
+    const char*           end = nullptr;
+    std::vector<float>    vertices;
+    std::vector<uint32_t> indices;
+    // Negative (relative) face indices can't be resolved until we know how
+    // many vertices precede the chunk. For those, `indices` holds a
+    // placeholder, and this list says which vertex (counted from the first
+    // vertex of this chunk, so possibly negative) belongs there.
+    struct Fixup
+    {
+        size_t  position;
+        int64_t chunkRelativeVertex;
+    };
+    std::vector<Fixup> fixups;
+    // Positions in `indices` where an `o`, `g`, or `usemtl` record started a
+    // new shape. A chunk doesn't know which material is in effect at its
+    // start, so only `usemtl` records name one:
+    struct ShapeStart
+    {
+        size_t      position;
+        bool        setsMaterial;
+        std::string material;
+    };
+    std::vector<ShapeStart>  shapeStarts;
+    std::vector<std::string> materialLibraries;  // From `mtllib` records
+    // Offsets of this chunk's data in the merged arrays, from prefix sums:
+    size_t      vertexOffset = 0;
+    size_t      indexOffset = 0;
+    const char* errorAt = nullptr;  // Start of the first malformed line, if any
+};
+
+inline bool IsSpace(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+inline bool IsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+inline const char* SkipSpaces(const char* p, const char* end)
+{
+    while (p < end && IsSpace(*p))
+    {
+        p++;
+    }
+    return p;
+}
+
+// Returns a pointer to the character after the next newline.
+inline const char* SkipLine(const char* p, const char* end)
+{
+    const char* newline = static_cast<const char*>(memchr(p, '\n', static_cast<size_t>(end - p)));
+    return (newline != nullptr) ? newline + 1 : end;
+}
+
+// Parses a decimal floating-point number such as -1.5e-3 without allocating
+// or depending on the locale. Digits past the 19th are dropped, which is far
+// more precision than a float can hold.
+bool ParseFloat(const char*& p, const char* end, float& result)
+{
+    // Exact powers of 10 that a double can represent:
+    static const double powersOf10[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                         1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const char*         s = p;
+    bool                negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+    {
+        negative = (*s == '-');
+        s++;
+    }
+
+    uint64_t mantissa = 0;
+    int      exponent = 0;
+    int      numDigits = 0;
+    bool     anyDigits = false;
+    for (; s < end && IsDigit(*s); s++, anyDigits = true)
+    {
+        if (numDigits < 19)
+        {
+            mantissa = mantissa * 10 + uint64_t(*s - '0');
+            numDigits += (mantissa != 0) ? 1 : 0;
+        }
+        else
+        {
+            exponent++;
+        }
+    }
+    if (s < end && *s == '.')
+    {
+        for (s++; s < end && IsDigit(*s); s++, anyDigits = true)
+        {
+            if (numDigits < 19)
+            {
+                mantissa = mantissa * 10 + uint64_t(*s - '0');
+                numDigits += (mantissa != 0) ? 1 : 0;
+                exponent--;
+            }
+        }
+    }
+    if (!anyDigits)
+    {
+        return false;
+    }
+    if (s < end && (*s == 'e' || *s == 'E'))
+    {
+        const char* exponentStart = s + 1;
+        bool        negativeExponent = false;
+        if (exponentStart < end && (*exponentStart == '-' || *exponentStart == '+'))
+        {
+            negativeExponent = (*exponentStart == '-');
+            exponentStart++;
+        }
+        if (exponentStart < end && IsDigit(*exponentStart))
+        {
+            int explicitExponent = 0;
+            for (s = exponentStart; s < end && IsDigit(*s); s++)
+            {
+                explicitExponent = std::min(explicitExponent * 10 + (*s - '0'), 100000);
+            }
+            exponent += negativeExponent ? -explicitExponent : explicitExponent;
+        }
+    }
+
+    double value = static_cast<double>(mantissa);
+    if (mantissa != 0)
+    {
+        // Apply the exponent in steps of at most 10^22; with this many steps
+        // the result is exact whenever the inputs are, and close otherwise.
+        while (exponent > 22 && value < 1e300)
+        {
+            value *= powersOf10[22];
+            exponent -= 22;
+        }
+        while (exponent < -22 && value > 1e-300)
+        {
+            value /= powersOf10[22];
+            exponent += 22;
+        }
+        if (exponent >= 0)
+        {
+            value *= powersOf10[std::min(exponent, 22)];
+        }
+        else
+        {
+            value /= powersOf10[std::min(-exponent, 22)];
+        }
+    }
+    result = static_cast<float>(negative ? -value : value);
+    p = s;
+    return true;
+}
+
+// Parses an optionally signed decimal integer.
+bool ParseInt(const char*& p, const char* end, int64_t& result)
+{
+    const char* s = p;
+    bool        negative = false;
+    if (s < end && (*s == '-' || *s == '+'))
+    {
+        negative = (*s == '-');
+        s++;
+    }
+    if (s >= end || !IsDigit(*s))
+    {
+        return false;
+    }
+    int64_t value = 0;
+    for (; s < end && IsDigit(*s); s++)
+    {
+        value = value * 10 + (*s - '0');
+        if (value > INT64_C(0xFFFFFFFF))
+        {
+            return false;  // More vertices than a uint32 index can address
+        }
+    }
+    result = negative ? -value : value;
+    p = s;
+    return true;
+}
+
+// Returns true if the line at `p` starts with the record type `keyword`
+// followed by a space.
+inline bool IsRecord(const char* p, const char* lineEnd, const char* keyword, size_t length)
+{
+    return p + length < lineEnd && memcmp(p, keyword, length) == 0 && IsSpace(p[length]);
+}
+
+// Returns true if the line starting at `p` is an `o` or `g` record. Unlike
+// IsRecord(), this also accepts a bare `g` without a name, which starts the
+// default group.
+inline bool IsGroupRecord(const char* p, const char* lineEnd)
+{
+    return p < lineEnd && (*p == 'o' || *p == 'g')
+           && (p + 1 == lineEnd || IsSpace(p[1]) || p[1] == '\r' || p[1] == '\n');
+}
+
+// Splits the rest of a line into names separated by spaces, and calls
+// `onName` with each one.
+template <class Function>
+void ForEachName(const char* p, const char* lineEnd, Function onName)
+{
+    for (;;)
+    {
+        p = SkipSpaces(p, lineEnd);
+        const char* nameEnd = p;
+        while (nameEnd < lineEnd && !IsSpace(*nameEnd) && *nameEnd != '\r' && *nameEnd != '\n')
+        {
+            nameEnd++;
+        }
+        if (nameEnd == p)
+        {
+            return;
+        }
+        onName(std::string(p, nameEnd));
+        p = nameEnd;
+    }
+}
+
+// Parses a `v x y z [w]` record, starting after the `v`.
+bool ParseVertex(const char* p, const char* lineEnd, Chunk& chunk)
+{
+    float xyz[3];
+    for (float& coordinate : xyz)
+    {
+        p = SkipSpaces(p, lineEnd);
+        if (!ParseFloat(p, lineEnd, coordinate))
+        {
+            return false;
+        }
+    }
+    chunk.vertices.insert(chunk.vertices.end(), xyz, xyz + 3);
+    return true;
+}
+
+// Parses an `f v1[/vt1][/vn1] v2... v3...` record, starting after the `f`,
+// and appends its triangles to the chunk.
+bool ParseFace(const char* p, const char* lineEnd, Chunk& chunk, std::vector<int64_t>& faceVertices)
+{
+    faceVertices.clear();
+    const int64_t chunkVertexCount = static_cast<int64_t>(chunk.vertices.size() / 3);
+    for (;;)
+    {
+        p = SkipSpaces(p, lineEnd);
+        if (p >= lineEnd || *p == '\r' || *p == '#')
+        {
+            break;
+        }
+        int64_t index;
+        if (!ParseInt(p, lineEnd, index) || index == 0)
+        {
+            return false;
+        }
+        // Skip the texture coordinate and normal indices; we only use positions:
+        while (p < lineEnd && !IsSpace(*p) && *p != '\r')
+        {
+            p++;
+        }
+        // Store positive indices 0-based, and negative indices as a vertex
+        // number relative to the start of this chunk, marked by an offset:
+        faceVertices.push_back((index > 0) ? index - 1 : INT64_MIN / 2 + (chunkVertexCount + index));
+    }
+    if (faceVertices.size() < 3)
+    {
+        return false;
+    }
+
+    const auto emit = [&](int64_t faceVertex) {
+        if (faceVertex < INT64_MIN / 4)
+        {
+            chunk.fixups.push_back({ chunk.indices.size(), faceVertex - INT64_MIN / 2 });
+            chunk.indices.push_back(0);
+        }
+        else
+        {
+            chunk.indices.push_back(static_cast<uint32_t>(faceVertex));
+        }
+    };
+    // Triangulate as a fan around the first vertex, like tinyobj:
+    for (size_t k = 2; k < faceVertices.size(); k++)
+    {
+        emit(faceVertices[0]);
+        emit(faceVertices[k - 1]);
+        emit(faceVertices[k]);
+    }
+    return true;
+}
+
+void ParseChunk(Chunk& chunk)
+{
+    // Guess the output size from the text size, to avoid most reallocations:
+    const size_t bytes = static_cast<size_t>(chunk.end - chunk.begin);
+    chunk.vertices.reserve(bytes / 16);
+    chunk.indices.reserve(bytes / 8);
+
+    std::vector<int64_t> faceVertices;
+    for (const char* line = chunk.begin; line < chunk.end;)
+    {
+        const char* next = SkipLine(line, chunk.end);
+        const char* p = SkipSpaces(line, next);
+        bool        ok = true;
+        if (IsGroupRecord(p, next))
+        {
+            chunk.shapeStarts.push_back({ chunk.indices.size(), false, std::string() });
+        }
+        else if (p + 1 < next && IsSpace(p[1]))
+        {
+            if (p[0] == 'v')
+            {
+                ok = ParseVertex(p + 1, next, chunk);
+            }
+            else if (p[0] == 'f')
+            {
+                ok = ParseFace(p + 1, next, chunk, faceVertices);
+            }
+        }
+        else if (IsRecord(p, next, "usemtl", 6))
+        {
+            // Like tinyobj, the material name is the first word:
+            std::string material;
+            ForEachName(p + 6, next, [&](std::string&& name) {
+                if (material.empty())
+                {
+                    material = std::move(name);
+                }
+            });
+            chunk.shapeStarts.push_back({ chunk.indices.size(), true, std::move(material) });
+        }
+        else if (IsRecord(p, next, "mtllib", 6))
+        {
+            ForEachName(p + 6, next, [&](std::string&& name) { chunk.materialLibraries.push_back(std::move(name)); });
+        }
+        if (!ok)
+        {
+            chunk.errorAt = line;
+            return;
+        }
+        line = next;
+    }
+}
+
+}  // namespace
+
+bool ParseObjParallel(const char* text, size_t size, ThreadPool& pool, ObjMesh& mesh, std::string& error)
+{
+    mesh = ObjMesh();
+    const char* const textEnd = text + size;
+
+    // Split the text into line-aligned chunks; use a few chunks per thread so
+    // that threads that finish early can pick up more work.
+    const size_t numChunksWanted = std::max<size_t>(1, std::min<size_t>(size / MIN_CHUNK_BYTES, 4 * pool.getConcurrency()));
+    std::vector<Chunk> chunks;
+    chunks.reserve(numChunksWanted);
+    const char* chunkBegin = text;
+    for (size_t chunkIdx = 1; chunkIdx <= numChunksWanted && chunkBegin < textEnd; chunkIdx++)
+    {
+        const char* chunkEnd = textEnd;
+        if (chunkIdx < numChunksWanted)
+        {
+            chunkEnd = std::max(chunkBegin, text + (size * chunkIdx) / numChunksWanted);
+            chunkEnd = SkipLine(chunkEnd, textEnd);
+        }
+        Chunk chunk;
+        chunk.begin = chunkBegin;
+        chunk.end = chunkEnd;
+        chunks.push_back(std::move(chunk));
+        chunkBegin = chunkEnd;
+    }
+
+    pool.parallelFor(chunks.size(), [&](size_t chunkIdx) { ParseChunk(chunks[chunkIdx]); });
+
+    // Prefix sums give each chunk's place in the merged arrays:
+    size_t numVertexFloats = 0;
+    size_t numIndices = 0;
+    for (Chunk& chunk : chunks)
+    {
+        if (chunk.errorAt != nullptr)
+        {
+            const char* lineEnd = SkipLine(chunk.errorAt, textEnd);
+            error = "Malformed OBJ record at byte offset " + std::to_string(chunk.errorAt - text) + ": "
+                + std::string(chunk.errorAt, std::min<size_t>(static_cast<size_t>(lineEnd - chunk.errorAt), 80));
+            return false;
+        }
+        chunk.vertexOffset = numVertexFloats / 3;
+        chunk.indexOffset = numIndices;
+        numVertexFloats += chunk.vertices.size();
+        numIndices += chunk.indices.size();
+    }
+    const uint64_t numVertices = numVertexFloats / 3;
+
+    // Copy the chunks into place, resolving relative indices and checking
+    // that every index refers to an existing vertex:
+    mesh.vertices.resize(numVertexFloats);
+    mesh.indices.resize(numIndices);
+    std::vector<char> chunkValid(chunks.size(), 1);
+    pool.parallelFor(chunks.size(), [&](size_t chunkIdx) {
+        Chunk& chunk = chunks[chunkIdx];
+        std::copy(chunk.vertices.begin(), chunk.vertices.end(), mesh.vertices.begin() + 3 * chunk.vertexOffset);
+        uint32_t* indices = mesh.indices.data() + chunk.indexOffset;
+        std::copy(chunk.indices.begin(), chunk.indices.end(), indices);
+        for (const Chunk::Fixup& fixup : chunk.fixups)
+        {
+            const int64_t vertex = static_cast<int64_t>(chunk.vertexOffset) + fixup.chunkRelativeVertex;
+            indices[fixup.position] = (vertex >= 0) ? static_cast<uint32_t>(vertex) : UINT32_MAX;
+        }
+        for (size_t i = 0; i < chunk.indices.size(); i++)
+        {
+            if (indices[i] >= numVertices)
+            {
+                chunkValid[chunkIdx] = 0;
+                break;
+            }
+        }
+        // Free this chunk's memory as soon as possible:
+        chunk.vertices = std::vector<float>();
+        chunk.indices = std::vector<uint32_t>();
+    });
+    if (std::find(chunkValid.begin(), chunkValid.end(), 0) != chunkValid.end())
+    {
+        error = "A face refers to a vertex that doesn't exist.";
+        mesh = ObjMesh();
+        return false;
+    }
+
+    // Faces before the first `o` or `g` record form a shape too. Like tinyobj,
+    // skip shapes without faces (e.g. a `g` record directly followed by `o`).
+    // The material stays in effect across `o` and `g` records, until the
+    // next `usemtl` record:
+    size_t      shapeBegin = 0;
+    std::string shapeMaterial;  // The material of the shape starting at shapeBegin
+    const auto  addShape = [&](size_t shapeEnd) {
+        if (shapeEnd > shapeBegin)
+        {
+            mesh.shapes.push_back({ static_cast<uint32_t>(shapeBegin), static_cast<uint32_t>(shapeEnd - shapeBegin), {} });
+            mesh.shapeMaterials.push_back(shapeMaterial);
+        }
+        shapeBegin = shapeEnd;
+    };
+    for (Chunk& chunk : chunks)
+    {
+        for (Chunk::ShapeStart& shapeStart : chunk.shapeStarts)
+        {
+            addShape(chunk.indexOffset + shapeStart.position);
+            if (shapeStart.setsMaterial)
+            {
+                shapeMaterial = std::move(shapeStart.material);
+            }
+        }
+        for (std::string& library : chunk.materialLibraries)
+        {
+            mesh.materialLibraries.push_back(std::move(library));
+        }
+    }
+    addShape(numIndices);
+    return true;
+}
+
+bool ParseObjFileParallel(const std::string& filename, ThreadPool& pool, ObjMesh& mesh, std::string& error)
+{
+    MappedFile file;
+    if (!file.open(filename))
+    {
+        error = "Could not open " + filename + ".";
+        return false;
+    }
+    return ParseObjParallel(reinterpret_cast<const char*>(file.data()), file.size(), pool, mesh, error);
+}
@@ -0,0 +1,57 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_OBJ_PARSER_HPP
+#define VK_MINI_PATH_TRACER_OBJ_PARSER_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class ThreadPool;
+
+// A range of triangles in ObjMesh::indices that came from one `o` or `g`
+// group of an OBJ file, and that use one material. Each shape becomes one
+// geometry in the BLAS.
+struct ObjShape
+{
+    uint32_t firstIndex;   // Offset of the shape's first index in ObjMesh::indices (a multiple of 3)
+    uint32_t numIndices;   // 3 per triangle
+    float    emission[3];  // The Ke (emitted radiance) of the shape's material; 0 if none
+};
+
+// The parts of an OBJ file that the path tracer uses: vertex positions and
+// triangle indices, in the same layout as the vertex and index buffers.
+// All shapes share these arrays, and their vertex indices are global.
+struct ObjMesh
+{
+    std::vector<float>       vertices;           // 3 floats per `v` record
+    std::vector<uint32_t>    indices;            // 3 per triangle; 0-based indices into `vertices`
+    std::vector<ObjShape>    shapes;             // Consecutive, non-empty ranges covering all of `indices`
+    std::vector<std::string> shapeMaterials;     // The `usemtl` name of each shape; empty if none
+    std::vector<std::string> materialLibraries;  // The files named by `mtllib` records
+};
+
+// A multithreaded parser for the geometry in OBJ files.
+//
+// The text is split into line-aligned chunks, which threads of `pool` parse
+// independently. Each chunk only reads `v` and `f` records (polygons are
+// triangulated as fans, like tinyobj does), using a float parser that doesn't
+// allocate, and `o` and `g` records, which start new shapes. A `g` record
+// without a name starts the default group, as the OBJ format specifies;
+// tinyobj ignores such lines, so its shapes differ there. Because a chunk
+// doesn't know how many vertices came before it, relative (negative) face
+// indices are resolved after all chunks finish, when prefix sums over the
+// per-chunk vertex and index counts give each chunk's offsets in the merged
+// arrays. The merge then copies each chunk's data into place in parallel.
+//
+// `usemtl` records also start new shapes, so that each shape has one
+// material. The parser only records material names; it leaves the shapes'
+// emission at 0 for the caller to look up in the material libraries.
+//
+// Returns false (and sets `error`) if the text contains a malformed `v` or
+// `f` record, or a face refers to a vertex that doesn't exist.
+bool ParseObjParallel(const char* text, size_t size, ThreadPool& pool, ObjMesh& mesh, std::string& error);
+// Memory-maps `filename` and parses it with ParseObjParallel.
+bool ParseObjFileParallel(const std::string& filename, ThreadPool& pool, ObjMesh& mesh, std::string& error);
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_OBJ_PARSER_HPP
@@ -0,0 +1,124 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "pipeline_cache.hpp"
+
+#include <cstring>
+#include <nvh/fileoperations.hpp>  // For nvh::loadFile
+#include <nvh/nvprint.hpp>         // For nvprintf
+#include <nvvk/error_vk.hpp>       // For NVVK_CHECK
+#include <nvvk/structs_vk.hpp>     // For nvvk::make
+#include <vector>
+
+#include "file_utils.hpp"
+
+void PipelineCache::init(VkDevice device, VkPhysicalDevice physicalDevice, bool enabled)
+{
+    m_device = device;
+    if (!enabled)
+    {
+        m_state = State::eDisabled;
+        return;
+    }
+
+    // Name the cache file after the device UUID and driver version:
+    m_filename = "pipelinecache_" + GetDeviceFileTag(physicalDevice, true) + ".bin";
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+    // Try to load data from a previous run. nvh::loadFile returns an empty
+    // string if the file doesn't exist.
+    std::string initialData = nvh::loadFile(m_filename, true);
+    if (!initialData.empty() && !validateHeader(initialData, properties))
+    {
+        initialData.clear();
+    }
+
+    VkPipelineCacheCreateInfo cacheInfo = nvvk::make<VkPipelineCacheCreateInfo>();
+    cacheInfo.initialDataSize = initialData.size();
+    cacheInfo.pInitialData = initialData.empty() ? nullptr : initialData.data();
+    NVVK_CHECK(vkCreatePipelineCache(device, &cacheInfo, nullptr, &m_cache));
+    m_state = initialData.empty() ? State::eEmpty : State::eLoaded;
+}
+
+bool PipelineCache::validateHeader(const std::string& data, const VkPhysicalDeviceProperties& properties)
+{
+    // This is the layout of the header defined by the Vulkan specification
+    // for VK_PIPELINE_CACHE_HEADER_VERSION_ONE. We read it field by field,
+    // since the file could have come from any machine.
+    const size_t headerSize = 4 * sizeof(uint32_t) + VK_UUID_SIZE;
+    if (data.size() < headerSize)
+    {
+        nvprintf("Ignoring pipeline cache: file is too small to hold a header.\n");
+        return false;
+    }
+    uint32_t fields[4];  // headerSize, headerVersion, vendorID, deviceID
+    memcpy(fields, data.data(), sizeof(fields));
+    const uint8_t* cacheUUID = reinterpret_cast<const uint8_t*>(data.data()) + sizeof(fields);
+
+    if (fields[0] < headerSize || fields[0] > data.size())
+    {
+        nvprintf("Ignoring pipeline cache: invalid header size %u.\n", fields[0]);
+        return false;
+    }
+    if (fields[1] != VK_PIPELINE_CACHE_HEADER_VERSION_ONE)
+    {
+        nvprintf("Ignoring pipeline cache: unknown header version %u.\n", fields[1]);
+        return false;
+    }
+    if (fields[2] != properties.vendorID || fields[3] != properties.deviceID)
+    {
+        nvprintf("Ignoring pipeline cache: created for vendor 0x%x device 0x%x.\n", fields[2], fields[3]);
+        return false;
+    }
+    if (memcmp(cacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+    {
+        nvprintf("Ignoring pipeline cache: pipeline cache UUID does not match the driver.\n");
+        return false;
+    }
+    return true;
+}
+
+void PipelineCache::save() const
+{
+    if (m_cache == VK_NULL_HANDLE)
+    {
+        return;
+    }
+
+    size_t dataSize = 0;
+    NVVK_CHECK(vkGetPipelineCacheData(m_device, m_cache, &dataSize, nullptr));
+    std::vector<char> data(dataSize);
+    NVVK_CHECK(vkGetPipelineCacheData(m_device, m_cache, &dataSize, data.data()));
+
+    // Other processes may share the cache directory, so they must never see
+    // a partially written cache file:
+    const bool written = WriteFileAtomically(m_filename, [&](std::ostream& file) {
+        return static_cast<bool>(file.write(data.data(), static_cast<std::streamsize>(dataSize)));
+    });
+    if (!written)
+    {
+        nvprintf("Could not write pipeline cache file %s.\n", m_filename.c_str());
+    }
+}
+
+void PipelineCache::deinit()
+{
+    if (m_cache != VK_NULL_HANDLE)
+    {
+        vkDestroyPipelineCache(m_device, m_cache, nullptr);
+        m_cache = VK_NULL_HANDLE;
+    }
+}
+
+const char* PipelineCache::getStateName() const
+{
+    switch (m_state)
+    {
+    case State::eEmpty:
+        return "empty";
+    case State::eLoaded:
+        return "loaded from disk";
+    default:
+        return "disabled";
+    }
+}
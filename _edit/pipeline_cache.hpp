@@ -0,0 +1,55 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_PIPELINE_CACHE_HPP
+#define VK_MINI_PATH_TRACER_PIPELINE_CACHE_HPP
+
+#include <string>
+#include <vulkan/vulkan_core.h>
+
+// PipelineCache wraps a VkPipelineCache that persists across runs.
+//
+// Without a pipeline cache, every launch of the program compiles every
+// shader stage from SPIR-V to GPU code again. For short-lived render jobs,
+// this can be a large part of the total run time. Here, init() loads the
+// cache data saved by a previous run (if it's compatible), and save()
+// writes the cache back to disk once pipelines have been created.
+//
+// The cache file name includes the device UUID and driver version, so that
+// different GPUs and driver updates get separate cache files. The header of
+// the loaded data is validated against the current device as well, since
+// drivers may reject (or, worse, misbehave on) data from another device.
+class PipelineCache
+{
+public:
+    enum class State
+    {
+        eDisabled,  // No VkPipelineCache is used
+        eEmpty,     // No compatible cache file was found; starting from an empty cache
+        eLoaded     // Cache data was loaded from disk
+    };
+
+    // Creates the VkPipelineCache. If `enabled` is false, get() returns
+    // VK_NULL_HANDLE and save() does nothing, so that pipeline creation can
+    // be timed without a cache.
+    void init(VkDevice device, VkPhysicalDevice physicalDevice, bool enabled);
+    // Writes the contents of the cache to disk.
+    void save() const;
+    void deinit();
+
+    VkPipelineCache    get() const { return m_cache; }
+    State              getState() const { return m_state; }
+    const char*        getStateName() const;
+    const std::string& getFilename() const { return m_filename; }
+
+private:
+    // Returns true if `data` starts with a pipeline cache header that matches
+    // `properties`. Otherwise, prints why not and returns false.
+    static bool validateHeader(const std::string& data, const VkPhysicalDeviceProperties& properties);
+
+    VkDevice        m_device = VK_NULL_HANDLE;
+    VkPipelineCache m_cache = VK_NULL_HANDLE;
+    State           m_state = State::eDisabled;
+    std::string     m_filename;
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_PIPELINE_CACHE_HPP
@@ -0,0 +1,80 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "pipeline_variants.hpp"
+
+#include <nvh/fileoperations.hpp>  // For nvh::loadFile
+#include <nvvk/error_vk.hpp>       // For NVVK_CHECK
+#include <nvvk/shaders_vk.hpp>     // For nvvk::createShaderModule
+#include <nvvk/structs_vk.hpp>     // For nvvk::make
+
+const VkSpecializationInfo* SpecializationConstants::getInfo()
+{
+    m_mapEntries.clear();
+    m_data.clear();
+    for (const auto& constant : m_values)
+    {
+        const uint32_t offset = static_cast<uint32_t>(m_data.size() * sizeof(uint32_t));
+        m_mapEntries.push_back(VkSpecializationMapEntry{ constant.first, offset, sizeof(uint32_t) });
+        m_data.push_back(constant.second);
+    }
+    m_info.mapEntryCount = static_cast<uint32_t>(m_mapEntries.size());
+    m_info.pMapEntries = m_mapEntries.data();
+    m_info.dataSize = m_data.size() * sizeof(uint32_t);
+    m_info.pData = m_data.data();
+    return &m_info;
+}
+
+void PipelineVariantCache::init(VkDevice device, VkPipelineCache pipelineCache, const std::vector<std::string>& searchPaths)
+{
+    m_device = device;
+    m_pipelineCache = pipelineCache;
+    m_searchPaths = searchPaths;
+}
+
+void PipelineVariantCache::deinit()
+{
+    for (const auto& pipeline : m_pipelines)
+    {
+        vkDestroyPipeline(m_device, pipeline.second, nullptr);
+    }
+    m_pipelines.clear();
+    for (const auto& shaderModule : m_shaderModules)
+    {
+        vkDestroyShaderModule(m_device, shaderModule.second, nullptr);
+    }
+    m_shaderModules.clear();
+}
+
+VkShaderModule PipelineVariantCache::getShaderModule(const std::string& spvFilename)
+{
+    VkShaderModule& shaderModule = m_shaderModules[spvFilename];
+    if (shaderModule == VK_NULL_HANDLE)
+    {
+        shaderModule = nvvk::createShaderModule(m_device, nvh::loadFile(spvFilename, true, m_searchPaths));
+    }
+    return shaderModule;
+}
+
+VkPipeline PipelineVariantCache::getComputePipeline(const std::string& spvFilename, VkPipelineLayout layout,
+    const SpecializationConstants& constants)
+{
+    const PipelineKey key(spvFilename, layout, constants);
+    const auto        found = m_pipelines.find(key);
+    if (found != m_pipelines.end())
+    {
+        return found->second;
+    }
+
+    SpecializationConstants specialization = constants;
+    VkComputePipelineCreateInfo pipelineCreateInfo = nvvk::make<VkComputePipelineCreateInfo>();
+    pipelineCreateInfo.stage = nvvk::make<VkPipelineShaderStageCreateInfo>();
+    pipelineCreateInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipelineCreateInfo.stage.module = getShaderModule(spvFilename);
+    pipelineCreateInfo.stage.pName = "main";
+    pipelineCreateInfo.stage.pSpecializationInfo = specialization.getInfo();
+    pipelineCreateInfo.layout = layout;
+    VkPipeline pipeline;
+    NVVK_CHECK(vkCreateComputePipelines(m_device, m_pipelineCache, 1, &pipelineCreateInfo, nullptr, &pipeline));
+    m_pipelines.emplace(key, pipeline);
+    return pipeline;
+}
@@ -0,0 +1,79 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_PIPELINE_VARIANTS_HPP
+#define VK_MINI_PATH_TRACER_PIPELINE_VARIANTS_HPP
+
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+// The values of a pipeline's specialization constants (see the CONSTANT_ID_*
+// IDs in common.h). Every constant is 32 bits wide, like VkBool32 and uint.
+// Shaders ignore the constants they don't declare, so one set of values can
+// specialize every stage of a pipeline.
+class SpecializationConstants
+{
+public:
+    SpecializationConstants& set(uint32_t constantId, uint32_t value)
+    {
+        m_values[constantId] = value;
+        return *this;
+    }
+    // Returns a VkSpecializationInfo with these values. It points into this
+    // object, so it's valid until the next call to set() or getInfo().
+    const VkSpecializationInfo* getInfo();
+
+    bool operator<(const SpecializationConstants& other) const { return m_values < other.m_values; }
+
+private:
+    std::map<uint32_t, uint32_t>          m_values;  // Value of each constant ID
+    std::vector<VkSpecializationMapEntry> m_mapEntries;
+    std::vector<uint32_t>                 m_data;
+    VkSpecializationInfo                  m_info{};
+};
+
+// PipelineVariantCache creates a compute pipeline for each combination of
+// shader and specialization constants the first time it's asked for, and
+// keeps it until deinit().
+//
+// Sample counts, loop bounds, and workgroup sizes are specialization
+// constants instead of #defines, so that changing them doesn't need the GLSL
+// to be recompiled; the driver still sees them as constants when it compiles
+// the SPIR-V, so it can unroll loops and fold arithmetic for each variant.
+// Switching back to a variant that was used before (as the benchmarks do)
+// is then a map lookup instead of a pipeline compile. Shader modules are
+// loaded once per file.
+//
+// Pipelines are keyed by the handle of their layout, so a layout must not be
+// recreated while the cache still holds pipelines that use it.
+class PipelineVariantCache
+{
+public:
+    // Pipelines are created with `pipelineCache` (which may be VK_NULL_HANDLE),
+    // and SPIR-V files are looked up in `searchPaths`.
+    void init(VkDevice device, VkPipelineCache pipelineCache, const std::vector<std::string>& searchPaths);
+    // Destroys every pipeline and shader module.
+    void deinit();
+
+    // Returns the compute pipeline that runs `spvFilename` with `layout`,
+    // specialized with `constants`, creating it if needed.
+    VkPipeline getComputePipeline(const std::string& spvFilename, VkPipelineLayout layout, const SpecializationConstants& constants);
+    // Returns the shader module of `spvFilename`, loading it if needed.
+    VkShaderModule getShaderModule(const std::string& spvFilename);
+
+    // Returns the number of pipelines created so far.
+    size_t getNumPipelines() const { return m_pipelines.size(); }
+
+private:
+    using PipelineKey = std::tuple<std::string, VkPipelineLayout, SpecializationConstants>;
+
+    VkDevice                              m_device = VK_NULL_HANDLE;
+    VkPipelineCache                       m_pipelineCache = VK_NULL_HANDLE;
+    std::vector<std::string>              m_searchPaths;
+    std::map<std::string, VkShaderModule> m_shaderModules;  // Indexed by file name
+    std::map<PipelineKey, VkPipeline>     m_pipelines;
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_PIPELINE_VARIANTS_HPP
@@ -0,0 +1,206 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "ray_packets.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include "simd.hpp"
+
+void RayPacket::prepare(uint32_t firstRay)
+{
+    for (uint32_t ray = firstRay; ray < numRays; ray++)
+    {
+        const float  origin[3] = { rays[ray].origin.x, rays[ray].origin.y, rays[ray].origin.z };
+        const float  direction[3] = { rays[ray].direction.x, rays[ray].direction.y, rays[ray].direction.z };
+        const BvhRay bvhRay(origin, direction);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            origins[axis][ray] = bvhRay.origin[axis];
+            inverseDirections[axis][ray] = bvhRay.inverseDirection[axis];
+        }
+    }
+
+    // The frustum needs a shared origin, and a dominant axis k along which
+    // every ray goes the same way. Then each ray's other coordinates i are
+    // d_i = r_i * d_k for ratios r_i within the packet's range of ratios,
+    // which gives two planes per axis i, and one more plane at the origin:
+    hasFrustum = false;
+    if (firstRay >= numRays)
+    {
+        return;
+    }
+    const vec3& origin = rays[firstRay].origin;
+    const vec3& firstDirection = rays[firstRay].direction;
+    int         k = 0;
+    for (int axis = 1; axis < 3; axis++)
+    {
+        if (std::abs(firstDirection[axis]) > std::abs(firstDirection[k]))
+        {
+            k = axis;
+        }
+    }
+    const float sign = (firstDirection[k] > 0.0f) ? 1.0f : -1.0f;
+    float       minRatio[3] = { 1e30f, 1e30f, 1e30f };
+    float       maxRatio[3] = { -1e30f, -1e30f, -1e30f };
+    for (uint32_t ray = firstRay; ray < numRays; ray++)
+    {
+        const CpuRay& packetRay = rays[ray];
+        if (packetRay.origin.x != origin.x || packetRay.origin.y != origin.y || packetRay.origin.z != origin.z
+            || sign * packetRay.direction[k] <= 0.0f)
+        {
+            return;
+        }
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float ratio = packetRay.direction[axis] / packetRay.direction[k];
+            minRatio[axis] = std::min(minRatio[axis], ratio);
+            maxRatio[axis] = std::max(maxRatio[axis], ratio);
+        }
+    }
+
+    int plane = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (axis == k)
+        {
+            continue;
+        }
+        // Widen the range a little, so that rounding never culls a node
+        // that a ray on the edge of the frustum touches:
+        const float margin = 1e-5f * std::max(1.0f, std::max(std::abs(minRatio[axis]), std::abs(maxRatio[axis])));
+        const float low = minRatio[axis] - margin;
+        const float high = maxRatio[axis] + margin;
+        // d_i <= high * d_k and d_i >= low * d_k, with both sides times the sign of d_k:
+        for (int component = 0; component < 3; component++)
+        {
+            frustumPlanes[plane][component] = 0.0f;
+            frustumPlanes[plane + 1][component] = 0.0f;
+        }
+        frustumPlanes[plane][axis] = sign;
+        frustumPlanes[plane][k] = -sign * high;
+        frustumPlanes[plane + 1][axis] = -sign;
+        frustumPlanes[plane + 1][k] = sign * low;
+        plane += 2;
+    }
+    // Nothing behind the origin:
+    for (int component = 0; component < 3; component++)
+    {
+        frustumPlanes[4][component] = (component == k) ? -sign : 0.0f;
+    }
+    frustumOrigin[0] = origin.x;
+    frustumOrigin[1] = origin.y;
+    frustumOrigin[2] = origin.z;
+    hasFrustum = true;
+}
+
+bool RayPacket::frustumMisses(const BvhNode& node) const
+{
+    if (!hasFrustum)
+    {
+        return false;
+    }
+    for (const float* normal : frustumPlanes)
+    {
+        // The corner of the bounds that is furthest inside the plane:
+        float distance = 0.0f;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float corner = (normal[axis] > 0.0f) ? node.boundsMin[axis] : node.boundsMax[axis];
+            distance += normal[axis] * (corner - frustumOrigin[axis]);
+        }
+        if (distance > 0.0f)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RayPacket::intersectNode(const BvhNode& node, uint32_t ray, float tMin, float tMax, float& tEntry) const
+{
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float t0 = (node.boundsMin[axis] - origins[axis][ray]) * inverseDirections[axis][ray];
+        const float t1 = (node.boundsMax[axis] - origins[axis][ray]) * inverseDirections[axis][ray];
+        tMin = std::max(tMin, std::min(t0, t1));
+        tMax = std::min(tMax, std::max(t0, t1));
+    }
+    tEntry = tMin;
+    return tMin <= tMax;
+}
+
+namespace {
+// Returns a mask of the rays of the group of 8 from `group` that are in
+// [firstRay, numRays).
+uint32_t GroupRayMask(uint32_t group, uint32_t firstRay, uint32_t numRays)
+{
+    uint32_t mask = 0xFF;
+    if (firstRay > group)
+    {
+        mask &= 0xFFu << (firstRay - group);
+    }
+    if (numRays < group + 8)
+    {
+        mask &= 0xFFu >> (group + 8 - numRays);
+    }
+    return mask;
+}
+
+#if SIMD_X86
+// Tests the rays [group, group + 8) of `packet` against `node` at once, with
+// the same arithmetic as RayPacket::intersectNode(), and returns the mask
+// of the rays that overlap it.
+SIMD_AVX2_FUNCTION uint32_t IntersectNodeGroupAvx2(const RayPacket& packet, const BvhNode& node, uint32_t group, float tMin,
+    const TriangleHit* hits)
+{
+    __m256 entry = _mm256_set1_ps(tMin);
+    __m256 exit = _mm256_setr_ps(hits[group].t, hits[group + 1].t, hits[group + 2].t, hits[group + 3].t,  //
+                                 hits[group + 4].t, hits[group + 5].t, hits[group + 6].t, hits[group + 7].t);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const __m256 origin = _mm256_load_ps(packet.origins[axis] + group);
+        const __m256 inverseDirection = _mm256_load_ps(packet.inverseDirections[axis] + group);
+        const __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.boundsMin[axis]), origin), inverseDirection);
+        const __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.boundsMax[axis]), origin), inverseDirection);
+        entry = _mm256_max_ps(entry, _mm256_min_ps(t0, t1));
+        exit = _mm256_min_ps(exit, _mm256_max_ps(t0, t1));
+    }
+    return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(entry, exit, _CMP_LE_OQ)));
+}
+#endif  // #if SIMD_X86
+}  // namespace
+
+uint64_t RayPacket::intersectNodeMask(const BvhNode& node, uint32_t firstRay, float tMin, const TriangleHit* hits, bool firstGroupOnly) const
+{
+    uint64_t  mask = 0;
+    const bool avx2 = CpuHasAvx2();
+    for (uint32_t group = firstRay & ~7u; group < numRays; group += 8)
+    {
+        const uint32_t rayMask = GroupRayMask(group, firstRay, numRays);
+        uint32_t       groupMask = 0;
+#if SIMD_X86
+        if (avx2)
+        {
+            groupMask = IntersectNodeGroupAvx2(*this, node, group, tMin, hits) & rayMask;
+        }
+        else
+#endif
+        {
+            for (uint32_t lane = 0; lane < 8; lane++)
+            {
+                float tEntry;
+                if ((rayMask & (1u << lane)) != 0 && intersectNode(node, group + lane, tMin, hits[group + lane].t, tEntry))
+                {
+                    groupMask |= 1u << lane;
+                }
+            }
+        }
+        mask |= uint64_t(groupMask) << group;
+        if (firstGroupOnly && groupMask != 0)
+        {
+            break;
+        }
+    }
+    return mask;
+}
@@ -0,0 +1,145 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_RAY_PACKETS_HPP
+#define VK_MINI_PATH_TRACER_RAY_PACKETS_HPP
+
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "cpu_bvh.hpp"
+#include "triangle_packs.hpp"
+
+// The width and height of the screen tiles whose camera rays the CPU tracer
+// traces together, and the number of rays in a packet.
+const uint32_t RAY_PACKET_WIDTH = 8;
+const uint32_t RAY_PACKET_SIZE = RAY_PACKET_WIDTH * RAY_PACKET_WIDTH;
+static_assert(RAY_PACKET_SIZE <= 64, "Masks of the rays of a packet must fit in 64 bits!");
+
+// Up to RAY_PACKET_SIZE rays that are traced through a BVH together. Node
+// tests take 8 rays at once with AVX2. If the rays share an origin and go
+// roughly the same way, like the camera rays of a screen tile, prepare()
+// also bounds them with a frustum, which lets the traversal skip nodes that
+// no ray of the packet can reach with a single test.
+//
+// The functions that take `hits` read hits[ray].t as the end of each ray,
+// and need RAY_PACKET_SIZE hits even if there are fewer rays.
+struct RayPacket
+{
+    CpuRay   rays[RAY_PACKET_SIZE];
+    uint32_t numRays = 0;
+
+    // The rays prepared for node tests like BvhRay, in structure-of-arrays
+    // layout, so that one AVX2 register holds the same coordinate of 8 rays:
+    alignas(32) float origins[3][RAY_PACKET_SIZE];
+    alignas(32) float inverseDirections[3][RAY_PACKET_SIZE];
+
+    bool  hasFrustum = false;
+    float frustumOrigin[3];
+    // Normals of the planes through frustumOrigin that bound the frustum.
+    // Every point p on a ray of the packet has dot(normal, p - origin) <= 0.
+    float frustumPlanes[5][3];
+
+    // Prepares rays[firstRay, numRays) for node tests, and bounds them with
+    // the frustum if possible. Later calls only look at these rays.
+    void prepare(uint32_t firstRay = 0);
+    // Returns true if the bounds of `node` are entirely outside the frustum,
+    // so that no ray of the packet hits it; false if unsure.
+    bool frustumMisses(const BvhNode& node) const;
+
+    // Tests ray `ray` against `node`, like IntersectBvhNode().
+    bool intersectNode(const BvhNode& node, uint32_t ray, float tMin, float tMax, float& tEntry) const;
+    // Returns a mask of the rays from `firstRay` on that overlap `node` for
+    // some t in [tMin, hits[ray].t]. With `firstGroupOnly`, stops after the
+    // first group of 8 rays in which any ray does.
+    uint64_t intersectNodeMask(const BvhNode& node, uint32_t firstRay, float tMin, const TriangleHit* hits, bool firstGroupOnly) const;
+};
+
+// Returns the index of the lowest set bit of `mask`, which mustn't be 0.
+inline uint32_t FirstRayInMask(uint64_t mask)
+{
+    assert(mask != 0);
+    uint32_t ray = 0;
+    while ((mask & 1) == 0)
+    {
+        mask >>= 1;
+        ray++;
+    }
+    return ray;
+}
+
+// Traverses the binary BVH `nodes` with the rays of `packet` from `firstRay`
+// on, whose closest hits so far are `hits`, with tMin < t < hits[ray].t.
+// Each node is tested against the first ray that may still hit it (which
+// usually hits it, for coherent rays), then against the packet's frustum,
+// and only then against the remaining rays, 8 at a time. Calls
+// leafFunc(leaf, firstActiveRay) for every leaf that one of the rays from
+// firstActiveRay on hits, which returns a mask of the rays whose hits it
+// made closer. Returns the union of those masks.
+template <class LeafFunc>
+uint64_t TraversePacket(const std::vector<BvhNode>& nodes, const RayPacket& packet, uint32_t firstRay, float tMin,
+    const TriangleHit* hits, LeafFunc&& leafFunc)
+{
+    if (nodes.empty() || firstRay >= packet.numRays)
+    {
+        return 0;
+    }
+    struct StackEntry
+    {
+        uint32_t node;
+        uint32_t firstRay;
+    };
+    StackEntry stack[BVH_STACK_SIZE];
+    int        stackSize = 0;
+    stack[stackSize++] = { 0, firstRay };
+    uint64_t updated = 0;
+    while (stackSize > 0)
+    {
+        const StackEntry entry = stack[--stackSize];
+        const BvhNode&   node = nodes[entry.node];
+        uint32_t         active = entry.firstRay;
+        float            tEntry;
+        if (!packet.intersectNode(node, active, tMin, hits[active].t, tEntry))
+        {
+            if (packet.frustumMisses(node))
+            {
+                continue;
+            }
+            const uint64_t hitMask = packet.intersectNodeMask(node, active + 1, tMin, hits, true);
+            if (hitMask == 0)
+            {
+                continue;
+            }
+            active = FirstRayInMask(hitMask);
+        }
+        if (node.isLeaf())
+        {
+            updated |= leafFunc(node, active);
+            continue;
+        }
+        // Visit the child that the first active ray enters first, first:
+        uint32_t nearChild = entry.node + 1;
+        uint32_t farChild = node.offset;
+        float    nearEntry, farEntry;
+        if (!packet.intersectNode(nodes[nearChild], active, tMin, hits[active].t, nearEntry))
+        {
+            nearEntry = std::numeric_limits<float>::infinity();
+        }
+        if (!packet.intersectNode(nodes[farChild], active, tMin, hits[active].t, farEntry))
+        {
+            farEntry = std::numeric_limits<float>::infinity();
+        }
+        if (farEntry < nearEntry)
+        {
+            std::swap(nearChild, farChild);
+        }
+        assert(stackSize + 2 <= BVH_STACK_SIZE);
+        stack[stackSize++] = { farChild, active };
+        stack[stackSize++] = { nearChild, active };
+    }
+    return updated;
+}
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_RAY_PACKETS_HPP
@@ -0,0 +1,152 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "ray_stats.hpp"
+
+#include <cstring>
+#include <nvh/nvprint.hpp>      // For nvprintf
+#include <nvvk/structs_vk.hpp>  // For nvvk::make
+
+// The stages that count rays: the ray tracing pipeline, or the wavefront tracer's compute shaders.
+static const VkPipelineStageFlags SHADER_STAGES =
+    VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+
+// Returns the value of a counter that the shaders added to in two halves.
+static uint64_t ReadCount(const RayCount& count)
+{
+    return (uint64_t(count.high) << 32) | count.low;
+}
+
+void RayStatistics::init(nvvk::AllocatorDedicated* allocator, uint32_t numSlots)
+{
+    m_allocator = allocator;
+    m_deviceBuffer = allocator->createBuffer(sizeof(RayStats),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    m_readbackBuffer = allocator->createBuffer(numSlots * sizeof(RayStats), VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+    // The readback buffer stays mapped. Zeroed counters mean that no batch
+    // has copied to that slot since it was last read.
+    m_readbackData = reinterpret_cast<RayStats*>(allocator->map(m_readbackBuffer));
+    memset(m_readbackData, 0, numSlots * sizeof(RayStats));
+}
+
+void RayStatistics::deinit()
+{
+    if (m_readbackData != nullptr)
+    {
+        m_allocator->unmap(m_readbackBuffer);
+        m_readbackData = nullptr;
+    }
+    m_allocator->destroy(m_readbackBuffer);
+    m_allocator->destroy(m_deviceBuffer);
+}
+
+void RayStatistics::recordReset(VkCommandBuffer cmdBuffer) const
+{
+    // The previous batch may still be tracing rays or copying the counters, so
+    // wait for it before clearing them:
+    vkCmdPipelineBarrier(cmdBuffer,
+        SHADER_STAGES | VK_PIPELINE_STAGE_TRANSFER_BIT,  // From shaders and copies
+        VK_PIPELINE_STAGE_TRANSFER_BIT,                  // To the fill
+        0, 0, nullptr, 0, nullptr, 0, nullptr);  // An execution dependency is enough for a write after reads
+    vkCmdFillBuffer(cmdBuffer, m_deviceBuffer.buffer, 0, VK_WHOLE_SIZE, 0);
+    // Then make the zeros visible to the shader's atomics:
+    VkMemoryBarrier memoryBarrier = nvvk::make<VkMemoryBarrier>();
+    memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, SHADER_STAGES, 0,
+        1, &memoryBarrier, 0, nullptr, 0, nullptr);
+}
+
+void RayStatistics::recordCopy(VkCommandBuffer cmdBuffer, uint32_t slotIndex) const
+{
+    // Wait for the shader's atomics, copy the counters, then make the copy
+    // visible to the CPU:
+    VkMemoryBarrier memoryBarrier = nvvk::make<VkMemoryBarrier>();
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, SHADER_STAGES, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+        1, &memoryBarrier, 0, nullptr, 0, nullptr);
+    VkBufferCopy region;
+    region.srcOffset = 0;
+    region.dstOffset = slotIndex * sizeof(RayStats);
+    region.size = sizeof(RayStats);
+    vkCmdCopyBuffer(cmdBuffer, m_deviceBuffer.buffer, m_readbackBuffer.buffer, 1, &region);
+    memoryBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+        1, &memoryBarrier, 0, nullptr, 0, nullptr);
+}
+
+void RayStatistics::retireSlot(uint32_t slotIndex, double gpuMs)
+{
+    RayStats& stats = m_readbackData[slotIndex];
+    const uint64_t primaryRays = ReadCount(stats.primaryRays);
+    if (primaryRays == 0)
+    {
+        return;  // This batch didn't trace rays (e.g. it only read back the image)
+    }
+
+    const uint64_t secondaryRays = ReadCount(stats.secondaryRays);
+    const uint64_t shadowRays = ReadCount(stats.shadowRays);
+    const uint64_t rays = primaryRays + secondaryRays + shadowRays;
+    if (gpuMs > 0.0)
+    {
+        // rays / (gpuMs * 1000) is millions of rays per second:
+        nvprintf("Batch %u: %.2f Mrays/s (%.2f M rays in %.3f ms)\n", m_batches, double(rays) / (gpuMs * 1e3),
+                 double(rays) * 1e-6, gpuMs);
+    }
+    else
+    {
+        nvprintf("Batch %u: %.2f M rays\n", m_batches, double(rays) * 1e-6);
+    }
+
+    m_batches++;
+    m_gpuMs += gpuMs;
+    m_primaryRays += primaryRays;
+    m_secondaryRays += secondaryRays;
+    m_skyHits += ReadCount(stats.skyHits);
+    m_segmentCapTerminations += ReadCount(stats.segmentCapTerminations);
+    m_rouletteTerminations += ReadCount(stats.rouletteTerminations);
+    m_shadowRays += shadowRays;
+    for (uint32_t bin = 0; bin < MAX_PATH_SEGMENTS; bin++)
+    {
+        m_segmentHistogram[bin] += ReadCount(stats.segmentHistogram[bin]);
+    }
+    // Mark the slot as read, in case its next batch doesn't copy counters:
+    memset(&stats, 0, sizeof(RayStats));
+}
+
+void RayStatistics::printSummary() const
+{
+    if (m_batches == 0)
+    {
+        nvprintf("Ray statistics: no batches.\n");
+        return;
+    }
+
+    const uint64_t pathRays = m_primaryRays + m_secondaryRays;
+    const uint64_t rays = pathRays + m_shadowRays;
+    const double   paths = double(m_primaryRays);  // Each path starts with one primary ray
+    nvprintf("Ray statistics over %u batches:\n", m_batches);
+    nvprintf("  %.2f M rays (%.2f M primary, %.2f M secondary, %.2f M shadow)", double(rays) * 1e-6,
+             double(m_primaryRays) * 1e-6, double(m_secondaryRays) * 1e-6, double(m_shadowRays) * 1e-6);
+    if (m_gpuMs > 0.0)
+    {
+        nvprintf(" in %.3f ms: %.2f Mrays/s", m_gpuMs, double(rays) / (m_gpuMs * 1e3));
+    }
+    nvprintf("\n");
+    nvprintf("  Mean path length: %.3f segments\n", double(pathRays) / paths);
+    nvprintf("  Paths that hit the sky: %.2f%%; ended by Russian roulette: %.2f%%; stopped at the maximum depth: %.2f%%\n",
+             100.0 * double(m_skyHits) / paths, 100.0 * double(m_rouletteTerminations) / paths,
+             100.0 * double(m_segmentCapTerminations) / paths);
+    nvprintf("  Segments  Paths\n");
+    for (uint32_t bin = 0; bin < MAX_PATH_SEGMENTS; bin++)
+    {
+        if (m_segmentHistogram[bin] != 0)
+        {
+            nvprintf("  %8u  %llu (%.2f%%)\n", bin + 1, static_cast<unsigned long long>(m_segmentHistogram[bin]),
+                     100.0 * double(m_segmentHistogram[bin]) / paths);
+        }
+    }
+}
@@ -0,0 +1,63 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_RAY_STATS_HPP
+#define VK_MINI_PATH_TRACER_RAY_STATS_HPP
+
+#include <array>
+#include <nvvk/allocator_dedicated_vk.hpp>
+#include <vulkan/vulkan_core.h>
+
+#include "common.h"
+
+// RayStatistics owns the RayStats buffer that the ray generation shader
+// counts rays in, and reads it back after every sample batch.
+//
+// The shader adds to a single device-local buffer, which each batch resets
+// before tracing. After tracing, the batch copies the buffer to its slot's
+// part of a host-visible readback buffer, so that batches in flight don't
+// overwrite each other's counts. When BatchSubmitter retires the batch,
+// retireSlot() reads the counts, prints the batch's rate in Mrays/s, and adds
+// them to the totals.
+class RayStatistics
+{
+public:
+    // `numSlots` is the number of batches that can be in flight at once.
+    void init(nvvk::AllocatorDedicated* allocator, uint32_t numSlots);
+    void deinit();
+
+    // The buffer to bind at BINDING_STATS.
+    VkBuffer getBuffer() const { return m_deviceBuffer.buffer; }
+
+    // Records commands that zero the counters before a batch traces rays.
+    void recordReset(VkCommandBuffer cmdBuffer) const;
+    // Records commands that copy the counters to the readback area for
+    // `slotIndex` after a batch traces rays.
+    void recordCopy(VkCommandBuffer cmdBuffer, uint32_t slotIndex) const;
+
+    // Reads the counters of the batch that just finished in `slotIndex`,
+    // which took `gpuMs` milliseconds on the GPU (0 if unknown). Does nothing
+    // if that batch didn't copy any counters.
+    void retireSlot(uint32_t slotIndex, double gpuMs);
+
+    // Prints the totals over all batches: rays, Mrays/s, and path lengths.
+    void printSummary() const;
+
+private:
+    nvvk::AllocatorDedicated* m_allocator = nullptr;
+    nvvk::BufferDedicated     m_deviceBuffer;
+    nvvk::BufferDedicated     m_readbackBuffer;  // One RayStats per slot
+    RayStats*                 m_readbackData = nullptr;
+
+    // Totals over all retired batches:
+    uint32_t                                m_batches = 0;
+    double                                  m_gpuMs = 0.0;
+    uint64_t                                m_primaryRays = 0;
+    uint64_t                                m_secondaryRays = 0;
+    uint64_t                                m_skyHits = 0;
+    uint64_t                                m_segmentCapTerminations = 0;
+    uint64_t                                m_rouletteTerminations = 0;
+    uint64_t                                m_shadowRays = 0;
+    std::array<uint64_t, MAX_PATH_SEGMENTS> m_segmentHistogram{};
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_RAY_STATS_HPP
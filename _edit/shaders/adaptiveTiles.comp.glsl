@@ -0,0 +1,73 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#version 460
+#extension GL_EXT_scalar_block_layout : require
+#extension GL_GOOGLE_include_directive : require
+#include "../common.h"
+#include "shaderCommon.h"
+
+// One workgroup per tile, one invocation per pixel. AdaptiveSampler always
+// specializes the tile size.
+layout(local_size_x_id = CONSTANT_ID_ADAPTIVE_TILE_WIDTH, local_size_y_id = CONSTANT_ID_ADAPTIVE_TILE_HEIGHT, local_size_z = 1) in;
+
+layout(binding = BINDING_IMAGEDATA, set = 0, rgba32f) uniform readonly image2D storageImage;
+// The mean of the squared luminance of each sample batch of each pixel:
+layout(binding = BINDING_ADAPTIVE_VARIANCE, set = 0, r32f) uniform readonly image2D varianceImage;
+layout(binding = BINDING_ADAPTIVE_TILES, set = 0, scalar) buffer Tiles
+{
+  AdaptiveTileHeader header;
+  uint               tiles[];
+};
+
+layout(push_constant) uniform PushConsts
+{
+  AdaptivePushConstants pushConstants;
+};
+
+shared bool s_tileConverged;
+
+// Appends this workgroup's tile to the tile list if any of its pixels
+// haven't converged. The header must have been reset to an empty list.
+void main()
+{
+  if(gl_LocalInvocationIndex == 0)
+  {
+    s_tileConverged = true;
+  }
+  barrier();
+
+  const ivec2 resolution = imageSize(storageImage);
+  const ivec2 pixel      = ivec2(gl_GlobalInvocationID.xy);
+  if((pixel.x < resolution.x) && (pixel.y < resolution.y))
+  {
+    // The image holds the mean of the pixel's sample batches, and the
+    // alpha channel counts them:
+    const vec4  pixelMean  = imageLoad(storageImage, pixel);
+    const float numBatches = pixelMean.a;
+    bool        converged  = (numBatches >= float(max(pushConstants.minBatches, 2)));
+    if(converged)
+    {
+      // The variance of one batch's luminance, and the standard error of
+      // the mean of numBatches batches:
+      const float meanLuminance = luminance(pixelMean.rgb);
+      const float meanSquared   = imageLoad(varianceImage, pixel).r;
+      const float batchVariance = max(meanSquared - meanLuminance * meanLuminance, 0.0);
+      const float standardError = sqrt(batchVariance / numBatches);
+      // Don't ask dark pixels for a tiny absolute error:
+      const float relativeError = standardError / max(meanLuminance, 1e-2);
+      converged                 = (relativeError <= pushConstants.targetRelativeError);
+    }
+    if(!converged)
+    {
+      // Every writer writes the same value, so this race is benign:
+      s_tileConverged = false;
+    }
+  }
+  barrier();
+
+  if(gl_LocalInvocationIndex == 0 && !s_tileConverged)
+  {
+    const uint tileIndex = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+    tiles[atomicAdd(header.launchHeight, 1)] = tileIndex;
+  }
+}
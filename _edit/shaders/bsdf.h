@@ -0,0 +1,133 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+// The BSDF sampling interface of the materials (see materials.h).
+//
+// A material scatters a path by sampling one of its lobes, which returns a
+// BsdfSample: the new direction, the weight that the path's throughput is
+// multiplied by, and the density with which the direction was picked. For
+// the Lambertian lobe, the tracers can also evaluate the BSDF and density
+// for any other direction with evaluateLambertian() and lambertianPdf(),
+// which is what light sampling and MIS need (see lights.h). Delta lobes
+// (mirrors and pass-through) have a density of 0, since no other strategy
+// can produce their directions.
+//
+// Materials that mix lobes pick one with probability equal to its share of
+// the mixture, so the share and the probability cancel out, and the weight
+// of the sample is just the weight of the lobe.
+//
+// The including shader must include common.h and shaderCommon.h.
+#ifndef VK_MINI_PATH_TRACER_BSDF_H
+#define VK_MINI_PATH_TRACER_BSDF_H
+
+// How the Lambertian lobe samples directions (DIFFUSE_SAMPLING_COSINE or
+// DIFFUSE_SAMPLING_UNIFORM). Both give the same image in expectation; the
+// uniform strategy only exists to measure how much cosine-weighted sampling
+// saves (see RunBsdfSamplingBenchmark).
+layout(constant_id = CONSTANT_ID_DIFFUSE_SAMPLING) const uint DIFFUSE_SAMPLING = DIFFUSE_SAMPLING_COSINE;
+
+// A direction sampled from a lobe of a BSDF.
+struct BsdfSample
+{
+  vec3  direction;  // The sampled direction in world space
+  vec3  weight;     // BSDF * cos(theta) / pdf, what the path's throughput is multiplied by
+  float pdf;        // Solid angle density of `direction`; 0 for delta lobes
+};
+
+// Builds a tangent and bitangent that form an orthonormal basis with the unit
+// vector `normal`, without branching on which axis `normal` is closest to.
+// From Duff et al., "Building an Orthonormal Basis, Revisited" (JCGT, 2017).
+void orthonormalBasis(vec3 normal, out vec3 tangent, out vec3 bitangent)
+{
+  const float s = (normal.z >= 0.0) ? 1.0 : -1.0;
+  const float a = -1.0 / (s + normal.z);
+  const float b = normal.x * normal.y * a;
+  tangent       = vec3(1.0 + s * normal.x * normal.x * a, s * b, -s * normal.x);
+  bitangent     = vec3(b, s + normal.y * normal.y * a, -normal.y);
+}
+
+// Maps a uniformly distributed point `u` in [0, 1)^2 to a uniformly
+// distributed point on the unit disk, with Shirley and Chiu's concentric
+// mapping. Unlike the polar mapping, it keeps neighboring strata of the
+// sample sequence compact, so the stratification survives the mapping.
+vec2 concentricDisk(vec2 u)
+{
+  const vec2 offset = 2.0 * u - 1.0;
+  if(offset.x == 0.0 && offset.y == 0.0)
+  {
+    return vec2(0.0);
+  }
+  float radius, theta;
+  if(abs(offset.x) > abs(offset.y))
+  {
+    radius = offset.x;
+    theta  = 0.25 * k_pi * (offset.y / offset.x);
+  }
+  else
+  {
+    radius = offset.y;
+    theta  = 0.5 * k_pi - 0.25 * k_pi * (offset.x / offset.y);
+  }
+  return radius * vec2(cos(theta), sin(theta));
+}
+
+// Returns the density with which the Lambertian lobe around `normal` samples
+// `direction`.
+float lambertianPdf(vec3 normal, vec3 direction)
+{
+  const float cosTheta = dot(normal, direction);
+  if(cosTheta <= 0.0)
+  {
+    return 0.0;
+  }
+  return (DIFFUSE_SAMPLING == DIFFUSE_SAMPLING_UNIFORM) ? 1.0 / (2.0 * k_pi) : cosTheta / k_pi;
+}
+
+// Returns the Lambertian BSDF with albedo `albedo` around `normal`, times the
+// cosine of `direction` to the normal.
+vec3 evaluateLambertian(vec3 albedo, vec3 normal, vec3 direction)
+{
+  return albedo * max(dot(normal, direction), 0.0) / k_pi;
+}
+
+// Samples the Lambertian lobe with albedo `albedo` around `normal`, from a
+// uniformly distributed point `u` in [0, 1)^2.
+BsdfSample sampleLambertian(vec3 albedo, vec3 normal, vec2 u)
+{
+  vec3 tangent, bitangent;
+  orthonormalBasis(normal, tangent, bitangent);
+
+  BsdfSample result;
+  if(DIFFUSE_SAMPLING == DIFFUSE_SAMPLING_UNIFORM)
+  {
+    // Uniform over the hemisphere: the weight is 2 * albedo * cos(theta).
+    const float cosTheta = u.x;
+    const float sinTheta = sqrt(max(0.0, 1.0 - cosTheta * cosTheta));
+    const float phi      = 2.0 * k_pi * u.y;
+    result.direction     = normalize(sinTheta * (cos(phi) * tangent + sin(phi) * bitangent) + cosTheta * normal);
+  }
+  else
+  {
+    // Cosine-weighted (Malley's method): project a uniformly distributed
+    // point on the disk up to the hemisphere. The cosine in the density
+    // cancels the one in the integrand, so the weight is just the albedo.
+    const vec2  disk     = concentricDisk(u);
+    const float cosTheta = sqrt(max(0.0, 1.0 - dot(disk, disk)));
+    result.direction     = normalize(disk.x * tangent + disk.y * bitangent + cosTheta * normal);
+  }
+  result.pdf    = lambertianPdf(normal, result.direction);
+  result.weight = (result.pdf > 0.0) ? evaluateLambertian(albedo, normal, result.direction) / result.pdf : vec3(0.0);
+  return result;
+}
+
+// Returns the sample of a delta lobe that scatters in `direction` with
+// weight `color`: a mirror reflection, or a ray passing through.
+BsdfSample sampleDelta(vec3 color, vec3 direction)
+{
+  BsdfSample result;
+  result.direction = direction;
+  result.weight    = color;
+  result.pdf       = 0.0;
+  return result;
+}
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_BSDF_H
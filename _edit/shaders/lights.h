@@ -0,0 +1,119 @@
+// Next-event estimation: sampling the emissive triangles of the light buffer
+// (see LightTableHeader in common.h), and multiple importance sampling (MIS)
+// of light samples against the directions that materials scatter in.
+//
+// At each diffuse hit, a tracer picks a point on a light with sampleLight(),
+// and if a shadow ray to it (traced with gl_RayFlagsTerminateOnFirstHitEXT)
+// is unoccluded, adds lightSampleRadiance() to the path. When a scattered
+// ray then hits an emissive triangle, the tracer adds its emission weighted
+// by emissionMisWeight(). Both weights use the power heuristic, and add up
+// to 1 for any direction that both strategies can produce.
+//
+// The including shader must enable GL_EXT_scalar_block_layout, and include
+// common.h and shaderCommon.h.
+#ifndef VK_MINI_PATH_TRACER_LIGHTS_H
+#define VK_MINI_PATH_TRACER_LIGHTS_H
+
+layout(binding = BINDING_LIGHTS, set = 0, scalar) buffer Lights
+{
+  LightTableHeader lightHeader;
+  EmissiveTriangle lightTriangles[];
+};
+
+// A point on a light, as seen from a surface.
+struct LightSample
+{
+  vec3  direction;  // Normalized direction from the surface to the point
+  float distance;   // Distance from the surface to the point
+  vec3  radiance;   // Radiance the light emits towards the surface
+  float pdf;        // Solid angle probability density of `direction`
+};
+
+// Returns the solid angle probability density with which sampleLight() picks
+// a point on an emissive triangle with emission `emission`, `distance` away,
+// where the direction is at cosine `cosLight` to the triangle's normal.
+float lightPdf(vec3 emission, float distance, float cosLight)
+{
+  if(lightHeader.numTriangles == 0 || cosLight <= 0.0)
+  {
+    return 0.0;
+  }
+  // Convert the density per unit area to a density per unit solid angle:
+  const float areaPdf = luminance(emission) / lightHeader.totalPower;
+  return areaPdf * distance * distance / cosLight;
+}
+
+// Picks a point on an emissive triangle to connect `position` to, with the
+// SAMPLE_LIGHT_PICK and SAMPLE_LIGHT_POINT dimensions of `pathSampler`.
+// Returns false if there are no lights, or the point can't be connected to.
+bool sampleLight(vec3 position, Sampler pathSampler, out LightSample lightSample)
+{
+  const uint numTriangles = lightHeader.numTriangles;
+  if(numTriangles == 0)
+  {
+    return false;
+  }
+
+  // Pick a triangle in proportion to its power with the alias table:
+  const vec2 pick     = sample2D(pathSampler, SAMPLE_LIGHT_PICK);
+  uint       triangle = min(uint(pick.x * numTriangles), numTriangles - 1);
+  if(pick.y >= lightTriangles[triangle].keepProbability)
+  {
+    triangle = lightTriangles[triangle].alias;
+  }
+  const EmissiveTriangle light = lightTriangles[triangle];
+
+  // Pick a uniformly distributed point on the triangle:
+  const vec2  point         = sample2D(pathSampler, SAMPLE_LIGHT_POINT);
+  const float sqrtU         = sqrt(point.x);
+  const float v             = point.y;
+  const vec3  lightPosition = light.v0 + sqrtU * (1.0 - v) * light.edge1 + sqrtU * v * light.edge2;
+
+  const vec3 toLight   = lightPosition - position;
+  lightSample.distance = length(toLight);
+  if(lightSample.distance <= 0.0)
+  {
+    return false;
+  }
+  lightSample.direction = toLight / lightSample.distance;
+  // Lights emit from both sides:
+  const vec3  lightNormal = normalize(cross(light.edge1, light.edge2));
+  const float cosLight    = abs(dot(lightNormal, lightSample.direction));
+  lightSample.radiance    = light.emission;
+  lightSample.pdf         = lightPdf(light.emission, lightSample.distance, cosLight);
+  return lightSample.pdf > 0.0;
+}
+
+// The power heuristic for combining a sample from a strategy with density
+// `pdf` with a strategy with density `otherPdf`.
+float powerHeuristic(float pdf, float otherPdf)
+{
+  const float pdf2 = pdf * pdf;
+  return pdf2 / (pdf2 + otherPdf * otherPdf);
+}
+
+// Returns the radiance that `lightSample` adds at a surface, if the shadow ray
+// to it is unoccluded, where `bsdfCos` is the BSDF times the cosine towards
+// the light, and `scatterPdf` is the density with which BSDF sampling picks
+// the same direction (see evaluateLambertian() and lambertianPdf() in bsdf.h).
+// Returns 0 if the light is behind the surface, so no shadow ray is needed.
+vec3 lightSampleRadiance(LightSample lightSample, vec3 bsdfCos, float scatterPdf)
+{
+  return bsdfCos * lightSample.radiance * powerHeuristic(lightSample.pdf, scatterPdf) / lightSample.pdf;
+}
+
+// Returns the weight of emission that a path hit after scattering in a
+// direction sampled with density `scatterPdf`, where sampleLight() would
+// have picked the same direction with density `emissionLightPdf`. A
+// scatterPdf of 0 means light sampling can't produce the direction (camera
+// rays and mirror or pass-through directions), so the emission counts fully.
+float emissionMisWeight(float scatterPdf, float emissionLightPdf)
+{
+  if(scatterPdf <= 0.0)
+  {
+    return 1.0;
+  }
+  return powerHeuristic(scatterPdf, emissionLightPdf);
+}
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_LIGHTS_H
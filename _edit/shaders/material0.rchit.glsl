@@ -4,10 +4,6 @@
 
 void main()
 {
-  HitInfo hitInfo = getObjectHitInfo();
-
-  pld.color        = vec3(0.7);
-  pld.rayOrigin    = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
-  pld.rayDirection = diffuseReflection(hitInfo.worldNormal, pld.rngState);
-  pld.rayHitSky    = false;
+  const HitInfo hitInfo = getObjectHitInfo();
+  returnMaterial(hitInfo, material0(hitInfo, pld.pathSampler));
 }
\ No newline at end of file
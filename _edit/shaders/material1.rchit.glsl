@@ -6,10 +6,6 @@
 
 void main()
 {
-  HitInfo hitInfo = getObjectHitInfo();
-
-  pld.color        = vec3(0.7);
-  pld.rayOrigin    = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
-  pld.rayDirection = reflect(gl_WorldRayDirectionEXT, hitInfo.worldNormal);
-  pld.rayHitSky    = false;
+  const HitInfo hitInfo = getObjectHitInfo();
+  returnMaterial(hitInfo, material1(hitInfo, pld.pathSampler));
 }
\ No newline at end of file
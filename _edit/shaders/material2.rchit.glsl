@@ -6,10 +6,6 @@
 
 void main()
 {
-  HitInfo hitInfo = getObjectHitInfo();
-
-  pld.color        = vec3(0.5) + 0.5 * hitInfo.worldNormal;
-  pld.rayOrigin    = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
-  pld.rayDirection = diffuseReflection(hitInfo.worldNormal, pld.rngState);
-  pld.rayHitSky    = false;
+  const HitInfo hitInfo = getObjectHitInfo();
+  returnMaterial(hitInfo, material2(hitInfo, pld.pathSampler));
 }
\ No newline at end of file
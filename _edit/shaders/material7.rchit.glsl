@@ -6,11 +6,6 @@
 
 void main()
 {
-  HitInfo hitInfo = getObjectHitInfo();
-
-  const int primitiveID = gl_PrimitiveID;
-  pld.color             = clamp(vec3(primitiveID / 36.0, primitiveID / 9.0, primitiveID / 18.0), vec3(0.0), vec3(1.0));
-  pld.rayOrigin         = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
-  pld.rayDirection      = diffuseReflection(hitInfo.worldNormal, pld.rngState);
-  pld.rayHitSky         = false;
+  const HitInfo hitInfo = getObjectHitInfo();
+  returnMaterial(hitInfo, material7(hitInfo, pld.pathSampler));
 }
\ No newline at end of file
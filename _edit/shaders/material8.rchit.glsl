@@ -6,19 +6,6 @@
 
 void main()
 {
-  HitInfo hitInfo = getObjectHitInfo();
-
-  if(mod(length(hitInfo.objectPosition), 0.2) >= 0.05)
-  {
-    pld.color        = vec3(0.7);
-    pld.rayOrigin    = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
-    pld.rayDirection = diffuseReflection(hitInfo.worldNormal, pld.rngState);
-  }
-  else
-  {
-    pld.color        = vec3(1.0);
-    pld.rayOrigin    = offsetPositionAlongNormal(hitInfo.worldPosition, -hitInfo.worldNormal);
-    pld.rayDirection = gl_WorldRayDirectionEXT;
-  }
-  pld.rayHitSky = false;
+  const HitInfo hitInfo = getObjectHitInfo();
+  returnMaterial(hitInfo, material8(hitInfo, pld.pathSampler));
 }
\ No newline at end of file
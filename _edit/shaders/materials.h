@@ -0,0 +1,326 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+// The surface data and materials of the scene, shared by the closest-hit
+// shaders of the ray tracing pipeline and the kernels of the wavefront tracer.
+// Materials only depend on a HitInfo, so both tracers shade identically.
+// The including shader must enable GL_EXT_scalar_block_layout.
+#ifndef VK_MINI_PATH_TRACER_MATERIALS_H
+#define VK_MINI_PATH_TRACER_MATERIALS_H
+
+#include "../common.h"
+#include "shaderCommon.h"
+#include "bsdf.h"
+
+// These shaders can access the vertex and index buffers:
+// The scalar layout qualifier here means to align types according to the alignment
+// of their scalar components, instead of e.g. padding them to std140 rules.
+layout(binding = BINDING_VERTICES, set = 0, scalar) buffer Vertices
+{
+    vec3 vertices[];
+};
+layout(binding = BINDING_INDICES, set = 0, scalar) buffer Indices
+{
+    uint indices[];
+};
+// Data for each geometry (OBJ shape) in the BLAS:
+layout(binding = BINDING_GEOMETRIES, set = 0, scalar) buffer Geometries
+{
+    GeometryInfo geometries[];
+};
+
+struct HitInfo
+{
+    vec3 objectPosition;
+    vec3 worldPosition;
+    vec3 worldNormal;
+    vec3 worldRayDirection;  // Direction of the ray that hit the surface
+    int  primitiveID;        // Index of the triangle in its geometry, like gl_PrimitiveID
+    vec3 emission;           // Radiance the triangle emits (see GeometryInfo)
+};
+
+// What a material returns: the next segment of the path, and the lobe it was sampled from.
+struct ReturnedInfo
+{
+    vec3       rayOrigin;  // The new ray origin in world-space.
+    BsdfSample bsdf;       // The new ray direction in world-space, with its weight and density.
+    // If the material scattered with its Lambertian lobe, the lobe's albedo
+    // and normal, with which the tracers also sample lights at this hit (see
+    // lights.h). 0 for delta lobes, whose directions light sampling can't produce.
+    vec3 diffuseAlbedo;
+    vec3 diffuseNormal;
+};
+
+// Gets hit info about the triangle `primitiveID` of geometry `geometryIndex`
+// at the barycentric coordinates (1 - u - v, u, v), where `attributes` is (u, v).
+HitInfo computeHitInfo(uint geometryIndex, int primitiveID, vec2 attributes, mat4x3 objectToWorld, mat4x3 worldToObject, vec3 rayDirection)
+{
+    HitInfo result;
+    result.worldRayDirection = rayDirection;
+    result.primitiveID       = primitiveID;
+    result.emission          = geometries[geometryIndex].emission;
+    // Get the ID of the triangle. All geometries share the index buffer, and
+    // primitiveID is relative to the start of the geometry that was hit:
+    const uint primitiveIndex = geometries[geometryIndex].primitiveOffset + uint(primitiveID);
+
+    // Get the indices of the vertices of the triangle
+    const uint i0 = indices[3 * primitiveIndex + 0];
+    const uint i1 = indices[3 * primitiveIndex + 1];
+    const uint i2 = indices[3 * primitiveIndex + 2];
+
+    // Get the vertices of the triangle
+    const vec3 v0 = vertices[i0];
+    const vec3 v1 = vertices[i1];
+    const vec3 v2 = vertices[i2];
+
+
+    // Get the barycentric coordinates of the intersection
+    vec3 barycentrics = vec3(0.0, attributes.x, attributes.y);
+    barycentrics.x = 1.0 - barycentrics.y - barycentrics.z;
+
+    // Compute the coordinates of the intersection
+    result.objectPosition = v0 * barycentrics.x + v1 * barycentrics.y + v2 * barycentrics.z;
+    // Transform from object space to world space:
+    result.worldPosition = objectToWorld * vec4(result.objectPosition, 1.0f);
+
+
+    // Compute the normal of the triangle in object space, using the right-hand rule:
+    //    v2      .
+    //    |\      .
+    //    | \     .
+    //    |/ \    .
+    //    /   \   .
+    //   /|    \  .
+    //  L v0---v1 .
+    // n
+    const vec3 objectNormal = cross(v1 - v0, v2 - v0);
+    // Transform normals from object space to world space. These use the transpose of the inverse matrix,
+    // because they're directions of normals, not positions:
+    result.worldNormal = normalize((objectNormal * worldToObject).xyz);
+
+    // Flip the normal so it points against the ray direction:
+    result.worldNormal = faceforward(result.worldNormal, rayDirection, result.worldNormal);
+
+    return result;
+}
+
+// offsetPositionAlongNormal shifts a point on a triangle surface so that a
+// ray bouncing off the surface with tMin = 0.0 is no longer treated as
+// intersecting the surface it originated from.
+//
+// Here's the old implementation of it we used in earlier chapters:
+// vec3 offsetPositionAlongNormal(vec3 worldPosition, vec3 normal)
+// {
+//   return worldPosition + 0.0001 * normal;
+// }
+//
+// However, this code uses an improved technique by Carsten Wchter and
+// Nikolaus Binder from "A Fast and Robust Method for Avoiding
+// Self-Intersection" from Ray Tracing Gems (version 1.7, 2020).
+// The normal can be negated if one wants the ray to pass through
+// the surface instead.
+vec3 offsetPositionAlongNormal(vec3 worldPosition, vec3 normal)
+{
+    // Convert the normal to an integer offset.
+    const float int_scale = 256.0f;
+    const ivec3 of_i = ivec3(int_scale * normal);
+
+    // Offset each component of worldPosition using its binary representation.
+    // Handle the sign bits correctly.
+    const vec3 p_i = vec3(  //
+        intBitsToFloat(floatBitsToInt(worldPosition.x) + ((worldPosition.x < 0) ? -of_i.x : of_i.x)),
+        intBitsToFloat(floatBitsToInt(worldPosition.y) + ((worldPosition.y < 0) ? -of_i.y : of_i.y)),
+        intBitsToFloat(floatBitsToInt(worldPosition.z) + ((worldPosition.z < 0) ? -of_i.z : of_i.z)));
+
+    // Use a floating-point offset instead for points near (0,0,0), the origin.
+    const float origin = 1.0f / 32.0f;
+    const float floatScale = 1.0f / 65536.0f;
+    return vec3(  //
+        abs(worldPosition.x) < origin ? worldPosition.x + floatScale * normal.x : p_i.x,
+        abs(worldPosition.y) < origin ? worldPosition.y + floatScale * normal.y : p_i.y,
+        abs(worldPosition.z) < origin ? worldPosition.z + floatScale * normal.z : p_i.z);
+}
+
+// Scatters from the Lambertian lobe with albedo `albedo` around `normal`,
+// with the SAMPLE_DIRECTION dimensions of `pathSampler`.
+void scatterLambertian(inout ReturnedInfo result, vec3 albedo, vec3 normal, Sampler pathSampler)
+{
+    result.bsdf          = sampleLambertian(albedo, normal, sample2D(pathSampler, SAMPLE_DIRECTION));
+    result.diffuseAlbedo = albedo;
+    result.diffuseNormal = normal;
+}
+
+// Scatters from a delta lobe in `direction` with weight `color`: a mirror
+// reflection, or a ray passing through. Lights aren't sampled here.
+void scatterDelta(inout ReturnedInfo result, vec3 color, vec3 direction)
+{
+    result.bsdf          = sampleDelta(color, direction);
+    result.diffuseAlbedo = vec3(0.0);
+    result.diffuseNormal = vec3(0.0);
+}
+
+// The materials. The ray tracing pipeline calls each one from its own
+// closest-hit shader, and the wavefront tracer calls them through shadeMaterial().
+// `pathSampler` is at the bounce of the hit, and materials draw their random
+// numbers from its SAMPLE_LOBE and SAMPLE_DIRECTION dimensions.
+
+ReturnedInfo material0(HitInfo hitInfo, Sampler pathSampler)
+{
+    ReturnedInfo result;
+    result.rayOrigin = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
+    scatterLambertian(result, vec3(0.7), hitInfo.worldNormal, pathSampler);
+    return result;
+}
+
+ReturnedInfo material1(HitInfo hitInfo, Sampler pathSampler)
+{
+    ReturnedInfo result;
+    result.rayOrigin = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
+    scatterDelta(result, vec3(0.7), reflect(hitInfo.worldRayDirection, hitInfo.worldNormal));
+    return result;
+}
+
+ReturnedInfo material2(HitInfo hitInfo, Sampler pathSampler)
+{
+    ReturnedInfo result;
+    result.rayOrigin = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
+    scatterLambertian(result, vec3(0.5) + 0.5 * hitInfo.worldNormal, hitInfo.worldNormal, pathSampler);
+    return result;
+}
+
+// 20% mirror, 80% diffuse. Picking each lobe with its share of the mixture
+// makes the shares cancel out of the weights (see bsdf.h).
+ReturnedInfo material3(HitInfo hitInfo, Sampler pathSampler)
+{
+    ReturnedInfo result;
+    result.rayOrigin = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
+    if(sample1D(pathSampler, SAMPLE_LOBE) < 0.2)
+    {
+        scatterDelta(result, vec3(0.7), reflect(hitInfo.worldRayDirection, hitInfo.worldNormal));
+    }
+    else
+    {
+        scatterLambertian(result, vec3(0.7), hitInfo.worldNormal, pathSampler);
+    }
+    return result;
+}
+
+ReturnedInfo material4(HitInfo hitInfo, Sampler pathSampler)
+{
+    ReturnedInfo result;
+    if(sample1D(pathSampler, SAMPLE_LOBE) < 0.5)
+    {
+        result.rayOrigin = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
+        scatterLambertian(result, vec3(0.7), hitInfo.worldNormal, pathSampler);
+    }
+    else
+    {
+        result.rayOrigin = offsetPositionAlongNormal(hitInfo.worldPosition, -hitInfo.worldNormal);
+        scatterDelta(result, vec3(0.7), hitInfo.worldRayDirection);
+    }
+    return result;
+}
+
+ReturnedInfo material5(HitInfo hitInfo, Sampler pathSampler)
+{
+    ReturnedInfo result;
+    if(mod(dot(hitInfo.objectPosition, vec3(1, 1, 1)), 0.5) >= 0.25)
+    {
+        result.rayOrigin = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
+        scatterLambertian(result, vec3(0.7), hitInfo.worldNormal, pathSampler);
+    }
+    else
+    {
+        result.rayOrigin = offsetPositionAlongNormal(hitInfo.worldPosition, -hitInfo.worldNormal);
+        scatterDelta(result, vec3(1.0), hitInfo.worldRayDirection);
+    }
+    return result;
+}
+
+ReturnedInfo material6(HitInfo hitInfo, Sampler pathSampler)
+{
+    ReturnedInfo result;
+    result.rayOrigin = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
+
+    // Perturb the normal:
+    const float scaleFactor        = 80.0;
+    const vec3  perturbationAmount = 0.03
+                                    * vec3(sin(scaleFactor * hitInfo.worldPosition.x),  //
+                                           sin(scaleFactor * hitInfo.worldPosition.y),  //
+                                           sin(scaleFactor * hitInfo.worldPosition.z));
+    const vec3 shadingNormal = normalize(hitInfo.worldNormal + perturbationAmount);
+    BsdfSample lobeSample;
+    if(sample1D(pathSampler, SAMPLE_LOBE) < 0.4)
+    {
+        lobeSample = sampleDelta(vec3(0.7), reflect(hitInfo.worldRayDirection, shadingNormal));
+    }
+    else
+    {
+        lobeSample = sampleLambertian(vec3(0.7), shadingNormal, sample2D(pathSampler, SAMPLE_DIRECTION));
+    }
+    // If the ray now points into the surface, reflect it across:
+    vec3 direction = lobeSample.direction;
+    if(dot(direction, hitInfo.worldNormal) <= 0.0)
+    {
+        direction = reflect(direction, hitInfo.worldNormal);
+    }
+    // Folding directions across the surface changes their density, so this
+    // material doesn't use light sampling:
+    scatterDelta(result, lobeSample.weight, direction);
+    return result;
+}
+
+ReturnedInfo material7(HitInfo hitInfo, Sampler pathSampler)
+{
+    ReturnedInfo result;
+    const int  primitiveID = hitInfo.primitiveID;
+    const vec3 albedo      = clamp(vec3(primitiveID / 36.0, primitiveID / 9.0, primitiveID / 18.0), vec3(0.0), vec3(1.0));
+    result.rayOrigin       = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
+    scatterLambertian(result, albedo, hitInfo.worldNormal, pathSampler);
+    return result;
+}
+
+ReturnedInfo material8(HitInfo hitInfo, Sampler pathSampler)
+{
+    ReturnedInfo result;
+    if(mod(length(hitInfo.objectPosition), 0.2) >= 0.05)
+    {
+        result.rayOrigin = offsetPositionAlongNormal(hitInfo.worldPosition, hitInfo.worldNormal);
+        scatterLambertian(result, vec3(0.7), hitInfo.worldNormal, pathSampler);
+    }
+    else
+    {
+        result.rayOrigin = offsetPositionAlongNormal(hitInfo.worldPosition, -hitInfo.worldNormal);
+        scatterDelta(result, vec3(1.0), hitInfo.worldRayDirection);
+    }
+    return result;
+}
+
+// Shades a hit with material `material`, which is the hit group index of the
+// instance that was hit. As in the ray tracing pipeline's SBT, indices past
+// the last material use material8.
+ReturnedInfo shadeMaterial(uint material, HitInfo hitInfo, Sampler pathSampler)
+{
+    switch(material)
+    {
+        case 0:
+            return material0(hitInfo, pathSampler);
+        case 1:
+            return material1(hitInfo, pathSampler);
+        case 2:
+            return material2(hitInfo, pathSampler);
+        case 3:
+            return material3(hitInfo, pathSampler);
+        case 4:
+            return material4(hitInfo, pathSampler);
+        case 5:
+            return material5(hitInfo, pathSampler);
+        case 6:
+            return material6(hitInfo, pathSampler);
+        case 7:
+            return material7(hitInfo, pathSampler);
+        default:
+            return material8(hitInfo, pathSampler);
+    }
+}
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_MATERIALS_H
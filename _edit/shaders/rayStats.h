@@ -0,0 +1,130 @@
+// Ray statistics for the ray generation shader.
+// The including shader must enable GL_KHR_shader_subgroup_arithmetic and
+// GL_KHR_shader_subgroup_ballot, and include common.h.
+#ifndef VK_MINI_PATH_TRACER_RAY_STATS_H
+#define VK_MINI_PATH_TRACER_RAY_STATS_H
+
+// If false, the functions below do nothing, and the driver removes them.
+layout(constant_id = CONSTANT_ID_ENABLE_RAY_STATS) const bool ENABLE_RAY_STATS = false;
+
+layout(binding = BINDING_STATS, set = 0, scalar) buffer Stats
+{
+  RayStats stats;
+};
+
+// Adds the 64-bit count `count` (a uvec2 of its low and high halves) to the
+// RayCount `counter` in the buffer. The halves are two separate atomics, so
+// the total is only exact once all invocations finish; the CPU reads it
+// after the batch.
+#define rayStatsAdd(counter, count)                                                                                    \
+  {                                                                                                                    \
+    const uvec2 rayStatsValue = (count);                                                                               \
+    const uint  rayStatsHigh =                                                                                         \
+        rayStatsValue.y + ((atomicAdd((counter).low, rayStatsValue.x) > 0xFFFFFFFFu - rayStatsValue.x) ? 1u : 0u);    \
+    if(rayStatsHigh != 0)                                                                                              \
+    {                                                                                                                  \
+      atomicAdd((counter).high, rayStatsHigh);                                                                         \
+    }                                                                                                                  \
+  }
+
+// Each invocation sums its counts here, and rayStatsFlush() adds them to the
+// buffer, so that most of the atomics happen once per subgroup instead of
+// once per ray. An invocation of the ray generation shader traces every
+// sample of its pixel, so these have 64 bits too, as (low, high) halves.
+uvec2 g_primaryRays            = uvec2(0);
+uvec2 g_secondaryRays          = uvec2(0);
+uvec2 g_skyHits                = uvec2(0);
+uvec2 g_segmentCapTerminations = uvec2(0);
+uvec2 g_rouletteTerminations   = uvec2(0);
+uvec2 g_shadowRays             = uvec2(0);
+
+// Adds `count` to the 64-bit `counter`.
+void rayStatsCount(inout uvec2 counter, uint count)
+{
+  uint carry;
+  counter.x = uaddCarry(counter.x, count, carry);
+  counter.y += carry;
+}
+
+// Returns the 64-bit sum of `count` over the active invocations of the
+// subgroup. The low halves are summed in 16-bit parts, which can't wrap,
+// since a subgroup has at most 128 invocations.
+uvec2 rayStatsSubgroupAdd(uvec2 count)
+{
+  const uint lowSum = subgroupAdd(count.x & 0xFFFFu);
+  const uint midSum = subgroupAdd(count.x >> 16);
+  uvec2      sum    = uvec2(lowSum, subgroupAdd(count.y) + (midSum >> 16));
+  uint       carry;
+  sum.x = uaddCarry(sum.x, midSum << 16, carry);
+  sum.y += carry;
+  return sum;
+}
+
+// Counts a path that ended after `segments` segments, by hitting the sky,
+// by Russian roulette, or otherwise by reaching the maximum depth.
+void rayStatsAddPath(uint segments, bool hitSky, bool endedByRoulette)
+{
+  if(!ENABLE_RAY_STATS)
+  {
+    return;
+  }
+
+  rayStatsCount(g_primaryRays, 1);
+  rayStatsCount(g_secondaryRays, segments - 1);
+  rayStatsCount(g_skyHits, hitSky ? 1 : 0);
+  rayStatsCount(g_segmentCapTerminations, (!hitSky && !endedByRoulette) ? 1 : 0);
+  rayStatsCount(g_rouletteTerminations, endedByRoulette ? 1 : 0);
+
+  // Add to the histogram once per distinct bin in the subgroup: each
+  // iteration, the invocations with the same bin as the first active
+  // invocation count themselves with a ballot, and leave the loop.
+  const uint bin = segments - 1;
+  while(true)
+  {
+    if(bin == subgroupBroadcastFirst(bin))
+    {
+      const uint count = subgroupBallotBitCount(subgroupBallot(true));
+      if(subgroupElect())
+      {
+        rayStatsAdd(stats.segmentHistogram[bin], uvec2(count, 0));
+      }
+      break;
+    }
+  }
+}
+
+// Counts a shadow ray traced for next-event estimation.
+void rayStatsAddShadowRay()
+{
+  if(ENABLE_RAY_STATS)
+  {
+    rayStatsCount(g_shadowRays, 1);
+  }
+}
+
+// Adds the counts of all active invocations in the subgroup to the buffer.
+void rayStatsFlush()
+{
+  if(!ENABLE_RAY_STATS)
+  {
+    return;
+  }
+
+  const uvec2 primaryRays            = rayStatsSubgroupAdd(g_primaryRays);
+  const uvec2 secondaryRays          = rayStatsSubgroupAdd(g_secondaryRays);
+  const uvec2 skyHits                = rayStatsSubgroupAdd(g_skyHits);
+  const uvec2 segmentCapTerminations = rayStatsSubgroupAdd(g_segmentCapTerminations);
+  const uvec2 rouletteTerminations   = rayStatsSubgroupAdd(g_rouletteTerminations);
+  const uvec2 shadowRays             = rayStatsSubgroupAdd(g_shadowRays);
+  if(subgroupElect())
+  {
+    rayStatsAdd(stats.primaryRays, primaryRays);
+    rayStatsAdd(stats.secondaryRays, secondaryRays);
+    rayStatsAdd(stats.skyHits, skyHits);
+    rayStatsAdd(stats.segmentCapTerminations, segmentCapTerminations);
+    rayStatsAdd(stats.rouletteTerminations, rouletteTerminations);
+    rayStatsAdd(stats.shadowRays, shadowRays);
+  }
+}
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_RAY_STATS_H
@@ -4,37 +4,72 @@
 #extension GL_EXT_ray_tracing : require
 #extension GL_EXT_scalar_block_layout : require
 #extension GL_GOOGLE_include_directive : require
+#extension GL_KHR_shader_subgroup_arithmetic : require
+#extension GL_KHR_shader_subgroup_ballot : require
 #include "../common.h"
 #include "shaderCommon.h"
+#include "rayStats.h"
+#include "bsdf.h"
+#include "lights.h"
 
 // Binding BINDING_IMAGEDATA in set 0 is a storage image with four 32-bit floating-point channels,
 // defined using a uniform image2D variable.
 layout(binding = BINDING_IMAGEDATA, set = 0, rgba32f) uniform image2D storageImage;
 layout(binding = BINDING_TLAS, set = 0) uniform accelerationStructureEXT tlas;
 
-layout(push_constant) uniform PushConsts
+// With adaptive sampling, each row of the launch traces one tile from the
+// tile list, and each batch also updates the mean squared luminance of its
+// pixels, from which adaptiveTiles.comp.glsl estimates their variance.
+layout(constant_id = CONSTANT_ID_ADAPTIVE_SAMPLING) const bool ADAPTIVE_SAMPLING = false;
+layout(constant_id = CONSTANT_ID_ADAPTIVE_TILE_WIDTH) const uint ADAPTIVE_TILE_WIDTH   = DEFAULT_ADAPTIVE_TILE_WIDTH;
+layout(constant_id = CONSTANT_ID_ADAPTIVE_TILE_HEIGHT) const uint ADAPTIVE_TILE_HEIGHT = DEFAULT_ADAPTIVE_TILE_HEIGHT;
+layout(binding = BINDING_ADAPTIVE_VARIANCE, set = 0, r32f) uniform image2D varianceImage;
+layout(binding = BINDING_ADAPTIVE_TILES, set = 0, scalar) buffer Tiles
 {
-  PushConstants pushConstants;
+  AdaptiveTileHeader tileHeader;
+  uint               tiles[];
 };
 
 // Ray payloads are used to send information between shaders.
 layout(location = 0) rayPayloadEXT PassableInfo pld;
+// Shadow rays only need to know whether they reached the light:
+layout(location = 1) rayPayloadEXT bool shadowRayMissed;
+
+// Paths end after at most this many segments. This is a specialization
+// constant rather than termination.maxSegments, so that the compiler knows
+// the loop bound of each variant.
+layout(constant_id = CONSTANT_ID_MAX_SEGMENTS) const uint MAX_SEGMENTS = MAX_PATH_SEGMENTS;
+
+layout(push_constant) uniform PushConsts
+{
+  PathTermination termination;
+};
 
-// Uses the Box-Muller transform to return a normally distributed (centered
-// at 0, standard deviation 1) 2D point.
-vec2 randomGaussian(inout uint rngState)
+// Returns true if nothing is in the way of a ray of length `distance`.
+bool traceShadowRay(vec3 origin, vec3 direction, float distance)
 {
-  // Almost uniform in (0, 1] - make sure the value is never 0:
-  const float u1    = max(1e-38, stepAndOutputRNGFloat(rngState));
-  const float u2    = stepAndOutputRNGFloat(rngState);  // In [0, 1]
-  const float r     = sqrt(-2.0 * log(u1));
-  const float theta = 2 * k_pi * u2;  // Random in [0, 2pi]
-  return r * vec2(cos(theta), sin(theta));
+  rayStatsAddShadowRay();
+  shadowRayMissed = false;
+  // Any hit shows that the ray is blocked, so stop at the first one, and
+  // don't run closest-hit shaders:
+  traceRayEXT(tlas,                                     // Top-level acceleration structure
+              gl_RayFlagsOpaqueEXT | gl_RayFlagsTerminateOnFirstHitEXT
+                  | gl_RayFlagsSkipClosestHitShaderEXT,  // Ray flags
+              0xFF,                                     // 8-bit instance mask
+              0,                                        // SBT record offset
+              0,                                        // SBT record stride for offset
+              1,                                        // Miss index: shadow.rmiss.glsl
+              origin,                                   // Ray origin
+              0.0,                                      // Minimum t-value
+              direction,                                // Ray direction
+              distance * 0.999,                         // Maximum t-value: stop short of the light itself
+              1);                                       // Location of payload
+  return shadowRayMissed;
 }
 
 void main()
 {
-  // The resolution of the image, which is the same as the launch size:
+  // The resolution of the image, which is the same as the launch size without adaptive sampling:
   const ivec2 resolution = imageSize(storageImage);
 
   // Get the coordinates of the pixel for this invocation:
@@ -45,7 +80,17 @@ void main()
   // '-------'
   // v
   // y
-  const ivec2 pixel = ivec2(gl_LaunchIDEXT.xy);
+  //
+  // Number the invocations row by row, and visit the pixels in PIXEL_ORDER:
+  ivec2 pixel = pixelFromIndex(gl_LaunchIDEXT.y * gl_LaunchSizeEXT.x + gl_LaunchIDEXT.x, resolution);
+  if(ADAPTIVE_SAMPLING)
+  {
+    const uint tile       = tiles[gl_LaunchIDEXT.y];
+    const uint tilesWide  = uint(resolution.x + ADAPTIVE_TILE_WIDTH - 1) / ADAPTIVE_TILE_WIDTH;
+    const uint tilePixelX = gl_LaunchIDEXT.x % ADAPTIVE_TILE_WIDTH;
+    const uint tilePixelY = gl_LaunchIDEXT.x / ADAPTIVE_TILE_WIDTH;
+    pixel = ivec2((tile % tilesWide) * ADAPTIVE_TILE_WIDTH + tilePixelX, (tile / tilesWide) * ADAPTIVE_TILE_HEIGHT + tilePixelY);
+  }
 
   // If the pixel is outside of the image, don't do anything:
   if((pixel.x >= resolution.x) || (pixel.y >= resolution.y))
@@ -53,50 +98,41 @@ void main()
     return;
   }
 
-  // State of the random number generator with an initial seed.
-  pld.rngState = uint((pushConstants.sample_batch * resolution.y + pixel.y) * resolution.x + pixel.x);
-
-  // This scene uses a right-handed coordinate system like the OBJ file format, where the
-  // +x axis points right, the +y axis points up, and the -z axis points into the screen.
-  // The camera is located at (-0.001, 0, 53).
-  const vec3 cameraOrigin = vec3(-0.001, 0.0, 53.0);
-  // Define the field of view by the vertical slope of the topmost rays:
-  const float fovVerticalSlope = 1.0 / 5.0;
+  // The alpha channel of the storage image counts how many sample batches have
+  // been averaged into this pixel so far. Keeping this counter on the GPU
+  // (instead of passing the batch index in a push constant) means the same
+  // recorded command buffer can be submitted for every batch.
+  const vec4 previousPixel = imageLoad(storageImage, pixel);
+  const uint sampleBatch   = uint(previousPixel.a);
 
   // The sum of the colors of all of the samples.
   vec3 summedPixelColor = vec3(0.0);
 
-  // Limit the kernel to trace at most 64 samples.
-  const int NUM_SAMPLES = 64;
+  // Limit the kernel to trace at most SAMPLES_PER_BATCH samples.
+  const int NUM_SAMPLES = int(SAMPLES_PER_BATCH);
   for(int sampleIdx = 0; sampleIdx < NUM_SAMPLES; sampleIdx++)
   {
-    // Rays always originate at the camera for now. In the future, they'll
-    // bounce around the scene.
-    vec3 rayOrigin = cameraOrigin;
-    // Compute the direction of the ray for this pixel. To do this, we first
-    // transform the screen coordinates to look like this, where a is the
-    // aspect ratio (width/height) of the screen:
-    //           1
-    //    .------+------.
-    //    |      |      |
-    // -a + ---- 0 ---- + a
-    //    |      |      |
-    //    '------+------'
-    //          -1
-    // Use a Gaussian with standard deviation 0.375 centered at the center of
-    // the pixel:
-    const vec2 randomPixelCenter = vec2(pixel) + vec2(0.5) + 0.375 * randomGaussian(pld.rngState);
-    const vec2 screenUV          = vec2((2.0 * randomPixelCenter.x - resolution.x) / resolution.y,    //
-                               -(2.0 * randomPixelCenter.y - resolution.y) / resolution.y);  // Flip the y axis
-    // Create a ray direction:
-    vec3 rayDirection = vec3(fovVerticalSlope * screenUV.x, fovVerticalSlope * screenUV.y, -1.0);
-    rayDirection      = normalize(rayDirection);
+    // This is sample (sampleBatch * NUM_SAMPLES + sampleIdx) of the pixel's sample sequence:
+    pld.pathSampler = createSampler(pixel, sampleBatch * NUM_SAMPLES + sampleIdx, 0);
 
-    vec3 accumulatedRayColor = vec3(1.0);  // The amount of light that made it to the end of the current ray.
+    // Start the path at the camera:
+    vec3 rayOrigin, rayDirection;
+    generateCameraRay(pixel, resolution, pld.pathSampler, rayOrigin, rayDirection);
 
-    // Limit the kernel to trace at most 32 segments.
-    for(int tracedSegments = 0; tracedSegments < 32; tracedSegments++)
+    vec3 accumulatedRayColor = vec3(1.0);  // The amount of light that made it to the end of the current ray.
+    // The density with which the last segment's direction was sampled, for
+    // MIS; 0 for the camera ray (see emissionMisWeight):
+    float scatterPdf = 0.0;
+
+    // Limit the kernel to trace at most MAX_SEGMENTS segments.
+    uint pathSegments        = 0;
+    bool pathHitSky          = false;
+    bool pathEndedByRoulette = false;
+    for(uint tracedSegments = 0; tracedSegments < MAX_SEGMENTS; tracedSegments++)
     {
+      // Decisions at the surface this segment hits use this bounce's sample dimensions:
+      pld.pathSampler.bounce = tracedSegments;
+
       // Trace the ray into the scene and get data back!
       traceRayEXT(tlas,                  // Top-level acceleration structure
                   gl_RayFlagsOpaqueEXT,  // Ray flags, here saying "treat all geometry as opaque"
@@ -110,8 +146,7 @@ void main()
                   10000.0,               // Maximum t-value
                   0);                    // Location of payload
 
-      // Compute the amount of light that returns to this sample from the ray
-      accumulatedRayColor *= pld.color;
+      pathSegments++;
 
       if(pld.rayHitSky)
       {
@@ -119,8 +154,37 @@ void main()
         // Sum this with the pixel's other samples.
         // (Note that we treat a ray that didn't find a light source as if it had
         // an accumulated color of (0, 0, 0)).
-        summedPixelColor += accumulatedRayColor;
+        summedPixelColor += accumulatedRayColor * pld.color;
 
+        pathHitSky = true;
+        break;
+      }
+
+      // Add the light the surface emits, weighted against having sampled it
+      // with a light sample at the previous hit:
+      summedPixelColor += accumulatedRayColor * pld.emission * emissionMisWeight(scatterPdf, pld.emissionLightPdf);
+      // At diffuse surfaces, also sample a point on a light (next-event estimation):
+      LightSample lightSample;
+      if(pld.scatterPdf > 0.0 && sampleLight(pld.rayOrigin, pld.pathSampler, lightSample))
+      {
+        const vec3 lightRadiance =
+            lightSampleRadiance(lightSample, evaluateLambertian(pld.diffuseAlbedo, pld.diffuseNormal, lightSample.direction),
+                                lambertianPdf(pld.diffuseNormal, lightSample.direction));
+        if(any(greaterThan(lightRadiance, vec3(0.0)))
+           && traceShadowRay(pld.rayOrigin, lightSample.direction, lightSample.distance))
+        {
+          summedPixelColor += accumulatedRayColor * lightRadiance;
+        }
+      }
+      scatterPdf = pld.scatterPdf;
+
+      // Compute the amount of light that returns to this sample from the ray
+      accumulatedRayColor *= pld.color;
+
+      if(!russianRouletteSurvives(pathSegments, termination.rouletteMinSegments, accumulatedRayColor, pld.pathSampler))
+      {
+        // Little light would make it back along this path, so end it.
+        pathEndedByRoulette = true;
         break;
       }
       else
@@ -130,18 +194,31 @@ void main()
         rayDirection = pld.rayDirection;
       }
     }
+
+    rayStatsAddPath(pathSegments, pathHitSky, pathEndedByRoulette);
   }
+  rayStatsFlush();
 
   // Blend with the averaged image in the buffer:
-  vec3 averagePixelColor = summedPixelColor / float(NUM_SAMPLES);
-  if(pushConstants.sample_batch != 0)
+  const vec3 batchColor        = summedPixelColor / float(NUM_SAMPLES);
+  vec3       averagePixelColor = batchColor;
+  if(sampleBatch != 0)
   {
-    // Read the storage image:
-    const vec3 previousAverageColor = imageLoad(storageImage, pixel).rgb;
     // Compute the new average:
-    averagePixelColor =
-        (pushConstants.sample_batch * previousAverageColor + averagePixelColor) / (pushConstants.sample_batch + 1);
+    averagePixelColor = (sampleBatch * previousPixel.rgb + averagePixelColor) / (sampleBatch + 1);
+  }
+  if(ADAPTIVE_SAMPLING)
+  {
+    // Average the squared luminance of this batch the same way:
+    const float batchLuminance = luminance(batchColor);
+    float       meanSquared    = batchLuminance * batchLuminance;
+    if(sampleBatch != 0)
+    {
+      meanSquared = (sampleBatch * imageLoad(varianceImage, pixel).r + meanSquared) / (sampleBatch + 1);
+    }
+    imageStore(varianceImage, pixel, vec4(meanSquared));
   }
-  // Set the color of the pixel `pixel` in the storage image to `averagePixelColor`:
-  imageStore(storageImage, pixel, vec4(averagePixelColor, 0.0));
+  // Set the color of the pixel `pixel` in the storage image to `averagePixelColor`,
+  // and count this batch:
+  imageStore(storageImage, pixel, vec4(averagePixelColor, float(sampleBatch + 1)));
 }
\ No newline at end of file
@@ -8,17 +8,6 @@
 layout(location = 0) rayPayloadInEXT PassableInfo pld;
 
 void main() {
-  // Returns the color of the sky in a given direction (in linear color space)
-  // +y in world space is up, so:
-  const float rayDirY = gl_WorldRayDirectionEXT.y;
-  if(rayDirY > 0.0f)
-  {
-    pld.color = mix(vec3(1.0f), vec3(0.25f, 0.5f, 1.0f), rayDirY);
-  }
-  else
-  {
-    pld.color = vec3(0.03f);
-  }
-
+  pld.color     = skyColor(gl_WorldRayDirectionEXT);
   pld.rayHitSky = true;
 }
\ No newline at end of file
@@ -1,26 +1,341 @@
 // Common GLSL file shared across ray tracing shaders.
+// The including shader must include common.h first.
 #ifndef VK_MINI_PATH_TRACER_SHADER_COMMON_H
 #define VK_MINI_PATH_TRACER_SHADER_COMMON_H
 
+// Every random number a path uses comes from its Sampler, which stands for
+// one sample of one pixel. Instead of stepping a random number generator,
+// each sampling site reads a fixed dimension of the pixel's sample sequence:
+// the camera ray uses dimensions SAMPLE_CAMERA and SAMPLE_CAMERA + 1, and each
+// bounce gets its own SAMPLE_DIMENSIONS_PER_BOUNCE dimensions, laid out by the
+// offsets below. Sample i of a pixel then always makes the same decision with
+// the same dimension, which is what lets a low-discrepancy sequence spread
+// the samples of each decision evenly. The SAMPLER specialization constant
+// picks the sequence (see SAMPLER_RANDOM in common.h).
+struct Sampler
+{
+	uint pixel;        // The pixel's x coordinate in the low 16 bits, and its y coordinate in the high 16 bits
+	uint sampleIndex;  // Index of this sample in the pixel's sequence
+	uint bounce;       // Index of the surface the path is at along the path; 0 for the surface the camera ray hit
+	uint seed;         // Seed of the image; different seeds render independent images
+};
+
+layout(constant_id = CONSTANT_ID_SAMPLER) const uint SAMPLER = SAMPLER_SOBOL;
+// The number of samples each pixel gets per sample batch:
+layout(constant_id = CONSTANT_ID_SAMPLES_PER_BATCH) const uint SAMPLES_PER_BATCH = DEFAULT_SAMPLES_PER_BATCH;
+
+#define SAMPLE_CAMERA 0                 // 2D: The position in the pixel
+#define SAMPLE_FIRST_BOUNCE 4           // The first dimension of bounce 0
+#define SAMPLE_DIMENSIONS_PER_BOUNCE 8  // Each bounce uses this many dimensions:
+#define SAMPLE_LOBE 0                   // 1D: Which lobe a material scatters with
+#define SAMPLE_DIRECTION 1              // 2D: The scattered direction
+#define SAMPLE_ROULETTE 3               // 1D: Whether Russian roulette ends the path
+#define SAMPLE_LIGHT_PICK 4             // 2D: The alias table slot, and whether to take its alias
+#define SAMPLE_LIGHT_POINT 6            // 2D: The point on the picked light
+
 struct PassableInfo
 {
-	vec3 color;         // The reflectivity of the surface.
+	vec3 color;         // The weight of the new ray (see BsdfSample), or the sky's radiance if the ray hit the sky.
 	vec3 rayOrigin;     // The new ray origin in world-space.
 	vec3 rayDirection;  // The new ray direction in world-space.
-	uint rngState;      // State of the random number generator.
+	Sampler pathSampler;  // The path's sample, set by the ray generation shader.
 	bool rayHitSky;     // True if the ray hit the sky.
+	// Radiance the surface emits towards the ray's origin, and the density
+	// with which light sampling picks that direction (see lights.h):
+	vec3  emission;
+	float emissionLightPdf;
+	// How the material scattered (see ReturnedInfo in materials.h):
+	float scatterPdf;
+	vec3  diffuseAlbedo;
+	vec3  diffuseNormal;
 };
 
-// Steps the RNG and returns a floating-point value between 0 and 1 inclusive.
-float stepAndOutputRNGFloat(inout uint rngState)
+Sampler createSampler(ivec2 pixel, uint sampleIndex, uint seed)
+{
+	Sampler result;
+	result.pixel       = uint(pixel.x) | (uint(pixel.y) << 16);
+	result.sampleIndex = sampleIndex;
+	result.bounce      = 0;
+	result.seed        = seed;
+	return result;
+}
+
+// Hashes a 32-bit value with the permutation of pcg_output_rxs_m_xs_32_32.
+uint hashUint(uint value)
+{
+	const uint state = value * 747796405u + 2891336453u;
+	const uint word  = ((state >> ((state >> 28) + 4)) ^ state) * 277803737u;
+	return (word >> 22) ^ word;
+}
+
+// Combines a seed with a value, to derive independent seeds from one seed.
+uint hashCombine(uint seed, uint value)
+{
+	return seed ^ (hashUint(value) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+// Converts the high 24 bits of `value` to a float in [0, 1).
+float uintToUnitFloat(uint value)
+{
+	return float(value >> 8) * (1.0 / 16777216.0);
+}
+
+// The direction numbers of the first four dimensions of the Sobol sequence
+// (from Joe and Kuo's new-joe-kuo-6.21201), 32 per dimension.
+const uint SOBOL_DIRECTIONS[4 * 32] = uint[](
+	// Dimension 0 (the van der Corput sequence):
+	0x80000000u, 0x40000000u, 0x20000000u, 0x10000000u, 0x08000000u, 0x04000000u, 0x02000000u, 0x01000000u,
+	0x00800000u, 0x00400000u, 0x00200000u, 0x00100000u, 0x00080000u, 0x00040000u, 0x00020000u, 0x00010000u,
+	0x00008000u, 0x00004000u, 0x00002000u, 0x00001000u, 0x00000800u, 0x00000400u, 0x00000200u, 0x00000100u,
+	0x00000080u, 0x00000040u, 0x00000020u, 0x00000010u, 0x00000008u, 0x00000004u, 0x00000002u, 0x00000001u,
+	// Dimension 1:
+	0x80000000u, 0xc0000000u, 0xa0000000u, 0xf0000000u, 0x88000000u, 0xcc000000u, 0xaa000000u, 0xff000000u,
+	0x80800000u, 0xc0c00000u, 0xa0a00000u, 0xf0f00000u, 0x88880000u, 0xcccc0000u, 0xaaaa0000u, 0xffff0000u,
+	0x80008000u, 0xc000c000u, 0xa000a000u, 0xf000f000u, 0x88008800u, 0xcc00cc00u, 0xaa00aa00u, 0xff00ff00u,
+	0x80808080u, 0xc0c0c0c0u, 0xa0a0a0a0u, 0xf0f0f0f0u, 0x88888888u, 0xccccccccu, 0xaaaaaaaau, 0xffffffffu,
+	// Dimension 2:
+	0x80000000u, 0xc0000000u, 0x60000000u, 0x90000000u, 0xe8000000u, 0x5c000000u, 0x8e000000u, 0xc5000000u,
+	0x68800000u, 0x9cc00000u, 0xee600000u, 0x55900000u, 0x80680000u, 0xc09c0000u, 0x60ee0000u, 0x90550000u,
+	0xe8808000u, 0x5cc0c000u, 0x8e606000u, 0xc5909000u, 0x6868e800u, 0x9c9c5c00u, 0xeeee8e00u, 0x5555c500u,
+	0x8000e880u, 0xc0005cc0u, 0x60008e60u, 0x9000c590u, 0xe8006868u, 0x5c009c9cu, 0x8e00eeeeu, 0xc5005555u,
+	// Dimension 3:
+	0x80000000u, 0xc0000000u, 0x20000000u, 0x50000000u, 0xf8000000u, 0x74000000u, 0xa2000000u, 0x93000000u,
+	0xd8800000u, 0x25400000u, 0x59e00000u, 0xe6d00000u, 0x78080000u, 0xb40c0000u, 0x82020000u, 0xc3050000u,
+	0x208f8000u, 0x51474000u, 0xfbea2000u, 0x75d93000u, 0xa0858800u, 0x914e5400u, 0xdbe79e00u, 0x25db6d00u,
+	0x58800080u, 0xe54000c0u, 0x79e00020u, 0xb6d00050u, 0x800800f8u, 0xc00c0074u, 0x200200a2u, 0x50050093u
+);
+
+// Returns dimension `dimension` (at most 3) of point `index` of the Sobol sequence.
+uint sobol(uint index, uint dimension)
+{
+	uint result = 0;
+	for(uint bit = 0; index != 0; bit++, index >>= 1)
+	{
+		if((index & 1) != 0)
+		{
+			result ^= SOBOL_DIRECTIONS[dimension * 32 + bit];
+		}
+	}
+	return result;
+}
+
+// Owen scrambling with a hash, from Burley, "Practical Hash-based Owen
+// Scrambling" (JCGT 2020): a random permutation of 32-bit values in which
+// each bit only depends on itself and the bits above it...
+uint laineKarrasPermutation(uint value, uint seed)
+{
+	value += seed;
+	value ^= value * 0x6c50b47cu;
+	value ^= value * 0xb82f1e52u;
+	value ^= value * 0xc7afe638u;
+	value ^= value * 0x8d22f6e6u;
+	return value;
+}
+
+// ...so reversing the bits gives a permutation that, like Owen scrambling,
+// keeps every aligned power-of-two interval of values together.
+uint nestedUniformScramble(uint value, uint seed)
+{
+	return bitfieldReverse(laineKarrasPermutation(bitfieldReverse(value), seed));
+}
+
+// Returns dimension `dimension` of point `index` of an Owen-scrambled Sobol
+// sequence with seed `seed`, as a 32-bit fixed-point value. Dimensions
+// past the first four are padded with further groups of four dimensions,
+// each with its own scrambling, and with the points in a shuffled order, so
+// that the groups don't correlate; any power-of-two prefix of the points
+// stays stratified in each group.
+uint owenScrambledSobol(uint index, uint dimension, uint seed)
+{
+	const uint groupSeed     = hashCombine(seed, dimension / 4);
+	const uint shuffledIndex = nestedUniformScramble(index, groupSeed);
+	return nestedUniformScramble(sobol(shuffledIndex, dimension % 4), hashCombine(groupSeed, dimension % 4));
+}
+
+// A dither mask in [0, 1) over the pixels of the image, with most of its
+// energy at high frequencies, and a different pattern for each dimension
+// (Jimenez's interleaved gradient noise, shifted per dimension).
+float blueNoiseMask(uvec2 pixel, uint dimension)
+{
+	const vec2 position = vec2(pixel) + 5.588238 * float(dimension);
+	return fract(52.9829189 * fract(dot(position, vec2(0.06711056, 0.00583715))));
+}
+
+// Returns dimension `dimension` of the sample `pathSampler`, in [0, 1).
+float sampleDimension(Sampler pathSampler, uint dimension)
+{
+	if(SAMPLER == SAMPLER_SOBOL)
+	{
+		// Each pixel has its own scrambling of the sequence:
+		return uintToUnitFloat(owenScrambledSobol(pathSampler.sampleIndex, dimension, hashCombine(pathSampler.seed, pathSampler.pixel)));
+	}
+	else if(SAMPLER == SAMPLER_BLUE_NOISE)
+	{
+		// Every pixel uses the same sequence, rotated by the dither mask
+		// (Georgiev and Fajardo, "Blue-noise Dithered Sampling", 2016). Nearby
+		// pixels then get well-spread samples, so their errors differ, and
+		// the noise looks like high-frequency blue noise:
+		const uvec2 pixel = uvec2(pathSampler.pixel & 0xFFFF, pathSampler.pixel >> 16);
+		return fract(uintToUnitFloat(owenScrambledSobol(pathSampler.sampleIndex, dimension, pathSampler.seed))
+		             + blueNoiseMask(pixel, dimension));
+	}
+	else
+	{
+		// Independent random numbers:
+		return uintToUnitFloat(hashUint(hashCombine(hashCombine(hashCombine(pathSampler.seed, pathSampler.pixel), pathSampler.sampleIndex), dimension)));
+	}
+}
+
+// Returns dimension `offset` of pathSampler's current bounce (see SAMPLE_LOBE).
+float sample1D(Sampler pathSampler, uint offset)
 {
-	// Condensed version of pcg_output_rxs_m_xs_32_32, with simple conversion to floating-point [0,1].
-	rngState = rngState * 747796405 + 1;
-	uint word = ((rngState >> ((rngState >> 28) + 4)) ^ rngState) * 277803737;
-	word = (word >> 22) ^ word;
-	return float(word) / 4294967295.0f;
+	return sampleDimension(pathSampler, SAMPLE_FIRST_BOUNCE + pathSampler.bounce * SAMPLE_DIMENSIONS_PER_BOUNCE + offset);
+}
+
+// Returns dimensions `offset` and `offset + 1` of pathSampler's current bounce.
+vec2 sample2D(Sampler pathSampler, uint offset)
+{
+	return vec2(sample1D(pathSampler, offset), sample1D(pathSampler, offset + 1));
 }
 
 const float k_pi = 3.14159265;
 
+// Uses the Box-Muller transform to map a uniformly distributed point `u` in
+// [0, 1)^2 to a normally distributed (centered at 0, standard deviation 1)
+// 2D point.
+vec2 randomGaussian(vec2 u)
+{
+	// Uniform in (0, 1] - make sure the value is never 0:
+	const float u1    = 1.0 - u.x;
+	const float u2    = u.y;  // In [0, 1)
+	const float r     = sqrt(-2.0 * log(u1));
+	const float theta = 2 * k_pi * u2;  // Random in [0, 2pi]
+	return r * vec2(cos(theta), sin(theta));
+}
+
+// Returns the first segment of a path through pixel `pixel` of an image with
+// resolution `resolution`.
+void generateCameraRay(ivec2 pixel, ivec2 resolution, Sampler pathSampler, out vec3 rayOrigin, out vec3 rayDirection)
+{
+	// This scene uses a right-handed coordinate system like the OBJ file format, where the
+	// +x axis points right, the +y axis points up, and the -z axis points into the screen.
+	// The camera is located at (-0.001, 0, 53).
+	const vec3 cameraOrigin = vec3(-0.001, 0.0, 53.0);
+	// Define the field of view by the vertical slope of the topmost rays:
+	const float fovVerticalSlope = 1.0 / 5.0;
+
+	// Rays always originate at the camera.
+	rayOrigin = cameraOrigin;
+	// Compute the direction of the ray for this pixel. To do this, we first
+	// transform the screen coordinates to look like this, where a is the
+	// aspect ratio (width/height) of the screen:
+	//           1
+	//    .------+------.
+	//    |      |      |
+	// -a + ---- 0 ---- + a
+	//    |      |      |
+	//    '------+------'
+	//          -1
+	// Use a Gaussian with standard deviation 0.375 centered at the center of
+	// the pixel:
+	const vec2 pixelSample       = vec2(sampleDimension(pathSampler, SAMPLE_CAMERA), sampleDimension(pathSampler, SAMPLE_CAMERA + 1));
+	const vec2 randomPixelCenter = vec2(pixel) + vec2(0.5) + 0.375 * randomGaussian(pixelSample);
+	const vec2 screenUV          = vec2((2.0 * randomPixelCenter.x - resolution.x) / resolution.y,    //
+	                                    -(2.0 * randomPixelCenter.y - resolution.y) / resolution.y);  // Flip the y axis
+	// Create a ray direction:
+	rayDirection = normalize(vec3(fovVerticalSlope * screenUV.x, fovVerticalSlope * screenUV.y, -1.0));
+}
+
+// The order in which invocations visit the pixels of the image (see
+// PIXEL_ORDER_LINEAR in common.h):
+layout(constant_id = CONSTANT_ID_PIXEL_ORDER) const uint PIXEL_ORDER = PIXEL_ORDER_LINEAR;
+
+// Returns the even bits of `value`, packed into the low 16 bits.
+uint compactEvenBits(uint value)
+{
+	value &= 0x55555555u;
+	value = (value | (value >> 1)) & 0x33333333u;
+	value = (value | (value >> 2)) & 0x0F0F0F0Fu;
+	value = (value | (value >> 4)) & 0x00FF00FFu;
+	value = (value | (value >> 8)) & 0x0000FFFFu;
+	return value;
+}
+
+// Returns the pixel that invocation `index` visits, in PIXEL_ORDER. Every
+// order visits each pixel of the image once for the indices from 0 to
+// (resolution.x * resolution.y - 1).
+ivec2 pixelFromIndex(uint index, ivec2 resolution)
+{
+	const uint width = uint(resolution.x);
+	if(PIXEL_ORDER == PIXEL_ORDER_LINEAR)
+	{
+		return ivec2(index % width, index / width);
+	}
+
+	// The other orders visit blocks row by row. The blocks at the right and
+	// bottom edges of the image are cut off, so find the row of blocks
+	// first, and then the block in the row, since each has the same height:
+	const uint blockWidth  = (PIXEL_ORDER == PIXEL_ORDER_MORTON) ? PIXEL_MORTON_BLOCK_SIZE : PIXEL_TILE_WIDTH;
+	const uint blockHeight = (PIXEL_ORDER == PIXEL_ORDER_MORTON) ? PIXEL_MORTON_BLOCK_SIZE : PIXEL_TILE_HEIGHT;
+	const uint blockRow    = index / (width * blockHeight);
+	const uint rowHeight   = min(blockHeight, uint(resolution.y) - blockRow * blockHeight);
+	const uint indexInRow  = index - blockRow * width * blockHeight;
+	const uint blockColumn = indexInRow / (blockWidth * rowHeight);
+	const uint columnWidth = min(blockWidth, width - blockColumn * blockWidth);
+	const uint indexInBlock = indexInRow - blockColumn * blockWidth * rowHeight;
+
+	// Whole Morton blocks are visited in Z-order; everything else row by row:
+	uvec2 offset;
+	if(PIXEL_ORDER == PIXEL_ORDER_MORTON && columnWidth == blockWidth && rowHeight == blockHeight)
+	{
+		offset = uvec2(compactEvenBits(indexInBlock), compactEvenBits(indexInBlock >> 1));
+	}
+	else
+	{
+		offset = uvec2(indexInBlock % columnWidth, indexInBlock / columnWidth);
+	}
+	return ivec2(uvec2(blockColumn * blockWidth, blockRow * blockHeight) + offset);
+}
+
+// Returns the color of the sky in a given direction (in linear color space).
+vec3 skyColor(vec3 direction)
+{
+	// +y in world space is up, so:
+	if(direction.y > 0.0f)
+	{
+		return mix(vec3(1.0f), vec3(0.25f, 0.5f, 1.0f), direction.y);
+	}
+	else
+	{
+		return vec3(0.03f);
+	}
+}
+
+// Returns the luminance of a linear sRGB color.
+float luminance(vec3 color)
+{
+	return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}
+
+// Russian roulette: once a path has `segments` >= `minSegments` segments,
+// ends it with a probability that grows as its throughput (the product of
+// the colors of the surfaces it hit) shrinks. A path that survives has its
+// throughput divided by the survival probability, so the estimate stays
+// unbiased. `pathSampler` is at the bounce of the path's last surface. Returns
+// false if the path should end.
+bool russianRouletteSurvives(uint segments, uint minSegments, inout vec3 throughput, Sampler pathSampler)
+{
+	if(segments < minSegments)
+	{
+		return true;
+	}
+	const float survivalProbability = min(max(throughput.r, max(throughput.g, throughput.b)), 1.0);
+	if(survivalProbability <= 0.0 || sample1D(pathSampler, SAMPLE_ROULETTE) >= survivalProbability)
+	{
+		return false;
+	}
+	throughput /= survivalProbability;
+	return true;
+}
+
 #endif  // #ifndef VK_MINI_PATH_TRACER_SHADER_COMMON_H
\ No newline at end of file
@@ -0,0 +1,13 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#version 460
+#extension GL_EXT_ray_tracing : require
+
+// The miss shader of shadow rays, at miss index 1. Shadow rays skip
+// closest-hit shaders, so the payload only changes if nothing was in the way.
+layout(location = 1) rayPayloadInEXT bool shadowRayMissed;
+
+void main()
+{
+  shadowRayMissed = true;
+}
@@ -0,0 +1,38 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#version 460
+#extension GL_EXT_scalar_block_layout : require
+#extension GL_GOOGLE_include_directive : require
+#include "wavefrontCommon.h"
+
+// Averages the samples of one pixel per invocation into the image, like the
+// end of raytrace.rgen.glsl.
+void main()
+{
+  const ivec2 resolution = imageSize(storageImage);
+  const uint  numPixels  = uint(resolution.x * resolution.y);
+  const uint  pixelIndex = gl_GlobalInvocationID.x;
+  if(pixelIndex >= numPixels)
+  {
+    return;
+  }
+  const ivec2 pixel = pixelFromIndex(pixelIndex, resolution);
+
+  // Paths pixelIndex, pixelIndex + numPixels, ... traced this pixel:
+  vec3 summedPixelColor = vec3(0.0);
+  for(uint i = 0; i < WAVEFRONT_SAMPLES_PER_PASS; i++)
+  {
+    summedPixelColor += paths[i * numPixels + pixelIndex].radianceSum;
+  }
+
+  // Blend with the averaged image in the buffer:
+  const vec4 previousPixel     = imageLoad(storageImage, pixel);
+  const uint sampleBatch       = uint(previousPixel.a);
+  vec3       averagePixelColor = summedPixelColor / float(SAMPLES_PER_BATCH);
+  if(sampleBatch != 0)
+  {
+    // Compute the new average:
+    averagePixelColor = (sampleBatch * previousPixel.rgb + averagePixelColor) / (sampleBatch + 1);
+  }
+  imageStore(storageImage, pixel, vec4(averagePixelColor, float(sampleBatch + 1)));
+}
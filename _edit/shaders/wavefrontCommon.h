@@ -0,0 +1,88 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+// Common GLSL file shared across the kernels of the wavefront tracer.
+// The including shader must enable GL_EXT_scalar_block_layout.
+//
+// The wavefront tracer splits the loop of raytrace.rgen.glsl into kernels:
+// - wavefrontGenerate starts a path for each sample of a pass, and puts
+//   every path in active queue 0.
+// - wavefrontExtend traces the next segment of each path in an active queue.
+//   Paths that hit the sky are finished; the others add the surface's
+//   emission, are appended to the hit queue, and are counted in the
+//   histogram of material IDs.
+// - wavefrontSortOffsets and wavefrontSort counting-sort the hit queue by
+//   material ID into the sorted queue.
+// - wavefrontShade runs one material per workgroup over the sorted queue
+//   (or, without sorting, runs whichever material each path hit over the
+//   hit queue), traces a shadow ray to a light at diffuse hits, and
+//   appends paths that haven't reached their maximum number of segments to the
+//   other active queue.
+// - wavefrontAccumulate averages the samples of each pixel into the image.
+// Queues are compacted with atomics, and each queue's header holds the
+// arguments for the indirect dispatch that consumes it.
+#ifndef VK_MINI_PATH_TRACER_WAVEFRONT_COMMON_H
+#define VK_MINI_PATH_TRACER_WAVEFRONT_COMMON_H
+
+#include "../common.h"
+#include "shaderCommon.h"
+
+// WavefrontTracer always specializes the workgroup size, which the kernels
+// read as gl_WorkGroupSize.x.
+layout(local_size_x_id = CONSTANT_ID_WAVEFRONT_WORKGROUP_SIZE, local_size_y = 1, local_size_z = 1) in;
+
+layout(binding = BINDING_IMAGEDATA, set = 0, rgba32f) uniform image2D storageImage;
+layout(binding = BINDING_WAVEFRONT_PATHS, set = 0, scalar) buffer Paths
+{
+  WavefrontPath paths[];
+};
+// Queue q starts at entry q * numPaths. The sorted queue is last, since
+// padding its bins to whole workgroups makes it longer than numPaths.
+layout(binding = BINDING_WAVEFRONT_QUEUES, set = 0, scalar) buffer Queues
+{
+  uint queueEntries[];
+};
+layout(binding = BINDING_WAVEFRONT_COUNTERS, set = 0, scalar) buffer Counters
+{
+  WavefrontCounters counters;
+};
+
+layout(push_constant) uniform PushConsts
+{
+  WavefrontPushConstants pushConstants;
+};
+
+// Returns the index in queueEntries of entry `entry` of queue `queue`.
+uint queueEntryIndex(uint queue, uint entry)
+{
+  return queue * pushConstants.numPaths + entry;
+}
+
+// Appends a path to queue `queue`, which must have a header.
+void appendToQueue(uint queue, uint pathIndex)
+{
+  const uint entry = atomicAdd(counters.queues[queue].count, 1);
+  queueEntries[queueEntryIndex(queue, entry)] = pathIndex;
+  if(entry % gl_WorkGroupSize.x == 0)
+  {
+    atomicAdd(counters.queues[queue].groupCountX, 1);
+  }
+}
+
+// Returns the sampler of path `pathIndex`, at the bounce of the surface its
+// last segment hit.
+Sampler getPathSampler(uint pathIndex)
+{
+  const ivec2 resolution = imageSize(storageImage);
+  const ivec2 pixel      = pixelFromIndex(pathIndex % uint(resolution.x * resolution.y), resolution);
+  Sampler     result     = createSampler(pixel, paths[pathIndex].sampleIndex, pushConstants.samplerSeed);
+  result.bounce          = paths[pathIndex].segments;
+  return result;
+}
+
+// Returns the index in the sorted queue of entry `entry` of bin `material`.
+uint sortedEntryIndex(uint material, uint entry)
+{
+  return queueEntryIndex(WAVEFRONT_QUEUE_SORTED, counters.materialFirstGroups[material] * gl_WorkGroupSize.x + entry);
+}
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_WAVEFRONT_COMMON_H
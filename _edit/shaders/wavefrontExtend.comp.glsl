@@ -0,0 +1,127 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#version 460
+#extension GL_EXT_ray_query : require
+#extension GL_EXT_scalar_block_layout : require
+#extension GL_GOOGLE_include_directive : require
+#extension GL_KHR_shader_subgroup_arithmetic : require
+#extension GL_KHR_shader_subgroup_ballot : require
+#include "wavefrontCommon.h"
+#include "materials.h"
+#include "rayStats.h"
+#include "lights.h"
+
+layout(binding = BINDING_TLAS, set = 0) uniform accelerationStructureEXT tlas;
+// The material ID of each instance, indexed by instance index
+layout(binding = BINDING_WAVEFRONT_MATERIALS, set = 0, scalar) buffer InstanceMaterials
+{
+  uint instanceMaterials[];
+};
+
+// If true, the kernel runs persistent threads: it's dispatched with a fixed
+// number of workgroups, and each subgroup takes the next gl_SubgroupSize
+// entries of the queue from counters.extendCursor until the queue is empty.
+// Subgroups whose rays finish early then start on new rays, instead of
+// idling until the rest of their workgroup is done.
+layout(constant_id = CONSTANT_ID_PERSISTENT_THREADS) const bool PERSISTENT_THREADS = false;
+
+// Traces the next segment of the path in entry `entry` of active queue `queue`.
+void extendPath(uint queue, uint entry)
+{
+  const uint pathIndex    = queueEntries[queueEntryIndex(queue, entry)];
+  const vec3 rayOrigin    = paths[pathIndex].origin;
+  const vec3 rayDirection = paths[pathIndex].direction;
+
+  rayQueryEXT rayQuery;
+  rayQueryInitializeEXT(rayQuery,              // Ray query
+                        tlas,                  // Top-level acceleration structure
+                        gl_RayFlagsOpaqueEXT,  // Ray flags, here saying "treat all geometry as opaque"
+                        0xFF,                  // 8-bit instance mask, here saying "trace against all instances"
+                        rayOrigin,             // Ray origin
+                        0.0,                   // Minimum t-value
+                        rayDirection,          // Ray direction
+                        10000.0);              // Maximum t-value
+  // All geometry is opaque, so this finds the closest intersection in one call:
+  while(rayQueryProceedEXT(rayQuery))
+  {
+  }
+
+  if(rayQueryGetIntersectionTypeEXT(rayQuery, true) == gl_RayQueryCommittedIntersectionTriangleEXT)
+  {
+    // Save where the ray hit and the material ID, and queue the path for shading:
+    const HitInfo hitInfo = computeHitInfo(rayQueryGetIntersectionGeometryIndexEXT(rayQuery, true),
+                                           rayQueryGetIntersectionPrimitiveIndexEXT(rayQuery, true),
+                                           rayQueryGetIntersectionBarycentricsEXT(rayQuery, true),
+                                           rayQueryGetIntersectionObjectToWorldEXT(rayQuery, true),
+                                           rayQueryGetIntersectionWorldToObjectEXT(rayQuery, true), rayDirection);
+    paths[pathIndex].hitPrimitiveID    = hitInfo.primitiveID;
+    paths[pathIndex].hitObjectPosition = hitInfo.objectPosition;
+    paths[pathIndex].hitWorldPosition  = hitInfo.worldPosition;
+    paths[pathIndex].hitWorldNormal    = hitInfo.worldNormal;
+    // Add the light the surface emits, weighted against having sampled it
+    // with a light sample at the previous hit, like raytrace.rgen.glsl:
+    if(any(greaterThan(hitInfo.emission, vec3(0.0))))
+    {
+      const float emissionLightPdf = lightPdf(hitInfo.emission, rayQueryGetIntersectionTEXT(rayQuery, true),
+                                              abs(dot(hitInfo.worldNormal, rayDirection)));
+      paths[pathIndex].radianceSum += paths[pathIndex].throughput * hitInfo.emission
+                                      * emissionMisWeight(paths[pathIndex].scatterPdf, emissionLightPdf);
+    }
+    const uint material =
+        min(instanceMaterials[rayQueryGetIntersectionInstanceIdEXT(rayQuery, true)], uint(MAX_MATERIAL_IDS - 1));
+    paths[pathIndex].hitMaterial = material;
+    appendToQueue(WAVEFRONT_QUEUE_HIT, pathIndex);
+    // Build the histogram for the counting sort:
+    if(pushConstants.sortByMaterial != 0)
+    {
+      atomicAdd(counters.materialCounts[material], 1);
+    }
+  }
+  else
+  {
+    // The path hit the sky, so it's done:
+    paths[pathIndex].radianceSum += paths[pathIndex].throughput * skyColor(rayDirection);
+    rayStatsAddPath(paths[pathIndex].segments + 1, true, false);
+  }
+}
+
+// Traces the next segment of each path in the current active queue.
+void main()
+{
+  const uint queue = pushConstants.segment % 2;
+  const uint count = counters.queues[queue].count;
+  if(PERSISTENT_THREADS)
+  {
+    // Every invocation of the subgroup sees the same `first`, so the
+    // subgroup leaves the loop together:
+    while(true)
+    {
+      uint first = 0;
+      if(subgroupElect())
+      {
+        first = atomicAdd(counters.extendCursor, gl_SubgroupSize);
+      }
+      first = subgroupBroadcastFirst(first);
+      if(first >= count)
+      {
+        break;
+      }
+      const uint entry = first + gl_SubgroupInvocationID;
+      if(entry < count)
+      {
+        extendPath(queue, entry);
+      }
+    }
+  }
+  else
+  {
+    const uint entry = gl_GlobalInvocationID.x;
+    if(entry >= count)
+    {
+      return;
+    }
+    extendPath(queue, entry);
+  }
+
+  rayStatsFlush();
+}
@@ -0,0 +1,47 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#version 460
+#extension GL_EXT_scalar_block_layout : require
+#extension GL_GOOGLE_include_directive : require
+#include "wavefrontCommon.h"
+
+// Starts one path per invocation, at the camera.
+void main()
+{
+  const uint pathIndex = gl_GlobalInvocationID.x;
+  if(pathIndex >= pushConstants.numPaths)
+  {
+    return;
+  }
+
+  const ivec2 resolution = imageSize(storageImage);
+  const uint  numPixels  = uint(resolution.x * resolution.y);
+  const uint  pixelIndex = pathIndex % numPixels;
+  const ivec2 pixel      = pixelFromIndex(pixelIndex, resolution);
+  // The index of this sample in the batch:
+  const uint sampleIdx = counters.pass * WAVEFRONT_SAMPLES_PER_PASS + pathIndex / numPixels;
+
+  // As in raytrace.rgen.glsl, the alpha channel counts the batches so far,
+  // and every sample of every batch is the next sample of the pixel's sequence:
+  const uint    sampleBatch = uint(imageLoad(storageImage, pixel).a);
+  const uint    sampleIndex = sampleBatch * SAMPLES_PER_BATCH + sampleIdx;
+  const Sampler pathSampler = createSampler(pixel, sampleIndex, pushConstants.samplerSeed);
+
+  vec3 rayOrigin, rayDirection;
+  generateCameraRay(pixel, resolution, pathSampler, rayOrigin, rayDirection);
+  paths[pathIndex].origin      = rayOrigin;
+  paths[pathIndex].direction   = rayDirection;
+  paths[pathIndex].sampleIndex = sampleIndex;
+  paths[pathIndex].segments    = 0;
+  paths[pathIndex].throughput  = vec3(1.0);
+  paths[pathIndex].scatterPdf  = 0.0;
+  // The first pass of a batch starts a new sum:
+  if(counters.pass == 0)
+  {
+    paths[pathIndex].radianceSum = vec3(0.0);
+  }
+
+  // Every path starts in active queue 0. Its header was set when recording
+  // the command buffer, since it always holds all numPaths paths.
+  queueEntries[queueEntryIndex(0, pathIndex)] = pathIndex;
+}
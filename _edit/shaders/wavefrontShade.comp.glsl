@@ -0,0 +1,133 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#version 460
+#extension GL_EXT_ray_query : require
+#extension GL_EXT_scalar_block_layout : require
+#extension GL_GOOGLE_include_directive : require
+#extension GL_KHR_shader_subgroup_arithmetic : require
+#extension GL_KHR_shader_subgroup_ballot : require
+#include "wavefrontCommon.h"
+#include "materials.h"
+#include "rayStats.h"
+#include "lights.h"
+
+layout(binding = BINDING_TLAS, set = 0) uniform accelerationStructureEXT tlas;
+
+// Returns the bin of the sorted queue that this workgroup shades: the last
+// bin that starts at or before this workgroup. Empty bins start at the same
+// workgroup as the next bin, so they're skipped.
+uint findWorkgroupMaterial()
+{
+  uint first = 0;
+  uint count = MAX_MATERIAL_IDS;
+  while(count > 0)
+  {
+    const uint halfCount = count / 2;
+    if(counters.materialFirstGroups[first + halfCount] <= gl_WorkGroupID.x)
+    {
+      first += halfCount + 1;
+      count -= halfCount + 1;
+    }
+    else
+    {
+      count = halfCount;
+    }
+  }
+  return first - 1;
+}
+
+// Returns true if nothing is in the way of a ray of length `distance`.
+bool traceShadowRay(vec3 origin, vec3 direction, float distance)
+{
+  rayStatsAddShadowRay();
+  // Any hit shows that the ray is blocked, so stop at the first one:
+  rayQueryEXT rayQuery;
+  rayQueryInitializeEXT(rayQuery, tlas, gl_RayFlagsOpaqueEXT | gl_RayFlagsTerminateOnFirstHitEXT, 0xFF, origin, 0.0,
+                        direction, distance * 0.999);  // Stop short of the light itself
+  while(rayQueryProceedEXT(rayQuery))
+  {
+  }
+  return rayQueryGetIntersectionTypeEXT(rayQuery, true) == gl_RayQueryCommittedIntersectionNoneEXT;
+}
+
+// Shades the paths that hit a surface. With sortByMaterial, the workgroups
+// of this dispatch cover the bins of the sorted queue one after the other,
+// and every bin starts at a workgroup boundary, so all invocations of a
+// workgroup run the same material. Otherwise, each invocation shades one
+// entry of the hit queue, with whichever material its path hit.
+void main()
+{
+  uint pathIndex, material;
+  if(pushConstants.sortByMaterial != 0)
+  {
+    // This is uniform across the workgroup:
+    material         = findWorkgroupMaterial();
+    const uint entry = (gl_WorkGroupID.x - counters.materialFirstGroups[material]) * gl_WorkGroupSize.x
+                       + gl_LocalInvocationID.x;
+    if(entry >= counters.materialCounts[material])
+    {
+      return;
+    }
+    pathIndex = queueEntries[sortedEntryIndex(material, entry)];
+  }
+  else
+  {
+    const uint entry = gl_GlobalInvocationID.x;
+    if(entry >= counters.queues[WAVEFRONT_QUEUE_HIT].count)
+    {
+      return;
+    }
+    pathIndex = queueEntries[queueEntryIndex(WAVEFRONT_QUEUE_HIT, entry)];
+    material  = paths[pathIndex].hitMaterial;
+  }
+
+  HitInfo hitInfo;
+  hitInfo.objectPosition    = paths[pathIndex].hitObjectPosition;
+  hitInfo.worldPosition     = paths[pathIndex].hitWorldPosition;
+  hitInfo.worldNormal       = paths[pathIndex].hitWorldNormal;
+  hitInfo.worldRayDirection = paths[pathIndex].direction;
+  hitInfo.primitiveID       = paths[pathIndex].hitPrimitiveID;
+  hitInfo.emission          = vec3(0.0);  // The extend kernel already added it
+  const Sampler pathSampler = getPathSampler(pathIndex);
+
+  const ReturnedInfo returnedInfo = shadeMaterial(material % NUM_MATERIALS, hitInfo, pathSampler);
+
+  // At diffuse surfaces, also sample a point on a light (next-event estimation):
+  LightSample lightSample;
+  if(returnedInfo.bsdf.pdf > 0.0 && sampleLight(returnedInfo.rayOrigin, pathSampler, lightSample))
+  {
+    const vec3 bsdfCos =
+        evaluateLambertian(returnedInfo.diffuseAlbedo, returnedInfo.diffuseNormal, lightSample.direction);
+    const vec3 lightRadiance =
+        lightSampleRadiance(lightSample, bsdfCos, lambertianPdf(returnedInfo.diffuseNormal, lightSample.direction));
+    if(any(greaterThan(lightRadiance, vec3(0.0)))
+       && traceShadowRay(returnedInfo.rayOrigin, lightSample.direction, lightSample.distance))
+    {
+      paths[pathIndex].radianceSum += paths[pathIndex].throughput * lightRadiance;
+    }
+  }
+
+  const uint segments   = paths[pathIndex].segments + 1;
+  vec3       throughput = paths[pathIndex].throughput * returnedInfo.bsdf.weight;
+  const bool survived =
+      russianRouletteSurvives(segments, pushConstants.termination.rouletteMinSegments, throughput, pathSampler);
+  paths[pathIndex].origin     = returnedInfo.rayOrigin;
+  paths[pathIndex].direction  = returnedInfo.bsdf.direction;
+  paths[pathIndex].throughput = throughput;
+  paths[pathIndex].scatterPdf = returnedInfo.bsdf.pdf;
+  paths[pathIndex].segments   = segments;
+
+  if(survived && segments < pushConstants.termination.maxSegments)
+  {
+    // Extend the path in the next segment:
+    appendToQueue((pushConstants.segment + 1) % 2, pathIndex);
+  }
+  else
+  {
+    // Like raytrace.rgen.glsl, treat a path that didn't find a light source
+    // as if it had an accumulated color of (0, 0, 0).
+    rayStatsAddPath(segments, false, !survived);
+  }
+
+  rayStatsFlush();
+}
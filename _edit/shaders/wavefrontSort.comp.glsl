@@ -0,0 +1,40 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#version 460
+#extension GL_EXT_scalar_block_layout : require
+#extension GL_GOOGLE_include_directive : require
+#extension GL_KHR_shader_subgroup_ballot : require
+#include "wavefrontCommon.h"
+
+// Scatters each entry of the hit queue into the bin of its material ID in
+// the sorted queue: the last step of the counting sort.
+void main()
+{
+  const uint entry = gl_GlobalInvocationID.x;
+  if(entry >= counters.queues[WAVEFRONT_QUEUE_HIT].count)
+  {
+    return;
+  }
+
+  const uint pathIndex = queueEntries[queueEntryIndex(WAVEFRONT_QUEUE_HIT, entry)];
+  const uint material  = paths[pathIndex].hitMaterial;
+
+  // Invocations with the same material share one atomic: each iteration
+  // handles the material of the first remaining invocation, and all
+  // invocations with that material leave the loop.
+  while(true)
+  {
+    if(material == subgroupBroadcastFirst(material))
+    {
+      const uvec4 sameMaterial = subgroupBallot(true);
+      uint        binStart     = 0;
+      if(subgroupElect())
+      {
+        binStart = atomicAdd(counters.materialCursors[material], subgroupBallotBitCount(sameMaterial));
+      }
+      const uint binEntry = subgroupBroadcastFirst(binStart) + subgroupBallotExclusiveBitCount(sameMaterial);
+      queueEntries[sortedEntryIndex(material, binEntry)] = pathIndex;
+      break;
+    }
+  }
+}
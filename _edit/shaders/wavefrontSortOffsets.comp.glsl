@@ -0,0 +1,27 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#version 460
+#extension GL_EXT_scalar_block_layout : require
+#extension GL_GOOGLE_include_directive : require
+#include "wavefrontCommon.h"
+
+// Runs as a single workgroup between the extend and sort kernels. Computes
+// where each material's bin starts in the sorted queue from the histogram,
+// and the arguments of the shade kernel's indirect dispatch.
+void main()
+{
+  // There are only MAX_MATERIAL_IDS bins, so one invocation scans them:
+  if(gl_LocalInvocationIndex != 0)
+  {
+    return;
+  }
+
+  uint groups = 0;
+  for(uint material = 0; material < MAX_MATERIAL_IDS; material++)
+  {
+    counters.materialFirstGroups[material] = groups;
+    groups += (counters.materialCounts[material] + gl_WorkGroupSize.x - 1) / gl_WorkGroupSize.x;
+  }
+  counters.shadeDispatch.groupCountX = groups;
+  counters.shadeDispatch.count       = counters.queues[WAVEFRONT_QUEUE_HIT].count;
+}
@@ -0,0 +1,28 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_SIMD_HPP
+#define VK_MINI_PATH_TRACER_SIMD_HPP
+
+// The CPU tracer's SIMD code paths. The program is built for the baseline
+// instruction set of its target, so the AVX2 functions are compiled for AVX2
+// individually with SIMD_AVX2_FUNCTION, and only called once CpuHasAvx2()
+// confirms that the CPU running the program supports it. Every AVX2 function
+// has a scalar fallback for other CPUs and architectures.
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_X86 1
+#include <immintrin.h>
+#else
+#define SIMD_X86 0
+#endif
+
+#if SIMD_X86 && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_AVX2_FUNCTION __attribute__((target("avx2")))
+#else
+// MSVC allows AVX2 intrinsics in any function.
+#define SIMD_AVX2_FUNCTION
+#endif
+
+// Returns true if the CPU supports AVX2 (and the OS saves its registers).
+bool CpuHasAvx2();
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_SIMD_HPP
@@ -0,0 +1,125 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned numThreads)
+{
+    if (numThreads == 0)
+    {
+        const unsigned hardwareThreads = std::thread::hardware_concurrency();
+        numThreads = (hardwareThreads > 1) ? hardwareThreads - 1 : 1;
+    }
+    m_workers.reserve(numThreads);
+    for (unsigned i = 0; i < numThreads; i++)
+    {
+        m_workers.emplace_back(&ThreadPool::workerMain, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wakeWorkers.notify_all();
+    for (std::thread& worker : m_workers)
+    {
+        worker.join();
+    }
+}
+
+void ThreadPool::run(TaskGroup& group, std::function<void()> task)
+{
+    group.pending++;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_queue.push_back({ std::move(task), &group });
+    }
+    m_wakeWorkers.notify_one();
+    m_taskFinished.notify_all();  // Threads in wait() can help with this task too
+}
+
+void ThreadPool::wait(TaskGroup& group)
+{
+    while (group.pending.load() != 0)
+    {
+        // Help out instead of blocking, so that nested waits make progress:
+        if (!runOneTask())
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_taskFinished.wait(lock, [&] { return group.pending.load() == 0 || !m_queue.empty(); });
+        }
+    }
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& func)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    // Hand out indices dynamically, with one task per thread, so that uneven
+    // work per index balances out:
+    std::atomic<size_t> nextIndex{ 0 };
+    TaskGroup           group;
+    const auto          worker = [&]() {
+        for (size_t i = nextIndex++; i < count; i = nextIndex++)
+        {
+            func(i);
+        }
+    };
+    const size_t numTasks = std::min<size_t>(count, getConcurrency());
+    for (size_t taskIdx = 1; taskIdx < numTasks; taskIdx++)
+    {
+        run(group, worker);
+    }
+    worker();  // The calling thread works too
+    wait(group);
+}
+
+ThreadPool& ThreadPool::getDefault()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+bool ThreadPool::runOneTask()
+{
+    Task task;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_queue.empty())
+        {
+            return false;
+        }
+        task = std::move(m_queue.front());
+        m_queue.pop_front();
+    }
+    task.function();
+    {
+        // Decrement under the lock, so that wait() can't miss the notification:
+        std::lock_guard<std::mutex> lock(m_mutex);
+        task.group->pending--;
+    }
+    m_taskFinished.notify_all();
+    return true;
+}
+
+void ThreadPool::workerMain()
+{
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_wakeWorkers.wait(lock, [&] { return m_stopping || !m_queue.empty(); });
+            if (m_stopping && m_queue.empty())
+            {
+                return;
+            }
+        }
+        runOneTask();
+    }
+}
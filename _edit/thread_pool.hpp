@@ -0,0 +1,70 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_THREAD_POOL_HPP
+#define VK_MINI_PATH_TRACER_THREAD_POOL_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counts the tasks of a group that haven't finished yet. Pass one to
+// ThreadPool::run() and ThreadPool::wait() to wait for a set of tasks.
+struct TaskGroup
+{
+    std::atomic<size_t> pending{ 0 };
+};
+
+// A simple pool of worker threads with a single shared task queue.
+//
+// Threads that wait for a TaskGroup run queued tasks while they wait, so
+// tasks can safely spawn and wait for subtasks (e.g. for recursive builds)
+// without deadlocking the pool.
+class ThreadPool
+{
+public:
+    // Starts `numThreads` workers; 0 means one per hardware thread, minus one
+    // for the thread that calls wait().
+    explicit ThreadPool(unsigned numThreads = 0);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Number of threads that can run tasks at once, including the waiting thread.
+    unsigned getConcurrency() const { return static_cast<unsigned>(m_workers.size()) + 1; }
+
+    // Queues `task` as part of `group`.
+    void run(TaskGroup& group, std::function<void()> task);
+    // Runs queued tasks until every task in `group` has finished.
+    void wait(TaskGroup& group);
+
+    // Calls func(i) for every i in [0, count), spread across the pool, and
+    // returns once all calls have finished.
+    void parallelFor(size_t count, const std::function<void(size_t)>& func);
+
+    // A pool shared by everything in the program that doesn't need its own.
+    static ThreadPool& getDefault();
+
+private:
+    struct Task
+    {
+        std::function<void()> function;
+        TaskGroup*            group;
+    };
+
+    // Pops and runs one task if there is one; returns false if the queue was empty.
+    bool runOneTask();
+    void workerMain();
+
+    std::vector<std::thread> m_workers;
+    std::deque<Task>         m_queue;
+    std::mutex               m_mutex;
+    std::condition_variable  m_wakeWorkers;
+    std::condition_variable  m_taskFinished;
+    bool                     m_stopping = false;
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_THREAD_POOL_HPP
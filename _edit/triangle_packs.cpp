@@ -0,0 +1,523 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "triangle_packs.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#include "mesh_cache.hpp"  // For HashBytes
+#include "ray_packets.hpp"
+#include "simd.hpp"
+
+void TrianglePack::clear()
+{
+    memset(this, 0, sizeof(TrianglePack));
+    for (uint32_t lane = 0; lane < TRIANGLE_PACK_SIZE; lane++)
+    {
+        ids[lane] = ~0u;
+    }
+}
+
+void TrianglePack::set(uint32_t lane, const vec3& a, const vec3& b, const vec3& c, uint32_t id)
+{
+    const vec3 e1 = b - a;
+    const vec3 e2 = c - a;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        v0[axis][lane] = a[axis];
+        edge1[axis][lane] = e1[axis];
+        edge2[axis][lane] = e2[axis];
+    }
+    ids[lane] = id;
+}
+
+namespace {
+// Intersects `ray` with lane `lane` of `pack`, and returns true if it hits
+// with tMin < t < tMax. This is the scalar fallback of the AVX2 functions
+// below, and does the same arithmetic.
+bool IntersectLane(const TrianglePack& pack, uint32_t lane, const CpuRay& ray, float tMin, float tMax, float& t, float& u, float& v)
+{
+    const float e1[3] = { pack.edge1[0][lane], pack.edge1[1][lane], pack.edge1[2][lane] };
+    const float e2[3] = { pack.edge2[0][lane], pack.edge2[1][lane], pack.edge2[2][lane] };
+    const vec3& d = ray.direction;
+    // p = d x e2:
+    const float px = d.y * e2[2] - d.z * e2[1];
+    const float py = d.z * e2[0] - d.x * e2[2];
+    const float pz = d.x * e2[1] - d.y * e2[0];
+    const float det = e1[0] * px + e1[1] * py + e1[2] * pz;
+    if (det == 0.0f)
+    {
+        return false;
+    }
+    const float invDet = 1.0f / det;
+    const float tx = ray.origin.x - pack.v0[0][lane];
+    const float ty = ray.origin.y - pack.v0[1][lane];
+    const float tz = ray.origin.z - pack.v0[2][lane];
+    u = (tx * px + ty * py + tz * pz) * invDet;
+    // q = (origin - v0) x e1:
+    const float qx = ty * e1[2] - tz * e1[1];
+    const float qy = tz * e1[0] - tx * e1[2];
+    const float qz = tx * e1[1] - ty * e1[0];
+    v = (d.x * qx + d.y * qy + d.z * qz) * invDet;
+    t = (e2[0] * qx + e2[1] * qy + e2[2] * qz) * invDet;
+    return u >= 0.0f && v >= 0.0f && u + v <= 1.0f && t > tMin && t < tMax;
+}
+
+#if SIMD_X86
+// Intersects `ray` with every lane of `pack` at once, and returns the mask of
+// the lanes that hit with tMin < t < tMax.
+SIMD_AVX2_FUNCTION inline __m256 IntersectLanesAvx2(const TrianglePack& pack, const CpuRay& ray, float tMin, float tMax,
+    __m256& t, __m256& u, __m256& v)
+{
+    const __m256 dx = _mm256_set1_ps(ray.direction.x);
+    const __m256 dy = _mm256_set1_ps(ray.direction.y);
+    const __m256 dz = _mm256_set1_ps(ray.direction.z);
+    const __m256 e1x = _mm256_loadu_ps(pack.edge1[0]);
+    const __m256 e1y = _mm256_loadu_ps(pack.edge1[1]);
+    const __m256 e1z = _mm256_loadu_ps(pack.edge1[2]);
+    const __m256 e2x = _mm256_loadu_ps(pack.edge2[0]);
+    const __m256 e2y = _mm256_loadu_ps(pack.edge2[1]);
+    const __m256 e2z = _mm256_loadu_ps(pack.edge2[2]);
+
+    const __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    const __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    const __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    const __m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+    const __m256 invDet = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+
+    const __m256 tx = _mm256_sub_ps(_mm256_set1_ps(ray.origin.x), _mm256_loadu_ps(pack.v0[0]));
+    const __m256 ty = _mm256_sub_ps(_mm256_set1_ps(ray.origin.y), _mm256_loadu_ps(pack.v0[1]));
+    const __m256 tz = _mm256_sub_ps(_mm256_set1_ps(ray.origin.z), _mm256_loadu_ps(pack.v0[2]));
+    u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(tx, px), _mm256_mul_ps(ty, py)), _mm256_mul_ps(tz, pz)), invDet);
+
+    const __m256 qx = _mm256_sub_ps(_mm256_mul_ps(ty, e1z), _mm256_mul_ps(tz, e1y));
+    const __m256 qy = _mm256_sub_ps(_mm256_mul_ps(tz, e1x), _mm256_mul_ps(tx, e1z));
+    const __m256 qz = _mm256_sub_ps(_mm256_mul_ps(tx, e1y), _mm256_mul_ps(ty, e1x));
+    v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+    t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+
+    // Ordered comparisons are false for the NaNs of lanes with det == 0:
+    const __m256 zero = _mm256_setzero_ps();
+    __m256       mask = _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ);
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1.0f), _CMP_LE_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(tMin), _CMP_GT_OQ));
+    mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, _mm256_set1_ps(tMax), _CMP_LT_OQ));
+    return mask;
+}
+
+SIMD_AVX2_FUNCTION bool IntersectTrianglePackAvx2(const TrianglePack& pack, const CpuRay& ray, float tMin, TriangleHit& hit)
+{
+    __m256       t, u, v;
+    const __m256 mask = IntersectLanesAvx2(pack, ray, tMin, hit.t, t, u, v);
+    if (_mm256_movemask_ps(mask) == 0)
+    {
+        return false;
+    }
+    // Find the smallest t of the lanes that hit, by swapping halves, then
+    // pairs, then neighbors:
+    const __m256 hitT = _mm256_blendv_ps(_mm256_set1_ps(std::numeric_limits<float>::infinity()), t, mask);
+    __m256       minT = _mm256_min_ps(hitT, _mm256_permute2f128_ps(hitT, hitT, 1));
+    minT = _mm256_min_ps(minT, _mm256_shuffle_ps(minT, minT, _MM_SHUFFLE(1, 0, 3, 2)));
+    minT = _mm256_min_ps(minT, _mm256_shuffle_ps(minT, minT, _MM_SHUFFLE(2, 3, 0, 1)));
+    const int closestLanes = _mm256_movemask_ps(_mm256_and_ps(mask, _mm256_cmp_ps(hitT, minT, _CMP_EQ_OQ)));
+
+    alignas(32) float ts[TRIANGLE_PACK_SIZE], us[TRIANGLE_PACK_SIZE], vs[TRIANGLE_PACK_SIZE];
+    _mm256_store_ps(ts, t);
+    _mm256_store_ps(us, u);
+    _mm256_store_ps(vs, v);
+    uint32_t lane = 0;
+    while ((closestLanes & (1 << lane)) == 0)
+    {
+        lane++;
+    }
+    hit.t = ts[lane];
+    hit.u = us[lane];
+    hit.v = vs[lane];
+    hit.id = pack.ids[lane];
+    return true;
+}
+
+SIMD_AVX2_FUNCTION bool OccludedByTrianglePackAvx2(const TrianglePack& pack, const CpuRay& ray, float tMin, float tMax)
+{
+    __m256 t, u, v;
+    return _mm256_movemask_ps(IntersectLanesAvx2(pack, ray, tMin, tMax, t, u, v)) != 0;
+}
+#endif  // #if SIMD_X86
+}  // namespace
+
+bool IntersectTrianglePack(const TrianglePack& pack, const CpuRay& ray, float tMin, TriangleHit& hit)
+{
+#if SIMD_X86
+    if (CpuHasAvx2())
+    {
+        return IntersectTrianglePackAvx2(pack, ray, tMin, hit);
+    }
+#endif
+    bool found = false;
+    for (uint32_t lane = 0; lane < TRIANGLE_PACK_SIZE; lane++)
+    {
+        float t, u, v;
+        if (IntersectLane(pack, lane, ray, tMin, hit.t, t, u, v))
+        {
+            hit.t = t;
+            hit.u = u;
+            hit.v = v;
+            hit.id = pack.ids[lane];
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool OccludedByTrianglePack(const TrianglePack& pack, const CpuRay& ray, float tMin, float tMax)
+{
+#if SIMD_X86
+    if (CpuHasAvx2())
+    {
+        return OccludedByTrianglePackAvx2(pack, ray, tMin, tMax);
+    }
+#endif
+    for (uint32_t lane = 0; lane < TRIANGLE_PACK_SIZE; lane++)
+    {
+        float t, u, v;
+        if (IntersectLane(pack, lane, ray, tMin, tMax, t, u, v))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TriangleBvh::build(const float* positions, const uint32_t* indices, size_t numTriangles, uint32_t firstId,
+    ThreadPool* threadPool)
+{
+    // Leaves have at most one pack of triangles:
+    const Bvh bvh = BuildBvh(GetTriangleBounds(positions, indices, numTriangles, threadPool), TRIANGLE_PACK_SIZE, threadPool);
+    setNodes(bvh.nodes.data(), bvh.nodes.size(), bvh.primitives.data(), positions, indices, firstId);
+}
+
+bool TriangleBvh::buildCached(const std::string& bvhFilename, uint64_t sourceHash, const float* positions,
+    const uint32_t* indices, size_t numTriangles, uint32_t firstId, ThreadPool* threadPool)
+{
+    // The tree also depends on the leaf size:
+    const uint64_t hash = HashBytes(&TRIANGLE_PACK_SIZE, sizeof(TRIANGLE_PACK_SIZE), sourceHash);
+    MappedBvh      mappedBvh;
+    if (mappedBvh.open(bvhFilename, hash, numTriangles))
+    {
+        bool leavesFit = true;
+        for (uint64_t i = 0; leavesFit && i < mappedBvh.numNodes(); i++)
+        {
+            leavesFit = mappedBvh.nodes()[i].count <= TRIANGLE_PACK_SIZE;
+        }
+        if (leavesFit)
+        {
+            setNodes(mappedBvh.nodes(), mappedBvh.numNodes(), mappedBvh.primitives(), positions, indices, firstId);
+            return true;
+        }
+    }
+
+    const Bvh bvh = BuildBvh(GetTriangleBounds(positions, indices, numTriangles, threadPool), TRIANGLE_PACK_SIZE, threadPool);
+    setNodes(bvh.nodes.data(), bvh.nodes.size(), bvh.primitives.data(), positions, indices, firstId);
+    SaveBvh(bvhFilename, bvh, hash);  // If this fails, the next run builds the BVH again
+    return false;
+}
+
+void TriangleBvh::setNodes(const BvhNode* nodes, size_t numNodes, const uint32_t* primitives, const float* positions,
+    const uint32_t* indices, uint32_t firstId)
+{
+    const auto vertex = [&](size_t triangle, int corner) {
+        const float* position = positions + 3 * size_t(indices[3 * triangle + corner]);
+        return vec3(position[0], position[1], position[2]);
+    };
+
+    m_nodes.assign(nodes, nodes + numNodes);
+    m_wideNodes.clear();
+    m_packs.clear();
+    m_bounds = BvhBounds();
+    if (!m_nodes.empty())
+    {
+        std::copy(m_nodes[0].boundsMin, m_nodes[0].boundsMin + 3, m_bounds.min);
+        std::copy(m_nodes[0].boundsMax, m_nodes[0].boundsMax + 3, m_bounds.max);
+    }
+    for (BvhNode& node : m_nodes)
+    {
+        if (!node.isLeaf())
+        {
+            continue;
+        }
+        TrianglePack pack;
+        pack.clear();
+        for (uint32_t lane = 0; lane < node.count; lane++)
+        {
+            const uint32_t triangle = primitives[node.offset + lane];
+            pack.set(lane, vertex(triangle, 0), vertex(triangle, 1), vertex(triangle, 2), firstId + triangle);
+        }
+        node.offset = static_cast<uint32_t>(m_packs.size());
+        m_packs.push_back(pack);
+    }
+}
+
+void TriangleBvh::makeWide()
+{
+    // Put the packs in the order of the wide BVH's leaves:
+    WideBvh                   wideBvh = CollapseBvh(m_nodes);
+    std::vector<TrianglePack> packs(wideBvh.leaves.size());
+    for (size_t leaf = 0; leaf < packs.size(); leaf++)
+    {
+        packs[leaf] = m_packs[wideBvh.leaves[leaf]];
+    }
+    m_packs = std::move(packs);
+    m_wideNodes = std::move(wideBvh.nodes);
+    m_nodes.clear();
+}
+
+bool TriangleBvh::intersect(const CpuRay& ray, float tMin, TriangleHit& hit) const
+{
+    if (!m_wideNodes.empty())
+    {
+        return intersectWide(ray, tMin, hit);
+    }
+    if (m_nodes.empty())
+    {
+        return false;
+    }
+    const float  origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+    const float  direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+    const BvhRay bvhRay(origin, direction);
+
+    // Visit the nearer child first, and skip nodes on the stack that start
+    // beyond the closest hit found since they were pushed:
+    struct StackEntry
+    {
+        uint32_t node;
+        float    tEntry;
+    };
+    StackEntry stack[BVH_STACK_SIZE];
+    int        stackSize = 0;
+    float      rootEntry;
+    if (IntersectBvhNode(m_nodes[0], bvhRay, tMin, hit.t, rootEntry))
+    {
+        stack[stackSize++] = { 0, rootEntry };
+    }
+    bool found = false;
+    while (stackSize > 0)
+    {
+        const StackEntry entry = stack[--stackSize];
+        if (entry.tEntry > hit.t)
+        {
+            continue;
+        }
+        uint32_t nodeIndex = entry.node;
+        while (true)
+        {
+            const BvhNode& node = m_nodes[nodeIndex];
+            if (node.isLeaf())
+            {
+                found |= IntersectTrianglePack(m_packs[node.offset], ray, tMin, hit);
+                break;
+            }
+            uint32_t   nearChild = nodeIndex + 1;
+            uint32_t   farChild = node.offset;
+            float      nearEntry, farEntry;
+            const bool hitNear = IntersectBvhNode(m_nodes[nearChild], bvhRay, tMin, hit.t, nearEntry);
+            const bool hitFar = IntersectBvhNode(m_nodes[farChild], bvhRay, tMin, hit.t, farEntry);
+            if (hitNear && hitFar)
+            {
+                if (farEntry < nearEntry)
+                {
+                    std::swap(nearChild, farChild);
+                    std::swap(nearEntry, farEntry);
+                }
+                assert(stackSize < BVH_STACK_SIZE);
+                stack[stackSize++] = { farChild, farEntry };
+                nodeIndex = nearChild;
+            }
+            else if (hitNear || hitFar)
+            {
+                nodeIndex = hitNear ? nearChild : farChild;
+            }
+            else
+            {
+                break;
+            }
+        }
+    }
+    return found;
+}
+
+bool TriangleBvh::occluded(const CpuRay& ray, float tMin, float tMax) const
+{
+    if (!m_wideNodes.empty())
+    {
+        return occludedWide(ray, tMin, tMax);
+    }
+    if (m_nodes.empty())
+    {
+        return false;
+    }
+    const float  origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+    const float  direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+    const BvhRay bvhRay(origin, direction);
+
+    // Any hit will do, so visit the nodes in any order:
+    uint32_t stack[BVH_STACK_SIZE];
+    int      stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        const BvhNode& node = m_nodes[stack[--stackSize]];
+        float          tEntry;
+        if (!IntersectBvhNode(node, bvhRay, tMin, tMax, tEntry))
+        {
+            continue;
+        }
+        if (node.isLeaf())
+        {
+            if (OccludedByTrianglePack(m_packs[node.offset], ray, tMin, tMax))
+            {
+                return true;
+            }
+            continue;
+        }
+        assert(stackSize + 2 <= BVH_STACK_SIZE);
+        stack[stackSize++] = node.offset;
+        stack[stackSize++] = static_cast<uint32_t>(&node - m_nodes.data()) + 1;
+    }
+    return false;
+}
+
+uint64_t TriangleBvh::intersectPacket(const RayPacket& packet, uint32_t firstRay, float tMin, TriangleHit* hits) const
+{
+    if (!m_wideNodes.empty())
+    {
+        uint64_t updated = 0;
+        for (uint32_t ray = firstRay; ray < packet.numRays; ray++)
+        {
+            if (intersectWide(packet.rays[ray], tMin, hits[ray]))
+            {
+                updated |= uint64_t(1) << ray;
+            }
+        }
+        return updated;
+    }
+    return TraversePacket(m_nodes, packet, firstRay, tMin, hits, [&](const BvhNode& leaf, uint32_t firstActive) {
+        // Only the rays that reach the leaf's bounds test its triangles:
+        uint64_t       updated = 0;
+        const uint64_t reached = packet.intersectNodeMask(leaf, firstActive, tMin, hits, false);
+        for (uint32_t ray = firstActive; ray < packet.numRays; ray++)
+        {
+            if ((reached & (uint64_t(1) << ray)) != 0 && IntersectTrianglePack(m_packs[leaf.offset], packet.rays[ray], tMin, hits[ray]))
+            {
+                updated |= uint64_t(1) << ray;
+            }
+        }
+        return updated;
+    });
+}
+
+namespace {
+// An entry of the wide traversal stacks: a node, or a leaf if WIDE_STACK_LEAF
+// is set, and where the ray enters it.
+const uint32_t WIDE_STACK_LEAF = 1u << 31;
+
+struct WideStackEntry
+{
+    uint32_t ref;
+    float    tEntry;
+};
+
+// Pushes the children of `node` in `hitMask` onto `stack`, from the farthest
+// to the nearest, so that the nearest one is popped next.
+void PushWideChildren(const WideBvhNode& node, uint32_t hitMask, const float tEntries[WIDE_BVH_WIDTH], WideStackEntry* stack,
+    int& stackSize)
+{
+    const int firstPushed = stackSize;
+    for (uint32_t child = 0; child < WIDE_BVH_WIDTH; child++)
+    {
+        if ((hitMask & (1u << child)) == 0)
+        {
+            continue;
+        }
+        const WideStackEntry entry{ node.childIndex(child) | (node.isInner(child) ? 0 : WIDE_STACK_LEAF), tEntries[child] };
+        // Insertion sort by decreasing tEntry:
+        int position = stackSize++;
+        assert(stackSize <= WIDE_BVH_STACK_SIZE);
+        while (position > firstPushed && stack[position - 1].tEntry < entry.tEntry)
+        {
+            stack[position] = stack[position - 1];
+            position--;
+        }
+        stack[position] = entry;
+    }
+}
+}  // namespace
+
+bool TriangleBvh::intersectWide(const CpuRay& ray, float tMin, TriangleHit& hit) const
+{
+    const float  origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+    const float  direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+    const BvhRay bvhRay(origin, direction);
+
+    WideStackEntry stack[WIDE_BVH_STACK_SIZE];
+    int            stackSize = 0;
+    stack[stackSize++] = { 0, tMin };
+    bool found = false;
+    while (stackSize > 0)
+    {
+        const WideStackEntry entry = stack[--stackSize];
+        if (entry.tEntry > hit.t)
+        {
+            continue;
+        }
+        if ((entry.ref & WIDE_STACK_LEAF) != 0)
+        {
+            found |= IntersectTrianglePack(m_packs[entry.ref & ~WIDE_STACK_LEAF], ray, tMin, hit);
+            continue;
+        }
+        const WideBvhNode& node = m_wideNodes[entry.ref];
+        float              tEntries[WIDE_BVH_WIDTH];
+        const uint32_t     hitMask = IntersectWideBvhNode(node, bvhRay, tMin, hit.t, tEntries);
+        PushWideChildren(node, hitMask, tEntries, stack, stackSize);
+    }
+    return found;
+}
+
+bool TriangleBvh::occludedWide(const CpuRay& ray, float tMin, float tMax) const
+{
+    const float  origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+    const float  direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+    const BvhRay bvhRay(origin, direction);
+
+    // Any hit will do, so visit the children in any order:
+    uint32_t stack[WIDE_BVH_STACK_SIZE];
+    int      stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize > 0)
+    {
+        const uint32_t ref = stack[--stackSize];
+        if ((ref & WIDE_STACK_LEAF) != 0)
+        {
+            if (OccludedByTrianglePack(m_packs[ref & ~WIDE_STACK_LEAF], ray, tMin, tMax))
+            {
+                return true;
+            }
+            continue;
+        }
+        const WideBvhNode& node = m_wideNodes[ref];
+        float              tEntries[WIDE_BVH_WIDTH];
+        const uint32_t     hitMask = IntersectWideBvhNode(node, bvhRay, tMin, tMax, tEntries);
+        for (uint32_t child = 0; child < WIDE_BVH_WIDTH; child++)
+        {
+            if ((hitMask & (1u << child)) != 0)
+            {
+                assert(stackSize < WIDE_BVH_STACK_SIZE);
+                stack[stackSize++] = node.childIndex(child) | (node.isInner(child) ? 0 : WIDE_STACK_LEAF);
+            }
+        }
+    }
+    return false;
+}
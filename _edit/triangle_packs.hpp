@@ -0,0 +1,114 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_TRIANGLE_PACKS_HPP
+#define VK_MINI_PATH_TRACER_TRIANGLE_PACKS_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "cpu_bvh.hpp"
+#include "wide_bvh.hpp"
+
+// The number of triangles the CPU tracer intersects at once, one per AVX2 lane.
+const uint32_t TRIANGLE_PACK_SIZE = 8;
+
+// A ray for the CPU tracer. `direction` doesn't need to be normalized, but
+// the tracer always passes normalized directions, like the GPU tracers.
+struct CpuRay
+{
+    vec3 origin;
+    vec3 direction;
+};
+
+// The closest intersection found so far along a ray.
+struct TriangleHit
+{
+    float    t = 0.0f;   // Distance along the ray
+    float    u = 0.0f;   // Barycentric coordinates of the hit, like the hit attributes of the GPU tracers
+    float    v = 0.0f;
+    uint32_t id = ~0u;   // ID of the triangle that was hit
+    uint32_t instance = ~0u;  // Index of the instance that was hit; only InstanceBvh sets this
+};
+
+// Up to TRIANGLE_PACK_SIZE triangles in structure-of-arrays layout, so that
+// one AVX2 register holds the same coordinate of every triangle. Each
+// triangle has the vertices v0, v0 + edge1, and v0 + edge2, like
+// EmissiveTriangle. Unused lanes have zero edges, so they never hit.
+struct alignas(32) TrianglePack
+{
+    float    v0[3][TRIANGLE_PACK_SIZE];
+    float    edge1[3][TRIANGLE_PACK_SIZE];
+    float    edge2[3][TRIANGLE_PACK_SIZE];
+    uint32_t ids[TRIANGLE_PACK_SIZE];
+
+    // Makes every lane unused.
+    void clear();
+    // Sets lane `lane` to the triangle with vertices `a`, `b`, and `c`.
+    void set(uint32_t lane, const vec3& a, const vec3& b, const vec3& c, uint32_t id);
+};
+
+// Finds the closest intersection of `ray` with the triangles of `pack`
+// with tMin < t < hit.t, from either side, with Möller and Trumbore's test.
+// If there is one, overwrites `hit` with it and returns true.
+bool IntersectTrianglePack(const TrianglePack& pack, const CpuRay& ray, float tMin, TriangleHit& hit);
+// Returns true if `ray` intersects any triangle of `pack` with tMin < t < tMax.
+bool OccludedByTrianglePack(const TrianglePack& pack, const CpuRay& ray, float tMin, float tMax);
+
+struct RayPacket;
+
+// A BVH over triangles for the CPU tracer, with the triangles of each leaf in
+// one TrianglePack, so a leaf is a single SIMD intersection test.
+class TriangleBvh
+{
+public:
+    // Builds the BVH over `numTriangles` triangles with the vertex positions
+    // `positions` (3 floats per vertex) and 3 indices per triangle. Triangle
+    // i gets the ID (firstId + i). Builds in parallel on `threadPool`, if
+    // it isn't null.
+    void build(const float* positions, const uint32_t* indices, size_t numTriangles, uint32_t firstId = 0,
+        ThreadPool* threadPool = nullptr);
+    // Like build(), but first tries to load the BVH from `bvhFilename`
+    // (with MappedBvh), which must have been saved for triangles with the
+    // hash `sourceHash`. If that fails, builds the BVH and saves it there for
+    // the next run. Returns true if the BVH was loaded.
+    bool buildCached(const std::string& bvhFilename, uint64_t sourceHash, const float* positions, const uint32_t* indices,
+        size_t numTriangles, uint32_t firstId = 0, ThreadPool* threadPool = nullptr);
+
+    // Collapses the BVH into 8-wide nodes with quantized child bounds (see
+    // WideBvhNode), which intersect() and occluded() then traverse instead.
+    void makeWide();
+
+    // Finds the closest intersection with tMin < t < hit.t, as IntersectTrianglePack does.
+    bool intersect(const CpuRay& ray, float tMin, TriangleHit& hit) const;
+    // Returns true if anything intersects the ray with tMin < t < tMax.
+    bool occluded(const CpuRay& ray, float tMin, float tMax) const;
+    // Finds the closest intersection of each ray of `packet` from `firstRay`
+    // on, like intersect() does into hits[ray], with TraversePacket(). Wide
+    // BVHs trace the rays one at a time instead. Returns a mask of the rays
+    // whose hits it changed.
+    uint64_t intersectPacket(const RayPacket& packet, uint32_t firstRay, float tMin, TriangleHit* hits) const;
+
+    // The bounds of every triangle; empty if there are none.
+    BvhBounds getBounds() const { return m_bounds; }
+    // The size of the nodes, without the triangles.
+    size_t getNodeBytes() const { return m_nodes.size() * sizeof(BvhNode) + m_wideNodes.size() * sizeof(WideBvhNode); }
+
+private:
+    // Makes the packs of the `numNodes` nodes `nodes` over the primitives
+    // `primitives` (as in a Bvh) of the triangles.
+    void setNodes(const BvhNode* nodes, size_t numNodes, const uint32_t* primitives, const float* positions,
+        const uint32_t* indices, uint32_t firstId);
+    bool intersectWide(const CpuRay& ray, float tMin, TriangleHit& hit) const;
+    bool occludedWide(const CpuRay& ray, float tMin, float tMax) const;
+
+    // Leaves point to the pack of their triangles, instead of to Bvh::primitives.
+    std::vector<BvhNode>      m_nodes;
+    // After makeWide(), the wide nodes replace m_nodes, and leaf i is m_packs[i].
+    std::vector<WideBvhNode>  m_wideNodes;
+    std::vector<TrianglePack> m_packs;
+    BvhBounds                 m_bounds;
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_TRIANGLE_PACKS_HPP
@@ -0,0 +1,379 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "wavefront_tracer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <nvvk/error_vk.hpp>    // For NVVK_CHECK
+#include <nvvk/structs_vk.hpp>  // For nvvk::make
+
+#include "common.h"
+#include "pipeline_variants.hpp"
+
+static_assert(sizeof(WavefrontPushConstants) % 4 == 0, "Push constant size must be a multiple of 4 per the Vulkan spec!");
+
+namespace {
+// The header of an empty queue, ready to be appended to:
+const WavefrontQueueHeader EMPTY_QUEUE_HEADER = { 0, 1, 1, 0 };
+
+uint32_t DivideRoundingUp(uint32_t numerator, uint32_t denominator)
+{
+    return (numerator + denominator - 1) / denominator;
+}
+
+// Returns the number of uint32 entries in the queue buffer. Every queue can
+// hold every path, since in the worst case they all end up in one queue. The
+// sorted queue also has room for padding each bin to a whole number of
+// workgroups of the largest size.
+VkDeviceSize GetQueueEntries(uint64_t numPaths)
+{
+    return VkDeviceSize(WAVEFRONT_QUEUE_SORTED + 1) * numPaths + VkDeviceSize(MAX_MATERIAL_IDS) * MAX_WAVEFRONT_WORKGROUP_SIZE;
+}
+
+VkDescriptorBufferInfo WholeBuffer(VkBuffer buffer)
+{
+    VkDescriptorBufferInfo bufferInfo{};
+    bufferInfo.buffer = buffer;
+    bufferInfo.range = VK_WHOLE_SIZE;
+    return bufferInfo;
+}
+}  // namespace
+
+void WavefrontTracer::init(VkDevice device, nvvk::AllocatorDedicated* allocator, PipelineVariantCache* pipelineVariants,
+    uint32_t queueFamilyIndex, const WavefrontSceneBindings& scene, uint32_t width, uint32_t height,
+    const std::vector<uint32_t>& instanceMaterials, const WavefrontKernelConfig& config)
+{
+    m_device = device;
+    m_allocator = allocator;
+    m_pipelineVariants = pipelineVariants;
+    m_config = config;
+    assert(uint64_t(width) * height * WAVEFRONT_SAMPLES_PER_PASS <= UINT32_MAX);  // See computeNumPaths()
+    m_numPixels = width * height;
+    m_numPaths = m_numPixels * WAVEFRONT_SAMPLES_PER_PASS;
+
+    m_numInstances = static_cast<uint32_t>(instanceMaterials.size());
+
+    const VkBufferUsageFlags storageUsage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+    m_pathBuffer = allocator->createBuffer(VkDeviceSize(m_numPaths) * sizeof(WavefrontPath), storageUsage);
+    m_queueBuffer = allocator->createBuffer(GetQueueEntries(m_numPaths) * sizeof(uint32_t), storageUsage);
+    m_counterBuffer = allocator->createBuffer(sizeof(WavefrontCounters),
+        storageUsage | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+    // The material IDs are small and rarely change, so the CPU writes them directly:
+    m_materialBuffer = allocator->createBuffer(std::max<VkDeviceSize>(1, m_numInstances) * sizeof(uint32_t), storageUsage,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    setInstanceMaterials(instanceMaterials);
+
+    // The kernels use one descriptor set with the scene and the wavefront's buffers:
+    m_descriptorSetContainer.init(device);
+    m_descriptorSetContainer.addBinding(BINDING_IMAGEDATA, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.addBinding(BINDING_TLAS, VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.addBinding(BINDING_VERTICES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.addBinding(BINDING_INDICES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.addBinding(BINDING_GEOMETRIES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.addBinding(BINDING_STATS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.addBinding(BINDING_LIGHTS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.addBinding(BINDING_WAVEFRONT_PATHS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.addBinding(BINDING_WAVEFRONT_QUEUES, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.addBinding(BINDING_WAVEFRONT_COUNTERS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.addBinding(BINDING_WAVEFRONT_MATERIALS, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, VK_SHADER_STAGE_COMPUTE_BIT);
+    m_descriptorSetContainer.initLayout();
+    m_descriptorSetContainer.initPool(1);
+    VkPushConstantRange pushConstantRange;
+    pushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pushConstantRange.offset = 0;
+    pushConstantRange.size = sizeof(WavefrontPushConstants);
+    m_descriptorSetContainer.initPipeLayout(1, &pushConstantRange);
+
+    // Write the descriptor set:
+    VkDescriptorImageInfo imageInfo{};
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    imageInfo.imageView = scene.imageView;
+    VkWriteDescriptorSetAccelerationStructureKHR descriptorAS = nvvk::make<VkWriteDescriptorSetAccelerationStructureKHR>();
+    descriptorAS.accelerationStructureCount = 1;
+    descriptorAS.pAccelerationStructures = &scene.tlas;
+    const std::array<VkDescriptorBufferInfo, 9> bufferInfos = {
+        WholeBuffer(scene.vertexBuffer),   WholeBuffer(scene.indexBuffer),  WholeBuffer(scene.geometryInfoBuffer),
+        WholeBuffer(scene.statsBuffer),    WholeBuffer(scene.lightBuffer),  WholeBuffer(m_pathBuffer.buffer),
+        WholeBuffer(m_queueBuffer.buffer), WholeBuffer(m_counterBuffer.buffer), WholeBuffer(m_materialBuffer.buffer) };
+    const std::array<uint32_t, 9> bufferBindings = { BINDING_VERTICES, BINDING_INDICES, BINDING_GEOMETRIES, BINDING_STATS,
+        BINDING_LIGHTS, BINDING_WAVEFRONT_PATHS, BINDING_WAVEFRONT_QUEUES, BINDING_WAVEFRONT_COUNTERS,
+        BINDING_WAVEFRONT_MATERIALS };
+    std::vector<VkWriteDescriptorSet> writeDescriptorSets;
+    writeDescriptorSets.push_back(m_descriptorSetContainer.makeWrite(0, BINDING_IMAGEDATA, &imageInfo));
+    writeDescriptorSets.push_back(m_descriptorSetContainer.makeWrite(0, BINDING_TLAS, &descriptorAS));
+    for (size_t i = 0; i < bufferInfos.size(); i++)
+    {
+        writeDescriptorSets.push_back(m_descriptorSetContainer.makeWrite(0, bufferBindings[i], &bufferInfos[i]));
+    }
+    vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+
+    // The secondary command buffers in this pool are recorded once, and never reset:
+    VkCommandPoolCreateInfo cmdPoolInfo = nvvk::make<VkCommandPoolCreateInfo>();
+    cmdPoolInfo.queueFamilyIndex = queueFamilyIndex;
+    NVVK_CHECK(vkCreateCommandPool(device, &cmdPoolInfo, nullptr, &m_cmdPool));
+
+    selectPipelines();
+}
+
+void WavefrontTracer::selectPipelines()
+{
+    assert(m_config.samplesPerBatch % WAVEFRONT_SAMPLES_PER_PASS == 0 && "Each pass must trace the same number of samples!");
+    assert(m_config.workgroupSize <= MAX_WAVEFRONT_WORKGROUP_SIZE);
+
+    // The extend and shade kernels count rays when ray statistics are on, the
+    // kernels that sample pick the sample sequence, and the shade kernel
+    // picks how diffuse surfaces scatter. Kernels ignore the constants they
+    // don't declare:
+    SpecializationConstants constants;
+    constants.set(CONSTANT_ID_ENABLE_RAY_STATS, m_config.enableRayStats ? VK_TRUE : VK_FALSE)
+        .set(CONSTANT_ID_SAMPLER, m_config.sampler)
+        .set(CONSTANT_ID_DIFFUSE_SAMPLING, m_config.diffuseSampling)
+        .set(CONSTANT_ID_SAMPLES_PER_BATCH, m_config.samplesPerBatch)
+        .set(CONSTANT_ID_WAVEFRONT_WORKGROUP_SIZE, m_config.workgroupSize)
+        .set(CONSTANT_ID_PIXEL_ORDER, m_config.pixelOrder)
+        .set(CONSTANT_ID_PERSISTENT_THREADS, m_config.persistentThreads ? VK_TRUE : VK_FALSE);
+
+    const VkPipelineLayout layout = m_descriptorSetContainer.getPipeLayout();
+    m_generatePipeline = m_pipelineVariants->getComputePipeline("shaders/wavefrontGenerate.comp.glsl.spv", layout, constants);
+    m_extendPipeline = m_pipelineVariants->getComputePipeline("shaders/wavefrontExtend.comp.glsl.spv", layout, constants);
+    m_sortOffsetsPipeline =
+        m_pipelineVariants->getComputePipeline("shaders/wavefrontSortOffsets.comp.glsl.spv", layout, constants);
+    m_sortPipeline = m_pipelineVariants->getComputePipeline("shaders/wavefrontSort.comp.glsl.spv", layout, constants);
+    m_shadePipeline = m_pipelineVariants->getComputePipeline("shaders/wavefrontShade.comp.glsl.spv", layout, constants);
+    m_accumulatePipeline =
+        m_pipelineVariants->getComputePipeline("shaders/wavefrontAccumulate.comp.glsl.spv", layout, constants);
+}
+
+uint32_t WavefrontTracer::computeNumPaths(uint32_t width, uint32_t height, const VkPhysicalDeviceLimits& limits)
+{
+    // The kernels bind the whole path and queue buffers, so each must fit in
+    // one storage buffer range:
+    const uint64_t numPaths = uint64_t(width) * height * WAVEFRONT_SAMPLES_PER_PASS;
+    if (numPaths > UINT32_MAX || numPaths * sizeof(WavefrontPath) > limits.maxStorageBufferRange
+        || GetQueueEntries(numPaths) * sizeof(uint32_t) > limits.maxStorageBufferRange)
+    {
+        return 0;
+    }
+    return static_cast<uint32_t>(numPaths);
+}
+
+void WavefrontTracer::deinit()
+{
+    m_generatePipeline = m_extendPipeline = m_sortOffsetsPipeline = m_sortPipeline = VK_NULL_HANDLE;
+    m_shadePipeline = m_accumulatePipeline = VK_NULL_HANDLE;
+    m_passCommands.clear();
+    vkDestroyCommandPool(m_device, m_cmdPool, nullptr);  // Also frees the command buffers
+    m_cmdPool = VK_NULL_HANDLE;
+    m_descriptorSetContainer.deinit();
+    m_allocator->destroy(m_pathBuffer);
+    m_allocator->destroy(m_queueBuffer);
+    m_allocator->destroy(m_counterBuffer);
+    m_allocator->destroy(m_materialBuffer);
+}
+
+void WavefrontTracer::setInstanceMaterials(const std::vector<uint32_t>& instanceMaterials)
+{
+    assert(instanceMaterials.size() == m_numInstances);
+    void* data = m_allocator->map(m_materialBuffer);
+    memcpy(data, instanceMaterials.data(), instanceMaterials.size() * sizeof(uint32_t));
+    m_allocator->unmap(m_materialBuffer);
+}
+
+std::vector<uint32_t> WavefrontTracer::getInstanceMaterials() const
+{
+    std::vector<uint32_t> instanceMaterials(m_numInstances);
+    void*                 data = m_allocator->map(m_materialBuffer);
+    memcpy(instanceMaterials.data(), data, instanceMaterials.size() * sizeof(uint32_t));
+    m_allocator->unmap(m_materialBuffer);
+    return instanceMaterials;
+}
+
+void WavefrontTracer::setKernelConfig(const WavefrontKernelConfig& config)
+{
+    m_config = config;
+    selectPipelines();
+}
+
+void WavefrontTracer::setSampler(uint32_t sampler)
+{
+    WavefrontKernelConfig config = m_config;
+    config.sampler = sampler;
+    setKernelConfig(config);
+}
+
+void WavefrontTracer::setDiffuseSampling(uint32_t diffuseSampling)
+{
+    WavefrontKernelConfig config = m_config;
+    config.diffuseSampling = diffuseSampling;
+    setKernelConfig(config);
+}
+
+void WavefrontTracer::recordBarrier(VkCommandBuffer cmdBuffer)
+{
+    const VkPipelineStageFlags stages =
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT;
+    VkMemoryBarrier memoryBarrier = nvvk::make<VkMemoryBarrier>();
+    memoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT;
+    memoryBarrier.dstAccessMask =
+        VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT;
+    vkCmdPipelineBarrier(cmdBuffer, stages, stages, 0, 1, &memoryBarrier, 0, nullptr, 0, nullptr);
+}
+
+void WavefrontTracer::recordBindAndPush(VkCommandBuffer cmdBuffer, VkPipeline pipeline, uint32_t segment) const
+{
+    vkCmdBindPipeline(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
+    WavefrontPushConstants pushConstants;
+    pushConstants.numPaths = m_numPaths;
+    pushConstants.segment = segment;
+    pushConstants.sortByMaterial = m_sortByMaterial ? 1 : 0;
+    pushConstants.samplerSeed = m_samplerSeed;
+    pushConstants.termination = m_termination;
+    vkCmdPushConstants(cmdBuffer, m_descriptorSetContainer.getPipeLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0,
+        sizeof(pushConstants), &pushConstants);
+}
+
+void WavefrontTracer::recordPass(VkCommandBuffer cmdBuffer) const
+{
+    const VkDeviceSize queuesOffset = offsetof(WavefrontCounters, queues);
+    const VkDeviceSize hitQueueOffset = queuesOffset + WAVEFRONT_QUEUE_HIT * sizeof(WavefrontQueueHeader);
+    const VkDeviceSize shadeDispatchOffset = offsetof(WavefrontCounters, shadeDispatch);
+    const VkDeviceSize extendCursorOffset = offsetof(WavefrontCounters, extendCursor);
+    const VkDeviceSize materialCountsOffset = offsetof(WavefrontCounters, materialCounts);
+    const uint32_t     pathGroups = DivideRoundingUp(m_numPaths, m_config.workgroupSize);
+    // Persistent threads never need more invocations than there are paths:
+    const uint32_t persistentGroups =
+        DivideRoundingUp(std::min<uint32_t>(m_numPaths, WAVEFRONT_PERSISTENT_INVOCATIONS), m_config.workgroupSize);
+    // Active queue 0 always starts with every path:
+    const WavefrontQueueHeader allPathsHeader = { pathGroups, 1, 1, m_numPaths };
+    // The hit queue and the shade dispatch are next to each other, so one
+    // update empties both; the same goes for the arrays of the counting sort.
+    const std::array<WavefrontQueueHeader, 2> emptyHitHeaders = { EMPTY_QUEUE_HEADER, EMPTY_QUEUE_HEADER };
+    static_assert(offsetof(WavefrontCounters, shadeDispatch)
+            == offsetof(WavefrontCounters, queues) + (WAVEFRONT_QUEUE_HIT + 1) * sizeof(WavefrontQueueHeader),
+        "The shade dispatch must be right after the hit queue!");
+    static_assert(sizeof(WavefrontCounters) - offsetof(WavefrontCounters, materialCounts) == 3 * MAX_MATERIAL_IDS * sizeof(uint32_t),
+        "The arrays of the counting sort must be at the end of WavefrontCounters!");
+
+    // Wait for the pass index, and bind the descriptor set for all kernels,
+    // since a secondary command buffer doesn't inherit it:
+    recordBarrier(cmdBuffer);
+    VkDescriptorSet descriptorSet = m_descriptorSetContainer.getSet(0);
+    vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_descriptorSetContainer.getPipeLayout(), 0, 1,
+        &descriptorSet, 0, nullptr);
+
+    // Start a path for each sample of this pass:
+    vkCmdUpdateBuffer(cmdBuffer, m_counterBuffer.buffer, queuesOffset, sizeof(allPathsHeader), &allPathsHeader);
+    recordBindAndPush(cmdBuffer, m_generatePipeline, 0);
+    vkCmdDispatch(cmdBuffer, pathGroups, 1, 1);
+    recordBarrier(cmdBuffer);
+
+    // Then trace all of their segments. Once every path is done, the
+    // remaining indirect dispatches have no workgroups.
+    for (uint32_t segment = 0; segment < m_termination.maxSegments; segment++)
+    {
+        const uint32_t queue = segment % 2;
+        const uint32_t nextQueue = 1 - queue;
+        // Empty the queues and counters that this segment appends to:
+        vkCmdUpdateBuffer(cmdBuffer, m_counterBuffer.buffer, queuesOffset + nextQueue * sizeof(WavefrontQueueHeader),
+            sizeof(WavefrontQueueHeader), &EMPTY_QUEUE_HEADER);
+        vkCmdUpdateBuffer(cmdBuffer, m_counterBuffer.buffer, hitQueueOffset, sizeof(emptyHitHeaders), emptyHitHeaders.data());
+        if (m_sortByMaterial)
+        {
+            vkCmdFillBuffer(cmdBuffer, m_counterBuffer.buffer, materialCountsOffset, VK_WHOLE_SIZE, 0);
+        }
+        if (m_config.persistentThreads)
+        {
+            vkCmdFillBuffer(cmdBuffer, m_counterBuffer.buffer, extendCursorOffset, sizeof(uint32_t), 0);
+        }
+        recordBarrier(cmdBuffer);
+
+        recordBindAndPush(cmdBuffer, m_extendPipeline, segment);
+        if (m_config.persistentThreads)
+        {
+            // The kernel reads the queue's length itself, so the number
+            // of workgroups doesn't depend on it:
+            vkCmdDispatch(cmdBuffer, persistentGroups, 1, 1);
+        }
+        else
+        {
+            vkCmdDispatchIndirect(cmdBuffer, m_counterBuffer.buffer, queuesOffset + queue * sizeof(WavefrontQueueHeader));
+        }
+        recordBarrier(cmdBuffer);
+
+        if (m_sortByMaterial)
+        {
+            // Counting sort: the extend kernel built the histogram, so
+            // compute the bins' offsets, then scatter into them:
+            recordBindAndPush(cmdBuffer, m_sortOffsetsPipeline, segment);
+            vkCmdDispatch(cmdBuffer, 1, 1, 1);
+            recordBarrier(cmdBuffer);
+
+            recordBindAndPush(cmdBuffer, m_sortPipeline, segment);
+            vkCmdDispatchIndirect(cmdBuffer, m_counterBuffer.buffer, hitQueueOffset);
+            recordBarrier(cmdBuffer);
+        }
+
+        recordBindAndPush(cmdBuffer, m_shadePipeline, segment);
+        vkCmdDispatchIndirect(cmdBuffer, m_counterBuffer.buffer, m_sortByMaterial ? shadeDispatchOffset : hitQueueOffset);
+        recordBarrier(cmdBuffer);
+    }
+}
+
+VkCommandBuffer WavefrontTracer::getPassCommands() const
+{
+    const std::array<VkPipeline, 5> pipelines = { m_generatePipeline, m_extendPipeline, m_sortOffsetsPipeline,
+        m_sortPipeline, m_shadePipeline };
+    const PassKey key(
+        pipelines, m_sortByMaterial, m_termination.maxSegments, m_termination.rouletteMinSegments, m_samplerSeed);
+    const auto found = m_passCommands.find(key);
+    if (found != m_passCommands.end())
+    {
+        return found->second;
+    }
+
+    VkCommandBuffer             cmdBuffer;
+    VkCommandBufferAllocateInfo cmdAllocInfo = nvvk::make<VkCommandBufferAllocateInfo>();
+    cmdAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    cmdAllocInfo.commandPool = m_cmdPool;
+    cmdAllocInfo.commandBufferCount = 1;
+    NVVK_CHECK(vkAllocateCommandBuffers(m_device, &cmdAllocInfo, &cmdBuffer));
+
+    // Each batch executes it once per pass, and batches in flight at the
+    // same time share it:
+    VkCommandBufferInheritanceInfo inheritanceInfo = nvvk::make<VkCommandBufferInheritanceInfo>();
+    VkCommandBufferBeginInfo       beginInfo = nvvk::make<VkCommandBufferBeginInfo>();
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+    beginInfo.pInheritanceInfo = &inheritanceInfo;
+    NVVK_CHECK(vkBeginCommandBuffer(cmdBuffer, &beginInfo));
+    recordPass(cmdBuffer);
+    NVVK_CHECK(vkEndCommandBuffer(cmdBuffer));
+
+    m_passCommands[key] = cmdBuffer;
+    return cmdBuffer;
+}
+
+void WavefrontTracer::recordBatch(VkCommandBuffer cmdBuffer) const
+{
+    const VkCommandBuffer passCommands = getPassCommands();
+
+    // Wait for the previous batch, then trace each pass:
+    recordBarrier(cmdBuffer);
+    const uint32_t numPasses = m_config.samplesPerBatch / WAVEFRONT_SAMPLES_PER_PASS;
+    for (uint32_t pass = 0; pass < numPasses; pass++)
+    {
+        vkCmdUpdateBuffer(cmdBuffer, m_counterBuffer.buffer, offsetof(WavefrontCounters, pass), sizeof(pass), &pass);
+        vkCmdExecuteCommands(cmdBuffer, 1, &passCommands);
+    }
+
+    // Average the batch's samples into the image. The secondary command
+    // buffer left the bound state undefined, so bind the descriptor set again:
+    VkDescriptorSet descriptorSet = m_descriptorSetContainer.getSet(0);
+    vkCmdBindDescriptorSets(cmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_descriptorSetContainer.getPipeLayout(), 0, 1,
+        &descriptorSet, 0, nullptr);
+    recordBindAndPush(cmdBuffer, m_accumulatePipeline, 0);
+    vkCmdDispatch(cmdBuffer, DivideRoundingUp(m_numPixels, m_config.workgroupSize), 1, 1);
+}
@@ -0,0 +1,166 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_WAVEFRONT_TRACER_HPP
+#define VK_MINI_PATH_TRACER_WAVEFRONT_TRACER_HPP
+
+#include <nvvk/allocator_dedicated_vk.hpp>
+#include <nvvk/descriptorsets_vk.hpp>  // For nvvk::DescriptorSetContainer
+#include <array>
+#include <map>
+#include <tuple>
+#include <vector>
+#include <vulkan/vulkan_core.h>
+
+#include "common.h"
+
+class PipelineVariantCache;
+
+// The resources that the wavefront tracer shares with the ray tracing pipeline.
+struct WavefrontSceneBindings
+{
+    VkImageView                imageView = VK_NULL_HANDLE;  // The accumulation image, in GENERAL layout
+    VkAccelerationStructureKHR tlas = VK_NULL_HANDLE;
+    VkBuffer                   vertexBuffer = VK_NULL_HANDLE;
+    VkBuffer                   indexBuffer = VK_NULL_HANDLE;
+    VkBuffer                   geometryInfoBuffer = VK_NULL_HANDLE;
+    VkBuffer                   statsBuffer = VK_NULL_HANDLE;  // From RayStatistics
+    VkBuffer                   lightBuffer = VK_NULL_HANDLE;  // From LightTable
+};
+
+// The values the wavefront kernels are specialized for. Each combination is
+// a separate variant of the kernels (see PipelineVariantCache).
+struct WavefrontKernelConfig
+{
+    bool     enableRayStats = false;
+    uint32_t sampler = SAMPLER_SOBOL;                           // SAMPLER_RANDOM, SAMPLER_SOBOL, or SAMPLER_BLUE_NOISE
+    uint32_t diffuseSampling = DIFFUSE_SAMPLING_COSINE;         // DIFFUSE_SAMPLING_COSINE or DIFFUSE_SAMPLING_UNIFORM
+    uint32_t samplesPerBatch = DEFAULT_SAMPLES_PER_BATCH;       // A multiple of WAVEFRONT_SAMPLES_PER_PASS
+    uint32_t workgroupSize = DEFAULT_WAVEFRONT_WORKGROUP_SIZE;  // At most MAX_WAVEFRONT_WORKGROUP_SIZE
+    uint32_t pixelOrder = PIXEL_ORDER_LINEAR;                   // PIXEL_ORDER_LINEAR, PIXEL_ORDER_TILED, or PIXEL_ORDER_MORTON
+    bool     persistentThreads = false;                         // If true, the extend kernel runs persistent threads
+};
+
+// WavefrontTracer renders the same image as the ray tracing pipeline, but
+// with separate compute kernels for generating, extending (with ray queries),
+// shading, and accumulating paths, instead of one kernel that runs every
+// path to completion.
+//
+// In the single kernel, invocations of a subgroup wait for the longest path
+// among them, and diverge whenever their paths hit different materials. Here,
+// each segment of every path in flight is traced by one dispatch, and the
+// paths that are still alive are compacted into queues between dispatches.
+// The paths that hit a surface are then counting-sorted by material ID, so
+// that each workgroup of the shade kernel runs a single material. The
+// kernels append to queues with atomics, and also count the workgroups each
+// queue needs, so every dispatch after the first is an indirect dispatch that
+// the CPU never has to read back. See shaders/wavefrontCommon.h for the
+// kernels.
+//
+// Each instance has a material ID below MAX_MATERIAL_IDS; the default is the
+// instance's hit group, so that both tracers render the same image.
+//
+// Every pass of a batch runs the same commands (the pass index is in a
+// buffer), so they are recorded once into a secondary command buffer for
+// each combination of kernels and settings, and each batch only executes it
+// once per pass.
+//
+// This needs the rayQuery feature. The recorded commands don't depend on the
+// batch index, so they can be replayed like the ray tracing pipeline's.
+class WavefrontTracer
+{
+public:
+    // `instanceMaterials` has the material ID of each instance in the TLAS.
+    // The kernels come from `pipelineVariants`. Batches must be recorded into
+    // command buffers for the queue family `queueFamilyIndex`.
+    void init(VkDevice device, nvvk::AllocatorDedicated* allocator, PipelineVariantCache* pipelineVariants,
+        uint32_t queueFamilyIndex, const WavefrontSceneBindings& scene, uint32_t width, uint32_t height,
+        const std::vector<uint32_t>& instanceMaterials, const WavefrontKernelConfig& config);
+    void deinit();
+
+    // Returns the number of paths in flight for a `width` by `height` image,
+    // or 0 if that doesn't fit in 32 bits or the path and queue buffers would
+    // be larger than the device's `limits` allow. init() needs a nonzero result.
+    static uint32_t computeNumPaths(uint32_t width, uint32_t height, const VkPhysicalDeviceLimits& limits);
+
+    // Replaces the material ID of each instance. No batch may be executing.
+    void setInstanceMaterials(const std::vector<uint32_t>& instanceMaterials);
+    // Returns the material ID of each instance.
+    std::vector<uint32_t> getInstanceMaterials() const;
+    // Sets whether hits are sorted by material ID before shading (the
+    // default), for batches recorded after this call.
+    void setSortByMaterial(bool sortByMaterial) { m_sortByMaterial = sortByMaterial; }
+    bool getSortByMaterial() const { return m_sortByMaterial; }
+    // Sets how paths end, for batches recorded after this call. Each batch
+    // dispatches the extend and shade kernels termination.maxSegments times.
+    void setPathTermination(const PathTermination& termination) { m_termination = termination; }
+    // Switches to the kernels specialized for `config`, for batches recorded
+    // after this call. No batch may be executing.
+    void setKernelConfig(const WavefrontKernelConfig& config);
+    const WavefrontKernelConfig& getKernelConfig() const { return m_config; }
+    // Switches to the sample sequence `sampler`, like setKernelConfig().
+    void setSampler(uint32_t sampler);
+    // Sets the seed of the sample sequences, for batches recorded after this
+    // call. Images rendered with different seeds are independent.
+    void setSamplerSeed(uint32_t seed) { m_samplerSeed = seed; }
+    // Switches how the Lambertian lobe samples directions
+    // (DIFFUSE_SAMPLING_COSINE, the default, or DIFFUSE_SAMPLING_UNIFORM),
+    // like setKernelConfig().
+    void setDiffuseSampling(uint32_t diffuseSampling);
+
+    // Records the commands that trace one sample batch (getSamplesPerBatch()
+    // samples per pixel) and average it into the image.
+    void recordBatch(VkCommandBuffer cmdBuffer) const;
+
+    // Returns the number of paths in flight.
+    uint32_t getNumPaths() const { return m_numPaths; }
+    uint32_t getSamplesPerBatch() const { return m_config.samplesPerBatch; }
+
+private:
+    // Gets the kernels specialized for m_config from m_pipelineVariants.
+    void selectPipelines();
+    // Records a barrier between two steps of the wavefront: it makes shader
+    // and transfer writes visible to later shaders, transfers, and indirect
+    // dispatches.
+    static void recordBarrier(VkCommandBuffer cmdBuffer);
+    // Binds `pipeline`, and pushes the constants for `segment`.
+    void recordBindAndPush(VkCommandBuffer cmdBuffer, VkPipeline pipeline, uint32_t segment) const;
+    // Records the commands that trace one pass: generating a path for each of
+    // its samples, and tracing all of their segments.
+    void recordPass(VkCommandBuffer cmdBuffer) const;
+    // Returns the secondary command buffer with recordPass()'s commands for
+    // the current kernels and settings, recording it the first time.
+    VkCommandBuffer getPassCommands() const;
+
+    // The kernels of a pass, whether it sorts by material, the path
+    // termination, and the sampler seed:
+    using PassKey = std::tuple<std::array<VkPipeline, 5>, bool, uint32_t, uint32_t, uint32_t>;
+
+    VkDevice                     m_device = VK_NULL_HANDLE;
+    nvvk::AllocatorDedicated*    m_allocator = nullptr;
+    PipelineVariantCache*        m_pipelineVariants = nullptr;
+    nvvk::DescriptorSetContainer m_descriptorSetContainer;
+    VkCommandPool                m_cmdPool = VK_NULL_HANDLE;  // For the secondary command buffers
+    // The commands of a pass for each PassKey so far. They're only freed by
+    // deinit(), since batches recorded earlier may still execute them.
+    mutable std::map<PassKey, VkCommandBuffer> m_passCommands;
+    // The kernels, owned by m_pipelineVariants:
+    VkPipeline                   m_generatePipeline = VK_NULL_HANDLE;
+    VkPipeline                   m_extendPipeline = VK_NULL_HANDLE;
+    VkPipeline                   m_sortOffsetsPipeline = VK_NULL_HANDLE;
+    VkPipeline                   m_sortPipeline = VK_NULL_HANDLE;
+    VkPipeline                   m_shadePipeline = VK_NULL_HANDLE;
+    VkPipeline                   m_accumulatePipeline = VK_NULL_HANDLE;
+    nvvk::BufferDedicated        m_pathBuffer;     // numPaths WavefrontPaths
+    nvvk::BufferDedicated        m_queueBuffer;     // The active, hit, and sorted queues
+    nvvk::BufferDedicated        m_counterBuffer;   // WavefrontCounters
+    nvvk::BufferDedicated        m_materialBuffer;  // One material ID per instance, host-visible
+    uint32_t                     m_numInstances = 0;
+    uint32_t                     m_numPixels = 0;
+    uint32_t                     m_numPaths = 0;
+    bool                         m_sortByMaterial = true;
+    PathTermination              m_termination = { MAX_PATH_SEGMENTS, MAX_PATH_SEGMENTS };
+    WavefrontKernelConfig        m_config;
+    uint32_t                     m_samplerSeed = 0;
+};
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_WAVEFRONT_TRACER_HPP
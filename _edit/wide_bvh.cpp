@@ -0,0 +1,254 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#include "wide_bvh.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "simd.hpp"
+
+namespace {
+// Returns 2^exponent, for exponents of normal floats.
+float ExponentToScale(int exponent)
+{
+    const uint32_t bits = static_cast<uint32_t>(exponent + 127) << 23;
+    float          scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+BvhBounds GetNodeBounds(const BvhNode& node)
+{
+    BvhBounds bounds;
+    std::copy(node.boundsMin, node.boundsMin + 3, bounds.min);
+    std::copy(node.boundsMax, node.boundsMax + 3, bounds.max);
+    return bounds;
+}
+
+class BvhCollapser
+{
+public:
+    BvhCollapser(const std::vector<BvhNode>& nodes, WideBvh& wideBvh)
+        : m_nodes(nodes)
+        , m_wideBvh(wideBvh)
+    {
+    }
+
+    void collapse()
+    {
+        m_wideBvh.nodes.resize(1);
+        // A root that's a leaf becomes the only child of the wide root:
+        if (m_nodes[0].isLeaf())
+        {
+            const uint32_t children[1] = { 0 };
+            writeNode(0, children, 1);
+        }
+        else
+        {
+            collapseNode(0, 0);
+        }
+    }
+
+private:
+    // Writes wide node `wideIndex` and its subtree from binary inner node `nodeIndex`.
+    void collapseNode(uint32_t nodeIndex, uint32_t wideIndex)
+    {
+        // Start with the two children, and open the largest inner child until
+        // there are 8 of them:
+        uint32_t children[WIDE_BVH_WIDTH] = { nodeIndex + 1, m_nodes[nodeIndex].offset };
+        uint32_t numChildren = 2;
+        while (numChildren < WIDE_BVH_WIDTH)
+        {
+            int   largest = -1;
+            float largestArea = -1.0f;
+            for (uint32_t i = 0; i < numChildren; i++)
+            {
+                const BvhNode& child = m_nodes[children[i]];
+                const float    area = GetNodeBounds(child).halfArea();
+                if (!child.isLeaf() && area > largestArea)
+                {
+                    largest = static_cast<int>(i);
+                    largestArea = area;
+                }
+            }
+            if (largest < 0)
+            {
+                break;
+            }
+            const uint32_t opened = children[largest];
+            children[largest] = opened + 1;
+            children[numChildren++] = m_nodes[opened].offset;
+        }
+
+        const uint32_t firstInner = writeNode(wideIndex, children, numChildren);
+        uint32_t       inner = firstInner;
+        for (uint32_t i = 0; i < numChildren; i++)
+        {
+            if (!m_nodes[children[i]].isLeaf())
+            {
+                collapseNode(children[i], inner++);
+            }
+        }
+    }
+
+    // Writes wide node `wideIndex` with the binary nodes `children`,
+    // allocating its inner children and appending its leaves. Returns the
+    // index of its first inner child.
+    uint32_t writeNode(uint32_t wideIndex, const uint32_t* children, uint32_t numChildren)
+    {
+        BvhBounds bounds;
+        uint32_t  numInner = 0;
+        for (uint32_t i = 0; i < numChildren; i++)
+        {
+            bounds.grow(GetNodeBounds(m_nodes[children[i]]));
+            numInner += m_nodes[children[i]].isLeaf() ? 0 : 1;
+        }
+
+        WideBvhNode node{};
+        node.childNodeBase = static_cast<uint32_t>(m_wideBvh.nodes.size());
+        node.childLeafBase = static_cast<uint32_t>(m_wideBvh.leaves.size());
+        float scales[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            node.origin[axis] = bounds.min[axis];
+            // The smallest power of two that spans the bounds in 255 steps:
+            const float extent = bounds.max[axis] - bounds.min[axis];
+            int         exponent = (extent > 0.0f) ? static_cast<int>(std::ceil(std::log2(extent / 255.0f))) : -126;
+            exponent = std::max(-126, std::min(127, exponent));
+            while (exponent < 127 && node.origin[axis] + 255.0f * ExponentToScale(exponent) < bounds.max[axis])
+            {
+                exponent++;
+            }
+            node.exponents[axis] = static_cast<int8_t>(exponent);
+            scales[axis] = ExponentToScale(exponent);
+        }
+        for (uint32_t i = 0; i < numChildren; i++)
+        {
+            const BvhNode& child = m_nodes[children[i]];
+            node.validMask |= uint8_t(1u << i);
+            if (child.isLeaf())
+            {
+                m_wideBvh.leaves.push_back(child.offset);
+            }
+            else
+            {
+                node.innerMask |= uint8_t(1u << i);
+            }
+            // Round outwards, checking with the same arithmetic as the
+            // traversal, so the quantized bounds contain the child:
+            for (int axis = 0; axis < 3; axis++)
+            {
+                const float origin = node.origin[axis];
+                const float scale = scales[axis];
+                int         low = static_cast<int>(std::floor((child.boundsMin[axis] - origin) / scale));
+                int         high = static_cast<int>(std::ceil((child.boundsMax[axis] - origin) / scale));
+                low = std::max(0, std::min(255, low));
+                high = std::max(0, std::min(255, high));
+                while (low > 0 && origin + float(low) * scale > child.boundsMin[axis])
+                {
+                    low--;
+                }
+                while (high < 255 && origin + float(high) * scale < child.boundsMax[axis])
+                {
+                    high++;
+                }
+                node.quantizedMin[axis][i] = static_cast<uint8_t>(low);
+                node.quantizedMax[axis][i] = static_cast<uint8_t>(high);
+            }
+        }
+        m_wideBvh.nodes[wideIndex] = node;
+        m_wideBvh.nodes.resize(m_wideBvh.nodes.size() + numInner);
+        return node.childNodeBase;
+    }
+
+    const std::vector<BvhNode>& m_nodes;
+    WideBvh&                    m_wideBvh;
+};
+
+// The scalar fallback of IntersectWideBvhNodeAvx2(), with the same arithmetic.
+uint32_t IntersectWideBvhNodeScalar(const WideBvhNode& node, const BvhRay& ray, float tMin, float tMax, float tEntries[WIDE_BVH_WIDTH])
+{
+    uint32_t hitMask = 0;
+    for (uint32_t child = 0; child < WIDE_BVH_WIDTH; child++)
+    {
+        if ((node.validMask & (1u << child)) == 0)
+        {
+            continue;
+        }
+        float entry = tMin;
+        float exit = tMax;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            // The near plane is the minimum if the ray goes in the positive direction:
+            const bool    positive = ray.inverseDirection[axis] >= 0.0f;
+            const uint8_t nearQ = positive ? node.quantizedMin[axis][child] : node.quantizedMax[axis][child];
+            const uint8_t farQ = positive ? node.quantizedMax[axis][child] : node.quantizedMin[axis][child];
+            const float   scale = ExponentToScale(node.exponents[axis]);
+            const float   nearPlane = node.origin[axis] + float(nearQ) * scale;
+            const float   farPlane = node.origin[axis] + float(farQ) * scale;
+            entry = std::max(entry, (nearPlane - ray.origin[axis]) * ray.inverseDirection[axis]);
+            exit = std::min(exit, (farPlane - ray.origin[axis]) * ray.inverseDirection[axis]);
+        }
+        if (entry <= exit)
+        {
+            hitMask |= 1u << child;
+            tEntries[child] = entry;
+        }
+    }
+    return hitMask;
+}
+
+#if SIMD_X86
+// Dequantizes the 8 coordinates `quantized` to floats.
+SIMD_AVX2_FUNCTION inline __m256 DequantizeAvx2(const uint8_t quantized[WIDE_BVH_WIDTH], __m256 origin, __m256 scale)
+{
+    const __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(quantized));
+    const __m256  values = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+    return _mm256_add_ps(origin, _mm256_mul_ps(values, scale));
+}
+
+SIMD_AVX2_FUNCTION uint32_t IntersectWideBvhNodeAvx2(const WideBvhNode& node, const BvhRay& ray, float tMin, float tMax,
+    float tEntries[WIDE_BVH_WIDTH])
+{
+    __m256 entry = _mm256_set1_ps(tMin);
+    __m256 exit = _mm256_set1_ps(tMax);
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const bool   positive = ray.inverseDirection[axis] >= 0.0f;
+        const __m256 origin = _mm256_set1_ps(node.origin[axis]);
+        const __m256 scale = _mm256_set1_ps(ExponentToScale(node.exponents[axis]));
+        const __m256 nearPlane = DequantizeAvx2(positive ? node.quantizedMin[axis] : node.quantizedMax[axis], origin, scale);
+        const __m256 farPlane = DequantizeAvx2(positive ? node.quantizedMax[axis] : node.quantizedMin[axis], origin, scale);
+        const __m256 rayOrigin = _mm256_set1_ps(ray.origin[axis]);
+        const __m256 inverseDirection = _mm256_set1_ps(ray.inverseDirection[axis]);
+        entry = _mm256_max_ps(entry, _mm256_mul_ps(_mm256_sub_ps(nearPlane, rayOrigin), inverseDirection));
+        exit = _mm256_min_ps(exit, _mm256_mul_ps(_mm256_sub_ps(farPlane, rayOrigin), inverseDirection));
+    }
+    _mm256_storeu_ps(tEntries, entry);
+    const uint32_t hitMask = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(entry, exit, _CMP_LE_OQ)));
+    return hitMask & node.validMask;
+}
+#endif  // #if SIMD_X86
+}  // namespace
+
+WideBvh CollapseBvh(const std::vector<BvhNode>& nodes)
+{
+    WideBvh wideBvh;
+    if (!nodes.empty())
+    {
+        BvhCollapser(nodes, wideBvh).collapse();
+    }
+    return wideBvh;
+}
+
+uint32_t IntersectWideBvhNode(const WideBvhNode& node, const BvhRay& ray, float tMin, float tMax, float tEntries[WIDE_BVH_WIDTH])
+{
+#if SIMD_X86
+    if (CpuHasAvx2())
+    {
+        return IntersectWideBvhNodeAvx2(node, ray, tMin, tMax, tEntries);
+    }
+#endif
+    return IntersectWideBvhNodeScalar(node, ray, tMin, tMax, tEntries);
+}
@@ -0,0 +1,76 @@
+// Copyright 2020 NVIDIA Corporation
+// SPDX-License-Identifier: Apache-2.0
+#ifndef VK_MINI_PATH_TRACER_WIDE_BVH_HPP
+#define VK_MINI_PATH_TRACER_WIDE_BVH_HPP
+
+#include <bitset>
+#include <cstdint>
+#include <vector>
+
+#include "cpu_bvh.hpp"
+
+// The number of children of a WideBvhNode, one per AVX2 lane.
+const uint32_t WIDE_BVH_WIDTH = 8;
+
+// A node of a WideBvh with up to 8 children, whose bounds are quantized to
+// 8 bits per coordinate relative to the node's own bounds, like the
+// compressed wide BVHs of GPU ray tracers. A node is 80 bytes, while the 7
+// binary nodes it replaces take 224.
+//
+// Child i's bounds are origin + quantizedMin[axis][i] * 2^exponents[axis] to
+// origin + quantizedMax[axis][i] * 2^exponents[axis], rounded outwards, so
+// they always contain the child's exact bounds. Inner children are stored
+// next to each other starting at childNodeBase, and leaf children likewise
+// starting at childLeafBase, in the order of their slots.
+struct alignas(16) WideBvhNode
+{
+    float    origin[3];      // The minimum corner of the node's bounds
+    int8_t   exponents[3];   // Child bounds are in units of 2^exponents[axis]
+    uint8_t  innerMask;      // Bit i is set if child i is an inner node
+    uint32_t childNodeBase;  // Index of the first inner child in WideBvh::nodes
+    uint32_t childLeafBase;  // Index of the first leaf child in WideBvh::leaves
+    uint8_t  validMask;      // Bit i is set if child i exists
+    uint8_t  quantizedMin[3][WIDE_BVH_WIDTH];
+    uint8_t  quantizedMax[3][WIDE_BVH_WIDTH];
+
+    bool isInner(uint32_t child) const { return ((innerMask >> child) & 1) != 0; }
+    // Returns the index of child `child` in WideBvh::nodes if it's an inner
+    // node, or in WideBvh::leaves if it's a leaf.
+    uint32_t childIndex(uint32_t child) const
+    {
+        const uint32_t before = (1u << child) - 1;
+        if (isInner(child))
+        {
+            return childNodeBase + static_cast<uint32_t>(std::bitset<8>(innerMask & before).count());
+        }
+        return childLeafBase + static_cast<uint32_t>(std::bitset<8>(validMask & ~innerMask & before).count());
+    }
+};
+static_assert(sizeof(WideBvhNode) == 80, "WideBvhNode must be 80 bytes!");
+
+// A BVH of WideBvhNodes; nodes[0] is the root. Its leaves are the leaves of
+// the binary BVH it was collapsed from: leaves[i] is the `offset` of the
+// binary leaf that is leaf i here.
+struct WideBvh
+{
+    std::vector<WideBvhNode> nodes;
+    std::vector<uint32_t>    leaves;
+};
+
+// The most entries the wide traversal stacks can hold. Each node visited
+// pushes at most 7 more entries than it pops, and collapsing never makes a
+// path deeper than in the binary BVH, whose depth BuildBvh() caps.
+const int WIDE_BVH_STACK_SIZE = (WIDE_BVH_WIDTH - 1) * BVH_MAX_DEPTH + 1;
+
+// Collapses the binary BVH `nodes` (as BuildBvh() makes them) into a WideBvh
+// by repeatedly opening the child with the largest surface area until each
+// node has 8 children or only leaves are left.
+WideBvh CollapseBvh(const std::vector<BvhNode>& nodes);
+
+// Tests `ray` against the bounds of every child of `node` at once (with
+// AVX2 if the CPU has it), for t in [tMin, tMax]. Returns a mask of the
+// children that it overlaps, and sets tEntries[i] to where it enters child
+// i for each of them.
+uint32_t IntersectWideBvhNode(const WideBvhNode& node, const BvhRay& ray, float tMin, float tMax, float tEntries[WIDE_BVH_WIDTH]);
+
+#endif  // #ifndef VK_MINI_PATH_TRACER_WIDE_BVH_HPP